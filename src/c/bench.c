@@ -0,0 +1,619 @@
+// For clock_gettime, wait4 and perf_event_open
+#define _GNU_SOURCE
+
+/**
+ * Throughput benchmark of the decoder (make bench).
+ *
+ * gziped_bench [-n runs] [--zlib] [--gzip] [--manifest <manifest>]
+ *              <file.gz>...
+ *   decodes each file runs times and prints, for each decoder:
+ *   - the median and the 99th percentile (the slowest 1% of the runs, the
+ *     slowest run with less than 100) of the throughput, in MB/s of
+ *     compressed and of decompressed data,
+ *   - the median number of cycles per decompressed byte,
+ *   - the peak resident memory of the process which decoded the file.
+ *   The decoders are gziped itself, zlib when built with it (see the bench
+ *   target of the Makefile), and the gzip command of the system, run once per
+ *   run with its output to /dev/null. The output of the files listed in
+ *   manifest, written by test/tools/generate_corpus.py, is checked against
+ *   their size and CRC32 there.
+ *
+ * gziped_bench --generate <kind>-<size>
+ *   writes <size> bytes of generated data to stdout, to be compressed into the
+ *   corpus. kind is text, log or binary, size a number with an optional K, M
+ *   or G suffix. The data only depends on kind and size.
+ *
+ * The file is in memory, and the output buffer allocated and written once,
+ * before the first run: the runs measure the decoding, without I/O or page
+ * faults. A run which is not timed comes first, to warm the caches. Each
+ * decoder runs in its own child process, so that the peak memory is its own.
+ *
+ * The cycles are those of the CPU (perf_event_open) when the kernel gives
+ * access to its counters, else those of the time stamp counter on x86, which
+ * runs at a constant rate whatever the frequency of the CPU.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#if defined(BENCH_WITH_ZLIB)
+// zlib is linked in, with functions of the same names, which zlib itself
+// calls: the decoder's are renamed
+#define inflate gziped_bench_inflate
+#define crc32_combine gziped_bench_crc32_combine
+#endif
+#include "gziped.h"
+#include "members.h"
+#include "input.h"
+#include "gzi.h"
+
+#define BENCH_RUNS 20
+#define BENCH_MAX_RUNS 10000
+#define BENCH_GENERATE_CHUNK (64 * 1024)
+
+typedef enum bench_decoder_e {
+  BENCH_GZIPED,
+  BENCH_ZLIB,
+  BENCH_GZIP,
+  BENCH_DECODER_COUNT
+} bench_decoder_t;
+
+static const char *const bench_decoder_names[BENCH_DECODER_COUNT] = {
+  "gziped", "zlib", "gzip -d"
+};
+
+typedef struct bench_run_s {
+  uint64_t ns;
+  uint64_t cycles;        // 0 when there is no counter
+} bench_run_t;
+
+typedef struct bench_result_s {
+  int status;             // INFLATE_OK, or the error of the decoder
+  uint64_t in_size;
+  uint64_t out_size;
+  unsigned runs;
+  bench_run_t run[BENCH_MAX_RUNS];
+  long max_rss;           // in kB
+} bench_result_t;
+
+typedef struct bench_expected_s {
+  int known;              // 1 if the file is in the manifest
+  uint64_t size;
+  uint32_t crc32;
+} bench_expected_t;
+
+/**
+ * Looks the file at path up in manifest, by its name, and sets *expected to
+ * its entry. Returns 0 on success, -1 if manifest cannot be read.
+ */
+int bench_manifest_find(const char *manifest, const char *path,
+                        bench_expected_t *expected) {
+  memset(expected, 0, sizeof (bench_expected_t));
+  FILE *f = fopen(manifest, "r");
+  if (f == NULL) return -1;
+  const char *name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 :
+    path;
+  char entry[256];
+  unsigned long long size;
+  unsigned crc32;
+  while (fscanf(f, "%255s %llu %x", entry, &size, &crc32) == 3) {
+    if (strcmp(entry, name) == 0) {
+      expected->known = 1;
+      expected->size = size;
+      expected->crc32 = crc32;
+      break;
+    }
+  }
+  fclose(f);
+  return 0;
+}
+
+/**
+ * Random numbers for the generated data (xorshift64*), the same on every
+ * platform for a given seed.
+ */
+static inline uint64_t bench_random(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static const char *const bench_words[] = {
+  "the", "of", "and", "to", "a", "in", "is", "that", "it", "was", "for",
+  "on", "with", "he", "as", "his", "by", "at", "from", "her", "had", "not",
+  "but", "they", "which", "one", "all", "were", "she", "there", "would",
+  "their", "been", "when", "who", "will", "more", "no", "if", "out", "so",
+  "said", "what", "up", "its", "about", "into", "than", "them", "can", "only",
+  "other", "new", "some", "could", "time", "these", "two", "may", "then",
+  "first", "any", "like", "now", "my", "such", "over", "man", "our", "even",
+  "most", "made", "after", "also", "did", "many", "before", "must", "through",
+  "years", "where", "much", "your", "way", "well", "down", "should", "because",
+  "each", "just", "those", "people", "how", "too", "little", "state", "good",
+  "very", "make", "world", "still", "own", "see", "men", "work", "long",
+  "here", "get", "both", "between", "life", "being", "under", "never", "day",
+  "same", "another", "know", "while", "last", "might", "great", "old", "year",
+  "off", "come", "since", "against", "go", "came", "right", "used", "take",
+  "three", "barricade", "convent", "candlestick", "galley", "bishop"
+};
+#define BENCH_WORD_COUNT (sizeof (bench_words) / sizeof (bench_words[0]))
+
+static const char *const bench_levels[] = {
+  "DEBUG", "INFO", "INFO", "INFO", "INFO", "WARN", "ERROR"
+};
+static const char *const bench_paths[] = {
+  "/api/v1/items", "/api/v1/users", "/api/v1/orders", "/static/app.js",
+  "/static/style.css", "/health", "/login", "/search"
+};
+
+/**
+ * Appends generated data of kind to buf, which has room for
+ * BENCH_GENERATE_CHUNK bytes, and returns its new length.
+ */
+size_t bench_generate_chunk(const char *kind, uint64_t *state,
+                            uint64_t *counter, char *buf, size_t length) {
+  // Room for the longest line or record below
+  while (length + 256 < BENCH_GENERATE_CHUNK) {
+    uint64_t r = bench_random(state);
+    if (strcmp(kind, "text") == 0) {
+      // Frequent words are more likely, as in a natural language
+      size_t word = (r & 0xFFFF) * (r >> 16 & 0xFFFF) % BENCH_WORD_COUNT;
+      word = word * ((r >> 32 & 0xFF) + 1) >> 8;
+      length += sprintf(buf + length, "%s", bench_words[word]);
+      unsigned p = r >> 40 & 0xFF;
+      buf[length++] = p < 8 ? '\n' : p < 24 ? '.' : p < 40 ? ',' : ' ';
+      if (p < 40) buf[length++] = p < 8 ? '\n' : ' ';
+    } else if (strcmp(kind, "log") == 0) {
+      *counter += r & 0x3FF; // milliseconds since the first line
+      uint64_t ms = *counter;
+      length += sprintf(buf + length,
+        "2024-03-%02u %02u:%02u:%02u.%03u %-5s [worker-%u] %s %s/%u "
+        "status=%u bytes=%u latency_ms=%u\n",
+        (unsigned) (1 + ms / 86400000 % 28), (unsigned) (ms / 3600000 % 24),
+        (unsigned) (ms / 60000 % 60), (unsigned) (ms / 1000 % 60),
+        (unsigned) (ms % 1000), bench_levels[(r >> 10) % 7],
+        (unsigned) (r >> 13 & 7), (r >> 16 & 3) ? "GET" : "POST",
+        bench_paths[r >> 18 & 7], (unsigned) (r >> 21 & 0xFFF),
+        (r >> 33 & 15) ? 200 : 404, (unsigned) (r >> 37 & 0xFFFF),
+        (unsigned) (r >> 53 & 0x7F));
+    } else {
+      // Records of counters and small values, with a random payload
+      // sometimes: the kind of data found in binary formats
+      uint32_t id = (uint32_t) ++*counter;
+      memcpy(buf + length, &id, 4);
+      memcpy(buf + length + 4, counter, 8);
+      uint16_t value = 1000 + (r & 0x3F);
+      memcpy(buf + length + 12, &value, 2);
+      buf[length + 14] = r >> 8 & 3;
+      buf[length + 15] = 0;
+      length += 16;
+      if ((r >> 16 & 7) == 0) {
+        size_t random = 16 + (r >> 19 & 0x3F);
+        for (size_t i = 0; i < random; i += 8) {
+          uint64_t noise = bench_random(state);
+          memcpy(buf + length + i, &noise, 8);
+        }
+        length += random;
+      }
+    }
+  }
+  return length;
+}
+
+/**
+ * Writes the data named spec (<kind>-<size>) to stdout. Returns 0 on success.
+ */
+int bench_generate(const char *spec) {
+  char kind[16];
+  unsigned long long size;
+  char unit = 0;
+  if (sscanf(spec, "%15[a-z]-%llu%c", kind, &size, &unit) < 2 ||
+      (strcmp(kind, "text") != 0 && strcmp(kind, "log") != 0 &&
+       strcmp(kind, "binary") != 0)) {
+    fprintf(stderr, "%s: expected text, log or binary-<size>\n", spec);
+    return -1;
+  }
+  if (unit == 'K') size <<= 10;
+  else if (unit == 'M') size <<= 20;
+  else if (unit == 'G') size <<= 30;
+  char *buf = (char *) malloc(BENCH_GENERATE_CHUNK);
+  uint64_t state = 0x9E3779B97F4A7C15ULL ^ kind[0];
+  uint64_t counter = 0;
+  size_t length = 0;
+  while (size > 0) {
+    length = bench_generate_chunk(kind, &state, &counter, buf, length);
+    size_t chunk = length < size ? length : size;
+    if (fwrite(buf, 1, chunk, stdout) != chunk) {
+      perror("write");
+      free(buf);
+      return -1;
+    }
+    size -= chunk;
+    length = 0;
+  }
+  free(buf);
+  return fflush(stdout) == 0 ? 0 : -1;
+}
+
+static inline uint64_t bench_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Opens the cycle counter of the CPU for the calling thread. Returns its file
+ * descriptor, or -1 if the kernel does not give access to it.
+ */
+int bench_cycles_open() {
+#if defined(__linux__) && defined(SYS_perf_event_open)
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof (attr));
+  attr.size = sizeof (attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_CPU_CYCLES;
+  // Counting the kernel needs privileges, and the decoders make no syscall
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+/**
+ * Returns the cycles counted so far by fd, or by the time stamp counter if fd
+ * is -1, or 0 if there is neither.
+ */
+static inline uint64_t bench_cycles(int fd) {
+  uint64_t cycles = 0;
+  if (fd >= 0) {
+    if (read(fd, &cycles, sizeof (cycles)) != sizeof (cycles)) cycles = 0;
+    return cycles;
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  cycles = __rdtsc();
+#endif
+  return cycles;
+}
+
+/**
+ * Decodes all the members of the gzip file in buf to output, as gziped does
+ * with a single thread. Returns INFLATE_OK or the error of the decoder, and
+ * sets *produced to the size of the output.
+ */
+int bench_gziped(uint8_t *buf, size_t size, uint8_t *output,
+                 size_t output_size, size_t *produced) {
+  gziped_decoder_t *decoder = gziped_decoder_init();
+  size_t pos = 0;
+  int res = INFLATE_OK;
+  *produced = 0;
+  while (pos < size) {
+    // Past the first member, anything else than a member is padding
+    if (pos > 0 && member_header_size(buf + pos, size - pos) == 0) break;
+    inflate_result_t result;
+    res = gziped_inflate_member(decoder, buf + pos, size - pos,
+      output + *produced, output_size - *produced, &result);
+    if (res != INFLATE_OK) break;
+    pos += result.consumed;
+    *produced += result.produced;
+  }
+  gziped_decoder_free(decoder);
+  return res;
+}
+
+#if defined(BENCH_WITH_ZLIB)
+// In bench_zlib.c, which includes zlib.h
+int bench_zlib_decode(uint8_t *buf, size_t size, uint8_t *output,
+                      size_t output_size, size_t *produced);
+
+/**
+ * Same as bench_gziped, with zlib.
+ */
+int bench_zlib(uint8_t *buf, size_t size, uint8_t *output,
+               size_t output_size, size_t *produced) {
+  return bench_zlib_decode(buf, size, output, output_size, produced) == 0 ?
+    INFLATE_OK : INFLATE_INVALID_DATA;
+}
+#endif
+
+/**
+ * Measures decoder, gziped or zlib, on buf, in the calling process.
+ */
+void bench_in_process(bench_decoder_t decoder, uint8_t *buf, size_t size,
+                      unsigned runs, const bench_expected_t *expected,
+                      bench_result_t *result) {
+  result->in_size = size;
+  uint8_t *output = NULL;
+  size_t output_size = 0;
+  // The size of the output, and a check of the file
+  result->status = inflate_members(buf, size, 1, NULL, &output, &output_size);
+  if (result->status != INFLATE_OK) return;
+  if (expected->known && (output_size != expected->size ||
+      crc32_update(0, output, output_size) != expected->crc32)) {
+    result->status = INFLATE_CHECK_FAILED;
+    free(output);
+    return;
+  }
+  result->out_size = output_size;
+  int (*decode)(uint8_t *, size_t, uint8_t *, size_t, size_t *) =
+    bench_gziped;
+#if defined(BENCH_WITH_ZLIB)
+  if (decoder == BENCH_ZLIB) decode = bench_zlib;
+#endif
+  int fd = bench_cycles_open();
+  // The first run warms the caches, and is not counted
+  for (unsigned i = 0; i <= runs; ++i) {
+    size_t produced;
+    uint64_t cycles = bench_cycles(fd);
+    uint64_t start = bench_now();
+    int res = decode(buf, size, output, output_size, &produced);
+    uint64_t end = bench_now();
+    cycles = bench_cycles(fd) - cycles;
+    if (res == INFLATE_OK && produced != output_size)
+      res = INFLATE_CHECK_FAILED;
+    if (res != INFLATE_OK) {
+      result->status = res;
+      break;
+    }
+    if (i == 0) continue;
+    result->run[result->runs].ns = end - start;
+    result->run[result->runs].cycles = cycles;
+    ++result->runs;
+  }
+  if (fd >= 0) close(fd);
+  free(output);
+}
+
+/**
+ * Measures gzip -d on the file at path, for an output of out_size bytes.
+ */
+void bench_gzip(const char *path, uint64_t in_size, uint64_t out_size,
+                unsigned runs, bench_result_t *result) {
+  result->in_size = in_size;
+  result->out_size = out_size;
+  for (unsigned i = 0; i <= runs; ++i) {
+    fflush(stdout);
+    uint64_t start = bench_now();
+    pid_t pid = fork();
+    if (pid == 0) {
+      int null = open("/dev/null", O_WRONLY);
+      if (null >= 0) dup2(null, STDOUT_FILENO);
+      execlp("gzip", "gzip", "-d", "-c", path, (char *) NULL);
+      _exit(127);
+    }
+    int status = 0;
+    struct rusage usage;
+    if (pid < 0 || wait4(pid, &status, 0, &usage) < 0) {
+      result->status = INFLATE_OUTPUT_FULL;
+      return;
+    }
+    uint64_t end = bench_now();
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      result->status = WIFEXITED(status) && WEXITSTATUS(status) == 127 ?
+        INFLATE_OUTPUT_FULL : INFLATE_INVALID_DATA;
+      return;
+    }
+    if (usage.ru_maxrss > result->max_rss) result->max_rss = usage.ru_maxrss;
+    if (i == 0) continue;
+    result->run[result->runs].ns = end - start;
+    result->run[result->runs].cycles = 0;
+    ++result->runs;
+  }
+}
+
+/**
+ * Measures decoder on the file at path in a child process, which passes its
+ * result back through a pipe. Returns 0 on success.
+ */
+int bench_file(bench_decoder_t decoder, const char *path, unsigned runs,
+               const bench_expected_t *expected, bench_result_t *result) {
+  memset(result, 0, sizeof (bench_result_t));
+  int fds[2];
+  if (pipe(fds) != 0) return -1;
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    input_t input;
+    int error = input_open(path, INPUT_PREAD, &input);
+    if (error != 0) {
+      errno = error;
+      perror(path);
+      _exit(1);
+    }
+    bench_in_process(decoder, input.data, input.size, runs, expected,
+      result);
+    input_close(&input);
+    size_t length = offsetof(bench_result_t, run) +
+      result->runs * sizeof (bench_run_t);
+    _exit(gzi_write_all(fds[1], (uint8_t *) result, length) == 0 ? 0 : 1);
+  }
+  close(fds[1]);
+  size_t length = 0;
+  ssize_t len;
+  while ((len = read(fds[0], (uint8_t *) result + length,
+                     sizeof (bench_result_t) - length)) != 0) {
+    if (len < 0 && errno == EINTR) continue;
+    if (len < 0) break;
+    length += len;
+  }
+  close(fds[0]);
+  int status = 0;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0 || length < offsetof(bench_result_t, run) ||
+      length < offsetof(bench_result_t, run) +
+        result->runs * sizeof (bench_run_t)) return -1;
+  result->max_rss = usage.ru_maxrss;
+  return 0;
+}
+
+static int bench_compare_runs(const void *a, const void *b) {
+  uint64_t x = ((const bench_run_t *) a)->ns;
+  uint64_t y = ((const bench_run_t *) b)->ns;
+  return x < y ? -1 : x > y;
+}
+
+static int bench_compare_cycles(const void *a, const void *b) {
+  uint64_t x = ((const bench_run_t *) a)->cycles;
+  uint64_t y = ((const bench_run_t *) b)->cycles;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Returns the run at percentile of the sorted runs (nearest rank).
+ */
+static inline const bench_run_t *bench_percentile(const bench_result_t *result,
+                                                  unsigned percentile) {
+  size_t rank = (result->runs * percentile + 99) / 100;
+  return &result->run[rank > 0 ? rank - 1 : 0];
+}
+
+// Bytes per nanosecond, i.e. GB/s, in MB/s
+static inline double bench_mbps(uint64_t size, uint64_t ns) {
+  return ns > 0 ? size * 1000.0 / ns : 0;
+}
+
+void bench_print(const char *path, bench_decoder_t decoder,
+                 bench_result_t *result) {
+  const char *name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 :
+    path;
+  printf("%-20.20s %-7s ", name, bench_decoder_names[decoder]);
+  if (result->status != INFLATE_OK || result->runs == 0) {
+    printf("%s\n", decoder == BENCH_GZIP &&
+      result->status == INFLATE_OUTPUT_FULL ? "could not run" :
+      inflate_strerror(result->status));
+    return;
+  }
+  qsort(result->run, result->runs, sizeof (bench_run_t), bench_compare_runs);
+  uint64_t median = bench_percentile(result, 50)->ns;
+  uint64_t p99 = bench_percentile(result, 99)->ns;
+  printf("%8.2f %8.2f  %7.1f %7.1f  %7.1f %7.1f  ",
+    result->in_size / 1e6, result->out_size / 1e6,
+    bench_mbps(result->in_size, median), bench_mbps(result->out_size, median),
+    bench_mbps(result->in_size, p99), bench_mbps(result->out_size, p99));
+  qsort(result->run, result->runs, sizeof (bench_run_t),
+    bench_compare_cycles);
+  uint64_t cycles = bench_percentile(result, 50)->cycles;
+  if (cycles > 0 && result->out_size > 0) {
+    printf("%8.2f", (double) cycles / result->out_size);
+  } else {
+    printf("%8s", "-");
+  }
+  printf("  %7.1f\n", result->max_rss / 1024.0);
+}
+
+void bench_usage() {
+  fprintf(stderr, "usage: gziped_bench [-n runs] [--zlib] [--gzip] "
+    "[--manifest <manifest>] <file.gz>...\n");
+  fprintf(stderr, "       gziped_bench --generate <text|log|binary>"
+    "-<size>[K|M|G]\n");
+}
+
+int main(int argc, char **argv) {
+  unsigned runs = BENCH_RUNS;
+  int decoders[BENCH_DECODER_COUNT] = { 1, 0, 0 };
+  const char *manifest = NULL;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; ++i) {
+    if (strcmp(argv[i], "--generate") == 0 && i + 1 < argc) {
+      return bench_generate(argv[i + 1]) == 0 ? 0 : 1;
+    } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      runs = strtoul(argv[++i], NULL, 10);
+      if (runs == 0 || runs > BENCH_MAX_RUNS) {
+        fprintf(stderr, "-n: expected 1 to %u runs\n", BENCH_MAX_RUNS);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--zlib") == 0) {
+#if defined(BENCH_WITH_ZLIB)
+      decoders[BENCH_ZLIB] = 1;
+#else
+      fprintf(stderr, "--zlib: not built with zlib, see make bench\n");
+      return 1;
+#endif
+    } else if (strcmp(argv[i], "--gzip") == 0) {
+      decoders[BENCH_GZIP] = 1;
+    } else if (strcmp(argv[i], "--manifest") == 0 && i + 1 < argc) {
+      manifest = argv[++i];
+    } else {
+      bench_usage();
+      return 1;
+    }
+  }
+  if (i == argc) {
+    bench_usage();
+    return 1;
+  }
+
+  bench_result_t *result = (bench_result_t *) malloc(sizeof (bench_result_t));
+  int cycles = bench_cycles_open();
+  printf("%d runs, cycles of the %s\n", runs, cycles >= 0 ? "CPU" :
+#if defined(__x86_64__) || defined(__i386__)
+    "time stamp counter"
+#else
+    "CPU: not available"
+#endif
+    );
+  if (cycles >= 0) close(cycles);
+  printf("%-20s %-7s %8s %8s  %15s  %15s  %8s  %7s\n", "", "", "in", "out",
+    "median MB/s", "p99 MB/s", "", "peak");
+  printf("%-20s %-7s %8s %8s  %7s %7s  %7s %7s  %8s  %7s\n", "file",
+    "decoder", "MB", "MB", "in", "out", "in", "out", "cycles/B", "RSS MB");
+  int failures = 0;
+  for (; i < argc; ++i) {
+    uint64_t in_size = 0;
+    uint64_t out_size = 0;
+    bench_expected_t expected = { 0, 0, 0 };
+    if (manifest != NULL &&
+        bench_manifest_find(manifest, argv[i], &expected) != 0) {
+      perror(manifest);
+      free(result);
+      return 1;
+    }
+    for (int decoder = 0; decoder < BENCH_DECODER_COUNT; ++decoder) {
+      if (!decoders[decoder]) continue;
+      if (decoder == BENCH_GZIP) {
+        // Sized by the gziped run, which always comes first
+        memset(result, 0, sizeof (bench_result_t));
+        if (in_size == 0) continue;
+        bench_gzip(argv[i], in_size, out_size, runs, result);
+      } else if (bench_file(decoder, argv[i], runs, &expected, result) != 0) {
+        fprintf(stderr, "%s: %s failed\n", argv[i],
+          bench_decoder_names[decoder]);
+        ++failures;
+        continue;
+      }
+      if (decoder == BENCH_GZIPED && result->status == INFLATE_OK) {
+        in_size = result->in_size;
+        out_size = result->out_size;
+      }
+      if (result->status != INFLATE_OK) ++failures;
+      bench_print(argv[i], decoder, result);
+    }
+  }
+  free(result);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,41 @@
+/**
+ * zlib for the benchmark (bench.c), in a translation unit of its own: the
+ * decoder defines functions with the same names as zlib (inflate,
+ * crc32_combine).
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include <zlib.h>
+
+int bench_zlib_decode(uint8_t *buf, size_t size, uint8_t *output,
+                      size_t output_size, size_t *produced);
+
+/**
+ * Decodes all the members of the gzip file in buf to output. Returns 0 on
+ * success, or the zlib error, and sets *produced to the size of the output.
+ */
+int bench_zlib_decode(uint8_t *buf, size_t size, uint8_t *output,
+                      size_t output_size, size_t *produced) {
+  z_stream stream;
+  memset(&stream, 0, sizeof (stream));
+  // 16 + window bits: gzip members only
+  int res = inflateInit2(&stream, 16 + MAX_WBITS);
+  if (res != Z_OK) return res;
+  stream.next_in = buf;
+  stream.avail_in = size;
+  stream.next_out = output;
+  stream.avail_out = output_size;
+  for (;;) {
+    res = inflate(&stream, Z_FINISH);
+    if (res != Z_STREAM_END) break;
+    res = Z_OK;
+    // The next member starts right after the trailer of the previous one
+    if (stream.avail_in == 0 || stream.next_in[0] != 0x1F) break;
+    inflateReset(&stream);
+  }
+  // Not total_out, which inflateReset resets
+  *produced = stream.next_out - output;
+  inflateEnd(&stream);
+  return res == Z_OK ? 0 : res;
+}
@@ -0,0 +1,274 @@
+#ifndef __BGZF_H__
+#define __BGZF_H__
+
+/**
+ * BGZF, blocked gzip files.
+ * https://samtools.github.io/hts-specs/SAMv1.pdf (section 4.1)
+ *
+ * A BGZF file is a series of gzip members, the blocks, each one holding at
+ * most 64 KB of data and giving its own size in the BC subfield of its extra
+ * field. The blocks can therefore be listed from their headers alone, and,
+ * with the ISIZE of their footers, where the data of each one goes in the
+ * output is known before decoding anything. They are then decoded in parallel,
+ * each one directly at its place in the output.
+ *
+ * A position in the data is given by a virtual offset: the offset of the block
+ * in the file in the upper 48 bits, and the offset in the data of the block in
+ * the lower 16 bits. Reading from a virtual offset only decodes the blocks
+ * read from.
+ *
+ * Usage example:
+ *
+ * bgzf_t *bgzf = bgzf_open(buf, size);
+ * if (bgzf != NULL) {
+ *   uint8_t out[4096];
+ *   uint64_t voffset = bgzf_tell(bgzf, 10000000);
+ *   ssize_t len = bgzf_read(bgzf, voffset, sizeof (out), out);
+ *   bgzf_close(bgzf);
+ * }
+ */
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "gziped.h"
+#include "thread_pool.h"
+#include "members.h"
+
+// Header, extra field length, and BC subfield
+#define BGZF_HEADER_SIZE (GZIP_HEADER_SIZE + 2 + 6)
+#define BGZF_MAX_BLOCK_SIZE (64 * 1024)
+
+#define bgzf_virtual_offset(block_offset, offset) \
+  ((uint64_t) (block_offset) << 16 | (offset))
+#define bgzf_block_offset(voffset) ((voffset) >> 16)
+#define bgzf_offset_in_block(voffset) ((voffset) & 0xFFFF)
+
+typedef struct bgzf_block_s {
+  size_t offset;   // the offset of the block in the file
+  size_t size;     // the size of the block, BSIZE + 1
+  uint64_t out;    // the offset of its data in the decompressed data
+  uint32_t isize;  // the size of its data
+} bgzf_block_t;
+
+typedef struct bgzf_s {
+  uint8_t *buf;
+  size_t size;
+  bgzf_block_t *blocks;
+  size_t count;
+  uint64_t length; // the size of the decompressed data
+  // The statistics of the table caches of the last bgzf_inflate
+  uint64_t table_hits;
+  uint64_t table_misses;
+} bgzf_t;
+
+/**
+ * Returns the size of the BGZF block at buf, or 0 if buf does not start with
+ * a BGZF block.
+ */
+size_t bgzf_block_size(const uint8_t *buf, size_t size) {
+  if (size < BGZF_HEADER_SIZE || buf[0] != 0x1F || buf[1] != 0x8B ||
+      buf[2] != GZIP_DEFLATE_CM || !(buf[3] & FEXTRA))
+    return 0;
+  uint16_t xlen = buf[10] | buf[11] << 8;
+  if (size - 12 < xlen) return 0;
+  uint16_t len = 0;
+  const uint8_t *bsize = find_extra_subfield(buf + 12, xlen, 'B', 'C', &len);
+  if (bsize == NULL || len != 2) return 0;
+  size_t block_size = (bsize[0] | bsize[1] << 8) + 1;
+  // The header, and at least an empty DEFLATE stream and the footer
+  if (block_size < 12 + (size_t) xlen + 2 + 8 || block_size > size) return 0;
+  return block_size;
+}
+
+void bgzf_close(bgzf_t *bgzf) {
+  if (bgzf == NULL) return;
+  free(bgzf->blocks);
+  free(bgzf);
+}
+
+/**
+ * Lists the blocks of the BGZF file in buf. Returns NULL if buf is not made of
+ * BGZF blocks only, zero padding at the end aside.
+ */
+bgzf_t *bgzf_open(uint8_t *buf, size_t size) {
+  if (bgzf_block_size(buf, size) == 0) return NULL;
+  bgzf_t *bgzf = (bgzf_t *) calloc(1, sizeof (bgzf_t));
+  if (bgzf == NULL) return NULL;
+  bgzf->buf = buf;
+  bgzf->size = size;
+  size_t capacity = 0;
+  size_t pos = 0;
+  while (pos < size) {
+    size_t block_size = bgzf_block_size(buf + pos, size - pos);
+    if (block_size == 0) {
+      if (is_zero_padding(buf + pos, size - pos)) break;
+      bgzf_close(bgzf);
+      return NULL;
+    }
+    if (bgzf->count == capacity) {
+      capacity = capacity ? capacity * 2 : 1024;
+      bgzf_block_t *blocks = (bgzf_block_t *) realloc(bgzf->blocks,
+        capacity * sizeof (bgzf_block_t));
+      if (blocks == NULL) {
+        bgzf_close(bgzf);
+        return NULL;
+      }
+      bgzf->blocks = blocks;
+    }
+    bgzf_block_t *block = &bgzf->blocks[bgzf->count++];
+    block->offset = pos;
+    block->size = block_size;
+    block->out = bgzf->length;
+    block->isize = read_le32(buf + pos + block_size - 4);
+    if (block->isize > BGZF_MAX_BLOCK_SIZE) {
+      bgzf_close(bgzf);
+      return NULL;
+    }
+    bgzf->length += block->isize;
+    pos += block_size;
+  }
+  return bgzf;
+}
+
+/**
+ * Returns 1 if buf is a BGZF file.
+ */
+int is_bgzf(uint8_t *buf, size_t size) {
+  return bgzf_block_size(buf, size) != 0;
+}
+
+typedef struct bgzf_inflate_s {
+  bgzf_t *bgzf;
+  uint8_t *output;
+  int *status;     // the result of each block
+  size_t blocks_per_task;
+} bgzf_inflate_t;
+
+// The blocks are handed to the threads in runs of consecutive blocks, which
+// share a decoder as they were likely written with the same tables
+#define BGZF_TASKS_PER_THREAD 4
+
+void bgzf_inflate_task(size_t index, void *context) {
+  bgzf_inflate_t *inflate = (bgzf_inflate_t *) context;
+  bgzf_t *bgzf = inflate->bgzf;
+  gziped_decoder_t *decoder = gziped_decoder_init();
+  size_t end = (index + 1) * inflate->blocks_per_task;
+  if (end > bgzf->count) end = bgzf->count;
+  for (size_t i = index * inflate->blocks_per_task; i < end; ++i) {
+    bgzf_block_t *block = &bgzf->blocks[i];
+    inflate_result_t result;
+    // inflate_member checks the CRC and that the data is ISIZE bytes
+    inflate->status[i] = gziped_inflate_member(decoder,
+      bgzf->buf + block->offset, block->size, inflate->output + block->out,
+      block->isize, &result);
+    if (inflate->status[i] == INFLATE_OK && result.consumed != block->size)
+      inflate->status[i] = INFLATE_INVALID_DATA;
+  }
+  if (decoder != NULL) {
+    __atomic_fetch_add(&bgzf->table_hits, decoder->cache.hits,
+      __ATOMIC_RELAXED);
+    __atomic_fetch_add(&bgzf->table_misses, decoder->cache.misses,
+      __ATOMIC_RELAXED);
+  }
+  gziped_decoder_free(decoder);
+}
+
+/**
+ * Decodes all the blocks into output, which holds bgzf->length bytes, using
+ * up to `threads` threads. Returns INFLATE_OK or the error of the first block
+ * which failed.
+ */
+int bgzf_inflate(bgzf_t *bgzf, uint8_t *output, unsigned threads) {
+  int *status = (int *) malloc((bgzf->count ? bgzf->count : 1) * sizeof (int));
+  if (status == NULL) return INFLATE_OUTPUT_FULL;
+  if (threads == 0) threads = 1;
+  size_t tasks = (size_t) threads * BGZF_TASKS_PER_THREAD;
+  bgzf_inflate_t inflate = { bgzf, output, status,
+    (bgzf->count + tasks - 1) / tasks };
+  if (inflate.blocks_per_task == 0) inflate.blocks_per_task = 1;
+  bgzf->table_hits = 0;
+  bgzf->table_misses = 0;
+  thread_pool_run((bgzf->count + inflate.blocks_per_task - 1) /
+    inflate.blocks_per_task, threads, bgzf_inflate_task, &inflate);
+  int res = INFLATE_OK;
+  for (size_t i = 0; i < bgzf->count && res == INFLATE_OK; ++i) {
+    res = status[i];
+  }
+  free(status);
+  return res;
+}
+
+/**
+ * Returns the virtual offset of the offset in the decompressed data. Past the
+ * end, it is the virtual offset of the end of the data.
+ */
+uint64_t bgzf_tell(bgzf_t *bgzf, uint64_t offset) {
+  if (bgzf->count == 0) return 0;
+  if (offset > bgzf->length) offset = bgzf->length;
+  // The last block starting at or before offset
+  size_t low = 0;
+  size_t high = bgzf->count;
+  while (high - low > 1) {
+    size_t middle = (low + high) / 2;
+    if (bgzf->blocks[middle].out <= offset) {
+      low = middle;
+    } else {
+      high = middle;
+    }
+  }
+  // Between two blocks, that is the start of the second one
+  bgzf_block_t *block = &bgzf->blocks[low];
+  return bgzf_virtual_offset(block->offset, offset - block->out);
+}
+
+/**
+ * Returns the index of the block at offset in the file, or -1 if no block
+ * starts there.
+ */
+ssize_t bgzf_find_block(bgzf_t *bgzf, size_t offset) {
+  size_t low = 0;
+  size_t high = bgzf->count;
+  while (low < high) {
+    size_t middle = (low + high) / 2;
+    if (bgzf->blocks[middle].offset < offset) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  if (low == bgzf->count || bgzf->blocks[low].offset != offset) return -1;
+  return low;
+}
+
+/**
+ * Reads up to len bytes of decompressed data from the virtual offset voffset
+ * into out. Returns the number of bytes read, less than len only at the end
+ * of the data, or -1 if voffset is not valid or the data is invalid.
+ */
+ssize_t bgzf_read(bgzf_t *bgzf, uint64_t voffset, size_t len, uint8_t *out) {
+  ssize_t index = bgzf_find_block(bgzf, bgzf_block_offset(voffset));
+  if (index < 0) return -1;
+  size_t offset = bgzf_offset_in_block(voffset);
+  if (offset > bgzf->blocks[index].isize) return -1;
+  uint8_t *data = (uint8_t *) malloc(BGZF_MAX_BLOCK_SIZE);
+  if (data == NULL) return -1;
+  size_t done = 0;
+  for (; done < len && (size_t) index < bgzf->count; ++index) {
+    bgzf_block_t *block = &bgzf->blocks[index];
+    inflate_result_t result;
+    if (inflate_member(bgzf->buf + block->offset, block->size, data,
+                       block->isize, &result) != INFLATE_OK) {
+      done = -1;
+      break;
+    }
+    size_t n = block->isize - offset;
+    if (n > len - done) n = len - done;
+    memcpy(out + done, data + offset, n);
+    done += n;
+    offset = 0;
+  }
+  free(data);
+  return done;
+}
+
+#endif // __BGZF_H__
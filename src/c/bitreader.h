@@ -0,0 +1,153 @@
+#ifndef __BITREADER_H__
+#define __BITREADER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/**
+ * Bit reader for DEFLATE streams.
+ * https://tools.ietf.org/html/rfc1951#page-6
+ *
+ * Bits are accumulated in a 64 bits buffer, the next bit to be read being the
+ * least significant one:
+ * 76543210 FEDCBA98 ...
+ * ——▶——▶—— —————▶——
+ * is loaded in bitbuf as ...FEDCBA9876543210.
+ * The buffer is refilled with a single unaligned 8 bytes load, after which at
+ * least 56 bits are available. That is enough to read a literal/length code,
+ * its extra bits, a distance code and its extra bits (15 + 5 + 15 + 13 = 48
+ * bits) without refilling in between.
+ * Reading past the end of the input yields zeros. The number of those
+ * implicit bytes is kept in overrun so that the caller can detect a truncated
+ * stream.
+ */
+typedef struct bitreader_s {
+  const uint8_t *begin; // the start of the input
+  const uint8_t *ptr;   // the next byte to be loaded in bitbuf
+  const uint8_t *end;   // the end of the input
+  uint64_t bitbuf;      // the bits not consumed yet
+  uint8_t bitcount;     // the number of valid bits in bitbuf
+  size_t overrun;       // the number of bytes loaded past the end
+} bitreader_t;
+
+// The maximum number of bits that can be peeked after a refill
+#define BITREADER_MAX_BITS 56
+
+static inline void bitreader_init(bitreader_t *br, const uint8_t *buf,
+                                  size_t size) {
+  br->begin = buf;
+  br->ptr = buf;
+  br->end = buf + size;
+  br->bitbuf = 0;
+  br->bitcount = 0;
+  br->overrun = 0;
+}
+
+static inline uint64_t bitreader_load64(const uint8_t *ptr) {
+  uint64_t word;
+  memcpy(&word, ptr, sizeof (uint64_t));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  return word;
+}
+
+/**
+ * Fills bitbuf up to at least BITREADER_MAX_BITS bits. At least 8 bytes of
+ * input must be left.
+ */
+static inline void bitreader_refill_fast(bitreader_t *br) {
+  // The bytes only partially loaded in bitbuf will be loaded again by the
+  // next refill, at the same position.
+  br->bitbuf |= bitreader_load64(br->ptr) << br->bitcount;
+  br->ptr += (63 - br->bitcount) >> 3;
+  br->bitcount |= BITREADER_MAX_BITS;
+}
+
+/**
+ * Fills bitbuf up to at least BITREADER_MAX_BITS bits.
+ */
+static inline void bitreader_refill(bitreader_t *br) {
+  if (br->end - br->ptr >= 8) {
+    bitreader_refill_fast(br);
+  } else {
+    while (br->bitcount < BITREADER_MAX_BITS) {
+      if (br->ptr < br->end) {
+        br->bitbuf |= (uint64_t) *br->ptr++ << br->bitcount;
+      } else {
+        br->overrun++;
+      }
+      br->bitcount += 8;
+    }
+  }
+}
+
+/**
+ * Returns the next `n` bits without consuming them. bitcount must be at least
+ * n, which is always the case for n <= BITREADER_MAX_BITS after a refill.
+ */
+static inline uint32_t bitreader_peek(const bitreader_t *br, uint8_t n) {
+  return br->bitbuf & ((1ULL << n) - 1);
+}
+
+static inline void bitreader_consume(bitreader_t *br, uint8_t n) {
+  br->bitbuf >>= n;
+  br->bitcount -= n;
+}
+
+/**
+ * Reads and consumes the next `n` bits, refilling if needed.
+ */
+static inline uint32_t bitreader_read(bitreader_t *br, uint8_t n) {
+  if (br->bitcount < n) bitreader_refill(br);
+  uint32_t value = bitreader_peek(br, n);
+  bitreader_consume(br, n);
+  return value;
+}
+
+/**
+ * Skips the bits up to the next byte boundary and gives back to the input the
+ * whole bytes still in bitbuf. Afterward ptr points to the next byte to read.
+ * Used for stored blocks: https://tools.ietf.org/html/rfc1951#page-11
+ */
+static inline void bitreader_align(bitreader_t *br) {
+  bitreader_consume(br, br->bitcount & 7);
+  size_t bytes = br->bitcount >> 3;
+  if (br->overrun >= bytes) {
+    br->overrun -= bytes;
+  } else {
+    br->ptr -= bytes - br->overrun;
+    br->overrun = 0;
+  }
+  br->bitbuf = 0;
+  br->bitcount = 0;
+}
+
+/**
+ * Moves the reader to the given bit offset from the start of the input.
+ */
+static inline void bitreader_seek(bitreader_t *br, size_t bit) {
+  br->ptr = br->begin + bit / 8;
+  br->bitbuf = 0;
+  br->bitcount = 0;
+  br->overrun = 0;
+  bitreader_refill(br);
+  bitreader_consume(br, bit % 8);
+}
+
+/**
+ * Returns the number of bits consumed since the start of the input.
+ */
+static inline size_t bitreader_position(const bitreader_t *br) {
+  return (br->ptr - br->begin + br->overrun) * 8 - br->bitcount;
+}
+
+/**
+ * Returns 1 if bits past the end of the input were consumed.
+ */
+static inline int bitreader_overrun(const bitreader_t *br) {
+  return br->overrun * 8 > br->bitcount;
+}
+
+#endif // __BITREADER_H__
@@ -1,65 +1,255 @@
 #ifndef __CRC_32__
 #define __CRC_32__
 /**
- * This code is directly copied from the RFC 1952.
+ * CRC-32 as used by gzip.
+ * https://tools.ietf.org/html/rfc1952#page-10
+ *
+ * The RFC sample code processes one byte per table lookup. Here the input is
+ * processed 8 or 16 bytes at a time ("slicing-by-8/16"): each byte of a word
+ * is looked up in its own table and the results are xored together, so the
+ * lookups do not depend on each other. The tables are generated at build
+ * time by mktables.
+ * On x86 CPUs supporting PCLMULQDQ, large buffers are instead folded 64 bytes
+ * at a time with carry-less multiplications, the table version being the
+ * portable fallback.
  */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
 
-/* Table of CRCs of all 8-bit messages. */
-unsigned long crc_table[256];
-
-/* Flag: has the table been computed? Initially false. */
-int crc_table_computed = 0;
-
-/* Make the table for a fast CRC. */
-void make_crc_table(void)
-{
-  unsigned long c;
-  int n, k;
-  for (n = 0; n < 256; n++) {
-    c = (unsigned long) n;
-    for (k = 0; k < 8; k++) {
-      if (c & 1) {
-        c = 0xedb88320L ^ (c >> 1);
-      } else {
-        c = c >> 1;
-      }
-    }
-    crc_table[n] = c;
+#include "crc32_table.h"
+
+static inline uint64_t crc32_load64(const uint8_t *ptr) {
+  uint64_t word;
+  memcpy(&word, ptr, sizeof (uint64_t));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  return word;
+}
+
+/**
+ * The functions below work on the raw CRC register, i.e. without the pre-
+ * and post-conditioning (one's complement) which is done by crc32_update.
+ */
+static inline uint32_t crc32_bytewise(uint32_t c, const uint8_t *buf,
+                                      size_t len) {
+  while (len--) {
+    c = crc32_table[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
   }
-  crc_table_computed = 1;
+  return c;
 }
 
+uint32_t crc32_slice8(uint32_t c, const uint8_t *buf, size_t len) {
+  for (; len >= 8; len -= 8, buf += 8) {
+    uint64_t word = crc32_load64(buf) ^ c;
+    c = crc32_table[7][word & 0xff] ^
+      crc32_table[6][(word >> 8) & 0xff] ^
+      crc32_table[5][(word >> 16) & 0xff] ^
+      crc32_table[4][(word >> 24) & 0xff] ^
+      crc32_table[3][(word >> 32) & 0xff] ^
+      crc32_table[2][(word >> 40) & 0xff] ^
+      crc32_table[1][(word >> 48) & 0xff] ^
+      crc32_table[0][word >> 56];
+  }
+  return crc32_bytewise(c, buf, len);
+}
+
+uint32_t crc32_slice16(uint32_t c, const uint8_t *buf, size_t len) {
+  for (; len >= 16; len -= 16, buf += 16) {
+    uint64_t low = crc32_load64(buf) ^ c;
+    uint64_t high = crc32_load64(buf + 8);
+    c = crc32_table[15][low & 0xff] ^
+      crc32_table[14][(low >> 8) & 0xff] ^
+      crc32_table[13][(low >> 16) & 0xff] ^
+      crc32_table[12][(low >> 24) & 0xff] ^
+      crc32_table[11][(low >> 32) & 0xff] ^
+      crc32_table[10][(low >> 40) & 0xff] ^
+      crc32_table[9][(low >> 48) & 0xff] ^
+      crc32_table[8][low >> 56] ^
+      crc32_table[7][high & 0xff] ^
+      crc32_table[6][(high >> 8) & 0xff] ^
+      crc32_table[5][(high >> 16) & 0xff] ^
+      crc32_table[4][(high >> 24) & 0xff] ^
+      crc32_table[3][(high >> 32) & 0xff] ^
+      crc32_table[2][(high >> 40) & 0xff] ^
+      crc32_table[1][(high >> 48) & 0xff] ^
+      crc32_table[0][high >> 56];
+  }
+  return crc32_slice8(c, buf, len);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define CRC32_HAS_FOLDING
+
+/**
+ * CRC-32 folding with carry-less multiplications, from "Fast CRC Computation
+ * for Generic Polynomials Using PCLMULQDQ Instruction" (Intel, 2009).
+ * Four 128 bits accumulators are folded 64 bytes at a time, then into a
+ * single one, and finally reduced to 32 bits with a Barrett reduction. The
+ * constants are the bit-reflected k1..k5 and polynomials given at the end of
+ * the paper. len must be at least 64 and a multiple of 16.
+ */
+__attribute__((target("pclmul,sse4.1")))
+uint32_t crc32_fold_pclmul(uint32_t c, const uint8_t *buf, size_t len) {
+  static const uint64_t __attribute__((aligned(16))) k1k2[] = {
+    0x0154442bd4, 0x01c6e41596
+  };
+  static const uint64_t __attribute__((aligned(16))) k3k4[] = {
+    0x01751997d0, 0x00ccaa009e
+  };
+  static const uint64_t __attribute__((aligned(16))) k5k0[] = {
+    0x0163cd6124, 0x0000000000
+  };
+  static const uint64_t __attribute__((aligned(16))) poly[] = {
+    0x01db710641, 0x01f7011641
+  };
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+  x1 = _mm_loadu_si128((const __m128i *) (buf + 0x00));
+  x2 = _mm_loadu_si128((const __m128i *) (buf + 0x10));
+  x3 = _mm_loadu_si128((const __m128i *) (buf + 0x20));
+  x4 = _mm_loadu_si128((const __m128i *) (buf + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(c));
+  x0 = _mm_load_si128((const __m128i *) k1k2);
+  buf += 64;
+  len -= 64;
+
+  // Fold 64 bytes at a time
+  while (len >= 64) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+    y5 = _mm_loadu_si128((const __m128i *) (buf + 0x00));
+    y6 = _mm_loadu_si128((const __m128i *) (buf + 0x10));
+    y7 = _mm_loadu_si128((const __m128i *) (buf + 0x20));
+    y8 = _mm_loadu_si128((const __m128i *) (buf + 0x30));
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+    buf += 64;
+    len -= 64;
+  }
+
+  // Fold the four accumulators into one
+  x0 = _mm_load_si128((const __m128i *) k3k4);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  // Fold the remaining 16 bytes blocks
+  while (len >= 16) {
+    x2 = _mm_loadu_si128((const __m128i *) buf);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    buf += 16;
+    len -= 16;
+  }
+
+  // Fold 128 bits to 64 bits
+  x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+  x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+  x1 = _mm_srli_si128(x1, 8);
+  x1 = _mm_xor_si128(x1, x2);
+  x0 = _mm_loadl_epi64((const __m128i *) k5k0);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, x3);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction to 32 bits
+  x0 = _mm_load_si128((const __m128i *) poly);
+  x2 = _mm_and_si128(x1, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+  x2 = _mm_and_si128(x2, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return _mm_extract_epi32(x1, 1);
+}
+
+/**
+ * CPUID based dispatch. __builtin_cpu_supports reads the features detected
+ * once at startup by the compiler runtime, so the check costs a load.
+ */
+static inline int crc32_has_pclmul() {
+  return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+#endif
+
+// Below that size folding does not pay for its setup and final reduction
+#define CRC32_FOLD_MIN_SIZE 256
+
 /**
  * Update a running crc with the bytes buf[0..len-1] and return
  * the updated crc. The crc should be initialized to zero. Pre- and
  * post-conditioning (one's complement) is performed within this
  * function so it shouldn't be done by the caller. Usage example:
  *
- * unsigned long crc = 0L;
+ * uint32_t crc = 0;
  *
  * while (read_buffer(buffer, length) != EOF) {
- *   crc = update_crc(crc, buffer, length);
+ *   crc = crc32_update(crc, buffer, length);
  * }
  * if (crc != original_crc) error();
  */
-unsigned long update_crc(unsigned long crc,
-                unsigned char *buf, int len)
-{
-  unsigned long c = crc ^ 0xffffffffL;
-  int n;
-
-  if (!crc_table_computed)
-    make_crc_table();
-  for (n = 0; n < len; n++) {
-    c = crc_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
+uint32_t crc32_update(uint32_t crc, const uint8_t *buf, size_t len) {
+  uint32_t c = ~crc;
+#ifdef CRC32_HAS_FOLDING
+  if (len >= CRC32_FOLD_MIN_SIZE && crc32_has_pclmul()) {
+    size_t folded = len & ~(size_t) 15;
+    c = crc32_fold_pclmul(c, buf, folded);
+    buf += folded;
+    len -= folded;
+  }
+#endif
+  return ~crc32_slice16(c, buf, len);
+}
+
+/**
+ * Multiplies a and b modulo the CRC polynomial (see mktables.c).
+ */
+uint32_t crc32_multmodp(uint32_t a, uint32_t b) {
+  uint32_t m = (uint32_t) 1 << 31;
+  uint32_t p = 0;
+  for (;;) {
+    if (a & m) {
+      p ^= b;
+      if ((a & (m - 1)) == 0) break;
+    }
+    m >>= 1;
+    b = b & 1 ? (b >> 1) ^ 0xedb88320 : b >> 1;
   }
-  return c ^ 0xffffffffL;
+  return p;
 }
 
-/* Return the CRC of the bytes buf[0..len-1]. */
-unsigned long crc(unsigned char *buf, int len)
-{
-  return update_crc(0L, buf, len);
+/**
+ * Returns the CRC of the concatenation of two buffers A and B given the CRC
+ * of A, the CRC of B and the length of B, in O(log(len_b)):
+ * crc(AB) = crc(A) * x^(8 * len_b) + crc(B) (mod p)
+ * so that chunks can be checked independently and merged afterward.
+ */
+uint32_t crc32_combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b) {
+  // x^(8 * len_b) is the product of x^(2^k) for each bit k of 8 * len_b
+  uint32_t shift = (uint32_t) 1 << 31; // x^0
+  for (uint8_t k = 3; len_b; len_b >>= 1, k++) {
+    if (len_b & 1) shift = crc32_multmodp(crc32_x2n_table[k & 31], shift);
+  }
+  return crc32_multmodp(shift, crc_a) ^ crc_b;
 }
 
 #endif //__CRC_32__
@@ -0,0 +1,170 @@
+#ifndef __DEFLATE_H__
+#define __DEFLATE_H__
+
+/**
+ * Minimal DEFLATE compressor.
+ * https://tools.ietf.org/html/rfc1951#page-11
+ *
+ * Only used to store small buffers compactly, the windows of an index file
+ * (see gzi.h), which are decoded back with inflate. Matches are found with a
+ * hash chain on 3 bytes and greedily coded with the fixed Huffman codes, so
+ * there is no tree to build or to store. When that does not make the data
+ * smaller, it is written in stored blocks instead.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "gziped.h"
+
+#define DEFLATE_HASH_BITS 12
+#define DEFLATE_HASH_SIZE (1 << DEFLATE_HASH_BITS)
+#define DEFLATE_MAX_CHAIN 32
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_STORED_MAX 65535
+// The size of the buffer deflate_fixed needs for len bytes: the data in stored
+// blocks, each one with a 5 bytes header
+#define DEFLATE_BOUND(len) ((len) + 5 * ((len) / DEFLATE_STORED_MAX + 1))
+
+typedef struct bitwriter_s {
+  uint8_t *ptr;
+  uint8_t *end;
+  uint64_t bitbuf;
+  uint8_t bitcount;
+  uint8_t overflow;  // 1 if the output did not fit between ptr and end
+} bitwriter_t;
+
+static inline void put_bits(bitwriter_t *bw, uint32_t bits, uint8_t count) {
+  if (bw->overflow) return;
+  bw->bitbuf |= (uint64_t) bits << bw->bitcount;
+  bw->bitcount += count;
+  while (bw->bitcount >= 8) {
+    if (bw->ptr == bw->end) {
+      bw->overflow = 1;
+      return;
+    }
+    *bw->ptr++ = bw->bitbuf;
+    bw->bitbuf >>= 8;
+    bw->bitcount -= 8;
+  }
+}
+
+static inline void flush_bits(bitwriter_t *bw) {
+  if (bw->bitcount > 0) put_bits(bw, 0, 8 - bw->bitcount);
+}
+
+/**
+ * Writes a literal/length value with its fixed Huffman code
+ * (https://tools.ietf.org/html/rfc1951#page-12). Codes are packed starting
+ * with their most significant bit, hence the reversal.
+ */
+static inline void put_fixed_litlen(bitwriter_t *bw, uint16_t value) {
+  if (value < 144) {
+    put_bits(bw, reverse_bits(0x30 + value, 8), 8);
+  } else if (value < 256) {
+    put_bits(bw, reverse_bits(0x190 + value - 144, 9), 9);
+  } else if (value < 280) {
+    put_bits(bw, reverse_bits(value - 256, 7), 7);
+  } else {
+    put_bits(bw, reverse_bits(0xC0 + value - 280, 8), 8);
+  }
+}
+
+static inline void put_fixed_match(bitwriter_t *bw, uint16_t length,
+                                   uint16_t distance) {
+  uint8_t code = DEFLATE_LENGTH_EXTRA_BITS_ARRAY_SIZE - 1;
+  while (length_lookup[code] > length) --code;
+  put_fixed_litlen(bw, DEFLATE_END_BLOCK_VALUE + 1 + code);
+  put_bits(bw, length - length_lookup[code], length_extra_bits[code]);
+  code = DEFLATE_DISTANCE_EXTRA_BITS_ARRAY_SIZE - 1;
+  while (distance_lookup[code] > distance) --code;
+  put_bits(bw, reverse_bits(code, 5), 5);
+  put_bits(bw, distance - distance_lookup[code], distance_extra_bits[code]);
+}
+
+static inline uint16_t deflate_hash(const uint8_t *ptr) {
+  uint32_t value = ptr[0] | ptr[1] << 8 | ptr[2] << 16;
+  return (value * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+/**
+ * Writes buf in stored blocks. Returns the size written.
+ */
+size_t deflate_stored(const uint8_t *buf, size_t len, uint8_t *output) {
+  uint8_t *ptr = output;
+  do {
+    uint16_t size = len < DEFLATE_STORED_MAX ? len : DEFLATE_STORED_MAX;
+    len -= size;
+    *ptr++ = len == 0; // BFINAL, BTYPE 00, aligned on the next byte
+    *ptr++ = size;
+    *ptr++ = size >> 8;
+    *ptr++ = ~size;
+    *ptr++ = ~size >> 8;
+    memcpy(ptr, buf, size);
+    ptr += size;
+    buf += size;
+  } while (len > 0);
+  return ptr - output;
+}
+
+/**
+ * Compresses len bytes of buf into a raw DEFLATE stream in output, which must
+ * hold at least DEFLATE_BOUND(len) bytes. Returns the size of the stream.
+ */
+size_t deflate_fixed(const uint8_t *buf, size_t len, uint8_t *output) {
+  // The stored blocks are the fallback, so the compressed stream has to be
+  // smaller than them
+  size_t bound = DEFLATE_BOUND(len);
+  bitwriter_t bw = { output, output + bound, 0, 0, 0 };
+  int32_t head[DEFLATE_HASH_SIZE];
+  int32_t *prev = (int32_t *) malloc((len ? len : 1) * sizeof (int32_t));
+  if (prev == NULL) return deflate_stored(buf, len, output);
+  memset(head, 0xFF, sizeof (head));
+
+  put_bits(&bw, 1, 1); // BFINAL
+  put_bits(&bw, 1, 2); // BTYPE 01, fixed Huffman codes
+  size_t pos = 0;
+  while (pos < len && !bw.overflow) {
+    uint16_t best_length = 0;
+    uint16_t best_distance = 0;
+    if (len - pos >= DEFLATE_MIN_MATCH) {
+      size_t max_length = len - pos < DEFLATE_MAX_MATCH_LENGTH ?
+        len - pos : DEFLATE_MAX_MATCH_LENGTH;
+      uint16_t hash = deflate_hash(buf + pos);
+      int32_t candidate = head[hash];
+      for (unsigned chain = 0; candidate >= 0 && chain < DEFLATE_MAX_CHAIN &&
+           pos - candidate <= DEFLATE_WINDOW_SIZE; ++chain) {
+        uint16_t length = 0;
+        while (length < max_length &&
+               buf[candidate + length] == buf[pos + length]) ++length;
+        if (length > best_length) {
+          best_length = length;
+          best_distance = pos - candidate;
+          if (length == max_length) break;
+        }
+        candidate = prev[candidate];
+      }
+    }
+    size_t next = pos + 1;
+    if (best_length >= DEFLATE_MIN_MATCH) {
+      put_fixed_match(&bw, best_length, best_distance);
+      next = pos + best_length;
+    } else {
+      put_fixed_litlen(&bw, buf[pos]);
+    }
+    // Every position passed is inserted in the chains
+    for (; pos < next; ++pos) {
+      if (len - pos >= DEFLATE_MIN_MATCH) {
+        uint16_t hash = deflate_hash(buf + pos);
+        prev[pos] = head[hash];
+        head[hash] = pos;
+      }
+    }
+  }
+  put_fixed_litlen(&bw, DEFLATE_END_BLOCK_VALUE);
+  flush_bits(&bw);
+  free(prev);
+  if (bw.overflow) return deflate_stored(buf, len, output);
+  return bw.ptr - output;
+}
+
+#endif // __DEFLATE_H__
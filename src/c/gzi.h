@@ -0,0 +1,270 @@
+#ifndef __GZI_H__
+#define __GZI_H__
+
+/**
+ * Index files.
+ *
+ * An index (see index.h) takes a full decode of the gzip file to build. It is
+ * saved next to the file, as file.gz.gzi, and loaded back by mapping it in
+ * memory: the windows, which make most of the index, are used where they are
+ * in the mapping and only the checkpoint table is read.
+ *
+ * All the integers are little endian.
+ *
+ * Header, GZI_HEADER_SIZE bytes:
+ *    0 magic, GZI_MAGIC
+ *    8 uint32 version, GZI_VERSION
+ *   12 uint32 flags, 0
+ *   16 uint64 size of the gzip file
+ *   24 uint64 modification time of the gzip file, in seconds since the epoch
+ *   32 uint64 span of the index
+ *   40 uint64 size of the decompressed data
+ *   48 uint64 number of checkpoints
+ *   56 uint32 CRC32 of the gzip file
+ *   60 uint32 nanoseconds of the modification time of the gzip file
+ *
+ * Followed by the checkpoints, GZI_CHECKPOINT_SIZE bytes each, by increasing
+ * output offset:
+ *    0 uint64 bit offset of the block in the gzip file
+ *    8 uint64 offset of the block in the decompressed data
+ *   16 uint64 offset of the window in the index file
+ *   24 uint32 size of the window, at most 32 KB
+ *   28 uint32 size of the window compressed, 0 for an empty window
+ *
+ * Followed by the windows, each one a raw DEFLATE stream (see deflate.h).
+ *
+ * The size and the modification time of the gzip file, to the nanosecond, tell
+ * whether the index is stale: a file rewritten within the same second still
+ * gets a new one on file systems with a finer resolution. Its CRC is only
+ * checked on request (GZI_CHECK_CRC), as that takes a pass over the whole
+ * file.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "gziped.h"
+#include "deflate.h"
+#include "index.h"
+
+#define GZI_MAGIC "\x89GZI\r\n\x1A\n"
+#define GZI_MAGIC_SIZE 8
+#define GZI_VERSION 1
+#define GZI_HEADER_SIZE 64
+#define GZI_CHECKPOINT_SIZE 32
+
+// gziped_load_index flags
+#define GZI_CHECK_CRC 1
+
+#define GZI_OK 0
+#define GZI_IO_ERROR -1      // see errno
+#define GZI_INVALID -2       // not an index file, or a corrupted one
+#define GZI_UNSUPPORTED -3   // an index file of another version
+#define GZI_STALE -4         // the gzip file changed since the index was built
+
+const char *gzi_strerror(int res) {
+  switch (res) {
+    case GZI_OK: return "success";
+    case GZI_IO_ERROR: return "cannot read or write the index file";
+    case GZI_INVALID: return "invalid index file";
+    case GZI_UNSUPPORTED: return "unsupported index file version";
+    case GZI_STALE: return "the index file is out of date";
+    default: return "unknown error";
+  }
+}
+
+static inline uint64_t read_le64(const uint8_t *ptr) {
+  return read_le32(ptr) | (uint64_t) read_le32(ptr + 4) << 32;
+}
+
+static inline void write_le32(uint8_t *ptr, uint32_t value) {
+  ptr[0] = value;
+  ptr[1] = value >> 8;
+  ptr[2] = value >> 16;
+  ptr[3] = value >> 24;
+}
+
+static inline void write_le64(uint8_t *ptr, uint64_t value) {
+  write_le32(ptr, value);
+  write_le32(ptr + 4, value >> 32);
+}
+
+int gzi_write_all(int fd, const uint8_t *buf, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, buf, size);
+    if (written < 0) return -1;
+    buf += written;
+    size -= written;
+  }
+  return 0;
+}
+
+/**
+ * Saves index to path. mtime is the modification time of the gzip file the
+ * index was built from (st_mtim).
+ */
+int gziped_save_index(const gziped_index_t *index, const char *path,
+                      struct timespec mtime) {
+  size_t table_size = index->count * GZI_CHECKPOINT_SIZE;
+  uint8_t *table = (uint8_t *) calloc(1, GZI_HEADER_SIZE + table_size);
+  uint8_t *compressed = (uint8_t *) malloc(DEFLATE_BOUND(DEFLATE_WINDOW_SIZE));
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC,
+    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  int res = GZI_OK;
+  if (table == NULL || compressed == NULL || fd < 0) {
+    res = GZI_IO_ERROR;
+    goto end;
+  }
+  // The windows are written first, after room left for the header and the
+  // table, which are only complete once the windows offsets are known
+  uint64_t offset = GZI_HEADER_SIZE + table_size;
+  if (lseek(fd, offset, SEEK_SET) < 0) {
+    res = GZI_IO_ERROR;
+    goto end;
+  }
+  for (size_t i = 0; i < index->count; ++i) {
+    const checkpoint_t *checkpoint = &index->checkpoints[i];
+    size_t size = 0;
+    if (checkpoint->window_size > 0) {
+      size = deflate_fixed(checkpoint->window, checkpoint->window_size,
+        compressed);
+      if (gzi_write_all(fd, compressed, size) != 0) {
+        res = GZI_IO_ERROR;
+        goto end;
+      }
+    }
+    uint8_t *record = table + GZI_HEADER_SIZE + i * GZI_CHECKPOINT_SIZE;
+    write_le64(record, checkpoint->in);
+    write_le64(record + 8, checkpoint->out);
+    write_le64(record + 16, offset);
+    write_le32(record + 24, checkpoint->window_size);
+    write_le32(record + 28, size);
+    offset += size;
+  }
+
+  memcpy(table, GZI_MAGIC, GZI_MAGIC_SIZE);
+  write_le32(table + 8, GZI_VERSION);
+  write_le64(table + 16, index->size);
+  write_le64(table + 24, mtime.tv_sec);
+  write_le64(table + 32, index->span);
+  write_le64(table + 40, index->length);
+  write_le64(table + 48, index->count);
+  write_le32(table + 56, crc32_update(0, index->buf, index->size));
+  write_le32(table + 60, mtime.tv_nsec);
+  if (lseek(fd, 0, SEEK_SET) < 0 ||
+      gzi_write_all(fd, table, GZI_HEADER_SIZE + table_size) != 0) {
+    res = GZI_IO_ERROR;
+  }
+
+end:
+  if (fd >= 0 && close(fd) != 0 && res == GZI_OK) res = GZI_IO_ERROR;
+  if (res != GZI_OK && fd >= 0) unlink(path);
+  free(compressed);
+  free(table);
+  return res;
+}
+
+/**
+ * Reads the checkpoint table of the index file in map.
+ */
+int gzi_read_checkpoints(gziped_index_t *index, const uint8_t *map,
+                         size_t map_size) {
+  uint64_t count = read_le64(map + 48);
+  if (count > (map_size - GZI_HEADER_SIZE) / GZI_CHECKPOINT_SIZE)
+    return GZI_INVALID;
+  index->checkpoints = (checkpoint_t *) malloc(
+    (count ? count : 1) * sizeof (checkpoint_t));
+  if (index->checkpoints == NULL) return GZI_IO_ERROR;
+  index->count = index->capacity = count;
+  for (size_t i = 0; i < count; ++i) {
+    const uint8_t *record = map + GZI_HEADER_SIZE + i * GZI_CHECKPOINT_SIZE;
+    checkpoint_t *checkpoint = &index->checkpoints[i];
+    checkpoint->in = read_le64(record);
+    checkpoint->out = read_le64(record + 8);
+    uint64_t offset = read_le64(record + 16);
+    checkpoint->window_size = read_le32(record + 24);
+    checkpoint->window_compressed_size = read_le32(record + 28);
+    checkpoint->window = (uint8_t *) map + offset;
+    // What gziped_seek_read relies on
+    if (checkpoint->in / 8 >= index->size || checkpoint->out > index->length ||
+        (i > 0 && checkpoint->out < index->checkpoints[i - 1].out) ||
+        checkpoint->window_size > DEFLATE_WINDOW_SIZE ||
+        (checkpoint->window_compressed_size == 0) !=
+          (checkpoint->window_size == 0) ||
+        offset > map_size ||
+        checkpoint->window_compressed_size > map_size - offset) {
+      return GZI_INVALID;
+    }
+  }
+  return GZI_OK;
+}
+
+/**
+ * Loads the index of the gzip file in buf, of size bytes and modified at
+ * mtime (st_mtim), from the index file at path. On success *index receives the index,
+ * to be freed with gziped_free_index, and which refers to buf.
+ */
+int gziped_load_index(const char *path, uint8_t *buf, size_t size,
+                      struct timespec mtime, int flags,
+                      gziped_index_t **index) {
+  *index = NULL;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return GZI_IO_ERROR;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return GZI_IO_ERROR;
+  }
+  size_t map_size = st.st_size;
+  if (map_size < GZI_HEADER_SIZE) {
+    close(fd);
+    return GZI_INVALID;
+  }
+  uint8_t *map = (uint8_t *) mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return GZI_IO_ERROR;
+
+  int res = GZI_OK;
+  gziped_index_t *result = NULL;
+  if (memcmp(map, GZI_MAGIC, GZI_MAGIC_SIZE) != 0) {
+    res = GZI_INVALID;
+  } else if (read_le32(map + 8) != GZI_VERSION) {
+    res = GZI_UNSUPPORTED;
+  } else if (read_le64(map + 16) != size ||
+             read_le64(map + 24) != (uint64_t) mtime.tv_sec ||
+             read_le32(map + 60) != (uint32_t) mtime.tv_nsec ||
+             ((flags & GZI_CHECK_CRC) &&
+              read_le32(map + 56) != crc32_update(0, buf, size))) {
+    res = GZI_STALE;
+  } else if ((result = (gziped_index_t *) calloc(1,
+               sizeof (gziped_index_t))) == NULL) {
+    res = GZI_IO_ERROR;
+  } else {
+    result->buf = buf;
+    result->size = size;
+    result->span = read_le64(map + 32);
+    result->length = read_le64(map + 40);
+    result->map = map;
+    result->map_size = map_size;
+    res = gzi_read_checkpoints(result, map, map_size);
+  }
+  if (res != GZI_OK) {
+    if (result != NULL) {
+      gziped_free_index(result); // unmaps map
+    } else {
+      munmap(map, map_size);
+    }
+    return res;
+  }
+  *index = result;
+  return GZI_OK;
+}
+
+#endif // __GZI_H__
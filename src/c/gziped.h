@@ -25,6 +25,9 @@
  * gzip container: https://www.ietf.org/rfc/rfc1952.txt
  * DEFLATE compression method: https://www.ietf.org/rfc/rfc1951.txt
  */
+#ifndef __GZIPED_H__
+#define __GZIPED_H__
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -40,7 +43,12 @@
 
 #include <sys/mman.h>
 
+#include "libgziped.h"
 #include "debug.h"
+#include "bitreader.h"
+#include "crc32.h"
+#include "fixed_huffman_table.h"
+#include "match_copy.h"
 
 // To quiet the pesky compiler
 char *strndup(const char *s, size_t n);
@@ -58,40 +66,14 @@ char *strndup(const char *s, size_t n);
 #define DEFLATE_CODE_MAX_BIT_LENGTH 32
 #define DEFLATE_ALPHABET_SIZE 288
 #define DEFLATE_END_BLOCK_VALUE 256
+#define DEFLATE_WINDOW_SIZE 32768
+#define DEFLATE_MAX_MATCH_LENGTH 258
 
-// Can seem a little steep but according to
-// https://tools.ietf.org/html/rfc1951#page-13, code lengths for dynamic
-// dictionaries can be as long as 15 bits.
-#define DYNAMIC_DICT_SIZE 65535
-
-// https://tools.ietf.org/html/rfc1952#page-5
-typedef struct header_s {
-  uint16_t  magic;
-  uint8_t   cm;
-  uint8_t   flg;
-  uint32_t  mtime;
-  uint8_t   xfl;
-  uint8_t   os;
-} header_t;
-
-typedef struct extra_header_s {
-  uint16_t xlen;
-  char *fname;
-  char *fcomment;
-  uint16_t crc16;
-} extra_header_t;
-
-typedef struct footer_s {
-  uint32_t crc32;
-  uint32_t isize;
-} footer_t;
-
-typedef struct metadata_s {
-  header_t header;
-  extra_header_t extra_header;
-  ssize_t block_offset;
-  footer_t footer;
-} metadata_t;
+// According to https://tools.ietf.org/html/rfc1951#page-13, code lengths for
+// dynamic dictionaries can be as long as 15 bits.
+#define DEFLATE_MAX_CODE_LENGTH 15
+#define DEFLATE_MAX_LENGTH_VALUE 285
+#define DEFLATE_MAX_DISTANCE_VALUE 29
 
 // https://tools.ietf.org/html/rfc1951#page-10
 typedef struct block_s {
@@ -106,7 +88,7 @@ typedef struct block_s {
 #define FNAME     (1 << 3)
 #define FCOMMENT  (1 << 4)
 
-const char *OS[14] = {
+static const char *const OS[14] = {
   "FAT filesystem (MS-DOS, OS/2, NT/Win32)",
   "Amiga",
   "VMS (or OpenVMS)",
@@ -130,7 +112,7 @@ typedef struct static_huffman_params_s {
   uint32_t next_codes[32];
 } static_huffman_params_t;
 // [8] * (144 - 0) + [9] * (256-144) + [7] * (280 - 256) + [8] * (288 - 280)
-static_huffman_params_t static_huffman_params = {
+static const static_huffman_params_t static_huffman_params = {
   {
     8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
     8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
@@ -155,7 +137,8 @@ static_huffman_params_t static_huffman_params = {
 // still use one to keep coherent with the dynamic dictionary case.
 #define DEFLATE_STATIC_DISTANCE_CODE_LENGTHS_SIZE 32
 #define DEFLATE_SDCLS DEFLATE_STATIC_DISTANCE_CODE_LENGTHS_SIZE
-uint8_t static_huffman_params_distance_code_lengths[DEFLATE_SDCLS] = {
+static const uint8_t
+    static_huffman_params_distance_code_lengths[DEFLATE_SDCLS] = {
   5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
   5, 5, 5, 5, 5, 5
 };
@@ -163,72 +146,98 @@ uint8_t static_huffman_params_distance_code_lengths[DEFLATE_SDCLS] = {
 #define DEFLATE_LENGTH_EXTRA_BITS_ARRAY_SIZE 29
 #define DEFLATE_LENGTH_EXTRA_BITS_ARRAY_OFFSET 257
 
-uint16_t length_lookup[DEFLATE_LENGTH_EXTRA_BITS_ARRAY_SIZE] = {
+static const uint16_t length_lookup[DEFLATE_LENGTH_EXTRA_BITS_ARRAY_SIZE] = {
   3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67,
   83, 99, 115, 131, 163, 195, 227, 258
 };
 
 // https://tools.ietf.org/html/rfc1951#page-12
-uint8_t length_extra_bits[DEFLATE_LENGTH_EXTRA_BITS_ARRAY_SIZE] = {
+static const uint8_t length_extra_bits[DEFLATE_LENGTH_EXTRA_BITS_ARRAY_SIZE] = {
   0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5,
   5, 5, 0
 };
 
 #define DEFLATE_DISTANCE_EXTRA_BITS_ARRAY_SIZE 30
 
-uint16_t distance_lookup[DEFLATE_DISTANCE_EXTRA_BITS_ARRAY_SIZE] = {
+static const uint16_t
+    distance_lookup[DEFLATE_DISTANCE_EXTRA_BITS_ARRAY_SIZE] = {
   1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
   1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
 };
 
 // https://tools.ietf.org/html/rfc1951#page-12
-uint8_t distance_extra_bits[DEFLATE_DISTANCE_EXTRA_BITS_ARRAY_SIZE] = {
+static const uint8_t
+    distance_extra_bits[DEFLATE_DISTANCE_EXTRA_BITS_ARRAY_SIZE] = {
   0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11,
   11, 12, 12, 13, 13
 };
 
 // https://tools.ietf.org/html/rfc1951#page-14
 #define CODE_LENGTHS_CODE_LENGTH 19 // yeah...
-uint8_t code_length_code_alphabet[CODE_LENGTHS_CODE_LENGTH] = {
+static const uint8_t code_length_code_alphabet[CODE_LENGTHS_CODE_LENGTH] = {
   16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
 };
-uint8_t code_length_lengths_extra_size[CODE_LENGTHS_CODE_LENGTH] = {
+static const uint8_t
+    code_length_lengths_extra_size[CODE_LENGTHS_CODE_LENGTH] = {
   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7
 };
-uint8_t code_length_lengths_extra_size_offset[CODE_LENGTHS_CODE_LENGTH] = {
+static const uint8_t
+    code_length_lengths_extra_size_offset[CODE_LENGTHS_CODE_LENGTH] = {
   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 3, 3, 11
 };
 
-// For debugging purposes
-uint8_t *g_buf = NULL;
-uint8_t *g_output = NULL;
-
-// Move the mask bit to the left up to 128, then reinit to 1 and increment ptr
-#define INCREMENT_MASK(mask, ptr) \
-  mask = mask << 1 | mask >> 7; \
-  ptr += mask & 1;
-
-// Retrieve multiple bits.
-// 76543210 FEDCBA98
-// ——▶——▶—— —————▶——
-//  3 2  1    5   3
-// result:
-//  210 543 9876 FEDCB
-#define READ(dest, mask, ptr, size) { \
-  dest = 0; \
-  uint32_t _pos = 1; \
-  uint8_t _size = size; \
-  while (_size--) { \
-    dest |= (*ptr & mask ? _pos : 0); \
-    _pos <<= 1; \
-    INCREMENT_MASK(mask, ptr) \
-  } \
-}
-
-typedef uint16_t *dict_t;
+// A decode table entry, read in a single load:
+//   bits 0-7:   number of bits to consume at this level
+//   bits 8-13:  for a sub-table pointer, the number of bits indexing it
+//   bit 14:     the entry does not correspond to any code
+//   bit 15:     the entry points to a sub-table
+//   bits 16-31: the decoded value, or the sub-table offset
+typedef uint32_t huffman_entry_t;
+
+#define HUFFMAN_ENTRY_SUBTABLE 0x8000
+#define HUFFMAN_ENTRY_INVALID  0x4000
+#define HUFFMAN_ENTRY(value, length) ((uint32_t) (value) << 16 | (length))
+#define HUFFMAN_ENTRY_LENGTH(entry) ((entry) & 0xFF)
+#define HUFFMAN_ENTRY_SUB_BITS(entry) (((entry) >> 8) & 0x3F)
+#define HUFFMAN_ENTRY_VALUE(entry) ((entry) >> 16)
+
+// Number of bits indexing the primary tables. Codes longer than that are
+// resolved with a second lookup in a sub-table. The table sizes are the
+// worst case for those parameters as computed by zlib's enough.c
+// (enough 288 10 15, enough 32 8 15 and enough 19 7 7).
+#define LITLEN_TABLE_BITS 10
+#define LITLEN_TABLE_SIZE 1334
+#define DISTANCE_TABLE_BITS 8
+#define DISTANCE_TABLE_SIZE 402
+#define CODE_LENGTH_TABLE_BITS 7
+#define CODE_LENGTH_TABLE_SIZE 128
+
+// The decode tables of the fixed codes are generated by mktables, indexed the
+// same way so that the loops decoding dynamic blocks can use them as well.
+#if FIXED_LITLEN_TABLE_BITS != LITLEN_TABLE_BITS || \
+    FIXED_DISTANCE_TABLE_BITS != DISTANCE_TABLE_BITS
+#error "the fixed huffman tables do not match the table parameters"
+#endif
+// Fixed distance codes are all 5 bits long
+#define FIXED_DISTANCE_CODE_LENGTH 5
 
 void usage() {
-  fprintf(stderr, "usage: gzip <file>\n");
+  fprintf(stderr, "usage: gzip [-j threads] [--stats] [--mmap] [--pipeline] "
+    "[--input <method>] <file>...\n");
+  fprintf(stderr, "       gzip [-j threads] [--stats] [--mmap] [--pipeline] "
+    "[--input <method>] --files-from <list> (decompress the files listed in "
+    "<list>, - for stdin)\n");
+  fprintf(stderr, "       with several files, --uring reads and writes them "
+    "with io_uring\n");
+  fprintf(stderr, "       gzip -c [<file>...] (decompress the files, or "
+    "stdin, to stdout)\n");
+  fprintf(stderr, "       gzip - (decompress stdin to stdout)\n");
+  fprintf(stderr, "       gzip --build-index <file> (write <file>.gzi)\n");
+  fprintf(stderr, "       gzip [--check-index] --range <offset>:<length> "
+    "<file> (decompress a byte range to stdout, --check-index checking the "
+    "CRC of <file> against its index)\n");
+  fprintf(stderr, "       <method> reads the input files: mmap (default), "
+    "populate, pread or direct\n");
 }
 
 void print_metadata(metadata_t metadata) {
@@ -265,8 +274,9 @@ void print_metadata(metadata_t metadata) {
 uint8_t *get_extra_header(uint8_t *buf, header_t header, extra_header_t *extra) {
   uint8_t *current = buf + GZIP_HEADER_SIZE;
   if (header.flg & FEXTRA) {
-    uint16_t xlen = *current;
+    uint16_t xlen = current[0] | current[1] << 8;
     extra->xlen = xlen;
+    extra->extra = current + 2;
     current += 2 + xlen;
   }
   if (header.flg & FNAME) {
@@ -280,44 +290,100 @@ uint8_t *get_extra_header(uint8_t *buf, header_t header, extra_header_t *extra)
     extra->fcomment = strndup((const char *) beg, current - beg);
   }
   if (header.flg & FHCRC) {
-    uint16_t crc16 = *current;
+    uint16_t crc16 = current[0] | current[1] << 8;
     extra->crc16 = crc16;
     current += 2;
   }
   return current;
 }
 
+/**
+ * Looks for the subfield with the identifier si1, si2 in the extra field of a
+ * header. Returns its data, *len receiving its size, or NULL if there is none.
+ * https://tools.ietf.org/html/rfc1952#page-8
+ */
+const uint8_t *find_extra_subfield(const uint8_t *extra, uint16_t xlen,
+                                   uint8_t si1, uint8_t si2, uint16_t *len) {
+  size_t pos = 0;
+  // Each subfield is SI1, SI2, a 2 bytes LEN and LEN bytes of data
+  while (xlen - pos >= 4) {
+    uint16_t sublen = extra[pos + 2] | extra[pos + 3] << 8;
+    if (xlen - pos - 4 < sublen) break;
+    if (extra[pos] == si1 && extra[pos + 1] == si2) {
+      *len = sublen;
+      return extra + pos + 4;
+    }
+    pos += 4 + sublen;
+  }
+  return NULL;
+}
+
 void free_metadata(metadata_t *metadata) {
   if (metadata->extra_header.fname != NULL) free(metadata->extra_header.fname);
   if (metadata->extra_header.fcomment != NULL) free(metadata->extra_header.fcomment);
 }
 
-// https://tools.ietf.org/html/rfc1952#page-5
-void get_metadata(uint8_t *buf, ssize_t size, metadata_t *metadata) {
-  // Get header
-  memcpy(&metadata->header, buf, GZIP_HEADER_SIZE);
-  // Get extra header depeneding on xflg
-  memset(&metadata->extra_header, 0, sizeof (extra_header_t));
-  uint8_t *pos = get_extra_header(buf, metadata->header, &metadata->extra_header);
-  // Footer
-  metadata->footer.crc32 = buf[size - 8] | buf[size - 7] << 8 |
-    buf[size - 6] << 16 | buf[size - 5] << 24;
-  metadata->footer.isize = buf[size - 4] | buf[size - 3] << 8 |
-    buf[size - 2] << 16 | buf[size - 1] << 24;
+static inline uint32_t read_le32(const uint8_t *ptr) {
+  return ptr[0] | ptr[1] << 8 | ptr[2] << 16 | (uint32_t) ptr[3] << 24;
+}
 
-  // Sanity checks
-  if (metadata->header.magic != GZIP_MAGIC) {
-    fprintf(stderr, "error: incorrect magic number\n");
-    exit(4);
+/**
+ * Returns the size of the gzip member header at the beginning of buf, or 0 if
+ * buf does not start with a valid header. Nothing is read past the end of the
+ * buffer, so that it can be used on untrusted offsets.
+ * https://tools.ietf.org/html/rfc1952#page-5
+ */
+size_t member_header_size(const uint8_t *buf, size_t size) {
+  if (size < GZIP_HEADER_SIZE || buf[0] != 0x1F || buf[1] != 0x8B ||
+      buf[2] != GZIP_DEFLATE_CM || (buf[3] & 0xE0) != 0)
+    return 0;
+  uint8_t flg = buf[3];
+  size_t pos = GZIP_HEADER_SIZE;
+  if (flg & FEXTRA) {
+    if (size - pos < 2) return 0;
+    pos += 2 + (buf[pos] | buf[pos + 1] << 8);
+    if (pos > size) return 0;
   }
-  if (metadata->header.cm != GZIP_DEFLATE_CM) {
-    fprintf(stderr, "error: unknown compression method\n");
-    exit(4);
+  if (flg & FNAME) {
+    const uint8_t *nul = memchr(buf + pos, 0, size - pos);
+    if (nul == NULL) return 0;
+    pos = nul - buf + 1;
   }
+  if (flg & FCOMMENT) {
+    const uint8_t *nul = memchr(buf + pos, 0, size - pos);
+    if (nul == NULL) return 0;
+    pos = nul - buf + 1;
+  }
+  if (flg & FHCRC) {
+    if (size - pos < 2) return 0;
+    pos += 2;
+  }
+  return pos;
+}
 
-  metadata->block_offset = pos - buf;
+/**
+ * Reads the header and the footer of the gzip file in buf. Returns INFLATE_OK
+ * or one of the INFLATE_* errors, in which case there is nothing to free.
+ * https://tools.ietf.org/html/rfc1952#page-5
+ */
+int get_metadata(uint8_t *buf, ssize_t size, metadata_t *metadata) {
+  memset(metadata, 0, sizeof (metadata_t));
+  if (size < GZIP_HEADER_SIZE + 8) return INFLATE_TRUNCATED;
+  // Get header
+  memcpy(&metadata->header, buf, GZIP_HEADER_SIZE);
+  // Sanity checks
+  if (metadata->header.magic != GZIP_MAGIC) return INFLATE_BAD_MAGIC;
+  if (metadata->header.cm != GZIP_DEFLATE_CM) return INFLATE_BAD_METHOD;
+  size_t header_size = member_header_size(buf, size);
+  if (header_size == 0) return INFLATE_INVALID_DATA;
+  // Get extra header depeneding on xflg
+  get_extra_header(buf, metadata->header, &metadata->extra_header);
+  // Footer
+  metadata->footer.crc32 = read_le32(buf + size - 8);
+  metadata->footer.isize = read_le32(buf + size - 4);
 
-  return;
+  metadata->block_offset = header_size;
+  return INFLATE_OK;
 }
 
 /**
@@ -332,8 +398,8 @@ void get_metadata(uint8_t *buf, ssize_t size, metadata_t *metadata) {
  * with a minimum size of DEFLATE_CODE_MAX_BIT_LENGTH.
  */
 void count_by_code_length(const uint8_t *code_lengths, ssize_t size,
-                          uint8_t *length_counts) {
-  memset(length_counts, 0, DEFLATE_CODE_MAX_BIT_LENGTH * sizeof (uint8_t));
+                          uint16_t *length_counts) {
+  memset(length_counts, 0, DEFLATE_CODE_MAX_BIT_LENGTH * sizeof (uint16_t));
   for (; size > 0; --size) {
     length_counts[code_lengths[size - 1]]++;
   }
@@ -360,7 +426,7 @@ void count_by_code_length(const uint8_t *code_lengths, ssize_t size,
  * @param next_codes  next_codes[N] is the first code of length N. It must be
  * allocated with a minimum size of DEFLATE_CODE_MAX_BIT_LENGTH.
  */
-void generate_next_codes(uint8_t *length_counts, uint32_t *next_codes) {
+void generate_next_codes(uint16_t *length_counts, uint32_t *next_codes) {
   uint32_t code = 0;
   memset(next_codes, 0, DEFLATE_CODE_MAX_BIT_LENGTH * sizeof (uint32_t));
   for (uint8_t nbits = 1; nbits < DEFLATE_CODE_MAX_BIT_LENGTH; nbits++) {
@@ -369,80 +435,168 @@ void generate_next_codes(uint8_t *length_counts, uint32_t *next_codes) {
 }
 
 /**
- * Generates an containg the mapped value.
+ * Reverses the `length` lowest bits of code.
+ * Huffman codes are packed starting with their most significant bit while
+ * everything else is read least significant bit first, so the tables are
+ * indexed by the reversed codes.
+ */
+uint16_t reverse_bits(uint16_t code, uint8_t length) {
+  uint16_t reversed = 0;
+  while (length--) {
+    reversed = (reversed << 1) | (code & 1);
+    code >>= 1;
+  }
+  return reversed;
+}
+
+/**
+ * Generates a decode table from a list of code lengths.
+ * The primary table is indexed by the next `table_bits` bits of the input. An
+ * entry either directly gives the value and the length of the code, or, for
+ * codes longer than table_bits, points to a sub-table indexed by the
+ * following bits. For example, with table_bits = 2:
+ * { A: 010, B: 00, C: 10, D: 011, E: 11 }
+ * is stored in this array (indexes are the bits in reading order):
+ * 00 -> B (2)  01 -> C (2)  10 -> @4 (2, 1 bit)  11 -> E (2)
+ * @4: 0 -> A (1)  1 -> D (1)
+ *
  * @params code_lengths is the array of code length
  * @params size is the size of code_lengths
- * @param next_codes  next_codes[N] is the first code of length N. It must be
- * allocated with a minimum size of DEFLATE_CODE_MAX_BIT_LENGTH.
- * @params dict A array filled up with values depending on their huffman
- * code. For example:
- * { A: 010, B: 00, C: 10 }
- * is represented with this tree:
- *      x
- *    /   \
- *   x     x
- *  / \   /
- * B   x C
- *    /
- *   A
- * which in turn is stored in this array:
- * { -1, -1, -1, B, -1, C, -1, -1, -1, A, -1, -1, -1, -1, -1 }
+ * @params table_bits the number of bits indexing the primary table
+ * @params table the resulting table
+ * @params table_size the number of entries allocated for table
+ * @return 0 on success, -1 if the code lengths do not describe a valid code.
  */
-void generate_dict(const uint8_t *code_lengths, ssize_t size,
-                   uint32_t *next_codes, dict_t dict, uint16_t dict_size) {
-  memset(dict, NO_VALUE, dict_size * sizeof (uint16_t));
+int build_decode_table(const uint8_t *code_lengths, uint16_t size,
+                       uint8_t table_bits, huffman_entry_t *table,
+                       uint16_t table_size) {
+  uint16_t length_counts[DEFLATE_CODE_MAX_BIT_LENGTH];
+  count_by_code_length(code_lengths, size, length_counts);
+
+  // Reject over-subscribed codes. As zlib does, incomplete codes are only
+  // accepted when made of a single code, which the RFC allows for distances.
+  // A code with no symbol at all, as the distance code of a block of
+  // literals, gives a table of invalid entries only.
+  for (uint8_t length = DEFLATE_MAX_CODE_LENGTH + 1;
+       length < DEFLATE_CODE_MAX_BIT_LENGTH; ++length) {
+    if (length_counts[length] != 0) return -1;
+  }
+  int32_t left = 1;
+  uint8_t max_length = 0;
+  for (uint8_t length = 1; length <= DEFLATE_MAX_CODE_LENGTH; ++length) {
+    left = (left << 1) - length_counts[length];
+    if (left < 0) return -1;
+    if (length_counts[length] != 0) max_length = length;
+  }
+  if (left > 0 && max_length > 1) return -1;
+
+  uint32_t next_codes[DEFLATE_CODE_MAX_BIT_LENGTH];
+  generate_next_codes(length_counts, next_codes);
+
+  uint16_t primary_size = 1 << table_bits;
+  for (uint16_t i = 0; i < primary_size; ++i) {
+    table[i] = HUFFMAN_ENTRY(NO_VALUE, 1) | HUFFMAN_ENTRY_INVALID;
+  }
+
+  // Fill the primary table with the short codes and, for the long ones,
+  // compute how many bits each sub-table must be indexed with.
+  uint16_t codes[DEFLATE_ALPHABET_SIZE];
+  uint8_t sub_bits[1 << LITLEN_TABLE_BITS];
+  memset(sub_bits, 0, primary_size * sizeof (uint8_t));
   for (uint16_t i = 0; i < size; ++i) {
     uint8_t length = code_lengths[i];
     if (length == 0) continue;
-    uint32_t code = next_codes[length];
-    // printf("%u %s (%u)\n", i, tobin(code, length), length);
-    uint32_t m = 1 << (length - 1);
-    uint16_t index = 0;
-    while (m) {
-      index <<= 1;
-      index += code & m ? 2 : 1;
-      m >>= 1;
+    codes[i] = reverse_bits(next_codes[length]++, length);
+    if (length <= table_bits) {
+      for (uint16_t j = codes[i]; j < primary_size; j += 1 << length) {
+        table[j] = HUFFMAN_ENTRY(i, length);
+      }
+    } else {
+      uint16_t prefix = codes[i] & (primary_size - 1);
+      if (length - table_bits > sub_bits[prefix])
+        sub_bits[prefix] = length - table_bits;
+    }
+  }
+  if (max_length <= table_bits) return 0;
+
+  // Lay out the sub-tables after the primary table
+  uint16_t offset = primary_size;
+  for (uint16_t prefix = 0; prefix < primary_size; ++prefix) {
+    if (sub_bits[prefix] == 0) continue;
+    if (offset + (1 << sub_bits[prefix]) > table_size) return -1;
+    table[prefix] = HUFFMAN_ENTRY(offset, table_bits) |
+      sub_bits[prefix] << 8 | HUFFMAN_ENTRY_SUBTABLE;
+    offset += 1 << sub_bits[prefix];
+  }
+
+  // Fill the sub-tables with the long codes
+  for (uint16_t i = 0; i < size; ++i) {
+    uint8_t length = code_lengths[i];
+    if (length <= table_bits) continue;
+    huffman_entry_t pointer = table[codes[i] & (primary_size - 1)];
+    huffman_entry_t *subtable = &table[HUFFMAN_ENTRY_VALUE(pointer)];
+    uint16_t subtable_size = 1 << HUFFMAN_ENTRY_SUB_BITS(pointer);
+    for (uint16_t j = codes[i] >> table_bits; j < subtable_size;
+         j += 1 << (length - table_bits)) {
+      subtable[j] = HUFFMAN_ENTRY(i, length - table_bits);
     }
-    // printf("[%u] = %u \n", index, i);
-    dict[index] = i;
-    next_codes[code_lengths[i]]++;
   }
+  return 0;
 }
 
 /**
- * Shorthand function.
+ * Same as decode_symbol, for callers which made sure that bitbuf holds at
+ * least DEFLATE_MAX_CODE_LENGTH bits.
  */
-void generate_dict_from_code_length(const uint8_t *code_lengths,
-                                    size_t length_counts_size, dict_t dict,
-                                    uint32_t dict_size) {
-  uint8_t length_counts[DEFLATE_CODE_MAX_BIT_LENGTH];
-  count_by_code_length(code_lengths, length_counts_size, length_counts);
+static inline uint16_t decode_symbol_fast(bitreader_t *br,
+                                          const huffman_entry_t *table,
+                                          uint8_t table_bits) {
+  uint32_t bits = bitreader_peek(br, DEFLATE_MAX_CODE_LENGTH);
+  huffman_entry_t entry = table[bits & ((1 << table_bits) - 1)];
+  if (entry & HUFFMAN_ENTRY_SUBTABLE) {
+    bitreader_consume(br, table_bits);
+    bits >>= table_bits;
+    entry = table[HUFFMAN_ENTRY_VALUE(entry) +
+      (bits & ((1 << HUFFMAN_ENTRY_SUB_BITS(entry)) - 1))];
+  }
+  bitreader_consume(br, HUFFMAN_ENTRY_LENGTH(entry));
+  return HUFFMAN_ENTRY_VALUE(entry);
+}
 
-  uint32_t next_codes[DEFLATE_CODE_MAX_BIT_LENGTH];
-  generate_next_codes(length_counts, next_codes);
+/**
+ * Decodes the next value from the input using a table generated by
+ * build_decode_table. Returns NO_VALUE if the input does not match any code.
+ */
+uint16_t decode_symbol(bitreader_t *br, const huffman_entry_t *table,
+                       uint8_t table_bits) {
+  if (br->bitcount < DEFLATE_MAX_CODE_LENGTH) bitreader_refill(br);
+  return decode_symbol_fast(br, table, table_bits);
+}
 
-  generate_dict(code_lengths, length_counts_size,
-    next_codes, dict, dict_size);
+const char *inflate_strerror(int error) {
+  switch (error) {
+    case INFLATE_OK: return "success";
+    case INFLATE_INVALID_DATA: return "invalid deflate stream";
+    case INFLATE_OUTPUT_FULL: return "output buffer too small";
+    case INFLATE_TRUNCATED: return "unexpected end of input";
+    case INFLATE_CHECK_FAILED: return "cyclic redundancy check failed";
+    case INFLATE_BAD_MAGIC: return "incorrect magic number";
+    case INFLATE_BAD_METHOD: return "unknown compression method";
+    default: return "unknown error";
+  }
 }
 
 /**
  * Dynamic dictionaries are using special encoding rules.
  * https://tools.ietf.org/html/rfc1951#page-13.
  */
-void decode_dynamic_dict_lengths(uint8_t **buf, uint8_t *mask, size_t output_size,
-                                 dict_t dict, uint8_t *output) {
-  uint16_t index = 0;
+int decode_dynamic_dict_lengths(bitreader_t *br, size_t output_size,
+                                const huffman_entry_t *table, uint8_t *output) {
+  uint8_t *begin = output;
   uint16_t value = 0;
 
   while (output_size) {
-    do {
-      index <<= 1;
-      index += **buf & *mask ? 2 : 1;
-      // printf("%u", **buf & *mask ? 1 : 0);
-      INCREMENT_MASK(*mask, *buf);
-    } while ((value = dict[index]) == NO_VALUE);
-    // printf("\n");
-    index = 0;
+    value = decode_symbol(br, table, CODE_LENGTH_TABLE_BITS);
     // A little complicated dance here...
     // https://tools.ietf.org/html/rfc1951#page-13
     if (value < 16) {
@@ -450,43 +604,52 @@ void decode_dynamic_dict_lengths(uint8_t **buf, uint8_t *mask, size_t output_siz
       *output++ = value;
       output_size--;
     } else {
+      uint8_t repeated = 0;
+      uint8_t extra = 0;
+      uint8_t count = 0;
       if (value == 16) {
         // 16 we copy the last value according to the 2 next bits + 3
-        uint8_t extra = 0;
-        READ(extra, *mask, *buf, 2);
-        uint8_t last_value = *(output - 1);
-        for (int i = 0; i < extra + 3; ++i) {
-          *output++ = last_value;
-          output_size--;
-        }
-      } else {
+        if (output == begin) return INFLATE_INVALID_DATA;
+        repeated = *(output - 1);
+        extra = bitreader_read(br, 2);
+        count = extra + 3;
+      } else if (value == 17 || value == 18) {
         // 17 or 18, we append 0 according to the extra bits
-        uint8_t extra = 0;
-        uint8_t extra_size = code_length_lengths_extra_size[value];
-        READ(extra, *mask, *buf, extra_size);
-        for (int i = 0; i < extra + code_length_lengths_extra_size_offset[value]; ++i) {
-          *output++ = 0;
-          output_size--;
-        }
+        extra = bitreader_read(br, code_length_lengths_extra_size[value]);
+        count = extra + code_length_lengths_extra_size_offset[value];
+      } else {
+        return INFLATE_INVALID_DATA;
       }
+      if (count > output_size) return INFLATE_INVALID_DATA;
+      memset(output, repeated, count);
+      output += count;
+      output_size -= count;
     }
   }
+  return INFLATE_OK;
 }
 
 /**
- * Decode the dynamic code and generate a dictionary.
+ * Reads the code lengths of a dynamic block header: lengths receives the
+ * *nlit literal/length code lengths followed by the *ndist distance ones.
+ * Every decoder reads its headers here, or checks them as it does (see
+ * inflate_stream.h), so that they all reject the same ones.
  * https://tools.ietf.org/html/rfc1951#page-13.
  */
-void parse_dynamic_tree(uint8_t **buf, uint8_t *mask,
-                        dict_t litdict, dict_t distdict) {
+int read_dynamic_lengths(bitreader_t *br, uint8_t *lengths, uint16_t *nlit,
+                         uint8_t *ndist) {
   // First read HLEN (4 bits), HDIST (5 bits) and HLIT (5 bits)
-  uint8_t hlen;
-  uint8_t hdist;
-  uint8_t hlit;
-  READ(hlit, *mask, *buf, 5);
-  READ(hdist, *mask, *buf, 5);
-  READ(hlen, *mask, *buf, 4);
+  uint8_t hlit = bitreader_read(br, 5);
+  uint8_t hdist = bitreader_read(br, 5);
+  uint8_t hlen = bitreader_read(br, 4);
   // printf("hlen %u hdist %u hlit %u\n", hlen + 4, hdist + 1, hlit + 257);
+  // The fields can count up to 288 and 32 codes, the alphabets have 286
+  // and 30 symbols
+  *nlit = hlit + 257;
+  *ndist = hdist + 1;
+  if (*nlit > DEFLATE_MAX_LENGTH_VALUE + 1 ||
+      *ndist > DEFLATE_MAX_DISTANCE_VALUE + 1)
+    return INFLATE_INVALID_DATA;
   // Read HLEN + 4 code length codes.
   uint8_t code_length_lengths[CODE_LENGTHS_CODE_LENGTH];
   memset(code_length_lengths, 0, CODE_LENGTHS_CODE_LENGTH * sizeof (uint8_t));
@@ -502,131 +665,574 @@ void parse_dynamic_tree(uint8_t **buf, uint8_t *mask,
     // to increase the code according to the order of the value. Then what you
     // should have is:
     // 100 -> 4; 101 -> 6; 110 -> 8.
-    READ(code_length_lengths[code_length_code_alphabet[i]], *mask, *buf, 3);
+    code_length_lengths[code_length_code_alphabet[i]] = bitreader_read(br, 3);
+  }
+  // Generate the decode table from code length codes
+  huffman_entry_t code_length_table[CODE_LENGTH_TABLE_SIZE];
+  if (build_decode_table(code_length_lengths, CODE_LENGTHS_CODE_LENGTH,
+      CODE_LENGTH_TABLE_BITS, code_length_table, CODE_LENGTH_TABLE_SIZE) != 0)
+    return INFLATE_INVALID_DATA;
+  // Read the HLIT + 257 code lengths for the literal/length dynamic dictionary
+  // followed by the HDIST + 1 code lengths for the distance one. Both are a
+  // single sequence: a repeat code may span from one to the other.
+  if (decode_dynamic_dict_lengths(br, *nlit + *ndist, code_length_table,
+      lengths) != INFLATE_OK)
+    return INFLATE_INVALID_DATA;
+  // Without it the block could not end
+  if (lengths[DEFLATE_END_BLOCK_VALUE] == 0) return INFLATE_INVALID_DATA;
+  return INFLATE_OK;
+}
+
+/**
+ * Builds the decode tables of a dynamic block from its code lengths.
+ */
+int build_dynamic_tables(const uint8_t *lengths, uint16_t nlit, uint8_t ndist,
+                         huffman_entry_t *littable,
+                         huffman_entry_t *disttable) {
+  if (build_decode_table(lengths, nlit, LITLEN_TABLE_BITS, littable,
+      LITLEN_TABLE_SIZE) != 0)
+    return INFLATE_INVALID_DATA;
+  if (build_decode_table(lengths + nlit, ndist, DISTANCE_TABLE_BITS,
+      disttable, DISTANCE_TABLE_SIZE) != 0)
+    return INFLATE_INVALID_DATA;
+  return INFLATE_OK;
+}
+
+/**
+ * Decode the dynamic code and generate the decode tables.
+ * https://tools.ietf.org/html/rfc1951#page-13.
+ */
+int parse_dynamic_tree(bitreader_t *br, huffman_entry_t *littable,
+                       huffman_entry_t *disttable) {
+  uint8_t lengths[DEFLATE_ALPHABET_SIZE + DEFLATE_SDCLS];
+  uint16_t nlit = 0;
+  uint8_t ndist = 0;
+  if (read_dynamic_lengths(br, lengths, &nlit, &ndist) != INFLATE_OK)
+    return INFLATE_INVALID_DATA;
+  return build_dynamic_tables(lengths, nlit, ndist, littable, disttable);
+}
+
+/**
+ * Cache of the decode tables of dynamic blocks.
+ * Encoders with a fixed configuration, or fed with very regular data, tend to
+ * emit the same code lengths block after block, and member after member. The
+ * last TABLE_CACHE_SIZE pairs of tables built are kept, looked up by a hash of
+ * the code lengths and evicted least recently used first. The code lengths
+ * themselves are compared on a hit, so that a hash collision cannot give the
+ * wrong tables.
+ */
+#define TABLE_CACHE_SIZE 8
+
+typedef struct table_cache_entry_s {
+  uint32_t hash;      // the CRC32 of the code lengths
+  uint16_t nlit;      // 0 for an unused entry
+  uint8_t ndist;
+  uint64_t last_use;
+  uint8_t lengths[DEFLATE_ALPHABET_SIZE + DEFLATE_SDCLS];
+  huffman_entry_t littable[LITLEN_TABLE_SIZE];
+  huffman_entry_t disttable[DISTANCE_TABLE_SIZE];
+} table_cache_entry_t;
+
+typedef struct table_cache_s {
+  table_cache_entry_t entries[TABLE_CACHE_SIZE];
+  uint64_t clock;     // incremented by each lookup
+  uint64_t hits;      // the number of blocks whose tables were found
+  uint64_t misses;    // the number of blocks whose tables were built
+} table_cache_t;
+
+/**
+ * Same as parse_dynamic_tree, the tables being taken from the cache when
+ * possible. *littable and *disttable point in the cache, and remain valid
+ * until the next call.
+ */
+int parse_dynamic_tree_cached(bitreader_t *br, table_cache_t *cache,
+                              const huffman_entry_t **littable,
+                              const huffman_entry_t **disttable) {
+  uint8_t lengths[DEFLATE_ALPHABET_SIZE + DEFLATE_SDCLS];
+  uint16_t nlit = 0;
+  uint8_t ndist = 0;
+  if (read_dynamic_lengths(br, lengths, &nlit, &ndist) != INFLATE_OK)
+    return INFLATE_INVALID_DATA;
+  uint32_t hash = crc32_update(0, lengths, nlit + ndist);
+  cache->clock++;
+  table_cache_entry_t *victim = &cache->entries[0];
+  for (int i = 0; i < TABLE_CACHE_SIZE; ++i) {
+    table_cache_entry_t *entry = &cache->entries[i];
+    if (entry->hash == hash && entry->nlit == nlit && entry->ndist == ndist &&
+        memcmp(entry->lengths, lengths, nlit + ndist) == 0) {
+      entry->last_use = cache->clock;
+      cache->hits++;
+      *littable = entry->littable;
+      *disttable = entry->disttable;
+      return INFLATE_OK;
+    }
+    // Unused entries have a last_use of 0
+    if (entry->last_use < victim->last_use) victim = entry;
+  }
+  cache->misses++;
+  if (build_dynamic_tables(lengths, nlit, ndist, victim->littable,
+      victim->disttable) != INFLATE_OK) {
+    victim->nlit = 0;
+    victim->last_use = 0;
+    return INFLATE_INVALID_DATA;
   }
-  // Generate dictionary from code length codes
-  uint16_t code_length_dict[256];
-  generate_dict_from_code_length(code_length_lengths, CODE_LENGTHS_CODE_LENGTH,
-    code_length_dict, 256);
-  // Read the HLIT + 257 code length for the literal/length dynamic dictionary
-  uint8_t literal_lengths[287];
-  memset(literal_lengths, 0, 287 * sizeof (uint8_t));
-  decode_dynamic_dict_lengths(buf, mask, hlit + 257, code_length_dict,
-    literal_lengths);
-  // Read the HDIST + 1 code length for the distance dynamic dictionary
-  uint8_t distance_lengths[32];
-  memset(distance_lengths, 0, 32 * sizeof (uint8_t));
-  decode_dynamic_dict_lengths(buf, mask, hdist + 1, code_length_dict,
-    distance_lengths);
-  // Generates the dynamic dictionary
-  generate_dict_from_code_length(literal_lengths, hlit + 257, litdict,
-    DYNAMIC_DICT_SIZE);
-  generate_dict_from_code_length(distance_lengths, hdist + 1, distdict,
-    DYNAMIC_DICT_SIZE);
-}
-
-// TODO: break this function down into smaller functions
-uint8_t * inflate_block(uint8_t **buf, uint8_t *mask,
-                        dict_t litdict, dict_t distdict, uint8_t *output) {
-  uint16_t index = 0;
+  victim->hash = hash;
+  victim->nlit = nlit;
+  victim->ndist = ndist;
+  victim->last_use = cache->clock;
+  memcpy(victim->lengths, lengths, nlit + ndist);
+  *littable = victim->littable;
+  *disttable = victim->disttable;
+  return INFLATE_OK;
+}
+
+// While that much input and output is left, a symbol can be decoded, and its
+// match copied, without checking the bounds: a refill loads 8 bytes, and a
+// match writes at most DEFLATE_MAX_MATCH_LENGTH bytes and the slack of
+// match_copy.
+#define INFLATE_FAST_MIN_INPUT 32
+#define INFLATE_FAST_MIN_OUTPUT (DEFLATE_MAX_MATCH_LENGTH + MATCH_COPY_SLACK)
+// Returned by inflate_block_fast when it left the rest of the block to the
+// careful loop of inflate_block
+#define INFLATE_BLOCK_TAIL 1
+
+/**
+ * The fast loop of inflate_block, which decodes symbols while the input and
+ * the output are far enough from their end to need no bounds check. Only
+ * the distances of the matches are checked, as they depend on the data.
+ * Returns INFLATE_OK at the end of the block, INFLATE_BLOCK_TAIL if the end of
+ * the input or of the output is reached before.
+ */
+static inline int inflate_block_fast(bitreader_t *br,
+                                     const huffman_entry_t *littable,
+                                     const huffman_entry_t *disttable,
+                                     uint8_t *output_begin,
+                                     uint8_t **output_ptr,
+                                     uint8_t *output_end) {
+  uint8_t *output = *output_ptr;
+  int res = INFLATE_BLOCK_TAIL;
+  while (br->end - br->ptr >= INFLATE_FAST_MIN_INPUT &&
+         output_end - output >= INFLATE_FAST_MIN_OUTPUT) {
+    // A single refill provides enough bits for a whole literal or
+    // length/distance pair, extra bits included.
+    bitreader_refill_fast(br);
+    uint16_t value = decode_symbol_fast(br, littable, LITLEN_TABLE_BITS);
+    if (value < DEFLATE_END_BLOCK_VALUE) {
+      *output++ = value;
+      continue;
+    }
+    if (value == DEFLATE_END_BLOCK_VALUE) {
+      res = INFLATE_OK;
+      break;
+    }
+    if (value > DEFLATE_MAX_LENGTH_VALUE) {
+      res = INFLATE_INVALID_DATA;
+      break;
+    }
+    uint16_t length = length_lookup[value - DEFLATE_END_BLOCK_VALUE - 1];
+    uint8_t nb_extra_bits = length_extra_bits[value - DEFLATE_END_BLOCK_VALUE - 1];
+    length += bitreader_peek(br, nb_extra_bits);
+    bitreader_consume(br, nb_extra_bits);
+    value = decode_symbol_fast(br, disttable, DISTANCE_TABLE_BITS);
+    if (value > DEFLATE_MAX_DISTANCE_VALUE) {
+      res = INFLATE_INVALID_DATA;
+      break;
+    }
+    uint16_t distance = distance_lookup[value];
+    nb_extra_bits = distance_extra_bits[value];
+    distance += bitreader_peek(br, nb_extra_bits);
+    bitreader_consume(br, nb_extra_bits);
+    if (distance > output - output_begin) {
+      res = INFLATE_INVALID_DATA;
+      break;
+    }
+    output = match_copy(output, distance, length);
+  }
+  *output_ptr = output;
+  return res;
+}
+
+// The longest fixed code with its extra bits, or length/distance pair: 9 bits
+// for a literal, or 8 + 5 bits for a length and 5 + 13 bits for its distance
+#define INFLATE_FIXED_MAX_SYMBOL_BITS 32
+
+/**
+ * Same as inflate_block_fast for the fixed codes of a
+ * DEFLATE_FIX_HUF_BLOCK_TYPE block. Their tables are constant and no code
+ * is longer than LITLEN_TABLE_BITS, so a symbol is always a single lookup,
+ * and distance codes are read as 5 bits with no lookup of their length. The
+ * bit buffer is only refilled once it holds too few bits for a symbol.
+ */
+
+static inline int inflate_fixed_block_fast(bitreader_t *br,
+                                           uint8_t *output_begin,
+                                           uint8_t **output_ptr,
+                                           uint8_t *output_end) {
+  uint8_t *output = *output_ptr;
+  int res = INFLATE_BLOCK_TAIL;
+  while (br->end - br->ptr >= INFLATE_FAST_MIN_INPUT &&
+         output_end - output >= INFLATE_FAST_MIN_OUTPUT) {
+    if (br->bitcount < INFLATE_FIXED_MAX_SYMBOL_BITS)
+      bitreader_refill_fast(br);
+    huffman_entry_t entry =
+      fixed_litlen_table[bitreader_peek(br, LITLEN_TABLE_BITS)];
+    bitreader_consume(br, HUFFMAN_ENTRY_LENGTH(entry));
+    uint16_t value = HUFFMAN_ENTRY_VALUE(entry);
+    if (value < DEFLATE_END_BLOCK_VALUE) {
+      *output++ = value;
+      continue;
+    }
+    if (value == DEFLATE_END_BLOCK_VALUE) {
+      res = INFLATE_OK;
+      break;
+    }
+    if (value > DEFLATE_MAX_LENGTH_VALUE) {
+      res = INFLATE_INVALID_DATA;
+      break;
+    }
+    uint16_t length = length_lookup[value - DEFLATE_END_BLOCK_VALUE - 1];
+    uint8_t nb_extra_bits = length_extra_bits[value - DEFLATE_END_BLOCK_VALUE - 1];
+    length += bitreader_peek(br, nb_extra_bits);
+    bitreader_consume(br, nb_extra_bits);
+    // The first 32 entries of the distance table are the 32 codes
+    value = HUFFMAN_ENTRY_VALUE(
+      fixed_distance_table[bitreader_peek(br, FIXED_DISTANCE_CODE_LENGTH)]);
+    bitreader_consume(br, FIXED_DISTANCE_CODE_LENGTH);
+    if (value > DEFLATE_MAX_DISTANCE_VALUE) {
+      res = INFLATE_INVALID_DATA;
+      break;
+    }
+    uint16_t distance = distance_lookup[value];
+    nb_extra_bits = distance_extra_bits[value];
+    distance += bitreader_peek(br, nb_extra_bits);
+    bitreader_consume(br, nb_extra_bits);
+    if (distance > output - output_begin) {
+      res = INFLATE_INVALID_DATA;
+      break;
+    }
+    output = match_copy(output, distance, length);
+  }
+  *output_ptr = output;
+  return res;
+}
+
+/**
+ * The careful loop of inflate_block, which checks everything, for the last
+ * symbols of a block, close to the end of the input or of the output.
+ */
+int inflate_block_tail(bitreader_t *br, const huffman_entry_t *littable,
+                       const huffman_entry_t *disttable, uint8_t *output_begin,
+                       uint8_t **output_ptr, uint8_t *output_end) {
+  uint8_t *output = *output_ptr;
   uint16_t value = 0;
+  int res = INFLATE_OK;
 
-  while (value != DEFLATE_END_BLOCK_VALUE) {
-    do {
-      index = (index << 1) + 1;
-      if ((**buf & *mask) != 0) index++;
-      INCREMENT_MASK(*mask, *buf);
-    } while ((value = litdict[index]) == NO_VALUE);
+  for (;;) {
+    // A single refill provides enough bits for a whole literal or
+    // length/distance pair, extra bits included.
+    bitreader_refill(br);
+    // Past the end of the input, the zeros read would otherwise be decoded
+    // as symbols until the output is full
+    if (bitreader_overrun(br)) {
+      res = INFLATE_TRUNCATED;
+      break;
+    }
+    value = decode_symbol(br, littable, LITLEN_TABLE_BITS);
+    if (value == DEFLATE_END_BLOCK_VALUE) break;
     if (value < DEFLATE_END_BLOCK_VALUE) {
+      if (output == output_end) {
+        res = INFLATE_OUTPUT_FULL;
+        break;
+      }
       *output++ = value;
+      continue;
     }
-    if (value > DEFLATE_END_BLOCK_VALUE) {
-      uint16_t length = length_lookup[value - DEFLATE_END_BLOCK_VALUE - 1];
-      // length code
-      uint8_t nb_extra_bits = length_extra_bits[value - DEFLATE_END_BLOCK_VALUE - 1];
-      uint16_t extra_bits = 0;
-      READ(extra_bits, *mask, *buf, nb_extra_bits);
-      length += extra_bits;
-      // Now read the distance
-      index = 0;
-      do {
-        index <<= 1;
-        index += **buf & *mask ? 2 : 1;
-        INCREMENT_MASK(*mask, *buf);
-      } while ((value = distdict[index]) == NO_VALUE);
-      uint16_t distance = distance_lookup[value];
-      nb_extra_bits = distance_extra_bits[value];
-      extra_bits = 0;
-      READ(extra_bits, *mask, *buf, nb_extra_bits);
-      distance += extra_bits;
-      if (length > distance) {
-        while (length--) {
-          *output = *(output - distance);
-          ++output;
-        }
-      } else {
-        // memcpy to go a little faster
-        memcpy(output, output - distance, length);
-        output += length;
+    if (value > DEFLATE_MAX_LENGTH_VALUE) {
+      res = INFLATE_INVALID_DATA;
+      break;
+    }
+    uint16_t length = length_lookup[value - DEFLATE_END_BLOCK_VALUE - 1];
+    // length code
+    uint8_t nb_extra_bits = length_extra_bits[value - DEFLATE_END_BLOCK_VALUE - 1];
+    length += bitreader_peek(br, nb_extra_bits);
+    bitreader_consume(br, nb_extra_bits);
+    // Now read the distance
+    value = decode_symbol(br, disttable, DISTANCE_TABLE_BITS);
+    if (value > DEFLATE_MAX_DISTANCE_VALUE) {
+      res = INFLATE_INVALID_DATA;
+      break;
+    }
+    uint16_t distance = distance_lookup[value];
+    nb_extra_bits = distance_extra_bits[value];
+    distance += bitreader_peek(br, nb_extra_bits);
+    bitreader_consume(br, nb_extra_bits);
+    if (distance > output - output_begin) {
+      res = INFLATE_INVALID_DATA;
+      break;
+    }
+    if (length > output_end - output) {
+      res = INFLATE_OUTPUT_FULL;
+      break;
+    }
+    if (output_end - output >= length + MATCH_COPY_SLACK) {
+      output = match_copy(output, distance, length);
+    } else {
+      // Close to the end of the output, where the copy cannot overrun it
+      while (length--) {
+        *output = *(output - distance);
+        ++output;
       }
     }
-    index = 0;
   }
-  return output;
-}
-
-void inflate(uint8_t *buf, uint8_t *output) {
-  g_buf = buf; // for debugging purposes
-  g_output = output; // for debugging purposes
-  // Generate the static huffman dictionary for literals/lengths
-  uint16_t static_dict[1024];
-  generate_dict(static_huffman_params.code_lengths, DEFLATE_ALPHABET_SIZE,
-    static_huffman_params.next_codes, static_dict, 1024);
-  // Generate the static huffman dictionary for distances
-  uint16_t distance_static_dict[64];
-  memset(distance_static_dict, -1, 64 * sizeof (uint16_t));
-  generate_dict_from_code_length(static_huffman_params_distance_code_lengths,
-    32, distance_static_dict, 32);
+  *output_ptr = output;
+  return res;
+}
+
+/**
+ * Decodes the symbols of a huffman block up to its end-of-block code.
+ * *output is the current position in the output buffer, which spans from
+ * output_begin to output_end: matches may not reach before output_begin nor
+ * the copy go past output_end, which makes the function safe on any input.
+ * Most of the block is decoded by inflate_block_fast, and its last symbols by
+ * inflate_block_tail.
+ */
+int inflate_block(bitreader_t *br, const huffman_entry_t *littable,
+                  const huffman_entry_t *disttable, uint8_t *output_begin,
+                  uint8_t **output_ptr, uint8_t *output_end) {
+  int res = inflate_block_fast(br, littable, disttable, output_begin,
+    output_ptr, output_end);
+  if (res != INFLATE_BLOCK_TAIL) return res;
+  return inflate_block_tail(br, littable, disttable, output_begin, output_ptr,
+    output_end);
+}
 
+/**
+ * Same as inflate_block for a block using the fixed codes.
+ */
+int inflate_fixed_block(bitreader_t *br, uint8_t *output_begin,
+                        uint8_t **output_ptr, uint8_t *output_end) {
+  int res = inflate_fixed_block_fast(br, output_begin, output_ptr, output_end);
+  if (res != INFLATE_BLOCK_TAIL) return res;
+  return inflate_block_tail(br, fixed_litlen_table, fixed_distance_table,
+    output_begin, output_ptr, output_end);
+}
+
+/**
+ * Inflates the DEFLATE stream starting at buf into output, which can hold
+ * output_size bytes. Returns INFLATE_OK or one of the INFLATE_* errors.
+ * If result is not NULL, it receives the number of bytes consumed up to the
+ * end of the final block (rounded up to a byte), the number of bytes written
+ * and the CRC32 of the output. On error, only the number of bytes written
+ * before it is set. The CRC is updated with each block as soon as
+ * it is decoded, while it is still in cache, instead of in a separate pass
+ * over the whole output.
+ * If cache is not NULL, the tables of the dynamic blocks are looked up in it
+ * and added to it, see table_cache_t.
+ */
+int inflate_cached(uint8_t *buf, size_t size, uint8_t *output,
+                   size_t output_size, inflate_result_t *result,
+                   table_cache_t *cache) {
   uint8_t bfinal = 0; // 1 if this is the final block
-  uint8_t *current_buf = buf; // the pointer to the current position in the buffer
-  uint8_t mask = 1; // the integer used as mask to read bit by bit
+  bitreader_t br; // the bit reader over the input buffer
+  bitreader_init(&br, buf, size);
   uint8_t *current_output = output; // the pointer to the current positionin the output
+  uint8_t *output_end = output + output_size;
+  uint32_t crc = 0;
+  int res = INFLATE_OK;
   do {
-    READ(bfinal, mask, current_buf, 1);
+    uint8_t *block_output = current_output;
+    bfinal = bitreader_read(&br, 1);
     // Anything that is not inside the block is read from left to right.
     // See https://tools.ietf.org/html/rfc1951#page-6
-    uint8_t btype; // The buffer type
-    READ(btype, mask, current_buf, 2);
+    uint8_t btype = bitreader_read(&br, 2); // The buffer type
 
     switch (btype) {
       case DEFLATE_LITERAL_BLOCK_TYPE: {
         // printf("DEFLATE_LITERAL_BLOCK_TYPE\n");
         // https://tools.ietf.org/html/rfc1951#page-11
         // Uncompressed block starts on the next byte
-        if (mask != 1) current_buf++; // Only increment if we haven't done it before
-        uint16_t len = *current_buf | *(current_buf + 1) << 8;
-        current_buf += 4; // Skiping 4 bytes (LEN and NLEN)
-        memcpy(current_output, current_buf, len * sizeof (uint8_t));
-        current_buf += len;
+        bitreader_align(&br);
+        if (br.end - br.ptr < 4) {
+          res = INFLATE_TRUNCATED;
+          break;
+        }
+        uint16_t len = br.ptr[0] | br.ptr[1] << 8;
+        uint16_t nlen = br.ptr[2] | br.ptr[3] << 8;
+        if (len != (uint16_t) ~nlen) {
+          res = INFLATE_INVALID_DATA;
+          break;
+        }
+        br.ptr += 4; // Skiping 4 bytes (LEN and NLEN)
+        if (br.end - br.ptr < len) {
+          res = INFLATE_TRUNCATED;
+          break;
+        }
+        if (output_end - current_output < len) {
+          res = INFLATE_OUTPUT_FULL;
+          break;
+        }
+        memcpy(current_output, br.ptr, len * sizeof (uint8_t));
+        br.ptr += len;
         current_output += len;
-        mask = 1;
         break;
       }
       case DEFLATE_FIX_HUF_BLOCK_TYPE: {
         // printf("DEFLATE_FIX_HUF_BLOCK_TYPE\n");
-        current_output = inflate_block(&current_buf, &mask, static_dict,
-          distance_static_dict, current_output);
+        res = inflate_fixed_block(&br, output, &current_output, output_end);
         break;
       }
       case DEFLATE_DYN_HUF_BLOCK_TYPE: {
         // printf("DEFLATE_DYN_HUF_BLOCK_TYPE\n");
-        uint16_t dict[DYNAMIC_DICT_SIZE];
-        uint16_t dist_dict[DYNAMIC_DICT_SIZE];
-        parse_dynamic_tree(&current_buf, &mask, dict, dist_dict);
-        current_output = inflate_block(&current_buf, &mask, dict, dist_dict, current_output);
+        if (cache != NULL) {
+          const huffman_entry_t *table = NULL;
+          const huffman_entry_t *dist_table = NULL;
+          res = parse_dynamic_tree_cached(&br, cache, &table, &dist_table);
+          if (res == INFLATE_OK) {
+            res = inflate_block(&br, table, dist_table, output,
+              &current_output, output_end);
+          }
+          break;
+        }
+        huffman_entry_t table[LITLEN_TABLE_SIZE];
+        huffman_entry_t dist_table[DISTANCE_TABLE_SIZE];
+        res = parse_dynamic_tree(&br, table, dist_table);
+        if (res == INFLATE_OK) {
+          res = inflate_block(&br, table, dist_table, output, &current_output,
+            output_end);
+        }
         break;
       }
+      default:
+        res = INFLATE_INVALID_DATA;
+    }
+    // Reading past the end of the input yields zeros, which might be what
+    // made the data look invalid.
+    if (bitreader_overrun(&br)) res = INFLATE_TRUNCATED;
+    if (res != INFLATE_OK) {
+      if (result != NULL) result->produced = current_output - output;
+      return res;
     }
+    if (result != NULL)
+      crc = crc32_update(crc, block_output, current_output - block_output);
   } while (bfinal != 1);
+
+  if (result != NULL) {
+    result->consumed = (bitreader_position(&br) + 7) / 8;
+    result->produced = current_output - output;
+    result->crc = crc;
+  }
+  return INFLATE_OK;
+}
+
+int inflate(uint8_t *buf, size_t size, uint8_t *output, size_t output_size,
+            inflate_result_t *result) {
+  return inflate_cached(buf, size, output, output_size, result, NULL);
 }
+
+/**
+ * Checks the footer of a member against the result of the decoding of its
+ * DEFLATE stream, which started after header_size bytes. On success,
+ * result->consumed is updated to the size of the whole member.
+ * https://tools.ietf.org/html/rfc1952#page-5
+ */
+int check_member_footer(uint8_t *buf, size_t size, size_t header_size,
+                        inflate_result_t *result) {
+  size_t footer = header_size + result->consumed;
+  if (size - footer < 8) return INFLATE_TRUNCATED;
+  uint32_t crc32 = buf[footer] | buf[footer + 1] << 8 |
+    buf[footer + 2] << 16 | (uint32_t) buf[footer + 3] << 24;
+  uint32_t isize = buf[footer + 4] | buf[footer + 5] << 8 |
+    buf[footer + 6] << 16 | (uint32_t) buf[footer + 7] << 24;
+  // ISIZE is the size of the original input modulo 2^32
+  if (crc32 != result->crc || isize != (uint32_t) result->produced)
+    return INFLATE_CHECK_FAILED;
+  result->consumed = footer + 8;
+  return INFLATE_OK;
+}
+
+/**
+ * Decodes the gzip member at the beginning of buf, header included, and checks
+ * it against its own footer. On success result->consumed is the size of the
+ * whole member, so that the next member of a concatenated file starts at
+ * buf + result->consumed. cache may be NULL, see inflate_cached.
+ */
+int inflate_member_cached(uint8_t *buf, size_t size, uint8_t *output,
+                          size_t output_size, inflate_result_t *result,
+                          table_cache_t *cache) {
+  size_t header_size = member_header_size(buf, size);
+  if (header_size == 0) return INFLATE_INVALID_DATA;
+  int res = inflate_cached(buf + header_size, size - header_size, output,
+    output_size, result, cache);
+  if (res != INFLATE_OK) return res;
+  return check_member_footer(buf, size, header_size, result);
+}
+
+int inflate_member(uint8_t *buf, size_t size, uint8_t *output,
+                   size_t output_size, inflate_result_t *result) {
+  return inflate_member_cached(buf, size, output, output_size, result, NULL);
+}
+
+/**
+ * Decoder context, for callers decoding many streams.
+ * inflate and inflate_member keep nothing from one call to the next: the
+ * tables of each dynamic block are built on the stack, and thrown away. A
+ * decoder is allocated once and holds the tables instead, in its table
+ * cache, so that streams written with the same codes as a previous one are
+ * decoded with no table to build. The fixed tables are constant and the rest
+ * of the state fits in registers and on the stack, so, once the decoder is
+ * allocated, decoding into a caller buffer allocates nothing.
+ *
+ * Usage example:
+ *
+ * gziped_decoder_t *decoder = gziped_decoder_init();
+ * for (size_t i = 0; i < count; ++i) {
+ *   inflate_result_t result;
+ *   int res = gziped_inflate_member(decoder, files[i].buf, files[i].size,
+ *     output, sizeof (output), &result);
+ *   ...
+ * }
+ * gziped_decoder_free(decoder);
+ */
+struct gziped_decoder_s {
+  table_cache_t cache;
+};
+
+gziped_decoder_t *gziped_decoder_init() {
+  return (gziped_decoder_t *) calloc(1, sizeof (gziped_decoder_t));
+}
+
+/**
+ * Resets the statistics of the decoder. The cached tables are kept: they are
+ * looked up by their code lengths, and remain valid from one stream to the
+ * next.
+ */
+void gziped_decoder_reset(gziped_decoder_t *decoder) {
+  decoder->cache.hits = 0;
+  decoder->cache.misses = 0;
+}
+
+void gziped_decoder_free(gziped_decoder_t *decoder) {
+  free(decoder);
+}
+
+/**
+ * Same as inflate, with the tables of decoder. decoder may be NULL.
+ */
+int gziped_inflate(gziped_decoder_t *decoder, uint8_t *buf, size_t size,
+                   uint8_t *output, size_t output_size,
+                   inflate_result_t *result) {
+  return inflate_cached(buf, size, output, output_size, result,
+    decoder != NULL ? &decoder->cache : NULL);
+}
+
+/**
+ * Same as inflate_member, with the tables of decoder. decoder may be NULL.
+ */
+int gziped_inflate_member(gziped_decoder_t *decoder, uint8_t *buf,
+                          size_t size, uint8_t *output, size_t output_size,
+                          inflate_result_t *result) {
+  return inflate_member_cached(buf, size, output, output_size, result,
+    decoder != NULL ? &decoder->cache : NULL);
+}
+
+#endif // __GZIPED_H__
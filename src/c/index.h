@@ -0,0 +1,239 @@
+#ifndef __INDEX_H__
+#define __INDEX_H__
+
+/**
+ * Random access into gzip files.
+ *
+ * Decoding can only start at the beginning of a DEFLATE block, and needs the
+ * 32 KB of output preceding it (https://tools.ietf.org/html/rfc1951#page-5).
+ * So during a full decode, at the first block boundary after every `span`
+ * bytes of output, a checkpoint records the bit offset of the block in the
+ * file, the offset of its output in the decompressed data and the window
+ * preceding it. A read at any offset then only decodes from the last
+ * checkpoint before that offset, i.e. at most `span` bytes plus the bytes
+ * read, instead of the whole file.
+ *
+ * Usage example:
+ *
+ * gziped_index_t *index = gziped_build_index(buf, size, INDEX_DEFAULT_SPAN);
+ * uint8_t out[4096];
+ * ssize_t len = gziped_seek_read(index, 10000000000, sizeof (out), out);
+ * gziped_free_index(index);
+ *
+ * The index refers to buf, which has to outlive it. Concatenated members are
+ * supported. The part of a member read from a checkpoint cannot be checked
+ * against its CRC, which is only checked by the full decode building the
+ * index.
+ * An index can be saved next to the gzip file and loaded back instead of being
+ * built again, see gzi.h.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gziped.h"
+#include "inflate_stream.h"
+
+#define INDEX_DEFAULT_SPAN (1 << 20)
+#define INDEX_BUFFER_SIZE (64 * 1024)
+
+typedef struct checkpoint_s {
+  uint64_t in;          // the bit offset of a block boundary in the file
+  uint64_t out;         // the offset of the block in the decompressed data
+  uint32_t window_size; // the number of bytes in window
+  uint8_t *window;      // the bytes decoded before the block, at most 32 KB
+  // The size of window as a raw DEFLATE stream, 0 if it is not compressed
+  uint32_t window_compressed_size;
+} checkpoint_t;
+
+typedef struct gziped_index_s {
+  uint8_t *buf;         // the gzip file
+  size_t size;
+  uint64_t span;        // the minimum distance between two checkpoints
+  uint64_t length;      // the size of the decompressed data
+  checkpoint_t *checkpoints;
+  size_t count;
+  size_t capacity;
+  uint8_t *map;         // the index file the windows are in, see gzi.h
+  size_t map_size;
+} gziped_index_t;
+
+void gziped_free_index(gziped_index_t *index) {
+  if (index == NULL) return;
+  if (index->map != NULL) {
+    munmap(index->map, index->map_size);
+  } else {
+    for (size_t i = 0; i < index->count; ++i) {
+      free(index->checkpoints[i].window);
+    }
+  }
+  free(index->checkpoints);
+  free(index);
+}
+
+/**
+ * Records a checkpoint at the block boundary the stream stopped at.
+ */
+int index_add_checkpoint(gziped_index_t *index, inflate_stream_t *stream) {
+  if (index->count == index->capacity) {
+    size_t capacity = index->capacity ? index->capacity * 2 : 16;
+    checkpoint_t *checkpoints = (checkpoint_t *) realloc(index->checkpoints,
+      capacity * sizeof (checkpoint_t));
+    if (checkpoints == NULL) return -1;
+    index->checkpoints = checkpoints;
+    index->capacity = capacity;
+  }
+  checkpoint_t *checkpoint = &index->checkpoints[index->count];
+  // The bits left in bitbuf belong to the block
+  checkpoint->in = stream->total_in * 8 - stream->bitcount;
+  checkpoint->out = stream->total_out;
+  checkpoint->window_size = stream->wpos < STREAM_WINDOW_SIZE ?
+    stream->wpos : STREAM_WINDOW_SIZE;
+  checkpoint->window = (uint8_t *) malloc(checkpoint->window_size);
+  checkpoint->window_compressed_size = 0;
+  if (checkpoint->window == NULL) return -1;
+  // The last bytes decoded are right before wnext
+  memcpy(checkpoint->window,
+    stream->window + stream->wnext - checkpoint->window_size,
+    checkpoint->window_size);
+  index->count++;
+  return 0;
+}
+
+/**
+ * Decodes the whole gzip file in buf, which is checked along the way, and
+ * returns its index with a checkpoint every `span` bytes of output, or NULL
+ * if the file is invalid.
+ */
+gziped_index_t *gziped_build_index(uint8_t *buf, size_t size, uint64_t span) {
+  gziped_index_t *index = (gziped_index_t *) calloc(1, sizeof (gziped_index_t));
+  inflate_stream_t *stream = inflate_init();
+  uint8_t *scratch = (uint8_t *) malloc(INDEX_BUFFER_SIZE);
+  if (index == NULL || stream == NULL || scratch == NULL) {
+    free(scratch);
+    inflate_end(stream);
+    free(index);
+    return NULL;
+  }
+  index->buf = buf;
+  index->size = size;
+  index->span = span;
+  stream->stop_at_block = 1;
+  stream->next_in = buf;
+  stream->avail_in = size;
+  int res = INFLATE_STREAM_OK;
+  for (;;) {
+    stream->next_out = scratch;
+    stream->avail_out = INDEX_BUFFER_SIZE;
+    res = inflate_step(stream);
+    if (res == INFLATE_STREAM_ERROR) break;
+    if (res == INFLATE_STREAM_END) {
+      // Concatenated members, trailing garbage being ignored
+      if (stream->avail_in == 0 || stream->next_in[0] != 0x1F) break;
+      inflate_reset(stream);
+      continue;
+    }
+    if (stream->at_block && (index->count == 0 || stream->total_out -
+        index->checkpoints[index->count - 1].out >= span)) {
+      if (index_add_checkpoint(index, stream) != 0) {
+        res = INFLATE_STREAM_ERROR;
+        break;
+      }
+    } else if (stream->avail_in == 0 && stream->avail_out > 0) {
+      // The input ended in the middle of the stream
+      res = INFLATE_STREAM_ERROR;
+      break;
+    }
+  }
+  index->length = stream->total_out;
+  inflate_end(stream);
+  free(scratch);
+  if (res != INFLATE_STREAM_END) {
+    gziped_free_index(index);
+    return NULL;
+  }
+  return index;
+}
+
+/**
+ * Reads up to len bytes of decompressed data from offset into out. Returns
+ * the number of bytes read, less than len only at the end of the data, or -1
+ * if the data is invalid.
+ */
+ssize_t gziped_seek_read(gziped_index_t *index, uint64_t offset, size_t len,
+                         uint8_t *out) {
+  if (offset >= index->length || index->count == 0) return 0;
+  if (len > index->length - offset) len = index->length - offset;
+  // The last checkpoint at or before offset
+  size_t low = 0;
+  size_t high = index->count;
+  while (high - low > 1) {
+    size_t middle = (low + high) / 2;
+    if (index->checkpoints[middle].out <= offset) {
+      low = middle;
+    } else {
+      high = middle;
+    }
+  }
+  checkpoint_t *checkpoint = &index->checkpoints[low];
+
+  inflate_stream_t *stream = inflate_init();
+  uint8_t *scratch = (uint8_t *) malloc(INDEX_BUFFER_SIZE);
+  if (stream == NULL || scratch == NULL) {
+    free(scratch);
+    inflate_end(stream);
+    return -1;
+  }
+  const uint8_t *window = checkpoint->window;
+  if (checkpoint->window_compressed_size != 0) {
+    // scratch is larger than a window and only used once the stream is primed
+    inflate_result_t result;
+    if (inflate(checkpoint->window, checkpoint->window_compressed_size, scratch,
+                checkpoint->window_size, &result) != INFLATE_OK ||
+        result.produced != checkpoint->window_size) {
+      free(scratch);
+      inflate_end(stream);
+      return -1;
+    }
+    window = scratch;
+  }
+  stream->next_in = index->buf + checkpoint->in / 8;
+  stream->avail_in = index->size - checkpoint->in / 8;
+  inflate_resume(stream, checkpoint->in % 8, window, checkpoint->window_size);
+  uint64_t skip = offset - checkpoint->out;
+  size_t done = 0;
+  while (done < len) {
+    // Output up to offset is decoded in scratch and dropped
+    if (skip) {
+      stream->next_out = scratch;
+      stream->avail_out = skip < INDEX_BUFFER_SIZE ? skip : INDEX_BUFFER_SIZE;
+    } else {
+      stream->next_out = out + done;
+      stream->avail_out = len - done;
+    }
+    size_t avail_out = stream->avail_out;
+    int res = inflate_step(stream);
+    size_t produced = avail_out - stream->avail_out;
+    if (skip) {
+      skip -= produced;
+    } else {
+      done += produced;
+    }
+    if (res == INFLATE_STREAM_ERROR) {
+      done = -1;
+      break;
+    }
+    if (res == INFLATE_STREAM_END) {
+      if (stream->avail_in == 0 || stream->next_in[0] != 0x1F) break;
+      inflate_reset(stream);
+    } else if (stream->avail_in == 0 && stream->avail_out > 0) {
+      done = -1;
+      break;
+    }
+  }
+  inflate_end(stream);
+  free(scratch);
+  return done;
+}
+
+#endif // __INDEX_H__
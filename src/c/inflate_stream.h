@@ -0,0 +1,675 @@
+#ifndef __INFLATE_STREAM_H__
+#define __INFLATE_STREAM_H__
+
+/**
+ * Streaming gzip decoder.
+ *
+ * Unlike inflate(), which needs the whole compressed file in memory and an
+ * output buffer as large as the uncompressed data, this decoder accepts its
+ * input in chunks of any size and writes its output into a buffer of any
+ * size. Whenever it runs out of input or output space, it saves its state and
+ * returns; the next call to inflate_step resumes where it stopped.
+ *
+ * The only data kept between calls is the last 32 KB of output (the maximum
+ * distance a back-reference can reach, https://tools.ietf.org/html/rfc1951#page-5),
+ * the pending bits and the Huffman tables of the current block, so memory use
+ * does not depend on the size of the stream.
+ *
+ * While enough input and output space are available, the blocks are decoded
+ * by the same code as inflate(): parse_dynamic_tree for the headers and the
+ * fast loops of inflate_block for the symbols, which write into the window,
+ * the output being copied from there. The window is therefore linear, the
+ * last 32 KB being moved back to its beginning once it is full. Only close to
+ * the end of the input or of the output, where the fast loops stop, is the
+ * stream decoded one symbol at a time by a state machine which can save its
+ * state anywhere.
+ *
+ * Usage example:
+ *
+ * inflate_stream_t *stream = inflate_init();
+ * int res = INFLATE_STREAM_OK;
+ * while (res == INFLATE_STREAM_OK && (len = read(fd, in, sizeof (in))) > 0) {
+ *   stream->next_in = in;
+ *   stream->avail_in = len;
+ *   do {
+ *     stream->next_out = out;
+ *     stream->avail_out = sizeof (out);
+ *     res = inflate_step(stream);
+ *     write(1, out, sizeof (out) - stream->avail_out);
+ *   } while (res == INFLATE_STREAM_OK && stream->avail_out == 0);
+ * }
+ * inflate_end(stream);
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gziped.h"
+#include "crc32.h"
+
+#define STREAM_WINDOW_SIZE 32768
+// The room for the output of the fast loops after the last STREAM_WINDOW_SIZE
+// bytes, at least the length of the longest stored block, which is copied in
+// a single run. The window is moved back once per STREAM_WORK_SIZE bytes
+// output: at this size the moves copy half a byte per byte output, which,
+// from 32K to 256K, makes no measurable difference to the decoding time.
+#define STREAM_WORK_SIZE (64 * 1024)
+
+// Return values of inflate_step
+#define INFLATE_STREAM_OK     0  // more input or output space is needed
+#define INFLATE_STREAM_END    1  // the trailer was read and checked
+#define INFLATE_STREAM_ERROR -1  // invalid data, see stream->error
+
+typedef enum inflate_stream_state_e {
+  STREAM_HEADER,        // the 10 bytes of the fixed header
+  STREAM_EXTRA_LENGTH,  // XLEN
+  STREAM_EXTRA,         // the XLEN bytes of the extra field
+  STREAM_NAME,          // zero-terminated file name
+  STREAM_COMMENT,       // zero-terminated file comment
+  STREAM_HEADER_CRC,    // CRC16 of the header
+  STREAM_BLOCK,         // BFINAL and BTYPE of the next block
+  STREAM_STORED,        // LEN and NLEN of a stored block
+  STREAM_STORED_COPY,   // the LEN bytes of a stored block
+  STREAM_TABLE,         // HLIT, HDIST and HCLEN of a dynamic block
+  STREAM_CODE_LENGTH_LENGTHS, // the HCLEN code length code lengths
+  STREAM_CODE_LENGTHS,  // the HLIT + HDIST code lengths
+  STREAM_LENGTH,        // literal/length code and its extra bits
+  STREAM_DISTANCE,      // distance code and its extra bits
+  STREAM_COPY,          // copy of a match from the window
+  STREAM_TRAILER_CRC,   // CRC32 of the member
+  STREAM_TRAILER_SIZE,  // ISIZE of the member
+  STREAM_DONE,
+  STREAM_ERROR,
+} inflate_stream_state_t;
+
+typedef struct inflate_stream_s {
+  // Input and output buffers, set by the caller before each inflate_step and
+  // updated by it.
+  const uint8_t *next_in;
+  size_t avail_in;
+  uint8_t *next_out;
+  size_t avail_out;
+  uint64_t total_in;
+  uint64_t total_out;
+  const char *error; // the reason of the last INFLATE_STREAM_ERROR
+  uint8_t stop_at_block; // if set, inflate_step returns before each block
+  uint8_t at_block;      // 1 if the last inflate_step returned for that reason
+  uint8_t skip_crc;      // if set, the output is not checked against the CRC32
+                         // of the trailer, left in crc32 for the caller
+
+  inflate_stream_state_t state;
+  uint64_t bitbuf;   // bits pulled from the input and not consumed yet
+  uint8_t bitcount;  // number of bits in bitbuf
+  uint16_t count;    // progress within the current state
+
+  header_t header;
+  uint8_t header_bytes[GZIP_HEADER_SIZE];
+  uint16_t extra_length;
+
+  uint8_t bfinal;
+  uint16_t hlit;
+  uint16_t hdist;
+  uint16_t hclen;
+  uint8_t lengths[DEFLATE_ALPHABET_SIZE + DEFLATE_SDCLS];
+  const huffman_entry_t *littable;
+  const huffman_entry_t *disttable;
+  huffman_entry_t code_length_table[CODE_LENGTH_TABLE_SIZE];
+  huffman_entry_t dynamic_littable[LITLEN_TABLE_SIZE];
+  huffman_entry_t dynamic_disttable[DISTANCE_TABLE_SIZE];
+
+  uint16_t length;   // bytes left to copy for the current match/stored block
+  uint16_t distance; // distance of the current match
+
+  uint8_t block_stopped; // 1 once stopped before the current block
+  uint8_t resumed;   // 1 if decoding started mid-member (see inflate_resume)
+  uint32_t crc;      // running CRC32 of the output
+  uint32_t crc32;    // CRC32 read from the trailer
+  uint64_t wpos;     // number of bytes written to the window
+  size_t wnext;      // position in window of the next byte, the bytes before
+                     // it all being output of the current member
+  uint8_t window[STREAM_WINDOW_SIZE + STREAM_WORK_SIZE];
+} inflate_stream_t;
+
+inflate_stream_t *inflate_init() {
+  inflate_stream_t *stream = (inflate_stream_t *) malloc(sizeof (inflate_stream_t));
+  if (stream == NULL) return NULL;
+  memset(stream, 0, offsetof(inflate_stream_t, window));
+  stream->state = STREAM_HEADER;
+  return stream;
+}
+
+/**
+ * Prepares the stream for the next member of a concatenated file, keeping the
+ * totals. The back-references of a member cannot reach into the previous one,
+ * which wpos and wnext being reset to 0 enforces.
+ */
+void inflate_reset(inflate_stream_t *stream) {
+  stream->state = STREAM_HEADER;
+  stream->bitbuf = 0;
+  stream->bitcount = 0;
+  stream->count = 0;
+  stream->bfinal = 0;
+  stream->crc = 0;
+  stream->wpos = 0;
+  stream->wnext = 0;
+  stream->resumed = 0;
+}
+
+/**
+ * Prepares the stream to resume decoding at a block boundary of a DEFLATE
+ * stream, as recorded by an index (see index.h). The boundary is at bit
+ * `bit` (0 to 7) of the byte at next_in, to be set by the caller, and
+ * window holds the window_size bytes decoded before it (at most
+ * STREAM_WINDOW_SIZE). The trailer of the member cannot be checked.
+ */
+void inflate_resume(inflate_stream_t *stream, uint8_t bit,
+                    const uint8_t *window, size_t window_size) {
+  inflate_reset(stream);
+  stream->state = STREAM_BLOCK;
+  stream->resumed = 1;
+  if (bit) {
+    stream->bitbuf = *stream->next_in++ >> bit;
+    stream->bitcount = 8 - bit;
+    stream->avail_in--;
+  }
+  memcpy(stream->window, window, window_size);
+  stream->wpos = window_size;
+  stream->wnext = window_size;
+}
+
+void inflate_end(inflate_stream_t *stream) {
+  free(stream);
+}
+
+/**
+ * Looks up the code at the beginning of bitbuf. Returns the number of bits of
+ * that code, which can be more than bitcount in which case more input is
+ * needed to know the actual code. Missing bits are read as zeros.
+ */
+static inline uint8_t stream_lookup(const huffman_entry_t *table,
+                                    uint8_t table_bits, uint64_t bitbuf,
+                                    huffman_entry_t *entry) {
+  huffman_entry_t e = table[bitbuf & ((1 << table_bits) - 1)];
+  uint8_t length = HUFFMAN_ENTRY_LENGTH(e);
+  if (e & HUFFMAN_ENTRY_SUBTABLE) {
+    e = table[HUFFMAN_ENTRY_VALUE(e) +
+      ((bitbuf >> table_bits) & ((1 << HUFFMAN_ENTRY_SUB_BITS(e)) - 1))];
+    length = table_bits + HUFFMAN_ENTRY_LENGTH(e);
+  } else if (e & HUFFMAN_ENTRY_INVALID) {
+    // Only an entry read with all its bits is known to be invalid
+    length = table_bits;
+  }
+  *entry = e;
+  return length;
+}
+
+// Input is pulled one byte at a time, only when the bits are needed. When
+// there is none left, inflate_step saves its state and returns. Nothing is
+// consumed before all the bits of a code and its extra bits are available, so
+// that the state can always be resumed.
+#define PULLBYTE() { \
+  if (avail_in == 0) goto leave; \
+  avail_in--; \
+  bitbuf |= (uint64_t) *next_in++ << bitcount; \
+  bitcount += 8; \
+}
+#define NEEDBITS(n) { while (bitcount < (n)) PULLBYTE(); }
+#define BITS(n) ((uint32_t) (bitbuf & ((1ULL << (n)) - 1)))
+#define DROPBITS(n) { bitbuf >>= (n); bitcount -= (n); }
+#define STREAM_FAIL(reason) { \
+  stream->error = reason; \
+  stream->state = STREAM_ERROR; \
+  goto leave; \
+}
+
+/**
+ * Makes room for at least size bytes, at most STREAM_WORK_SIZE, after wnext,
+ * moving the last STREAM_WINDOW_SIZE bytes to the beginning of the window if
+ * needed.
+ */
+static inline void stream_window_room(inflate_stream_t *stream, size_t size) {
+  if (sizeof (stream->window) - stream->wnext >= size) return;
+  memmove(stream->window, stream->window + stream->wnext - STREAM_WINDOW_SIZE,
+    STREAM_WINDOW_SIZE);
+  stream->wnext = STREAM_WINDOW_SIZE;
+}
+
+/**
+ * Writes the output of a match, from the window, in runs which do not
+ * overlap.
+ */
+static inline void stream_copy_match(inflate_stream_t *stream, uint8_t **out,
+                                     size_t *avail_out) {
+  stream_window_room(stream, stream->length);
+  while (stream->length && *avail_out) {
+    uint8_t *to = stream->window + stream->wnext;
+    size_t n = stream->length;
+    if (n > *avail_out) n = *avail_out;
+    if (n > stream->distance) n = stream->distance;
+    memcpy(to, to - stream->distance, n);
+    memcpy(*out, to, n);
+    *out += n;
+    *avail_out -= n;
+    stream->wpos += n;
+    stream->wnext += n;
+    stream->length -= n;
+  }
+}
+
+/**
+ * Moves the pending bits and the input to a bit reader, for the functions of
+ * gziped.h.
+ */
+static inline void stream_to_bitreader(bitreader_t *br, const uint8_t *next_in,
+                                       size_t avail_in, uint64_t bitbuf,
+                                       uint8_t bitcount) {
+  bitreader_init(br, next_in, avail_in);
+  br->bitbuf = bitbuf;
+  br->bitcount = bitcount;
+}
+
+/**
+ * Moves the bits left in the bit reader back to the pending bits and the
+ * input. The whole bytes the reader loaded in advance are given back to the
+ * input, so that the pending bits are never more than before, or than 7.
+ * The reader must not have read past the end of the input.
+ */
+static inline void stream_from_bitreader(bitreader_t *br,
+                                         const uint8_t **next_in,
+                                         size_t *avail_in, uint64_t *bitbuf,
+                                         uint8_t *bitcount) {
+  size_t bytes = br->bitcount >> 3;
+  if (bytes > (size_t) (br->ptr - br->begin)) bytes = br->ptr - br->begin;
+  *bitcount = br->bitcount - 8 * bytes;
+  *bitbuf = br->bitbuf & ((1ULL << *bitcount) - 1);
+  *next_in = br->ptr - bytes;
+  *avail_in = br->end - *next_in;
+}
+
+/**
+ * Decodes the symbols of the current block with the fast loops of
+ * inflate_block, into the window then to the output, for as long as enough
+ * input and output space are left for them. Returns INFLATE_OK at the end of
+ * the block, INFLATE_BLOCK_TAIL when the rest of the block is left to the
+ * state machine, or INFLATE_INVALID_DATA.
+ */
+static int stream_block_fast(inflate_stream_t *stream, bitreader_t *br,
+                             uint8_t **out, size_t *avail_out) {
+  int res = INFLATE_BLOCK_TAIL;
+  while (res == INFLATE_BLOCK_TAIL &&
+         br->end - br->ptr >= INFLATE_FAST_MIN_INPUT &&
+         *avail_out >= INFLATE_FAST_MIN_OUTPUT) {
+    stream_window_room(stream, INFLATE_FAST_MIN_OUTPUT);
+    uint8_t *begin = stream->window + stream->wnext;
+    uint8_t *output = begin;
+    size_t room = sizeof (stream->window) - stream->wnext;
+    uint8_t *end = begin + (room < *avail_out ? room : *avail_out);
+    if (stream->littable == fixed_litlen_table) {
+      res = inflate_fixed_block_fast(br, stream->window, &output, end);
+    } else {
+      res = inflate_block_fast(br, stream->littable, stream->disttable,
+        stream->window, &output, end);
+    }
+    size_t produced = output - begin;
+    memcpy(*out, begin, produced);
+    *out += produced;
+    *avail_out -= produced;
+    stream->wpos += produced;
+    stream->wnext += produced;
+  }
+  return res;
+}
+
+/**
+ * Decodes as much as possible of the input into the output. Returns
+ * INFLATE_STREAM_END once the whole member has been decoded and checked,
+ * INFLATE_STREAM_OK if it needs more input or more output space, and
+ * INFLATE_STREAM_ERROR on invalid data.
+ */
+int inflate_step(inflate_stream_t *stream) {
+  const uint8_t *next_in = stream->next_in;
+  size_t avail_in = stream->avail_in;
+  uint8_t *next_out = stream->next_out;
+  size_t avail_out = stream->avail_out;
+  uint8_t *crc_from = next_out; // output not accounted in the CRC yet
+  uint64_t bitbuf = stream->bitbuf;
+  uint8_t bitcount = stream->bitcount;
+  huffman_entry_t entry;
+  uint8_t n;
+  stream->at_block = 0;
+
+  for (;;) switch (stream->state) {
+    case STREAM_HEADER: {
+      // https://tools.ietf.org/html/rfc1952#page-5
+      while (stream->count < GZIP_HEADER_SIZE) {
+        NEEDBITS(8);
+        stream->header_bytes[stream->count++] = BITS(8);
+        DROPBITS(8);
+      }
+      memcpy(&stream->header, stream->header_bytes, GZIP_HEADER_SIZE);
+      if (stream->header.magic != GZIP_MAGIC)
+        STREAM_FAIL("incorrect magic number");
+      if (stream->header.cm != GZIP_DEFLATE_CM)
+        STREAM_FAIL("unknown compression method");
+      stream->count = 0;
+      stream->state = STREAM_EXTRA_LENGTH;
+      break;
+    }
+    case STREAM_EXTRA_LENGTH: {
+      if (stream->header.flg & FEXTRA) {
+        NEEDBITS(16);
+        stream->extra_length = BITS(16);
+        DROPBITS(16);
+      }
+      stream->state = STREAM_EXTRA;
+      break;
+    }
+    case STREAM_EXTRA: {
+      if (stream->header.flg & FEXTRA) {
+        while (stream->extra_length) {
+          NEEDBITS(8);
+          DROPBITS(8);
+          stream->extra_length--;
+        }
+      }
+      stream->state = STREAM_NAME;
+      break;
+    }
+    case STREAM_NAME:
+    case STREAM_COMMENT: {
+      if (stream->header.flg &
+          (stream->state == STREAM_NAME ? FNAME : FCOMMENT)) {
+        uint8_t c;
+        do {
+          NEEDBITS(8);
+          c = BITS(8);
+          DROPBITS(8);
+        } while (c != 0);
+      }
+      stream->state++;
+      break;
+    }
+    case STREAM_HEADER_CRC: {
+      if (stream->header.flg & FHCRC) {
+        NEEDBITS(16);
+        DROPBITS(16);
+      }
+      stream->state = STREAM_BLOCK;
+      break;
+    }
+    case STREAM_BLOCK: {
+      if (stream->stop_at_block && !stream->block_stopped) {
+        stream->block_stopped = 1;
+        stream->at_block = 1;
+        goto leave;
+      }
+      // https://tools.ietf.org/html/rfc1951#page-10
+      NEEDBITS(3);
+      stream->block_stopped = 0;
+      stream->bfinal = BITS(1);
+      uint8_t btype = BITS(3) >> 1;
+      DROPBITS(3);
+      switch (btype) {
+        case DEFLATE_LITERAL_BLOCK_TYPE:
+          stream->state = STREAM_STORED;
+          break;
+        case DEFLATE_FIX_HUF_BLOCK_TYPE:
+          stream->littable = fixed_litlen_table;
+          stream->disttable = fixed_distance_table;
+          stream->state = STREAM_LENGTH;
+          break;
+        case DEFLATE_DYN_HUF_BLOCK_TYPE:
+          stream->state = STREAM_TABLE;
+          break;
+        default:
+          STREAM_FAIL("invalid block type");
+      }
+      break;
+    }
+    case STREAM_STORED: {
+      // https://tools.ietf.org/html/rfc1951#page-11
+      DROPBITS(bitcount & 7);
+      NEEDBITS(32);
+      uint16_t len = BITS(16);
+      uint16_t nlen = BITS(32) >> 16;
+      if (len != (uint16_t) ~nlen) STREAM_FAIL("invalid stored block length");
+      DROPBITS(32);
+      stream->length = len;
+      stream->state = STREAM_STORED_COPY;
+      break;
+    }
+    case STREAM_STORED_COPY: {
+      // The bit buffer is empty at this point: bytes are pulled only when
+      // needed and the stored block starts on a byte boundary.
+      while (stream->length) {
+        if (avail_in == 0 || avail_out == 0) goto leave;
+        size_t len = stream->length;
+        if (len > avail_in) len = avail_in;
+        if (len > avail_out) len = avail_out;
+        stream_window_room(stream, len);
+        memcpy(next_out, next_in, len);
+        memcpy(stream->window + stream->wnext, next_in, len);
+        next_in += len;
+        avail_in -= len;
+        next_out += len;
+        avail_out -= len;
+        stream->wpos += len;
+        stream->wnext += len;
+        stream->length -= len;
+      }
+      stream->state = stream->bfinal ? STREAM_TRAILER_CRC : STREAM_BLOCK;
+      break;
+    }
+    case STREAM_TABLE: {
+      if (avail_in >= INFLATE_FAST_MIN_INPUT) {
+        // The whole header is usually in the input. If it is not, or if it is
+        // invalid, it is read again below, which tells why.
+        bitreader_t br;
+        stream_to_bitreader(&br, next_in, avail_in, bitbuf, bitcount);
+        if (parse_dynamic_tree(&br, stream->dynamic_littable,
+            stream->dynamic_disttable) == INFLATE_OK &&
+            !bitreader_overrun(&br)) {
+          stream_from_bitreader(&br, &next_in, &avail_in, &bitbuf, &bitcount);
+          stream->littable = stream->dynamic_littable;
+          stream->disttable = stream->dynamic_disttable;
+          stream->state = STREAM_LENGTH;
+          break;
+        }
+      }
+      // https://tools.ietf.org/html/rfc1951#page-13
+      NEEDBITS(14);
+      stream->hlit = BITS(5) + 257;
+      DROPBITS(5);
+      stream->hdist = BITS(5) + 1;
+      DROPBITS(5);
+      stream->hclen = BITS(4) + 4;
+      DROPBITS(4);
+      if (stream->hlit > DEFLATE_MAX_LENGTH_VALUE + 1 ||
+          stream->hdist > DEFLATE_MAX_DISTANCE_VALUE + 1)
+        STREAM_FAIL("too many length or distance codes");
+      memset(stream->lengths, 0, CODE_LENGTHS_CODE_LENGTH);
+      stream->count = 0;
+      stream->state = STREAM_CODE_LENGTH_LENGTHS;
+      break;
+    }
+    case STREAM_CODE_LENGTH_LENGTHS: {
+      while (stream->count < stream->hclen) {
+        NEEDBITS(3);
+        stream->lengths[code_length_code_alphabet[stream->count++]] = BITS(3);
+        DROPBITS(3);
+      }
+      if (build_decode_table(stream->lengths, CODE_LENGTHS_CODE_LENGTH,
+          CODE_LENGTH_TABLE_BITS, stream->code_length_table,
+          CODE_LENGTH_TABLE_SIZE) != 0)
+        STREAM_FAIL("invalid code length code");
+      stream->count = 0;
+      stream->state = STREAM_CODE_LENGTHS;
+      break;
+    }
+    case STREAM_CODE_LENGTHS: {
+      uint16_t total = stream->hlit + stream->hdist;
+      while (stream->count < total) {
+        while ((n = stream_lookup(stream->code_length_table,
+                CODE_LENGTH_TABLE_BITS, bitbuf, &entry)) > bitcount)
+          PULLBYTE();
+        if (entry & HUFFMAN_ENTRY_INVALID)
+          STREAM_FAIL("invalid code length code");
+        uint16_t value = HUFFMAN_ENTRY_VALUE(entry);
+        if (value < 16) {
+          DROPBITS(n);
+          stream->lengths[stream->count++] = value;
+          continue;
+        }
+        uint8_t extra_size = value == 16 ? 2 : code_length_lengths_extra_size[value];
+        NEEDBITS(n + extra_size);
+        DROPBITS(n);
+        uint8_t repeated = 0;
+        uint8_t count = BITS(extra_size);
+        DROPBITS(extra_size);
+        if (value == 16) {
+          if (stream->count == 0)
+            STREAM_FAIL("repeat with no previous length");
+          repeated = stream->lengths[stream->count - 1];
+          count += 3;
+        } else {
+          count += code_length_lengths_extra_size_offset[value];
+        }
+        if (stream->count + count > total) STREAM_FAIL("too many code lengths");
+        memset(stream->lengths + stream->count, repeated, count);
+        stream->count += count;
+      }
+      if (stream->lengths[DEFLATE_END_BLOCK_VALUE] == 0)
+        STREAM_FAIL("missing end-of-block code");
+      if (build_decode_table(stream->lengths, stream->hlit, LITLEN_TABLE_BITS,
+          stream->dynamic_littable, LITLEN_TABLE_SIZE) != 0)
+        STREAM_FAIL("invalid literal/length code");
+      if (build_decode_table(stream->lengths + stream->hlit, stream->hdist,
+          DISTANCE_TABLE_BITS, stream->dynamic_disttable,
+          DISTANCE_TABLE_SIZE) != 0)
+        STREAM_FAIL("invalid distance code");
+      stream->littable = stream->dynamic_littable;
+      stream->disttable = stream->dynamic_disttable;
+      stream->state = STREAM_LENGTH;
+      break;
+    }
+    case STREAM_LENGTH: {
+      if (avail_in >= INFLATE_FAST_MIN_INPUT &&
+          avail_out >= INFLATE_FAST_MIN_OUTPUT) {
+        bitreader_t br;
+        stream_to_bitreader(&br, next_in, avail_in, bitbuf, bitcount);
+        int res = stream_block_fast(stream, &br, &next_out, &avail_out);
+        stream_from_bitreader(&br, &next_in, &avail_in, &bitbuf, &bitcount);
+        if (res == INFLATE_INVALID_DATA) STREAM_FAIL(inflate_strerror(res));
+        if (res == INFLATE_OK) {
+          stream->state = stream->bfinal ? STREAM_TRAILER_CRC : STREAM_BLOCK;
+          break;
+        }
+      }
+      for (;;) {
+        if (avail_out == 0) goto leave;
+        while ((n = stream_lookup(stream->littable, LITLEN_TABLE_BITS, bitbuf,
+                &entry)) > bitcount)
+          PULLBYTE();
+        if (entry & HUFFMAN_ENTRY_INVALID) STREAM_FAIL("invalid literal/length code");
+        uint16_t value = HUFFMAN_ENTRY_VALUE(entry);
+        if (value < DEFLATE_END_BLOCK_VALUE) {
+          DROPBITS(n);
+          stream_window_room(stream, 1);
+          stream->window[stream->wnext++] = value;
+          stream->wpos++;
+          *next_out++ = value;
+          avail_out--;
+          continue;
+        }
+        if (value == DEFLATE_END_BLOCK_VALUE) {
+          DROPBITS(n);
+          stream->state = stream->bfinal ? STREAM_TRAILER_CRC : STREAM_BLOCK;
+          break;
+        }
+        if (value > DEFLATE_MAX_LENGTH_VALUE) STREAM_FAIL("invalid length code");
+        value -= DEFLATE_END_BLOCK_VALUE + 1;
+        uint8_t extra_size = length_extra_bits[value];
+        NEEDBITS(n + extra_size);
+        DROPBITS(n);
+        stream->length = length_lookup[value] + BITS(extra_size);
+        DROPBITS(extra_size);
+        stream->state = STREAM_DISTANCE;
+        break;
+      }
+      break;
+    }
+    case STREAM_DISTANCE: {
+      while ((n = stream_lookup(stream->disttable, DISTANCE_TABLE_BITS, bitbuf,
+              &entry)) > bitcount)
+        PULLBYTE();
+      uint16_t value = HUFFMAN_ENTRY_VALUE(entry);
+      if ((entry & HUFFMAN_ENTRY_INVALID) || value > DEFLATE_MAX_DISTANCE_VALUE)
+        STREAM_FAIL("invalid distance code");
+      uint8_t extra_size = distance_extra_bits[value];
+      NEEDBITS(n + extra_size);
+      DROPBITS(n);
+      stream->distance = distance_lookup[value] + BITS(extra_size);
+      DROPBITS(extra_size);
+      if (stream->distance > stream->wpos) STREAM_FAIL("distance too far back");
+      stream->state = STREAM_COPY;
+      break;
+    }
+    case STREAM_COPY: {
+      stream_copy_match(stream, &next_out, &avail_out);
+      if (stream->length) goto leave;
+      stream->state = STREAM_LENGTH;
+      break;
+    }
+    case STREAM_TRAILER_CRC: {
+      // https://tools.ietf.org/html/rfc1952#page-5
+      DROPBITS(bitcount & 7);
+      NEEDBITS(32);
+      stream->crc32 = BITS(32);
+      DROPBITS(32);
+      stream->state = STREAM_TRAILER_SIZE;
+      break;
+    }
+    case STREAM_TRAILER_SIZE: {
+      NEEDBITS(32);
+      uint32_t isize = BITS(32);
+      DROPBITS(32);
+      if (!stream->skip_crc)
+        stream->crc = crc32_update(stream->crc, crc_from, next_out - crc_from);
+      crc_from = next_out;
+      // The output of a resumed stream is only the end of the member
+      if (!stream->resumed && !stream->skip_crc && stream->crc != stream->crc32)
+        STREAM_FAIL("cyclic redundancy check failed");
+      if (!stream->resumed && isize != (uint32_t) (stream->wpos))
+        STREAM_FAIL("size mismatch");
+      stream->state = STREAM_DONE;
+      break;
+    }
+    case STREAM_DONE:
+    case STREAM_ERROR:
+      goto leave;
+  }
+
+leave:
+  if (!stream->skip_crc)
+    stream->crc = crc32_update(stream->crc, crc_from, next_out - crc_from);
+  stream->total_in += next_in - stream->next_in;
+  stream->total_out += next_out - stream->next_out;
+  stream->next_in = next_in;
+  stream->avail_in = avail_in;
+  stream->next_out = next_out;
+  stream->avail_out = avail_out;
+  stream->bitbuf = bitbuf;
+  stream->bitcount = bitcount;
+  if (stream->state == STREAM_ERROR) return INFLATE_STREAM_ERROR;
+  if (stream->state == STREAM_DONE) return INFLATE_STREAM_END;
+  return INFLATE_STREAM_OK;
+}
+
+#undef PULLBYTE
+#undef NEEDBITS
+#undef BITS
+#undef DROPBITS
+#undef STREAM_FAIL
+
+#endif // __INFLATE_STREAM_H__
@@ -0,0 +1,188 @@
+#ifndef __INPUT_H__
+#define __INPUT_H__
+
+/**
+ * Input files, loaded in memory as a whole for the decoder by one of several
+ * methods (gziped --input <method>):
+ *
+ * mmap      the file is mapped, its pages read on first access. Readahead
+ *           is asked to be aggressive, the decoder going through the file
+ *           from the beginning to the end.
+ * populate  the file is mapped and read at once (MAP_POPULATE), the page
+ *           faults moving out of the decoding: for slow devices where
+ *           faulting pages in one by one leaves the device idle in between.
+ * pread     the file is read in chunks of INPUT_CHUNK_SIZE into an anonymous
+ *           buffer, the next chunk being requested (POSIX_FADV_WILLNEED)
+ *           before the current one is copied, so that the device reads one
+ *           while the other is copied.
+ * direct    as pread, with O_DIRECT: the reads bypass the page cache, which
+ *           neither holds the file afterwards nor evicts other files for it.
+ *           Falls back to pread where the file system refuses O_DIRECT.
+ *
+ * The anonymous buffers of pread and direct are asked for huge pages
+ * (MADV_HUGEPAGE) when large enough. So are the mappings, for kernels that
+ * give huge pages to read-only file mappings.
+ *
+ * MAP_POPULATE, MADV_HUGEPAGE and O_DIRECT need _GNU_SOURCE to be defined
+ * before any include on Linux; without them, populate only asks for
+ * readahead (POSIX_MADV_WILLNEED), and direct is pread.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define INPUT_CHUNK_SIZE (1024 * 1024)
+// Alignment of the buffers, offsets and sizes of O_DIRECT reads
+#define INPUT_ALIGNMENT 4096
+#define INPUT_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+typedef enum input_method_e {
+  INPUT_MMAP,
+  INPUT_POPULATE,
+  INPUT_PREAD,
+  INPUT_DIRECT,
+  INPUT_METHOD_COUNT
+} input_method_t;
+
+static const char *const input_method_names[INPUT_METHOD_COUNT] = {
+  "mmap", "populate", "pread", "direct"
+};
+
+typedef struct input_s {
+  uint8_t *data;    // NULL for an empty file
+  size_t size;      // the size of the file
+  size_t length;    // the size of the mapping of data
+} input_t;
+
+/**
+ * Sets *method to the method named name. Returns 0 on success, -1 if there is
+ * no such method.
+ */
+int input_method_parse(const char *name, input_method_t *method) {
+  for (int i = 0; i < INPUT_METHOD_COUNT; ++i) {
+    if (strcmp(name, input_method_names[i]) == 0) {
+      *method = (input_method_t) i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static inline void input_advise_huge(uint8_t *data, size_t length) {
+#if defined(MADV_HUGEPAGE)
+  if (length >= INPUT_HUGE_PAGE_SIZE) madvise(data, length, MADV_HUGEPAGE);
+#endif
+}
+
+/**
+ * Reads size bytes of fd into data, as the pread method does. The reads are
+ * rounded up to INPUT_ALIGNMENT for O_DIRECT, data must have room for it.
+ * Returns 0 on success, or an errno value.
+ */
+int input_read(int fd, uint8_t *data, size_t size) {
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  size_t offset = 0;
+  while (offset < size) {
+    size_t chunk = size - offset < INPUT_CHUNK_SIZE ?
+      size - offset : INPUT_CHUNK_SIZE;
+    if (offset + chunk < size) {
+      posix_fadvise(fd, offset + chunk, INPUT_CHUNK_SIZE, POSIX_FADV_WILLNEED);
+    }
+    size_t aligned = (chunk + INPUT_ALIGNMENT - 1) & ~(INPUT_ALIGNMENT - 1);
+    ssize_t len = pread(fd, data + offset, aligned, offset);
+    if (len < 0) {
+      if (errno == EINTR) continue;
+#if defined(O_DIRECT)
+      // Some file systems only refuse O_DIRECT on the first read
+      int flags = fcntl(fd, F_GETFL);
+      if (errno == EINVAL && flags >= 0 && (flags & O_DIRECT) &&
+          fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0) continue;
+#endif
+      return errno;
+    }
+    if (len == 0) return EIO; // the file was truncated meanwhile
+    // O_DIRECT reads past the end of the file stop at it
+    offset += (size_t) len < size - offset ? (size_t) len : size - offset;
+  }
+  return 0;
+}
+
+/**
+ * Loads the file at path in memory with method. Returns 0 on success, or an
+ * errno value. input_close releases it.
+ */
+int input_open(const char *path, input_method_t method, input_t *input) {
+  memset(input, 0, sizeof (input_t));
+  int flags = O_RDONLY;
+#if defined(O_DIRECT)
+  if (method == INPUT_DIRECT) flags |= O_DIRECT;
+#endif
+  int fd = open(path, flags);
+  if (fd < 0 && errno == EINVAL && flags != O_RDONLY) {
+    fd = open(path, O_RDONLY);
+  }
+  if (fd < 0) return errno;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    int error = errno;
+    close(fd);
+    return error;
+  }
+  input->size = st.st_size;
+  if (input->size == 0) {
+    close(fd);
+    return 0;
+  }
+
+  int error = 0;
+  if (method == INPUT_MMAP || method == INPUT_POPULATE) {
+    int map_flags = MAP_SHARED;
+#if defined(MAP_POPULATE)
+    if (method == INPUT_POPULATE) map_flags |= MAP_POPULATE;
+#endif
+    input->length = input->size;
+    input->data = (uint8_t *) mmap(NULL, input->length, PROT_READ, map_flags,
+      fd, 0);
+    if (input->data == MAP_FAILED) {
+      error = errno;
+    } else {
+      posix_madvise(input->data, input->length, POSIX_MADV_SEQUENTIAL);
+      input_advise_huge(input->data, input->length);
+#if !defined(MAP_POPULATE)
+      if (method == INPUT_POPULATE) {
+        posix_madvise(input->data, input->length, POSIX_MADV_WILLNEED);
+      }
+#endif
+    }
+  } else {
+    // Page aligned, as O_DIRECT wants, and with room for its last read
+    input->length = (input->size + INPUT_ALIGNMENT - 1) &
+      ~(size_t) (INPUT_ALIGNMENT - 1);
+    input->data = (uint8_t *) mmap(NULL, input->length,
+      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (input->data == MAP_FAILED) {
+      error = errno;
+    } else {
+      input_advise_huge(input->data, input->length);
+      error = input_read(fd, input->data, input->size);
+      if (error != 0) munmap(input->data, input->length);
+    }
+  }
+  close(fd);
+  if (error != 0) memset(input, 0, sizeof (input_t));
+  return error;
+}
+
+void input_close(input_t *input) {
+  if (input->data != NULL) munmap(input->data, input->length);
+  memset(input, 0, sizeof (input_t));
+}
+
+#endif // __INPUT_H__
@@ -0,0 +1,32 @@
+/**
+ * The translation unit of libgziped: the definitions of the functions
+ * declared in libgziped.h.
+ *
+ * The gziped_ functions defined in gziped.h are exported as they are, the
+ * others call the functions of the headers under their exported name.
+ */
+#include "libgziped.h"
+#include "gziped.h"
+#include "members.h"
+
+int gziped_get_metadata(uint8_t *buf, ssize_t size, metadata_t *metadata) {
+  return get_metadata(buf, size, metadata);
+}
+
+void gziped_free_metadata(metadata_t *metadata) {
+  free_metadata(metadata);
+}
+
+const char *gziped_strerror(int error) {
+  return inflate_strerror(error);
+}
+
+int gziped_inflate_members(gziped_decoder_t *decoder, uint8_t *buf,
+                           size_t size, unsigned threads, uint8_t **output,
+                           size_t *output_size) {
+  return inflate_members(buf, size, threads, decoder, output, output_size);
+}
+
+uint32_t gziped_crc32(uint32_t crc, const uint8_t *buf, size_t len) {
+  return crc32_update(crc, buf, len);
+}
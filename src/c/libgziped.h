@@ -0,0 +1,99 @@
+#ifndef __LIBGZIPED_H__
+#define __LIBGZIPED_H__
+
+/**
+ * Public interface of libgziped, the decoder built as a library (make lib).
+ *
+ * The headers of the decoder define their functions, and can therefore only
+ * be included in a single translation unit. A program made of several, or a
+ * service, links with libgziped.a or libgziped.so and includes this header
+ * only. gziped.h includes it as well, so that the types and the error codes
+ * below are the same in both cases.
+ *
+ * Only the functions below are exported, all prefixed with gziped_ so that
+ * they do not clash with those of zlib (inflate, crc32_combine...) in a
+ * program linked with both. The functions of the headers they call are local
+ * to the library, see the Makefile.
+ *
+ * The library has no mutable global state: its tables are constant, and
+ * everything a decoding needs is on the stack or in a gziped_decoder_t. Any
+ * number of threads can therefore decode at the same time, each one with its
+ * own decoder.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Exported by the shared library, which is built with hidden visibility
+#define GZIPED_API __attribute__((visibility("default")))
+
+// Return values of the inflate functions and of get_metadata
+#define INFLATE_OK            0
+#define INFLATE_INVALID_DATA  -1 // the input is not a valid gzip/DEFLATE stream
+#define INFLATE_OUTPUT_FULL   -2 // the output buffer is too small
+#define INFLATE_TRUNCATED     -3 // the input ends before the end of the stream
+#define INFLATE_CHECK_FAILED  -4 // the CRC32 or ISIZE of the footer do not match
+#define INFLATE_BAD_MAGIC     -5 // the input does not start with a gzip magic
+#define INFLATE_BAD_METHOD    -6 // the compression method is not DEFLATE
+
+// https://tools.ietf.org/html/rfc1952#page-5
+typedef struct header_s {
+  uint16_t  magic;
+  uint8_t   cm;
+  uint8_t   flg;
+  uint32_t  mtime;
+  uint8_t   xfl;
+  uint8_t   os;
+} header_t;
+
+typedef struct extra_header_s {
+  uint16_t xlen;
+  uint8_t *extra;  // the xlen bytes of subfields, pointing in the file
+  char *fname;
+  char *fcomment;
+  uint16_t crc16;
+} extra_header_t;
+
+typedef struct footer_s {
+  uint32_t crc32;
+  uint32_t isize;
+} footer_t;
+
+typedef struct metadata_s {
+  header_t header;
+  extra_header_t extra_header;
+  ssize_t block_offset;
+  footer_t footer;
+} metadata_t;
+
+typedef struct inflate_result_s {
+  size_t consumed;  // the number of input bytes used
+  size_t produced;  // the number of bytes written to the output
+  uint32_t crc;     // the CRC32 of the output
+} inflate_result_t;
+
+// Decoder context, see gziped.h
+typedef struct gziped_decoder_s gziped_decoder_t;
+
+GZIPED_API int gziped_get_metadata(uint8_t *buf, ssize_t size,
+                                   metadata_t *metadata);
+GZIPED_API void gziped_free_metadata(metadata_t *metadata);
+GZIPED_API const char *gziped_strerror(int error);
+
+GZIPED_API gziped_decoder_t *gziped_decoder_init();
+GZIPED_API void gziped_decoder_reset(gziped_decoder_t *decoder);
+GZIPED_API void gziped_decoder_free(gziped_decoder_t *decoder);
+GZIPED_API int gziped_inflate(gziped_decoder_t *decoder, uint8_t *buf,
+                              size_t size, uint8_t *output,
+                              size_t output_size, inflate_result_t *result);
+GZIPED_API int gziped_inflate_member(gziped_decoder_t *decoder, uint8_t *buf,
+                                     size_t size, uint8_t *output,
+                                     size_t output_size,
+                                     inflate_result_t *result);
+GZIPED_API int gziped_inflate_members(gziped_decoder_t *decoder, uint8_t *buf,
+                                      size_t size, unsigned threads,
+                                      uint8_t **output, size_t *output_size);
+
+GZIPED_API uint32_t gziped_crc32(uint32_t crc, const uint8_t *buf, size_t len);
+
+#endif // __LIBGZIPED_H__
@@ -1,69 +1,885 @@
+// For clock_gettime, getline and vmsplice (see pipe_io.h)
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
 
 #include "gziped.h"
-#include "crc32.h"
+#include "inflate_stream.h"
+#include "members.h"
+#include "gzi.h"
+#include "bgzf.h"
+#include "pipe_io.h"
+#include "input.h"
+#include "pipeline.h"
+#include "uring.h"
 
-void write_file(metadata_t metadata, uint8_t *content) {
-  if (metadata.extra_header.fname != NULL) {
-    int of = open(metadata.extra_header.fname, O_RDWR | O_CREAT | O_TRUNC,
-      S_IRUSR | S_IWUSR | S_IRGRP);
-    if (of < 0) {
+#define STREAM_BUFFER_SIZE (64 * 1024)
+
+/**
+ * Writes the decompressed data to the file at path, the name given by the
+ * header, if any. Returns 0 on success.
+ */
+int write_file(const char *path, uint8_t *content, size_t size) {
+  if (path == NULL) return 0;
+  int of = open(path, O_RDWR | O_CREAT | O_TRUNC,
+    S_IRUSR | S_IWUSR | S_IRGRP);
+  if (of < 0) {
+    perror("open");
+    return -1;
+  }
+  int res = 0;
+  if (gzi_write_all(of, content, size) != 0) {
+    perror("write");
+    res = -1;
+  }
+  if (close(of) != 0) {
+    perror("close");
+    res = -1;
+  }
+  return res;
+}
+
+/**
+ * Creates the file at path, of size bytes, and maps it writable, so that the
+ * data can be decompressed directly into the page cache instead of into a
+ * buffer which is then copied there by write. Returns MAP_FAILED on failure.
+ */
+uint8_t *map_output_file(const char *path, size_t size) {
+  int of = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP);
+  if (of < 0) return MAP_FAILED;
+  uint8_t *map = MAP_FAILED;
+  if (ftruncate(of, size) == 0) {
+    map = (uint8_t *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, of,
+      0);
+  }
+  close(of);
+  // The data is mostly written front to back, which lets the kernel write
+  // back the pages behind
+  if (map != MAP_FAILED) posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+  return map;
+}
+
+/**
+ * Decompresses ifd into writer with the streaming decoder, so that the input
+ * does not have to be a regular file and is never held in memory as a whole.
+ * Members of a concatenated file are decoded one after the other.
+ * The input is read and the output written in chunks of PIPE_IO_CHUNK_SIZE,
+ * the decoder copying its output from its window into the buffers of the
+ * pipe writer, so that the memory used does not depend on the size of the
+ * data. Those chunks are large enough for the decoder to spend nearly all its
+ * time in the fast loops of inflate_block, as inflate() does, the state
+ * machine only decoding the few symbols at their ends. What is left in the
+ * buffer of the writer is output by the caller.
+ */
+int inflate_fd(int ifd, pipe_writer_t *writer) {
+  void *in = NULL;
+  if (posix_memalign(&in, PIPE_IO_ALIGNMENT, PIPE_IO_CHUNK_SIZE) != 0) {
+    fprintf(stderr, "error: out of memory\n");
+    return 4;
+  }
+  inflate_stream_t *stream = inflate_init();
+  int res = INFLATE_STREAM_OK;
+  int trailing = 0; // 1 once the input left is not a member
+  ssize_t len = 0;
+  while ((res == INFLATE_STREAM_OK || res == INFLATE_STREAM_END) && !trailing) {
+    len = read(ifd, in, PIPE_IO_CHUNK_SIZE);
+    if (len < 0 && errno == EINTR) continue;
+    if (len <= 0) break;
+    stream->next_in = (uint8_t *) in;
+    stream->avail_in = len;
+    do {
+      if (res == INFLATE_STREAM_END) {
+        // The next member starts right after the trailer of the previous one
+        if (stream->next_in[0] != 0x1F) {
+          if (!is_zero_padding(stream->next_in, stream->avail_in))
+            fprintf(stderr, "warning: trailing garbage ignored\n");
+          trailing = 1;
+          break;
+        }
+        inflate_reset(stream);
+      }
+      size_t avail = 0;
+      stream->next_out = pipe_writer_buffer(writer, &avail);
+      stream->avail_out = avail;
+      res = inflate_step(stream);
+      if (pipe_writer_commit(writer, avail - stream->avail_out) != 0) {
+        perror("write");
+        res = INFLATE_STREAM_ERROR;
+        break;
+      }
+    } while ((res == INFLATE_STREAM_OK &&
+              (stream->avail_out == 0 || stream->avail_in > 0)) ||
+             (res == INFLATE_STREAM_END && stream->avail_in > 0));
+  }
+  if (len < 0) perror("read");
+  if (res == INFLATE_STREAM_ERROR && stream->error != NULL) {
+    fprintf(stderr, "error: %s\n", stream->error);
+  } else if (res == INFLATE_STREAM_OK && len == 0) {
+    fprintf(stderr, "error: unexpected end of input\n");
+  }
+  inflate_end(stream);
+  free(in);
+  return res == INFLATE_STREAM_END ? 0 : 4;
+}
+
+/**
+ * Decompresses the files at paths one after the other to the standard output,
+ * "-" being the standard input, or the standard input alone if count is 0.
+ * Like gzip -c, the output stops at the first file in error. All the files
+ * go through the same pipe writer: the pipe may still reference the pages it
+ * spliced from the last file when the next one is decoded.
+ */
+int inflate_to_stdout(char **paths, int count) {
+  pipe_writer_t *writer = pipe_writer_init(STDOUT_FILENO, PIPE_IO_CHUNK_SIZE);
+  if (writer == NULL) {
+    fprintf(stderr, "error: out of memory\n");
+    return 4;
+  }
+  int res = count == 0 ? inflate_fd(STDIN_FILENO, writer) : 0;
+  for (int i = 0; i < count && res == 0; ++i) {
+    if (strcmp(paths[i], "-") == 0) {
+      res = inflate_fd(STDIN_FILENO, writer);
+      continue;
+    }
+    int ifd = open(paths[i], O_RDONLY);
+    if (ifd < 0) {
       perror("open");
-      return;
+      res = 1;
+      break;
     }
-    if (write(of, content, metadata.footer.isize) != metadata.footer.isize) {
-      // We ignore the fact that we can write fewer byte than requested for now
+    posix_fadvise(ifd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    res = inflate_fd(ifd, writer);
+    close(ifd);
+  }
+  if (pipe_writer_flush(writer) != 0) {
+    perror("write");
+    res = 4;
+  }
+  pipe_writer_free(writer);
+  return res;
+}
+
+/**
+ * Returns the path of the index file of the gzip file at path, to be freed.
+ */
+char *get_index_path(const char *path) {
+  size_t length = strlen(path);
+  char *index_path = (char *) malloc(length + sizeof (".gzi"));
+  memcpy(index_path, path, length);
+  memcpy(index_path + length, ".gzi", sizeof (".gzi"));
+  return index_path;
+}
+
+int build_index_file(const char *path, uint8_t *buf, size_t size,
+                     struct timespec mtime) {
+  gziped_index_t *index = gziped_build_index(buf, size, INDEX_DEFAULT_SPAN);
+  if (index == NULL) {
+    fprintf(stderr, "error: %s: invalid gzip file\n", path);
+    return 4;
+  }
+  char *index_path = get_index_path(path);
+  int res = gziped_save_index(index, index_path, mtime);
+  if (res != GZI_OK) {
+    fprintf(stderr, "error: %s: %s\n", index_path, gzi_strerror(res));
+  }
+  free(index_path);
+  gziped_free_index(index);
+  return res == GZI_OK ? 0 : 4;
+}
+
+/**
+ * Writes length bytes of the decompressed data from offset to stdout, with
+ * the index file of the gzip file at path if there is an up to date one, or
+ * else with an index built in memory. BGZF files need no index.
+ * flags are passed to gziped_load_index: with GZI_CHECK_CRC, the index is
+ * only used if it was built from the same data, not just the same size and
+ * modification time.
+ */
+int extract_range(const char *path, uint8_t *buf, size_t size,
+                  struct timespec mtime, int flags, uint64_t offset,
+                  uint64_t length) {
+  bgzf_t *bgzf = bgzf_open(buf, size);
+  gziped_index_t *index = NULL;
+  if (bgzf == NULL) {
+    char *index_path = get_index_path(path);
+    int res = gziped_load_index(index_path, buf, size, mtime, flags,
+      &index);
+    if (res != GZI_OK) {
+      if (res != GZI_IO_ERROR || errno != ENOENT) {
+        fprintf(stderr, "warning: %s: %s, ignored\n", index_path,
+          gzi_strerror(res));
+      }
+      index = gziped_build_index(buf, size, INDEX_DEFAULT_SPAN);
+    }
+    free(index_path);
+    if (index == NULL) {
+      fprintf(stderr, "error: %s: invalid gzip file\n", path);
+      return 4;
+    }
+  }
+  uint8_t *out = (uint8_t *) malloc(STREAM_BUFFER_SIZE);
+  int status = 0;
+  while (length > 0) {
+    size_t chunk = length < STREAM_BUFFER_SIZE ? length : STREAM_BUFFER_SIZE;
+    ssize_t len = bgzf != NULL ?
+      bgzf_read(bgzf, bgzf_tell(bgzf, offset), chunk, out) :
+      gziped_seek_read(index, offset, chunk, out);
+    if (len < 0) {
+      fprintf(stderr, "error: %s: invalid gzip file\n", path);
+      status = 4;
+      break;
+    }
+    if (len == 0) break; // past the end of the data
+    if (gzi_write_all(STDOUT_FILENO, out, len) != 0) {
       perror("write");
-      return;
+      status = 4;
+      break;
     }
-    if (close(of) != 0) perror("close");
+    offset += len;
+    length -= len;
   }
+  free(out);
+  gziped_free_index(index);
+  bgzf_close(bgzf);
+  return status;
 }
 
-int main(int argc, char **argv) {
-  if (argc != 2) {
-    fprintf(stderr, "error: wrong arguments\n");
-    usage();
-    exit(1);
-  }
+/**
+ * Parses a byte range given as <offset>:<length>. strtoull accepts a sign
+ * and spaces, and negates what follows a '-': only digits are let through.
+ */
+int parse_range(const char *range, uint64_t *offset, uint64_t *length) {
+  char *end = NULL;
+  if (*range < '0' || *range > '9') return -1;
+  *offset = strtoull(range, &end, 10);
+  if (*end != ':') return -1;
+  range = end + 1;
+  if (*range < '0' || *range > '9') return -1;
+  *length = strtoull(range, &end, 10);
+  if (*end != 0) return -1;
+  return 0;
+}
 
-  int ifd = open(argv[1], O_RDONLY);
-  if (ifd < 0) {
-    perror("open");
-    exit(1);
+typedef struct file_stats_s {
+  uint64_t in;            // the size of the gzip files
+  uint64_t out;           // the size of the decompressed data
+  uint64_t table_hits;    // see gziped_decoder_t
+  uint64_t table_misses;
+  uint64_t mapped;        // the data decompressed into a mapped output file
+  uint64_t mapped_peak;   // the largest of those outputs
+  double pipeline[3];     // the time spent by each stage of the pipeline
+} file_stats_t;
+
+typedef struct decompress_options_s {
+  input_method_t method;  // how the input files are read
+  int map_output;         // see decompress_mapped
+  int pipeline;           // see decompress_pipelined
+  int uring;              // see uring_batch_task
+} decompress_options_t;
+
+/**
+ * Decompresses the member or the blocks of the gzip file in buf straight into
+ * the output file, mapped in memory, when the size of the data is known
+ * beforehand: for BGZF files, and for single member files, whose size is the
+ * ISIZE of their footer. Returns INFLATE_OK, or else the output file is left
+ * to be written from a buffer: its size turned out to be unknown, or it could
+ * not be mapped.
+ */
+int decompress_mapped(uint8_t *buf, size_t size, const char *output_path,
+                      uint32_t isize, bgzf_t *bgzf, unsigned threads,
+                      gziped_decoder_t *decoder) {
+  // Files of more than 4 GB, or of several members, do not fit in ISIZE. An
+  // ISIZE which the data could not expand to is corrupt, as in
+  // guess_member_size: the output file is not created at that size.
+  size_t length = bgzf != NULL ? bgzf->length : isize;
+  if (length == 0) return INFLATE_OUTPUT_FULL;
+  if (bgzf == NULL && length > size * DEFLATE_MAX_RATIO)
+    return INFLATE_OUTPUT_FULL;
+  uint8_t *map = map_output_file(output_path, length);
+  if (map == MAP_FAILED) return INFLATE_OUTPUT_FULL;
+  int res = INFLATE_OK;
+  if (bgzf != NULL) {
+    res = bgzf_inflate(bgzf, map, threads);
+  } else {
+    inflate_result_t result;
+    res = threads > 1 ?
+      inflate_member_parallel(buf, size, map, length, &result, threads) :
+      gziped_inflate_member(decoder, buf, size, map, length, &result);
+    if (res == INFLATE_OK && (result.produced != length ||
+        !is_zero_padding(buf + result.consumed, size - result.consumed)))
+      res = INFLATE_OUTPUT_FULL; // another member follows
   }
+  munmap(map, length);
+  return res;
+}
 
-  off_t size = lseek(ifd, 0, SEEK_END);
-  if (size < 0) {
-    perror("lseek");
-    exit(1);
+/**
+ * Decompresses the gzip file in buf to the output file, if there is one, with
+ * the decoding, the CRC check and the writing overlapped (see pipeline.h), and
+ * adds the time taken by each stage to stats. Sets *produced to the size of
+ * the data. Returns INFLATE_OK on success, INFLATE_OUTPUT_FULL if the output
+ * could not be written, which is reported here, or another inflate error.
+ */
+int decompress_pipelined(uint8_t *buf, size_t size, const char *output_path,
+                         size_t *produced, file_stats_t *stats) {
+  int fd = -1;
+  if (output_path != NULL) {
+    fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC,
+      S_IRUSR | S_IWUSR | S_IRGRP);
+    if (fd < 0) {
+      perror("open");
+      return INFLATE_OUTPUT_FULL;
+    }
+  }
+  pipeline_result_t result;
+  int res = inflate_pipelined(buf, size, fd, &result);
+  if (res == INFLATE_OUTPUT_FULL) perror("write");
+  if (fd >= 0 && close(fd) != 0 && res == INFLATE_OK) {
+    perror("close");
+    res = INFLATE_OUTPUT_FULL;
   }
+  *produced = result.produced;
+  for (int i = 0; i < 3; ++i) {
+    stats->pipeline[i] += result.seconds[i];
+  }
+  return res;
+}
 
-  uint8_t *buffer = NULL;
-  buffer = mmap(buffer, size, PROT_READ, MAP_SHARED, ifd, 0);
+/**
+ * Output of decompress_buffer, left to the caller to write.
+ */
+typedef struct output_file_s {
+  char *path;             // NULL if the header gives no file name
+  uint8_t *data;
+  size_t size;
+} output_file_t;
 
+/**
+ * Decompresses the gzip file at path, held in buffer, using up to `threads`
+ * threads and the tables of decoder, and adds its sizes to stats. With
+ * map_output, the data is decompressed directly into the output file when
+ * possible, see decompress_mapped. With pipeline, it is written as it is
+ * decoded, see decompress_pipelined. Otherwise it is decompressed into a
+ * buffer, written to the output file or, if output is not NULL, handed over
+ * to the caller in it, its path and data to be freed. Returns 0 on success,
+ * or the exit status of gziped.
+ */
+int decompress_buffer(const char *path, uint8_t *buffer, size_t size,
+                      const decompress_options_t *options, unsigned threads,
+                      gziped_decoder_t *decoder, file_stats_t *stats,
+                      output_file_t *output) {
   metadata_t metadata;
-  get_metadata(buffer, size, &metadata);
+  int res = get_metadata(buffer, size, &metadata);
+  if (res != INFLATE_OK) {
+    fprintf(stderr, "error: %s: %s\n", path, inflate_strerror(res));
+    return 4;
+  }
   // print_metadata(metadata);
 
-  uint8_t *inflated = (uint8_t *) malloc(metadata.footer.isize);
-  inflate(&buffer[metadata.block_offset], inflated);
-
-  uint32_t crc32 = crc(inflated, metadata.footer.isize);
-  if (crc32 != metadata.footer.crc32) {
-    fprintf(stderr, "error: cyclic redundancy check failed! (0x%08x != 0x%08x)\n",
-      metadata.footer.crc32, crc32);
+  // Concatenated files hold several members, each one checked against its
+  // own footer. The members of BGZF files give their sizes, so they do not
+  // have to be looked for.
+  uint8_t *inflated = NULL;
+  size_t inflated_size = 0;
+  bgzf_t *bgzf = bgzf_open(buffer, size);
+  if (decoder != NULL) gziped_decoder_reset(decoder);
+  res = INFLATE_OUTPUT_FULL;
+  int pipelined = options->pipeline && output == NULL;
+  int mapped = !pipelined && options->map_output && output == NULL &&
+    metadata.extra_header.fname != NULL;
+  if (pipelined) {
+    res = decompress_pipelined(buffer, size, metadata.extra_header.fname,
+      &inflated_size, stats);
+  } else if (mapped) {
+    res = decompress_mapped(buffer, size, metadata.extra_header.fname,
+      metadata.footer.isize, bgzf, threads, decoder);
+    if (res == INFLATE_OK) {
+      inflated_size = bgzf != NULL ? bgzf->length : metadata.footer.isize;
+      stats->mapped += inflated_size;
+      if (inflated_size > stats->mapped_peak)
+        stats->mapped_peak = inflated_size;
+    }
+  }
+  if (pipelined || res != INFLATE_OUTPUT_FULL) {
+    // Done in place, or the data is invalid, which decoding it again into a
+    // buffer would not change
+  } else if (bgzf != NULL) {
+    inflated_size = bgzf->length;
+    inflated = (uint8_t *) malloc(inflated_size ? inflated_size : 1);
+    res = inflated != NULL ? bgzf_inflate(bgzf, inflated, threads) :
+      INFLATE_OUTPUT_FULL;
   } else {
-    write_file(metadata, inflated);
+    res = inflate_members(buffer, size, threads, decoder, &inflated,
+      &inflated_size);
+  }
+  if (bgzf != NULL) {
+    stats->table_hits += bgzf->table_hits;
+    stats->table_misses += bgzf->table_misses;
+    bgzf_close(bgzf);
+  } else if (decoder != NULL) {
+    stats->table_hits += decoder->cache.hits;
+    stats->table_misses += decoder->cache.misses;
+  }
+  if (res != INFLATE_OK) {
+    if (!pipelined || res != INFLATE_OUTPUT_FULL)
+      fprintf(stderr, "error: %s: %s\n", path, inflate_strerror(res));
+    // Not to leave a partly written output behind
+    if ((mapped || pipelined) && metadata.extra_header.fname != NULL)
+      unlink(metadata.extra_header.fname);
+  } else if (output != NULL) {
+    output->path = metadata.extra_header.fname;
+    output->data = inflated;
+    output->size = inflated_size;
+    metadata.extra_header.fname = NULL;
+    inflated = NULL;
+  } else if (inflated != NULL &&
+             write_file(metadata.extra_header.fname, inflated,
+               inflated_size) != 0) {
+    res = INFLATE_OUTPUT_FULL;
+  }
+  if (res == INFLATE_OK) {
+    stats->in += size;
+    stats->out += inflated_size;
   }
 
   free(inflated);
   free_metadata(&metadata);
-  munmap(buffer, size);
-  return 0;
+  return res == INFLATE_OK ? 0 : 4;
+}
+
+/**
+ * Decompresses the gzip file at path, read with the input method of options,
+ * see decompress_buffer. Returns 0 on success, or the exit status of gziped.
+ */
+int decompress_file(const char *path, const decompress_options_t *options,
+                    unsigned threads, gziped_decoder_t *decoder,
+                    file_stats_t *stats) {
+  input_t input;
+  int error = input_open(path, options->method, &input);
+  if (error != 0 || input.size == 0) {
+    fprintf(stderr, "error: %s: %s\n", path,
+      error == 0 ? inflate_strerror(INFLATE_TRUNCATED) : strerror(error));
+    return error == 0 ? 4 : 1;
+  }
+  int res = decompress_buffer(path, input.data, input.size, options, threads,
+    decoder, stats, NULL);
+  input_close(&input);
+  return res;
+}
+
+void print_file_stats(const file_stats_t *stats) {
+  fprintf(stderr, "huffman table cache: %llu hits, %llu misses\n",
+    (unsigned long long) stats->table_hits,
+    (unsigned long long) stats->table_misses);
+  if (stats->mapped > 0) {
+    // The buffered path allocates the whole output of a file, then copies it
+    // with write: its peak is at least the largest of those buffers
+    fprintf(stderr, "mapped output: %.1f MB decompressed in place, "
+      "%.1f MB peak output buffer avoided\n", stats->mapped / 1e6,
+      stats->mapped_peak / 1e6);
+  }
+  if (stats->pipeline[PIPELINE_DECODE] > 0) {
+    fprintf(stderr, "pipeline: decode %.3f s, crc %.3f s, write %.3f s\n",
+      stats->pipeline[PIPELINE_DECODE], stats->pipeline[PIPELINE_CRC],
+      stats->pipeline[PIPELINE_WRITE]);
+  }
+}
+
+/**
+ * Batch mode, decompressing many files in a single process.
+ * The files are sorted by decreasing size. Those larger than an even share
+ * of the whole batch per thread are decompressed first, one after the
+ * other, each one with all the threads, as a single one of them would leave
+ * the other threads idle at the end. The rest are decompressed one file per
+ * thread by a work-stealing pool (see thread_pool_run_stealing), each worker
+ * with its own decoder. They are dealt to the workers in turn, largest
+ * first, so that every worker starts with a similar amount of work, and the
+ * small files at the end of the ranges are what gets stolen.
+ */
+typedef struct batch_file_s {
+  const char *path;
+  off_t size;
+  int status;
+  file_stats_t stats;
+} batch_file_t;
+
+typedef struct batch_s {
+  batch_file_t **files;       // in the order of the tasks
+  size_t count;
+  gziped_decoder_t **decoders; // one per worker
+  uring_t *rings;             // one per worker with --uring, or NULL
+  const decompress_options_t *options;
+} batch_t;
+
+int compare_batch_files(const void *a, const void *b) {
+  const batch_file_t *fa = *(const batch_file_t **) a;
+  const batch_file_t *fb = *(const batch_file_t **) b;
+  return fa->size < fb->size ? 1 : fa->size > fb->size ? -1 : 0;
+}
+
+void batch_task(size_t index, unsigned worker, void *context) {
+  batch_t *batch = (batch_t *) context;
+  batch_file_t *file = batch->files[index];
+  file->status = decompress_file(file->path, batch->options, 1,
+    batch->decoders[worker], &file->stats);
+}
+
+/**
+ * Task of the batch mode with --uring, for the files of index
+ * [group * URING_DEPTH, (group + 1) * URING_DEPTH) of the batch. They are
+ * read with a single system call, decompressed in turn into buffers, and
+ * then written with another one, see uring.h. Files too large for the
+ * buffers of the ring, and all the files of a worker whose ring turns out not
+ * to work, are decompressed with the POSIX calls instead.
+ */
+void uring_batch_task(size_t group, unsigned worker, void *context) {
+  batch_t *batch = (batch_t *) context;
+  uring_t *ring = &batch->rings[worker];
+  gziped_decoder_t *decoder = batch->decoders[worker];
+  batch_file_t **files = batch->files + group * URING_DEPTH;
+  size_t left = batch->count - group * URING_DEPTH;
+  unsigned count = left < URING_DEPTH ? left : URING_DEPTH;
+  const char *paths[URING_DEPTH] = { NULL };
+  ssize_t sizes[URING_DEPTH];
+  for (unsigned i = 0; i < count; ++i) {
+    paths[i] = files[i]->path;
+  }
+  if (ring->fd < 0 || uring_read_files(ring, paths, count, sizes) != 0) {
+    if (ring->fd >= 0) uring_free(ring);
+    for (unsigned i = 0; i < count; ++i) {
+      files[i]->status = decompress_file(files[i]->path, batch->options, 1,
+        decoder, &files[i]->stats);
+    }
+    return;
+  }
+
+  output_file_t outputs[URING_DEPTH];
+  batch_file_t *written[URING_DEPTH]; // the file of each output
+  size_t written_in[URING_DEPTH];     // and the size of its input
+  unsigned count_out = 0;
+  for (unsigned i = 0; i < count; ++i) {
+    batch_file_t *file = files[i];
+    output_file_t *output = &outputs[count_out];
+    if (sizes[i] < 0) {
+      fprintf(stderr, "error: %s: %s\n", file->path, strerror(-sizes[i]));
+      file->status = 1;
+    } else if (sizes[i] == 0) {
+      fprintf(stderr, "error: %s: %s\n", file->path,
+        inflate_strerror(INFLATE_TRUNCATED));
+      file->status = 4;
+    } else if (sizes[i] == URING_BUFFER_SIZE) {
+      // Possibly larger than the buffer
+      file->status = decompress_file(file->path, batch->options, 1, decoder,
+        &file->stats);
+    } else {
+      file->status = decompress_buffer(file->path, uring_buffer(ring, i),
+        sizes[i], batch->options, 1, decoder, &file->stats, output);
+      if (file->status == 0 && output->path != NULL) {
+        written[count_out] = file;
+        written_in[count_out++] = sizes[i];
+      } else if (file->status == 0) {
+        free(output->data);
+      }
+    }
+  }
+
+  const char *output_paths[URING_DEPTH] = { NULL };
+  uint8_t *output_data[URING_DEPTH] = { NULL };
+  size_t output_sizes[URING_DEPTH] = { 0 };
+  int errors[URING_DEPTH];
+  for (unsigned i = 0; i < count_out; ++i) {
+    output_paths[i] = outputs[i].path;
+    output_data[i] = outputs[i].data;
+    output_sizes[i] = outputs[i].size;
+  }
+  // The inputs being smaller than URING_BUFFER_SIZE, and DEFLATE expanding
+  // data by 1032 times at most, the outputs fit in a single write
+  int res = uring_write_files(ring, output_paths, output_data, output_sizes,
+    count_out, errors);
+  for (unsigned i = 0; i < count_out; ++i) {
+    if (res != 0) {
+      errors[i] = write_file(outputs[i].path, outputs[i].data,
+        outputs[i].size) != 0 ? EIO : 0;
+    } else if (errors[i] != 0) {
+      fprintf(stderr, "error: %s: %s\n", outputs[i].path,
+        strerror(errors[i]));
+    }
+    if (errors[i] != 0) {
+      written[i]->status = 4;
+      written[i]->stats.out -= outputs[i].size;
+      written[i]->stats.in -= written_in[i];
+    }
+    free(outputs[i].path);
+    free(outputs[i].data);
+  }
+}
+
+static inline double elapsed_seconds(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int decompress_batch(char **paths, size_t count,
+                     const decompress_options_t *options, unsigned threads,
+                     int stats) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  batch_file_t *files = (batch_file_t *) calloc(count, sizeof (batch_file_t));
+  batch_file_t **sorted = (batch_file_t **) malloc(
+    count * sizeof (batch_file_t *));
+  batch_file_t **dealt = (batch_file_t **) malloc(
+    count * sizeof (batch_file_t *));
+  gziped_decoder_t **decoders = (gziped_decoder_t **) calloc(threads,
+    sizeof (gziped_decoder_t *));
+  if (files == NULL || sorted == NULL || dealt == NULL || decoders == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  uint64_t total_size = 0;
+  for (size_t i = 0; i < count; ++i) {
+    struct stat st;
+    files[i].path = paths[i];
+    files[i].size = stat(paths[i], &st) == 0 ? st.st_size : 0;
+    total_size += files[i].size;
+    sorted[i] = &files[i];
+  }
+  qsort(sorted, count, sizeof (batch_file_t *), compare_batch_files);
+  for (unsigned i = 0; i < threads; ++i) {
+    decoders[i] = gziped_decoder_init();
+  }
+
+  size_t large = 0;
+  while (large < count && threads > 1 &&
+         (uint64_t) sorted[large]->size > total_size / threads) {
+    batch_file_t *file = sorted[large++];
+    file->status = decompress_file(file->path, options, threads, decoders[0],
+      &file->stats);
+  }
+  // Deal the other files to the workers in turn: the k-th file of worker w
+  // is the (k * workers + w)-th largest
+  size_t left = count - large;
+  unsigned workers = threads < left ? threads : (left ? left : 1);
+  for (unsigned w = 0; w < workers; ++w) {
+    size_t begin = thread_pool_range_begin(left, workers, w);
+    size_t end = thread_pool_range_begin(left, workers, w + 1);
+    for (size_t k = 0; begin + k < end; ++k) {
+      dealt[begin + k] = sorted[large + k * workers + w];
+    }
+  }
+  batch_t batch = { dealt, left, decoders, NULL, options };
+  if (options->uring) {
+    batch.rings = (uring_t *) calloc(workers, sizeof (uring_t));
+    int error = batch.rings == NULL ? -ENOMEM : 0;
+    for (unsigned i = 0; error == 0 && i < workers; ++i) {
+      error = uring_init(&batch.rings[i]);
+      if (error != 0) {
+        while (i > 0) uring_free(&batch.rings[--i]);
+      }
+    }
+    if (error != 0) {
+      fprintf(stderr, "warning: io_uring unavailable (%s), using POSIX I/O\n",
+        strerror(-error));
+      free(batch.rings);
+      batch.rings = NULL;
+    }
+  }
+  if (batch.rings != NULL) {
+    thread_pool_run_stealing((left + URING_DEPTH - 1) / URING_DEPTH, workers,
+      uring_batch_task, &batch);
+    for (unsigned i = 0; i < workers; ++i) {
+      uring_free(&batch.rings[i]);
+    }
+    free(batch.rings);
+  } else {
+    thread_pool_run_stealing(left, workers, batch_task, &batch);
+  }
+
+  file_stats_t total = { 0, 0, 0, 0, 0, 0, { 0, 0, 0 } };
+  size_t failed = 0;
+  int status = 0;
+  for (size_t i = 0; i < count; ++i) {
+    total.in += files[i].stats.in;
+    total.out += files[i].stats.out;
+    total.table_hits += files[i].stats.table_hits;
+    total.table_misses += files[i].stats.table_misses;
+    total.mapped += files[i].stats.mapped;
+    if (files[i].stats.mapped_peak > total.mapped_peak)
+      total.mapped_peak = files[i].stats.mapped_peak;
+    for (int j = 0; j < 3; ++j) {
+      total.pipeline[j] += files[i].stats.pipeline[j];
+    }
+    if (files[i].status != 0) {
+      ++failed;
+      if (files[i].status > status) status = files[i].status;
+    }
+  }
+  double seconds = elapsed_seconds(&start);
+  fprintf(stderr, "%zu files (%zu failed), %.1f MB in, %.1f MB out in %.3f s:"
+    " %.1f MB/s in, %.1f MB/s out\n", count, failed, total.in / 1e6,
+    total.out / 1e6, seconds, seconds > 0 ? total.in / 1e6 / seconds : 0,
+    seconds > 0 ? total.out / 1e6 / seconds : 0);
+  if (stats) print_file_stats(&total);
+
+  for (unsigned i = 0; i < threads; ++i) {
+    gziped_decoder_free(decoders[i]);
+  }
+  free(decoders);
+  free(dealt);
+  free(sorted);
+  free(files);
+  return status;
+}
+
+/**
+ * Reads the paths of a batch, one per line, from the file at path or from
+ * stdin for "-". Returns the number of paths, *paths receiving them.
+ */
+size_t read_file_list(const char *path, char ***paths) {
+  FILE *list = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  if (list == NULL) {
+    perror("fopen");
+    exit(1);
+  }
+  size_t count = 0;
+  size_t capacity = 0;
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t len;
+  *paths = NULL;
+  while ((len = getline(&line, &line_size, list)) >= 0) {
+    if (len > 0 && line[len - 1] == '\n') line[--len] = 0;
+    if (len == 0) continue;
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      *paths = (char **) realloc(*paths, capacity * sizeof (char *));
+      if (*paths == NULL) {
+        perror("realloc");
+        exit(1);
+      }
+    }
+    (*paths)[count++] = strndup(line, len);
+  }
+  free(line);
+  if (list != stdin) fclose(list);
+  return count;
+}
+
+int main(int argc, char **argv) {
+  unsigned threads = thread_pool_cpu_count();
+  int build_index = 0;
+  int index_flags = 0;
+  int stats = 0;
+  int to_stdout = 0;
+  decompress_options_t options = { INPUT_MMAP, 0, 0, 0 };
+  const char *range = NULL;
+  const char *files_from = NULL;
+  int argi = 1;
+  // Options come before the files
+  while (argi < argc) {
+    if (strcmp(argv[argi], "-j") == 0 && argi + 1 < argc) {
+      threads = atoi(argv[argi + 1]);
+      if (threads == 0) threads = 1;
+      argi += 2;
+    } else if (strcmp(argv[argi], "--input") == 0 && argi + 1 < argc) {
+      if (input_method_parse(argv[argi + 1], &options.method) != 0) {
+        fprintf(stderr, "error: unknown input method %s\n", argv[argi + 1]);
+        usage();
+        exit(1);
+      }
+      argi += 2;
+    } else if (strcmp(argv[argi], "-c") == 0) {
+      to_stdout = 1;
+      argi += 1;
+    } else if (strcmp(argv[argi], "--stats") == 0) {
+      stats = 1;
+      argi += 1;
+    } else if (strcmp(argv[argi], "--mmap") == 0) {
+      options.map_output = 1;
+      argi += 1;
+    } else if (strcmp(argv[argi], "--uring") == 0) {
+      options.uring = 1;
+      argi += 1;
+    } else if (strcmp(argv[argi], "--pipeline") == 0) {
+      options.pipeline = 1;
+      argi += 1;
+    } else if (strcmp(argv[argi], "--build-index") == 0) {
+      build_index = 1;
+      argi += 1;
+    } else if (strcmp(argv[argi], "--check-index") == 0) {
+      index_flags |= GZI_CHECK_CRC;
+      argi += 1;
+    } else if (strcmp(argv[argi], "--range") == 0 && argi + 1 < argc) {
+      range = argv[argi + 1];
+      argi += 2;
+    } else if (strcmp(argv[argi], "--files-from") == 0 && argi + 1 < argc) {
+      files_from = argv[argi + 1];
+      argi += 2;
+    } else {
+      break;
+    }
+  }
+  int count = argc - argi;
+  uint64_t range_offset = 0;
+  uint64_t range_length = 0;
+  if ((files_from != NULL ? count != 0 : count < 1 && !to_stdout) ||
+      (to_stdout && (build_index || range != NULL || files_from != NULL)) ||
+      ((build_index || range != NULL) && (count != 1 || files_from != NULL)) ||
+      (build_index && range != NULL) || (index_flags != 0 && range == NULL) ||
+      (range != NULL &&
+      parse_range(range, &range_offset, &range_length) != 0)) {
+    fprintf(stderr, "error: wrong arguments\n");
+    usage();
+    exit(1);
+  }
+
+  if (to_stdout) return inflate_to_stdout(argv + argi, count);
+
+  if (files_from != NULL) {
+    char **paths = NULL;
+    size_t files = read_file_list(files_from, &paths);
+    int res = decompress_batch(paths, files, &options, threads, stats);
+    for (size_t i = 0; i < files; ++i) {
+      free(paths[i]);
+    }
+    free(paths);
+    return res;
+  }
+  if (count > 1) {
+    return decompress_batch(argv + argi, count, &options, threads, stats);
+  }
+
+  if (strcmp(argv[argi], "-") == 0) return inflate_to_stdout(NULL, 0);
+
+  if (build_index || range != NULL) {
+    struct stat st;
+    input_t input;
+    int error = stat(argv[argi], &st) != 0 ? errno :
+      input_open(argv[argi], options.method, &input);
+    if (error != 0) {
+      fprintf(stderr, "error: %s: %s\n", argv[argi], strerror(error));
+      exit(1);
+    }
+    int res = build_index ?
+      build_index_file(argv[argi], input.data, input.size, st.st_mtim) :
+      extract_range(argv[argi], input.data, input.size, st.st_mtim,
+        index_flags, range_offset, range_length);
+    input_close(&input);
+    return res;
+  }
+
+  gziped_decoder_t *decoder = gziped_decoder_init();
+  file_stats_t file_stats = { 0, 0, 0, 0, 0, 0, { 0, 0, 0 } };
+  int res = decompress_file(argv[argi], &options, threads, decoder,
+    &file_stats);
+  gziped_decoder_free(decoder);
+  if (stats) print_file_stats(&file_stats);
+  return res;
 }
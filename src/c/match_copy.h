@@ -0,0 +1,134 @@
+#ifndef __MATCH_COPY_H__
+#define __MATCH_COPY_H__
+
+/**
+ * Copy of LZ77 matches.
+ * https://tools.ietf.org/html/rfc1951#page-5
+ *
+ * A match copies `length` bytes from `distance` bytes back in the output, the
+ * source overlapping the destination when length > distance. The copy is done
+ * a 16 bytes word at a time, past the end of the match if need be: the caller
+ * leaves MATCH_COPY_SLACK bytes of room after the match.
+ * A word read at least 16 bytes back is always made of bytes written already,
+ * so it can be copied as a whole. Closer sources repeat with a period of
+ * `distance` bytes: the first word is expanded from that period, after which
+ * the words are copied from a multiple of the period at least 16 bytes back.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define MATCH_COPY_HAS_SHUFFLE
+#endif
+
+#define MATCH_COPY_WORD 16
+// How far past the end of a match match_copy may write
+#define MATCH_COPY_SLACK (2 * MATCH_COPY_WORD)
+
+// The smallest multiple of each distance below MATCH_COPY_WORD which is at
+// least MATCH_COPY_WORD
+static const uint8_t match_copy_stride[MATCH_COPY_WORD] = {
+  0, 16, 16, 18, 16, 20, 18, 21, 16, 18, 20, 22, 24, 26, 28, 30
+};
+
+#ifdef MATCH_COPY_HAS_SHUFFLE
+#define MATCH_COPY_PERIOD(d) { \
+  0 % d, 1 % d, 2 % d, 3 % d, 4 % d, 5 % d, 6 % d, 7 % d, 8 % d, 9 % d, \
+  10 % d, 11 % d, 12 % d, 13 % d, 14 % d, 15 % d }
+// Shuffles repeating the first `distance` bytes of a word over the whole word
+static const uint8_t __attribute__((aligned(16)))
+    match_copy_shuffle[MATCH_COPY_WORD][MATCH_COPY_WORD] = {
+  MATCH_COPY_PERIOD(1), MATCH_COPY_PERIOD(1), MATCH_COPY_PERIOD(2),
+  MATCH_COPY_PERIOD(3), MATCH_COPY_PERIOD(4), MATCH_COPY_PERIOD(5),
+  MATCH_COPY_PERIOD(6), MATCH_COPY_PERIOD(7), MATCH_COPY_PERIOD(8),
+  MATCH_COPY_PERIOD(9), MATCH_COPY_PERIOD(10), MATCH_COPY_PERIOD(11),
+  MATCH_COPY_PERIOD(12), MATCH_COPY_PERIOD(13), MATCH_COPY_PERIOD(14),
+  MATCH_COPY_PERIOD(15)
+};
+
+/**
+ * Writes the first word of a match with 1 < distance < MATCH_COPY_WORD with
+ * a single shuffle. Compiled for SSSE3 whatever the flags, and only called
+ * when the CPU has it, as crc32_fold_pclmul.
+ */
+__attribute__((target("ssse3")))
+static inline void match_copy_shuffle_ssse3(uint8_t *output,
+                                            uint16_t distance) {
+  __m128i period = _mm_loadu_si128((const __m128i *) (output - distance));
+  _mm_storeu_si128((__m128i *) output, _mm_shuffle_epi8(period,
+    _mm_load_si128((const __m128i *) match_copy_shuffle[distance])));
+}
+
+static inline int match_copy_has_ssse3() {
+#if defined(__SSSE3__)
+  return 1;
+#else
+  return __builtin_cpu_supports("ssse3");
+#endif
+}
+#endif
+
+static inline void copy_word(uint8_t *dst, const uint8_t *src) {
+#if defined(__SSE2__)
+  _mm_storeu_si128((__m128i *) dst, _mm_loadu_si128((const __m128i *) src));
+#else
+  memcpy(dst, src, MATCH_COPY_WORD);
+#endif
+}
+
+/**
+ * Writes the first word of a match with distance < MATCH_COPY_WORD.
+ */
+static inline void match_copy_pattern(uint8_t *output, uint16_t distance) {
+  if (distance == 1) {
+    // A run of a single byte
+#if defined(__SSE2__)
+    _mm_storeu_si128((__m128i *) output, _mm_set1_epi8(output[-1]));
+#else
+    memset(output, output[-1], MATCH_COPY_WORD);
+#endif
+    return;
+  }
+#ifdef MATCH_COPY_HAS_SHUFFLE
+  if (match_copy_has_ssse3()) {
+    match_copy_shuffle_ssse3(output, distance);
+    return;
+  }
+#endif
+  for (int i = 0; i < MATCH_COPY_WORD; ++i) {
+    output[i] = output[i - distance];
+  }
+}
+
+/**
+ * Copies the length bytes starting distance bytes before output to output.
+ * Up to MATCH_COPY_SLACK - 1 bytes past output + length are overwritten.
+ * Returns output + length.
+ */
+static inline uint8_t *match_copy(uint8_t *output, uint16_t distance,
+                                  uint16_t length) {
+  uint8_t *end = output + length;
+  if (distance < MATCH_COPY_WORD) {
+    match_copy_pattern(output, distance);
+    if (length <= MATCH_COPY_WORD) return end;
+    output += MATCH_COPY_WORD;
+    distance = match_copy_stride[distance];
+  }
+  const uint8_t *src = output - distance;
+  // Two words per iteration: the second one reads at most up to the end of
+  // the first one, which is already written
+  do {
+    copy_word(output, src);
+    copy_word(output + MATCH_COPY_WORD, src + MATCH_COPY_WORD);
+    output += 2 * MATCH_COPY_WORD;
+    src += 2 * MATCH_COPY_WORD;
+  } while (output < end);
+  return end;
+}
+
+#endif // __MATCH_COPY_H__
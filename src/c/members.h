@@ -0,0 +1,236 @@
+#ifndef __MEMBERS_H__
+#define __MEMBERS_H__
+
+/**
+ * Multi-member gzip files.
+ * https://tools.ietf.org/html/rfc1952#page-5
+ *
+ * A gzip file is a series of members, each one with its own header and its
+ * own footer: files appended to each other with cat are a valid gzip file
+ * which decompresses to the concatenation of their contents.
+ * Where a member ends is only known once its final block is decoded, but the
+ * members themselves are independent. So the file is first scanned for the
+ * byte sequences looking like a member header, and the output is laid out as
+ * if each of them started a member whose size is the ISIZE of the footer
+ * preceding the next one. As for BGZF files (see bgzf.h), the members are
+ * then speculatively decoded in parallel, each one directly at its place in
+ * that single output buffer. Then, starting from the first member, each
+ * member is required to end where the next one was decoded from.
+ * Candidates which are not actual member starts (a header-like sequence in the
+ * compressed data) are discarded, and a member which could not be decoded
+ * speculatively is decoded again in order, at its final offset. The members
+ * after one which turned out smaller than its room are moved down to follow
+ * it, and, should one turn out larger, the members after it are all decoded
+ * again in order, the output being grown as needed.
+ * Large members are not decoded speculatively but in order, each one with all
+ * the threads (see parallel_inflate.h).
+ */
+#include "gziped.h"
+#include "thread_pool.h"
+#include "parallel_inflate.h"
+
+// A member is at least a header, an empty fixed block and a footer
+#define GZIP_MIN_MEMBER_SIZE (GZIP_HEADER_SIZE + 2 + 8)
+// A DEFLATE stream expands to at most 1032 times its size: a 258 bytes match
+// can be coded on 2 bits
+#define DEFLATE_MAX_RATIO 1032
+
+typedef struct member_s {
+  size_t offset;           // the offset of the member in the file
+  size_t position;         // the offset of its room in the output
+  size_t capacity;         // the size of that room, its guessed size
+  int status;              // the return value of inflate_member
+  uint8_t parallel;        // 1 if left to inflate_member_parallel
+  inflate_result_t result;
+} member_t;
+
+typedef struct members_s {
+  uint8_t *buf;
+  size_t size;
+  uint8_t *output;         // the output of all the members
+  member_t *members;
+  size_t count;
+} members_t;
+
+/**
+ * Returns the offsets at which a member header could start, the first member
+ * being always at 0. *count receives the number of offsets.
+ */
+size_t *find_member_candidates(uint8_t *buf, size_t size, size_t *count) {
+  size_t capacity = 16;
+  size_t *offsets = (size_t *) malloc(capacity * sizeof (size_t));
+  offsets[0] = 0;
+  *count = 1;
+  if (size < 2 * GZIP_MIN_MEMBER_SIZE) return offsets;
+  const uint8_t *ptr = buf + GZIP_MIN_MEMBER_SIZE;
+  const uint8_t *end = buf + size - GZIP_MIN_MEMBER_SIZE + 1;
+  while ((ptr = memchr(ptr, 0x1F, end - ptr)) != NULL) {
+    // Beside the header being valid, XFL and OS are required to be values
+    // actually written by compressors, which makes false positives in the
+    // compressed data very unlikely
+    uint8_t xfl = ptr[8];
+    uint8_t os = ptr[9];
+    if ((xfl == 0 || xfl == 2 || xfl == 4) && (os <= 13 || os == 255) &&
+        member_header_size(ptr, buf + size - ptr) != 0) {
+      if (*count == capacity) {
+        capacity *= 2;
+        offsets = (size_t *) realloc(offsets, capacity * sizeof (size_t));
+      }
+      offsets[(*count)++] = ptr - buf;
+    }
+    ++ptr;
+  }
+  return offsets;
+}
+
+/**
+ * Guesses the decoded size of a member starting at offset, assuming the next
+ * member starts at end: if so, the 4 bytes before end are its ISIZE.
+ * Returns 0 if the guess is not possible for a DEFLATE stream of that size.
+ */
+size_t guess_member_size(uint8_t *buf, size_t offset, size_t end) {
+  if (end - offset < GZIP_MIN_MEMBER_SIZE) return 0;
+  size_t isize = read_le32(buf + end - 4);
+  if (isize > (end - offset) * DEFLATE_MAX_RATIO) return 0;
+  return isize;
+}
+
+void inflate_member_task(size_t index, void *context) {
+  members_t *members = (members_t *) context;
+  member_t *member = &members->members[index];
+  if (member->parallel) return;
+  member->status = inflate_member(members->buf + member->offset,
+    members->size - member->offset, members->output + member->position,
+    member->capacity, &member->result);
+}
+
+/**
+ * Returns 1 if the bytes are all zeros. Some tools pad gzip files, tapes for
+ * instance, and gzip ignores that padding.
+ */
+int is_zero_padding(const uint8_t *buf, size_t size) {
+  while (size--) {
+    if (*buf++ != 0) return 0;
+  }
+  return 1;
+}
+
+/**
+ * Decodes all the members of the gzip file in buf using up to `threads`
+ * threads. On success, *output receives a buffer allocated with malloc
+ * holding the concatenation of the members and *output_size its size.
+ * Returns INFLATE_OK or the error of the first member which failed.
+ * decoder, which may be NULL, is used by the members decoded in order, i.e. by
+ * all of them with a single thread.
+ */
+int inflate_members(uint8_t *buf, size_t size, unsigned threads,
+                    gziped_decoder_t *decoder, uint8_t **output,
+                    size_t *output_size) {
+  size_t count = 0;
+  size_t *offsets = find_member_candidates(buf, size, &count);
+  members_t members = { buf, size, NULL, NULL, count };
+  members.members = (member_t *) calloc(count, sizeof (member_t));
+  size_t allocated = 0;
+  for (size_t i = 0; i < count; ++i) {
+    member_t *member = &members.members[i];
+    size_t end = i + 1 < count ? offsets[i + 1] : size;
+    member->offset = offsets[i];
+    member->position = allocated;
+    member->capacity = guess_member_size(buf, offsets[i], end);
+    member->status = INFLATE_INVALID_DATA;
+    member->parallel = threads > 1 &&
+      end - offsets[i] >= INFLATE_PARALLEL_MIN_SIZE;
+    allocated += member->capacity;
+  }
+  free(offsets);
+  uint8_t *out = (uint8_t *) malloc(allocated ? allocated : 1);
+  if (out == NULL) {
+    free(members.members);
+    return INFLATE_OUTPUT_FULL;
+  }
+  members.output = out;
+  // With a single candidate, or a single thread, there is nothing to
+  // speculate on: the members are decoded in order below.
+  int speculative = threads > 1 && count > 1;
+  if (speculative) {
+    thread_pool_run(count, threads, inflate_member_task, &members);
+  }
+
+  // Follow the chain of members from the start of the file. As long as the
+  // speculative outputs are kept, a member decoded in order may not go past
+  // the room of the next candidate.
+  size_t pos = 0;
+  size_t candidate = 0;
+  size_t total = 0;
+  int res = INFLATE_OK;
+  while (pos < size) {
+    while (candidate < count && members.members[candidate].offset < pos)
+      ++candidate;
+    member_t *member = candidate < count &&
+      members.members[candidate].offset == pos ?
+      &members.members[candidate] : NULL;
+    size_t next = member != NULL ? candidate + 1 : candidate;
+    inflate_result_t result;
+    if (speculative && member != NULL && member->status == INFLATE_OK) {
+      // The members before may have been smaller than their room
+      if (member->position != total) {
+        memmove(out + total, out + member->position, member->result.produced);
+      }
+      result = member->result;
+    } else if (pos > 0 && member_header_size(buf + pos, size - pos) == 0) {
+      if (!is_zero_padding(buf + pos, size - pos))
+        fprintf(stderr, "warning: trailing garbage ignored\n");
+      break;
+    } else {
+      size_t end = next < count ? members.members[next].offset : size;
+      size_t limit = speculative && next < count ?
+        members.members[next].position : allocated;
+      size_t capacity = limit - total;
+      res = INFLATE_OUTPUT_FULL;
+      if (threads > 1 && end - pos >= INFLATE_PARALLEL_MIN_SIZE) {
+        // Assuming the member ends where the next candidate starts, which
+        // the footer check confirms
+        res = inflate_member_parallel(buf + pos, end - pos, out + total,
+          capacity, &result, threads);
+      }
+      for (;;) {
+        if (res != INFLATE_OK) {
+          res = gziped_inflate_member(decoder, buf + pos, size - pos,
+            out + total, capacity, &result);
+        }
+        // Past that size the output cannot be the cause of the failure
+        if (res != INFLATE_OUTPUT_FULL ||
+            capacity > (size - pos) * DEFLATE_MAX_RATIO)
+          break;
+        // The member runs over the room of the candidates after it, which
+        // are all decoded again in order from now on
+        speculative = 0;
+        if (total + capacity < allocated) {
+          capacity = allocated - total;
+          continue;
+        }
+        capacity = capacity ? 2 * capacity : 1;
+        uint8_t *grown = (uint8_t *) realloc(out, total + capacity);
+        if (grown == NULL) break;
+        out = grown;
+        allocated = total + capacity;
+      }
+      if (res != INFLATE_OK) break;
+    }
+    pos += result.consumed;
+    total += result.produced;
+  }
+
+  free(members.members);
+  if (res != INFLATE_OK) {
+    free(out);
+    return res;
+  }
+  // Gives back the room left by members smaller than guessed
+  uint8_t *shrunk = (uint8_t *) realloc(out, total ? total : 1);
+  *output = shrunk != NULL ? shrunk : out;
+  *output_size = total;
+  return INFLATE_OK;
+}
+
+#endif // __MEMBERS_H__
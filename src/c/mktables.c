@@ -0,0 +1,168 @@
+/**
+ * Generates the constant tables used by the decoder so that none of them has
+ * to be computed at runtime.
+ *
+ * usage: mktables crc32 > crc32_table.h
+ *        mktables fixed > fixed_huffman_table.h
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#define CRC32_POLYNOMIAL 0xedb88320
+#define CRC32_SLICES 16
+
+/**
+ * Multiplies a and b modulo the CRC polynomial, both being in the reflected
+ * representation (x^0 is the most significant bit).
+ */
+uint32_t multmodp(uint32_t a, uint32_t b) {
+  uint32_t m = (uint32_t) 1 << 31;
+  uint32_t p = 0;
+  for (;;) {
+    if (a & m) {
+      p ^= b;
+      if ((a & (m - 1)) == 0) break;
+    }
+    m >>= 1;
+    b = b & 1 ? (b >> 1) ^ CRC32_POLYNOMIAL : b >> 1;
+  }
+  return p;
+}
+
+/**
+ * crc32_table[0] is the table of CRCs of all 8-bit messages from RFC 1952.
+ * crc32_table[k][n] is the CRC of the byte n followed by k zero bytes, which
+ * lets the slicing-by-N loops process N bytes with N independent lookups.
+ */
+void print_crc32_table() {
+  uint32_t table[CRC32_SLICES][256];
+  for (uint32_t n = 0; n < 256; n++) {
+    uint32_t c = n;
+    for (int k = 0; k < 8; k++) {
+      c = c & 1 ? CRC32_POLYNOMIAL ^ (c >> 1) : c >> 1;
+    }
+    table[0][n] = c;
+  }
+  for (int k = 1; k < CRC32_SLICES; k++) {
+    for (uint32_t n = 0; n < 256; n++) {
+      uint32_t c = table[k - 1][n];
+      table[k][n] = (c >> 8) ^ table[0][c & 0xff];
+    }
+  }
+
+  printf("// Generated by mktables, do not edit.\n");
+  printf("#ifndef __CRC32_TABLE_H__\n#define __CRC32_TABLE_H__\n\n");
+  printf("#include <stdint.h>\n\n");
+  printf("#define CRC32_SLICES %i\n\n", CRC32_SLICES);
+  printf("static const uint32_t crc32_table[CRC32_SLICES][256] = {\n");
+  for (int k = 0; k < CRC32_SLICES; k++) {
+    printf("  {");
+    for (int n = 0; n < 256; n++) {
+      printf("%s0x%08x%s", n % 6 == 0 ? "\n    " : " ", table[k][n],
+        n == 255 ? "" : ",");
+    }
+    printf("\n  },\n");
+  }
+  printf("};\n\n");
+
+  // crc32_x2n_table[k] is x^(2^k) modulo the CRC polynomial, used to shift
+  // a CRC by a number of zero bytes in crc32_combine.
+  uint32_t p = 1 << 30; // x^1
+  printf("static const uint32_t crc32_x2n_table[32] = {");
+  for (int k = 0; k < 32; k++) {
+    printf("%s0x%08x%s", k % 6 == 0 ? "\n  " : " ", p, k == 31 ? "" : ",");
+    p = multmodp(p, p);
+  }
+  printf("\n};\n\n#endif // __CRC32_TABLE_H__\n");
+}
+
+// The decode tables are indexed like the dynamic ones, by LITLEN_TABLE_BITS
+// and DISTANCE_TABLE_BITS bits (see gziped.h, which checks that they match).
+// The fixed codes being at most 9 bits long, they need no sub-table.
+#define FIXED_LITLEN_TABLE_BITS 10
+#define FIXED_DISTANCE_TABLE_BITS 8
+#define FIXED_LITLEN_COUNT 288
+#define FIXED_DISTANCE_COUNT 32
+
+/**
+ * Fills table, indexed by table_bits bits in reading order, with the entries
+ * of the canonical code of the given code lengths, in the huffman_entry_t
+ * format of gziped.h: the value in the upper 16 bits, the code length in the
+ * lower ones. The code must be complete.
+ */
+void fill_fixed_table(const uint8_t *lengths, int count, int table_bits,
+                      uint32_t *table) {
+  uint32_t length_counts[16] = { 0 };
+  for (int i = 0; i < count; i++) length_counts[lengths[i]]++;
+  uint32_t next_codes[16] = { 0 };
+  uint32_t code = 0;
+  for (int bits = 1; bits < 16; bits++) {
+    next_codes[bits] = code = (code + length_counts[bits - 1]) << 1;
+  }
+  for (int i = 0; i < count; i++) {
+    uint32_t reversed = 0;
+    uint32_t c = next_codes[lengths[i]]++;
+    for (int k = 0; k < lengths[i]; k++) {
+      reversed = (reversed << 1) | (c & 1);
+      c >>= 1;
+    }
+    for (uint32_t j = reversed; j < 1u << table_bits; j += 1 << lengths[i]) {
+      table[j] = (uint32_t) i << 16 | lengths[i];
+    }
+  }
+}
+
+void print_table(const char *name, const char *size, const uint32_t *table,
+                 int count) {
+  printf("static const uint32_t %s[%s] = {", name, size);
+  for (int n = 0; n < count; n++) {
+    printf("%s0x%08x%s", n % 6 == 0 ? "\n  " : " ", table[n],
+      n == count - 1 ? "" : ",");
+  }
+  printf("\n};\n\n");
+}
+
+/**
+ * The decode tables of the fixed huffman codes.
+ * https://tools.ietf.org/html/rfc1951#page-12
+ */
+void print_fixed_tables() {
+  uint8_t lengths[FIXED_LITLEN_COUNT];
+  for (int i = 0; i < FIXED_LITLEN_COUNT; i++) {
+    lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+  }
+  uint32_t littable[1 << FIXED_LITLEN_TABLE_BITS];
+  fill_fixed_table(lengths, FIXED_LITLEN_COUNT, FIXED_LITLEN_TABLE_BITS,
+    littable);
+  memset(lengths, 5, FIXED_DISTANCE_COUNT);
+  uint32_t disttable[1 << FIXED_DISTANCE_TABLE_BITS];
+  fill_fixed_table(lengths, FIXED_DISTANCE_COUNT, FIXED_DISTANCE_TABLE_BITS,
+    disttable);
+
+  printf("// Generated by mktables, do not edit.\n");
+  printf("#ifndef __FIXED_HUFFMAN_TABLE_H__\n");
+  printf("#define __FIXED_HUFFMAN_TABLE_H__\n\n");
+  printf("#include <stdint.h>\n\n");
+  printf("#define FIXED_LITLEN_TABLE_BITS %i\n", FIXED_LITLEN_TABLE_BITS);
+  printf("#define FIXED_DISTANCE_TABLE_BITS %i\n\n",
+    FIXED_DISTANCE_TABLE_BITS);
+  print_table("fixed_litlen_table", "1 << FIXED_LITLEN_TABLE_BITS", littable,
+    1 << FIXED_LITLEN_TABLE_BITS);
+  print_table("fixed_distance_table", "1 << FIXED_DISTANCE_TABLE_BITS",
+    disttable, 1 << FIXED_DISTANCE_TABLE_BITS);
+  printf("#endif // __FIXED_HUFFMAN_TABLE_H__\n");
+}
+
+int main(int argc, char **argv) {
+  if (argc == 2 && strcmp(argv[1], "crc32") == 0) {
+    print_crc32_table();
+    return 0;
+  }
+  if (argc == 2 && strcmp(argv[1], "fixed") == 0) {
+    print_fixed_tables();
+    return 0;
+  }
+  fprintf(stderr, "usage: mktables crc32|fixed\n");
+  return 1;
+}
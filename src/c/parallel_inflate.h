@@ -0,0 +1,467 @@
+#ifndef __PARALLEL_INFLATE_H__
+#define __PARALLEL_INFLATE_H__
+
+/**
+ * Parallel decoding of a single DEFLATE stream.
+ *
+ * A DEFLATE stream gives no way to find where its blocks start other than
+ * decoding it from the beginning, and a block may copy bytes from the 32 KB
+ * decoded before it (https://tools.ietf.org/html/rfc1951#page-5). So:
+ * 1. The compressed stream is split in chunks. In each chunk but the first one,
+ *    every bit offset is tried until one is the start of a dynamic block whose
+ *    header (parse_dynamic_tree) is valid and which decodes without error.
+ *    The chunk is speculatively decoded from there up to the first block
+ *    boundary past the end of the chunk. As the 32 KB window preceding the
+ *    chunk is not known, the bytes copied from it are kept as markers: the
+ *    output is 16 bits wide, values below 256 being actual bytes and the
+ *    others standing for the byte at (value - CHUNK_MARKER) in the window.
+ *    All the chunks are decoded in parallel.
+ * 2. Starting from the first chunk, which is decoded from the start of the
+ *    stream, each chunk is required to start exactly where the previous one
+ *    stopped. When that is not the case (a false positive block start, or a
+ *    chunk starting with a fixed or stored block), the stream is decoded
+ *    again from where the previous chunk stopped, with the actual window,
+ *    up to the next chunk. Along the way the last 32 KB of each chunk are
+ *    resolved, which gives the window of the next one.
+ * 3. The markers of all the chunks are replaced by the bytes of their windows
+ *    in parallel, each chunk being written at its offset in the output. The
+ *    CRC of each chunk is computed at the same time and the CRCs are merged
+ *    with crc32_combine.
+ * The output is the same as inflate() byte for byte, and the CRC is still
+ * checked by the caller against the footer.
+ */
+#include "gziped.h"
+#include "crc32.h"
+#include "thread_pool.h"
+
+// Smaller chunks would not amortize the block search and the window
+// resolution
+#define INFLATE_PARALLEL_MIN_CHUNK_SIZE (4 << 20)
+// Below that compressed size a stream is decoded by inflate()
+#define INFLATE_PARALLEL_MIN_SIZE (2 * INFLATE_PARALLEL_MIN_CHUNK_SIZE)
+// Decoded values at or above CHUNK_MARKER are bytes of the unknown window
+#define CHUNK_MARKER 256
+#define CHUNK_NO_START SIZE_MAX
+// The room first given to the output of a chunk, in values per byte of its
+// compressed data. Most data expands less than that, the rest grows the
+// buffer.
+#define CHUNK_EXPANSION 4
+
+typedef struct chunk_s {
+  size_t begin;     // the bit offset from which a block start is searched
+  size_t start;     // the bit offset of the first block, or CHUNK_NO_START
+  size_t stop;      // decoding stops at the first block boundary past stop
+  size_t end;       // the bit offset where decoding stopped
+  uint8_t final;    // 1 if the final block was decoded
+  uint8_t markers;  // 1 if data holds markers
+  int status;       // the return value of inflate_chunk
+  uint16_t *data;   // the decoded bytes and markers
+  size_t length;
+  size_t capacity;
+  uint8_t *window;  // the 32 KB preceding the chunk, to resolve the markers
+  size_t offset;    // the offset of the chunk in the output
+  uint32_t crc;     // the CRC32 of the chunk
+} chunk_t;
+
+typedef struct parallel_inflate_s {
+  uint8_t *buf;
+  size_t size;
+  chunk_t *chunks;
+  size_t count;
+  uint8_t *output;
+  size_t output_size;
+} parallel_inflate_t;
+
+/**
+ * Makes room for `length` more values in the chunk, which never grows past
+ * max_length values. Returns -1 if they do not fit or on allocation failure.
+ */
+int chunk_reserve(chunk_t *chunk, size_t length, size_t max_length) {
+  if (chunk->capacity - chunk->length >= length) return 0;
+  if (length > max_length || chunk->length > max_length - length) return -1;
+  size_t capacity = chunk->capacity * 2;
+  if (capacity < chunk->length + length) capacity = chunk->length + length;
+  if (capacity > max_length) capacity = max_length;
+  uint16_t *data = (uint16_t *) realloc(chunk->data,
+    capacity * sizeof (uint16_t));
+  if (data == NULL) return -1;
+  chunk->data = data;
+  chunk->capacity = capacity;
+  return 0;
+}
+
+/**
+ * inflate_block for 16 bits output. The window_size bytes before window are
+ * the bytes preceding the chunk. Matches reaching before them are invalid,
+ * unless speculative is set, in which case they produce markers. The chunk
+ * is not grown past max_length values, see chunk_reserve.
+ */
+int inflate_chunk_block(bitreader_t *br, const huffman_entry_t *littable,
+                        const huffman_entry_t *disttable, chunk_t *chunk,
+                        const uint8_t *window, size_t window_size,
+                        int speculative, size_t max_length) {
+  // As in inflate_block_fast, the room is only compared to a margin of the
+  // longest match for each symbol, and grown when the margin is reached
+  uint16_t *output = chunk->data + chunk->length;
+  uint16_t *output_limit = chunk->data + chunk->capacity -
+    DEFLATE_MAX_MATCH_LENGTH;
+  int res = INFLATE_OK;
+  for (;;) {
+    if (output > output_limit) {
+      chunk->length = output - chunk->data;
+      if (chunk_reserve(chunk, DEFLATE_MAX_MATCH_LENGTH, max_length) != 0) {
+        res = INFLATE_OUTPUT_FULL;
+        break;
+      }
+      output = chunk->data + chunk->length;
+      output_limit = chunk->data + chunk->capacity - DEFLATE_MAX_MATCH_LENGTH;
+    }
+    bitreader_refill(br);
+    // As in inflate_block_tail, the zeros past the end of the input are not
+    // decoded
+    if (bitreader_overrun(br)) {
+      res = INFLATE_TRUNCATED;
+      break;
+    }
+    uint16_t value = decode_symbol(br, littable, LITLEN_TABLE_BITS);
+    if (value == DEFLATE_END_BLOCK_VALUE) break;
+    if (value < DEFLATE_END_BLOCK_VALUE) {
+      *output++ = value;
+      continue;
+    }
+    if (value > DEFLATE_MAX_LENGTH_VALUE) {
+      res = INFLATE_INVALID_DATA;
+      break;
+    }
+    uint16_t length = length_lookup[value - DEFLATE_END_BLOCK_VALUE - 1];
+    uint8_t nb_extra_bits = length_extra_bits[value - DEFLATE_END_BLOCK_VALUE - 1];
+    length += bitreader_peek(br, nb_extra_bits);
+    bitreader_consume(br, nb_extra_bits);
+    value = decode_symbol(br, disttable, DISTANCE_TABLE_BITS);
+    if (value > DEFLATE_MAX_DISTANCE_VALUE) {
+      res = INFLATE_INVALID_DATA;
+      break;
+    }
+    uint16_t distance = distance_lookup[value];
+    nb_extra_bits = distance_extra_bits[value];
+    distance += bitreader_peek(br, nb_extra_bits);
+    bitreader_consume(br, nb_extra_bits);
+    size_t produced = output - chunk->data;
+    if (distance <= produced) {
+      for (uint16_t i = 0; i < length; ++i) {
+        output[i] = output[(ptrdiff_t) i - distance];
+      }
+    } else {
+      for (uint16_t i = 0; i < length; ++i) {
+        ptrdiff_t src = (ptrdiff_t) (produced + i) - distance;
+        if (src >= 0) {
+          output[i] = chunk->data[src];
+        } else if ((size_t) -src <= window_size) {
+          output[i] = window[src];
+        } else if (speculative) {
+          output[i] = CHUNK_MARKER + DEFLATE_WINDOW_SIZE + src;
+          chunk->markers = 1;
+        } else {
+          res = INFLATE_INVALID_DATA;
+          break;
+        }
+      }
+      if (res != INFLATE_OK) break;
+    }
+    output += length;
+  }
+  chunk->length = output - chunk->data;
+  return res;
+}
+
+/**
+ * Decodes the blocks from chunk->start until the final block or the first
+ * block boundary at or past chunk->stop. See inflate_chunk_block for window.
+ */
+int inflate_chunk(parallel_inflate_t *p, chunk_t *chunk, const uint8_t *window,
+                  size_t window_size, int speculative) {
+  bitreader_t br;
+  bitreader_init(&br, p->buf, p->size);
+  bitreader_seek(&br, chunk->start);
+  chunk->length = 0;
+  chunk->markers = 0;
+  chunk->final = 0;
+  // The buffer is sized once from the compressed data up to stop, and kept
+  // from one start tried to the next. A chunk holds no more than the whole
+  // output, and the margin of inflate_chunk_block.
+  size_t max_length = p->output_size + DEFLATE_MAX_MATCH_LENGTH;
+  size_t stop = chunk->stop < p->size * 8 ? chunk->stop : p->size * 8;
+  size_t expected = (stop > chunk->start ? (stop - chunk->start) / 8 : 0) *
+    CHUNK_EXPANSION;
+  if (expected > p->output_size) expected = p->output_size;
+  if (chunk_reserve(chunk, expected + DEFLATE_MAX_MATCH_LENGTH,
+      max_length) != 0)
+    return INFLATE_OUTPUT_FULL;
+  for (;;) {
+    size_t position = bitreader_position(&br);
+    if (position >= chunk->stop && position > chunk->start) {
+      chunk->end = position;
+      return INFLATE_OK;
+    }
+    uint8_t bfinal = bitreader_read(&br, 1);
+    uint8_t btype = bitreader_read(&br, 2);
+    int res = INFLATE_OK;
+    switch (btype) {
+      case DEFLATE_LITERAL_BLOCK_TYPE: {
+        bitreader_align(&br);
+        if (br.end - br.ptr < 4) return INFLATE_TRUNCATED;
+        uint16_t len = br.ptr[0] | br.ptr[1] << 8;
+        uint16_t nlen = br.ptr[2] | br.ptr[3] << 8;
+        if (len != (uint16_t) ~nlen) return INFLATE_INVALID_DATA;
+        br.ptr += 4;
+        if (br.end - br.ptr < len) return INFLATE_TRUNCATED;
+        if (chunk_reserve(chunk, len, max_length) != 0)
+          return INFLATE_OUTPUT_FULL;
+        for (uint16_t i = 0; i < len; ++i) {
+          chunk->data[chunk->length++] = br.ptr[i];
+        }
+        br.ptr += len;
+        break;
+      }
+      case DEFLATE_FIX_HUF_BLOCK_TYPE:
+        res = inflate_chunk_block(&br, fixed_litlen_table, fixed_distance_table,
+          chunk, window, window_size, speculative, max_length);
+        break;
+      case DEFLATE_DYN_HUF_BLOCK_TYPE: {
+        huffman_entry_t littable[LITLEN_TABLE_SIZE];
+        huffman_entry_t disttable[DISTANCE_TABLE_SIZE];
+        res = parse_dynamic_tree(&br, littable, disttable);
+        if (res == INFLATE_OK) {
+          res = inflate_chunk_block(&br, littable, disttable, chunk, window,
+            window_size, speculative, max_length);
+        }
+        break;
+      }
+      default:
+        res = INFLATE_INVALID_DATA;
+    }
+    if (bitreader_overrun(&br)) return INFLATE_TRUNCATED;
+    if (res != INFLATE_OK) return res;
+    if (bfinal) {
+      chunk->final = 1;
+      chunk->end = bitreader_position(&br);
+      return INFLATE_OK;
+    }
+  }
+}
+
+/**
+ * Returns 1 if a non-final dynamic block with a valid header starts at bit.
+ */
+int is_dynamic_block_start(parallel_inflate_t *p, size_t bit) {
+  // BFINAL = 0, BTYPE = 2, then HLIT and HDIST which are at most 29. Most bit
+  // offsets are rejected by that check, which is done on a single load.
+  uint32_t header;
+  if (bit / 8 + 8 <= p->size) {
+    header = bitreader_load64(p->buf + bit / 8) >> (bit % 8);
+  } else {
+    header = bit / 8 < p->size ? p->buf[bit / 8] >> (bit % 8) : 0;
+  }
+  if ((header & 7) != 4 || ((header >> 3) & 31) > 29 ||
+      ((header >> 8) & 31) > 29)
+    return 0;
+  // The code length code has to be complete (or a single code of length 1,
+  // as accepted by build_decode_table), which rejects most of the rest
+  // before any table is built.
+  bitreader_t br;
+  bitreader_init(&br, p->buf, p->size);
+  bitreader_seek(&br, bit + 13);
+  uint8_t hclen = bitreader_read(&br, 4) + 4;
+  uint16_t kraft = 0;
+  for (uint8_t i = 0; i < hclen; ++i) {
+    uint8_t length = bitreader_read(&br, 3);
+    if (length) kraft += 128 >> length;
+  }
+  if (kraft != 128 && kraft != 64) return 0;
+  bitreader_seek(&br, bit + 3);
+  huffman_entry_t littable[LITLEN_TABLE_SIZE];
+  huffman_entry_t disttable[DISTANCE_TABLE_SIZE];
+  return parse_dynamic_tree(&br, littable, disttable) == INFLATE_OK &&
+    !bitreader_overrun(&br);
+}
+
+void inflate_chunk_task(size_t index, void *context) {
+  parallel_inflate_t *p = (parallel_inflate_t *) context;
+  chunk_t *chunk = &p->chunks[index];
+  if (index == 0) {
+    chunk->start = 0;
+    chunk->status = inflate_chunk(p, chunk, NULL, 0, 0);
+    return;
+  }
+  size_t limit = chunk->stop < p->size * 8 ? chunk->stop : p->size * 8;
+  for (size_t bit = chunk->begin; bit < limit; ++bit) {
+    if (!is_dynamic_block_start(p, bit)) continue;
+    chunk->start = bit;
+    chunk->status = inflate_chunk(p, chunk, NULL, 0, 1);
+    if (chunk->status == INFLATE_OK) return;
+    // A start decoded up to the end of the input: the input is truncated, and
+    // the other starts would be decoded up to its end as well. The chain
+    // decodes the chunk again, from the end of the previous one, to tell.
+    if (chunk->status == INFLATE_TRUNCATED) return;
+  }
+  chunk->start = CHUNK_NO_START;
+  chunk->status = INFLATE_INVALID_DATA;
+}
+
+/**
+ * Slides the window (the last DEFLATE_WINDOW_SIZE bytes of output, of which
+ * the last *window_size are valid) past the chunk, whose markers refer to it.
+ */
+void chunk_slide_window(const chunk_t *chunk, uint8_t *window,
+                        size_t *window_size) {
+  size_t n = chunk->length < DEFLATE_WINDOW_SIZE ?
+    chunk->length : DEFLATE_WINDOW_SIZE;
+  uint8_t tail[DEFLATE_WINDOW_SIZE];
+  const uint16_t *data = chunk->data + chunk->length - n;
+  for (size_t i = 0; i < n; ++i) {
+    tail[i] = data[i] < CHUNK_MARKER ? data[i] : window[data[i] - CHUNK_MARKER];
+  }
+  memmove(window, window + n, DEFLATE_WINDOW_SIZE - n);
+  memcpy(window + DEFLATE_WINDOW_SIZE - n, tail, n);
+  *window_size += n;
+  if (*window_size > DEFLATE_WINDOW_SIZE) *window_size = DEFLATE_WINDOW_SIZE;
+}
+
+void resolve_chunk_task(size_t index, void *context) {
+  parallel_inflate_t *p = (parallel_inflate_t *) context;
+  chunk_t *chunk = &p->chunks[index];
+  uint8_t *output = p->output + chunk->offset;
+  if (chunk->markers) {
+    for (size_t i = 0; i < chunk->length; ++i) {
+      uint16_t value = chunk->data[i];
+      output[i] = value < CHUNK_MARKER ?
+        value : chunk->window[value - CHUNK_MARKER];
+    }
+  } else {
+    for (size_t i = 0; i < chunk->length; ++i) {
+      output[i] = chunk->data[i];
+    }
+  }
+  chunk->crc = crc32_update(0, output, chunk->length);
+}
+
+void free_chunks(chunk_t *chunks, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    free(chunks[i].data);
+    free(chunks[i].window);
+  }
+  free(chunks);
+}
+
+/**
+ * Same as inflate(), using up to `threads` threads on chunks of chunk_size
+ * bytes of compressed data (0 picks a size from the number of threads).
+ * result is mandatory.
+ */
+int inflate_parallel(uint8_t *buf, size_t size, uint8_t *output,
+                     size_t output_size, inflate_result_t *result,
+                     unsigned threads, size_t chunk_size) {
+  if (chunk_size == 0) {
+    chunk_size = (size + threads - 1) / (threads ? threads : 1);
+    if (chunk_size < INFLATE_PARALLEL_MIN_CHUNK_SIZE)
+      chunk_size = INFLATE_PARALLEL_MIN_CHUNK_SIZE;
+  }
+  if (threads <= 1 || size <= chunk_size)
+    return inflate(buf, size, output, output_size, result);
+
+  parallel_inflate_t *p = (parallel_inflate_t *) malloc(
+    sizeof (parallel_inflate_t));
+  p->buf = buf;
+  p->size = size;
+  p->output = output;
+  p->output_size = output_size;
+  p->count = (size + chunk_size - 1) / chunk_size;
+  p->chunks = (chunk_t *) calloc(p->count, sizeof (chunk_t));
+  for (size_t i = 0; i < p->count; ++i) {
+    p->chunks[i].begin = i * chunk_size * 8;
+    p->chunks[i].stop = i + 1 < p->count ? (i + 1) * chunk_size * 8 : SIZE_MAX;
+  }
+  thread_pool_run(p->count, threads, inflate_chunk_task, p);
+
+  // Follow the chain of chunks from the start of the stream. It replaces the
+  // speculative chunks in p->chunks once done.
+  chunk_t *chain = (chunk_t *) calloc(p->count, sizeof (chunk_t));
+  size_t chain_capacity = p->count;
+  size_t chain_length = 0;
+  uint8_t window[DEFLATE_WINDOW_SIZE];
+  size_t window_size = 0;
+  size_t total = 0;
+  size_t next = 1; // the first chunk which might follow the last one
+  chunk_t chunk = p->chunks[0];
+  memset(&p->chunks[0], 0, sizeof (chunk_t)); // now owned by the chain
+  int res = chunk.status;
+  while (res == INFLATE_OK) {
+    if (chunk.markers) {
+      chunk.window = (uint8_t *) malloc(DEFLATE_WINDOW_SIZE);
+      memcpy(chunk.window, window, DEFLATE_WINDOW_SIZE);
+    }
+    chunk_slide_window(&chunk, window, &window_size);
+    chunk.offset = total;
+    total += chunk.length;
+    if (chain_length == chain_capacity) {
+      chain_capacity *= 2;
+      chain = (chunk_t *) realloc(chain, chain_capacity * sizeof (chunk_t));
+    }
+    chain[chain_length++] = chunk;
+    if (chunk.final) break;
+    size_t end = chunk.end;
+    while (next < p->count && (p->chunks[next].start < end ||
+           p->chunks[next].status != INFLATE_OK))
+      ++next;
+    if (next < p->count && p->chunks[next].start == end) {
+      chunk = p->chunks[next];
+      memset(&p->chunks[next], 0, sizeof (chunk_t));
+    } else {
+      // The next chunk did not start where this one stopped: decode the gap
+      // now that the window is known.
+      memset(&chunk, 0, sizeof (chunk_t));
+      chunk.start = end;
+      chunk.stop = next < p->count ? p->chunks[next].start : SIZE_MAX;
+      chunk.status = inflate_chunk(p, &chunk, window + DEFLATE_WINDOW_SIZE,
+        window_size, 0);
+    }
+    res = chunk.status;
+  }
+  if (res != INFLATE_OK) free(chunk.data);
+
+  if (res == INFLATE_OK && total > output_size) res = INFLATE_OUTPUT_FULL;
+  if (res == INFLATE_OK) {
+    free_chunks(p->chunks, p->count);
+    p->chunks = chain;
+    p->count = chain_length;
+    thread_pool_run(chain_length, threads, resolve_chunk_task, p);
+    uint32_t crc = 0;
+    for (size_t i = 0; i < chain_length; ++i) {
+      crc = crc32_combine(crc, chain[i].crc, chain[i].length);
+    }
+    result->consumed = (chain[chain_length - 1].end + 7) / 8;
+    result->produced = total;
+    result->crc = crc;
+  } else {
+    free_chunks(chain, chain_length);
+  }
+  free_chunks(p->chunks, p->count);
+  free(p);
+  return res;
+}
+
+/**
+ * inflate_member with inflate_parallel.
+ */
+int inflate_member_parallel(uint8_t *buf, size_t size, uint8_t *output,
+                            size_t output_size, inflate_result_t *result,
+                            unsigned threads) {
+  size_t header_size = member_header_size(buf, size);
+  if (header_size == 0) return INFLATE_INVALID_DATA;
+  int res = inflate_parallel(buf + header_size, size - header_size, output,
+    output_size, result, threads, 0);
+  if (res != INFLATE_OK) return res;
+  return check_member_footer(buf, size, header_size, result);
+}
+
+#endif // __PARALLEL_INFLATE_H__
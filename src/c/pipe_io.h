@@ -0,0 +1,171 @@
+#ifndef __PIPE_IO_H__
+#define __PIPE_IO_H__
+
+/**
+ * Output of the pipe mode (gziped -c), for data streamed to another process.
+ *
+ * The decoder writes directly into one of two page aligned buffers of
+ * PIPE_IO_CHUNK_SIZE bytes, and each full buffer is handed to the output
+ * in a single call. When the output is a pipe, on Linux, the buffer is
+ * vmsplice'd into it: its pages are referenced by the pipe instead of being
+ * copied. They are then read by the consumer in place, so a buffer may only
+ * be written again once the consumer is done with it. The pipe is resized
+ * to hold no more than a buffer: once the other buffer has been fully
+ * spliced, the pipe holds nothing of the first one, which can be reused.
+ * Elsewhere, or when the kernel refuses, the buffers are written with write.
+ * A partial buffer, as flushed at the end of a file, is always written: the
+ * pipe could otherwise still hold part of the other buffer once it is in.
+ * The pages last spliced may be referenced by the pipe until the consumer
+ * reads them, long after the writer is done: the buffers are mapped, not
+ * allocated, so that freeing them never hands those pages back to malloc.
+ * One writer is meant to serve all the output of the process.
+ *
+ * vmsplice and F_SETPIPE_SZ need _GNU_SOURCE to be defined before any
+ * include; without it, write is always used.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(_GNU_SOURCE)
+#include <sys/uio.h>
+#include <sys/mman.h>
+#define PIPE_IO_SPLICE 1
+#endif
+
+// Larger chunks save few system calls more, while the decoder writing
+// through them evicts its window and the input from the cache
+#define PIPE_IO_CHUNK_SIZE (128 * 1024)
+#define PIPE_IO_ALIGNMENT 4096
+
+typedef struct pipe_writer_s {
+  int fd;
+  int splice;          // 1 if the buffers are vmsplice'd into fd
+  size_t chunk_size;   // the size of each buffer
+  uint8_t *buffers[2];
+  unsigned current;    // the buffer being filled
+  size_t fill;         // the number of bytes in it
+  uint64_t total;      // the number of bytes output
+} pipe_writer_t;
+
+void pipe_writer_free(pipe_writer_t *writer) {
+  if (writer == NULL) return;
+  for (int i = 0; i < 2; ++i) {
+#if defined(PIPE_IO_SPLICE)
+    // The pages stay alive as long as the pipe references them
+    if (writer->buffers[i] != NULL)
+      munmap(writer->buffers[i], writer->chunk_size);
+#else
+    free(writer->buffers[i]);
+#endif
+  }
+  free(writer);
+}
+
+/**
+ * Returns a writer to fd with buffers of chunk_size bytes, a multiple of
+ * PIPE_IO_ALIGNMENT, or NULL if it cannot be allocated.
+ */
+pipe_writer_t *pipe_writer_init(int fd, size_t chunk_size) {
+  pipe_writer_t *writer = (pipe_writer_t *) calloc(1, sizeof (pipe_writer_t));
+  if (writer == NULL) return NULL;
+  writer->fd = fd;
+  writer->chunk_size = chunk_size;
+  for (int i = 0; i < 2; ++i) {
+#if defined(PIPE_IO_SPLICE)
+    void *buffer = mmap(NULL, chunk_size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) {
+#else
+    void *buffer = NULL;
+    if (posix_memalign(&buffer, PIPE_IO_ALIGNMENT, chunk_size) != 0) {
+#endif
+      pipe_writer_free(writer);
+      return NULL;
+    }
+    writer->buffers[i] = (uint8_t *) buffer;
+  }
+#if defined(PIPE_IO_SPLICE)
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+    // Growing the pipe past /proc/sys/fs/pipe-max-size may not be allowed,
+    // all that matters is that it holds at most a buffer
+    fcntl(fd, F_SETPIPE_SZ, (int) chunk_size);
+    int pipe_size = fcntl(fd, F_GETPIPE_SZ);
+    writer->splice = pipe_size > 0 && (size_t) pipe_size <= chunk_size;
+  }
+#endif
+  return writer;
+}
+
+/**
+ * Outputs size bytes of data, vmsplice'd if splice is set and the writer
+ * allows it. Returns 0 on success, -1 on error (see errno).
+ */
+int pipe_writer_output(pipe_writer_t *writer, const uint8_t *data,
+                       size_t size, int splice) {
+  while (size > 0) {
+    ssize_t written = -1;
+#if defined(PIPE_IO_SPLICE)
+    if (writer->splice && splice) {
+      struct iovec iov = { (void *) data, size };
+      written = vmsplice(writer->fd, &iov, 1, 0);
+      if (written < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        writer->splice = 0; // not for this file, written below
+      }
+    }
+#endif
+    if (!writer->splice || !splice) written = write(writer->fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    data += written;
+    size -= written;
+    writer->total += written;
+  }
+  return 0;
+}
+
+/**
+ * Returns where the next bytes are to be written, *size receiving how many
+ * can be.
+ */
+static inline uint8_t *pipe_writer_buffer(pipe_writer_t *writer,
+                                          size_t *size) {
+  *size = writer->chunk_size - writer->fill;
+  return writer->buffers[writer->current] + writer->fill;
+}
+
+/**
+ * Records that size bytes were written to the buffer returned by
+ * pipe_writer_buffer, and outputs it once full. Returns 0 on success, -1 on
+ * error.
+ */
+int pipe_writer_commit(pipe_writer_t *writer, size_t size) {
+  writer->fill += size;
+  if (writer->fill < writer->chunk_size) return 0;
+  int res = pipe_writer_output(writer, writer->buffers[writer->current],
+    writer->fill, 1);
+  writer->current ^= 1;
+  writer->fill = 0;
+  return res;
+}
+
+/**
+ * Outputs what is left in the buffer, copied by write so that the buffer
+ * can be filled again right away. Returns 0 on success, -1 on error.
+ */
+int pipe_writer_flush(pipe_writer_t *writer) {
+  int res = pipe_writer_output(writer, writer->buffers[writer->current],
+    writer->fill, 0);
+  writer->fill = 0;
+  return res;
+}
+
+#endif // __PIPE_IO_H__
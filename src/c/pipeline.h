@@ -0,0 +1,459 @@
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+/**
+ * Pipelined decompression of a gzip file to an output file (gziped
+ * --pipeline).
+ *
+ * Decoding, checking the CRC32 of the output and writing it run on three
+ * threads at the same time, so that the time taken approaches that of the
+ * slowest of them instead of their sum:
+ *
+ *   decoder --decoded--> crc --checked--> writer --free--> decoder
+ *
+ * The decoder fills chunks of PIPELINE_CHUNK_SIZE bytes with the fast loops of
+ * inflate_block, the window of the matches being the chunks decoded before,
+ * which are contiguous in memory. The chunks are passed from a stage to the
+ * next through single producer, single consumer queues. The writer gives the
+ * chunks back to the decoder once written. There are PIPELINE_CHUNKS chunks
+ * in all: when the writer falls behind, the decoder waits for one to be free,
+ * which bounds the memory used.
+ *
+ * A chunk ends where a member ends, with the CRC32 of its trailer for the crc
+ * stage to check, the decoder checking ISIZE. The last chunk is empty, and
+ * tells the next stages to stop.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "gziped.h"
+#include "members.h"
+
+#define PIPELINE_CHUNK_SIZE (256 * 1024)
+#define PIPELINE_CHUNKS 16 // a power of 2, the capacity of the queues
+// Number of times a stage polls an empty or full queue before yielding the CPU
+#define PIPELINE_SPIN 128
+
+typedef struct pipeline_chunk_s {
+  uint8_t *data;
+  size_t size;
+  uint64_t offset;        // the offset of data in the output
+  int member_end;         // 1 if the chunk ends a member
+  uint32_t crc32;         // the CRC32 of its trailer then
+  int last;               // 1 for the empty chunk after the others
+} pipeline_chunk_t;
+
+/**
+ * Lock free single producer, single consumer queue of chunks. head is only
+ * written by the consumer and tail by the producer, each on its own cache
+ * line so that they do not bounce between the cores of the two stages.
+ */
+typedef struct spsc_queue_s {
+  pipeline_chunk_t *slots[PIPELINE_CHUNKS];
+  uint8_t pad0[64];
+  size_t head;  // the next slot to pop
+  uint8_t pad1[64 - sizeof (size_t)];
+  size_t tail;  // the next slot to push
+  uint8_t pad2[64 - sizeof (size_t)];
+} spsc_queue_t;
+
+static inline void spsc_wait(unsigned *spins) {
+  if (++*spins < PIPELINE_SPIN) return;
+  *spins = 0;
+  sched_yield();
+}
+
+/**
+ * Pushes chunk, waiting for room if the queue is full.
+ */
+void spsc_push(spsc_queue_t *queue, pipeline_chunk_t *chunk) {
+  size_t tail = queue->tail;
+  unsigned spins = 0;
+  while (tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) ==
+         PIPELINE_CHUNKS) {
+    spsc_wait(&spins);
+  }
+  queue->slots[tail & (PIPELINE_CHUNKS - 1)] = chunk;
+  __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Pops the oldest chunk, waiting for one if the queue is empty.
+ */
+pipeline_chunk_t *spsc_pop(spsc_queue_t *queue) {
+  size_t head = queue->head;
+  unsigned spins = 0;
+  while (__atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == head) {
+    spsc_wait(&spins);
+  }
+  pipeline_chunk_t *chunk = queue->slots[head & (PIPELINE_CHUNKS - 1)];
+  __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+  return chunk;
+}
+
+typedef struct pipeline_s {
+  spsc_queue_t decoded;   // decoder to crc
+  spsc_queue_t checked;   // crc to writer
+  spsc_queue_t free;      // writer to decoder
+  pipeline_chunk_t chunks[PIPELINE_CHUNKS];
+  int fd;                 // the output file, -1 to only check the data
+  int failed;             // set by any stage on error, for the others to stop
+  int crc_error;          // INFLATE_CHECK_FAILED, set by the crc stage
+  int write_error;        // the errno of the failed write
+  double seconds[3];      // the time spent working by each stage
+} pipeline_t;
+
+// Stages, for the seconds of pipeline_t and pipeline_result_t
+#define PIPELINE_DECODE 0
+#define PIPELINE_CRC    1
+#define PIPELINE_WRITE  2
+
+typedef struct pipeline_result_s {
+  uint64_t produced;      // the size of the output
+  double seconds[3];      // the time spent working by each stage
+} pipeline_result_t;
+
+static inline double pipeline_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void *pipeline_crc_stage(void *arg) {
+  pipeline_t *pipeline = (pipeline_t *) arg;
+  uint32_t crc = 0;
+  for (;;) {
+    pipeline_chunk_t *chunk = spsc_pop(&pipeline->decoded);
+    if (chunk->last) {
+      spsc_push(&pipeline->checked, chunk);
+      break;
+    }
+    double start = pipeline_now();
+    crc = crc32_update(crc, chunk->data, chunk->size);
+    if (chunk->member_end) {
+      if (crc != chunk->crc32) {
+        pipeline->crc_error = INFLATE_CHECK_FAILED;
+        __atomic_store_n(&pipeline->failed, 1, __ATOMIC_RELAXED);
+      }
+      crc = 0;
+    }
+    pipeline->seconds[PIPELINE_CRC] += pipeline_now() - start;
+    spsc_push(&pipeline->checked, chunk);
+  }
+  return NULL;
+}
+
+void *pipeline_write_stage(void *arg) {
+  pipeline_t *pipeline = (pipeline_t *) arg;
+  for (;;) {
+    pipeline_chunk_t *chunk = spsc_pop(&pipeline->checked);
+    if (chunk->last) break;
+    double start = pipeline_now();
+    size_t written = 0;
+    while (pipeline->fd >= 0 && pipeline->write_error == 0 &&
+           written < chunk->size) {
+      ssize_t len = pwrite(pipeline->fd, chunk->data + written,
+        chunk->size - written, chunk->offset + written);
+      if (len < 0 && errno == EINTR) continue;
+      if (len <= 0) {
+        pipeline->write_error = len < 0 ? errno : EIO;
+        __atomic_store_n(&pipeline->failed, 1, __ATOMIC_RELAXED);
+        break;
+      }
+      written += len;
+    }
+    pipeline->seconds[PIPELINE_WRITE] += pipeline_now() - start;
+    // Given back even on error, not to leave the decoder waiting
+    spsc_push(&pipeline->free, chunk);
+  }
+  return NULL;
+}
+
+// Room before the first chunk for the window of the output wrapping around
+// from the last chunk to the first one
+#define PIPELINE_WINDOW DEFLATE_WINDOW_SIZE
+// Room after the last chunk for the output going past it. After
+// pipeline_advance, there is at least that much room left for the output,
+// which is more than a stored block, or than the tail of a block decoded
+// from the last INFLATE_FAST_MIN_INPUT bytes of input and the bit buffer:
+// at most 258 bytes for every 2 bits.
+#define PIPELINE_OVERFLOW (64 * 1024)
+
+/**
+ * State of the decode stage. The chunks are contiguous in memory and, all the
+ * queues being FIFO, taken back from the free queue in the order of their
+ * memory, which only wraps around from the last chunk to the first. The
+ * decoder holds the chunk it fills and the next one, so that the output of
+ * the fast loops of inflate_block can go past the end of the first, and
+ * matches can reach into the chunks before.
+ */
+typedef struct pipeline_decoder_s {
+  pipeline_t *pipeline;
+  pipeline_chunk_t *chunk; // the chunk being filled
+  pipeline_chunk_t *next;  // the chunk after it
+  uint8_t *output;         // the next byte of the output, possibly past chunk
+  uint8_t *begin;          // the first byte of the member matches may reach
+  double waiting;          // the time spent waiting for free chunks
+} pipeline_decoder_t;
+
+/**
+ * Takes a free chunk, waiting for the writer to give one back if needed.
+ */
+static pipeline_chunk_t *pipeline_take(pipeline_decoder_t *decoder) {
+  double start = pipeline_now();
+  pipeline_chunk_t *chunk = spsc_pop(&decoder->pipeline->free);
+  decoder->waiting += pipeline_now() - start;
+  chunk->size = 0;
+  chunk->member_end = 0;
+  chunk->last = 0;
+  return chunk;
+}
+
+/**
+ * Returns the end of the room the output can be written to: the end of the
+ * next chunk, or of the room after the last one.
+ */
+static inline uint8_t *pipeline_limit(const pipeline_decoder_t *decoder) {
+  uint8_t *end = decoder->chunk->data + PIPELINE_CHUNK_SIZE;
+  return decoder->next->data == end ? end + PIPELINE_CHUNK_SIZE :
+    end + PIPELINE_OVERFLOW;
+}
+
+/**
+ * Passes the chunks the output filled to the crc stage. The output past the
+ * last chunk is moved to the first one, and the window before it to the room
+ * before the first one, where the decoding goes on.
+ */
+static void pipeline_advance(pipeline_decoder_t *decoder) {
+  while (decoder->output >= decoder->chunk->data + PIPELINE_CHUNK_SIZE) {
+    pipeline_chunk_t *chunk = decoder->chunk;
+    uint8_t *end = chunk->data + PIPELINE_CHUNK_SIZE;
+    chunk->size = PIPELINE_CHUNK_SIZE;
+    decoder->chunk = decoder->next;
+    decoder->chunk->offset = chunk->offset + PIPELINE_CHUNK_SIZE;
+    if (decoder->chunk->data != end) {
+      size_t window = end - decoder->begin;
+      if (window > PIPELINE_WINDOW) window = PIPELINE_WINDOW;
+      memcpy(decoder->chunk->data - window, end - window, window);
+      memcpy(decoder->chunk->data, end, decoder->output - end);
+      decoder->output = decoder->chunk->data + (decoder->output - end);
+      decoder->begin = decoder->chunk->data - window;
+    }
+    spsc_push(&decoder->pipeline->decoded, chunk);
+    decoder->next = pipeline_take(decoder);
+  }
+}
+
+/**
+ * Ends the chunk being filled with the end of a member, and starts the next
+ * member in the next chunk.
+ */
+static void pipeline_member_end(pipeline_decoder_t *decoder, uint32_t crc32) {
+  pipeline_chunk_t *chunk = decoder->chunk;
+  chunk->size = decoder->output - chunk->data;
+  chunk->member_end = 1;
+  chunk->crc32 = crc32;
+  decoder->chunk = decoder->next;
+  decoder->chunk->offset = chunk->offset + chunk->size;
+  decoder->output = decoder->chunk->data;
+  decoder->begin = decoder->chunk->data;
+  spsc_push(&decoder->pipeline->decoded, chunk);
+  decoder->next = pipeline_take(decoder);
+}
+
+/**
+ * Decodes the symbols of a huffman block into the chunks, see inflate_block.
+ * The fast loop runs up to the limit of the output, and goes on once the
+ * chunks filled are passed on. The careful one is only needed at the end of
+ * the input, whose output fits in the room always left.
+ */
+static int pipeline_block(pipeline_decoder_t *decoder, bitreader_t *br,
+                          const huffman_entry_t *littable,
+                          const huffman_entry_t *disttable) {
+  for (;;) {
+    int res;
+    if (littable == fixed_litlen_table) {
+      res = inflate_fixed_block_fast(br, decoder->begin, &decoder->output,
+        pipeline_limit(decoder));
+    } else {
+      res = inflate_block_fast(br, littable, disttable, decoder->begin,
+        &decoder->output, pipeline_limit(decoder));
+    }
+    pipeline_advance(decoder);
+    if (res != INFLATE_BLOCK_TAIL) return res;
+    if (br->end - br->ptr < INFLATE_FAST_MIN_INPUT) {
+      res = inflate_block_tail(br, littable, disttable, decoder->begin,
+        &decoder->output, pipeline_limit(decoder));
+      pipeline_advance(decoder);
+      return res;
+    }
+  }
+}
+
+/**
+ * The decode stage: decodes the members of the gzip file in buf into the
+ * chunks. Returns INFLATE_OK once all the members are decoded, or when
+ * another stage failed, or an inflate error.
+ */
+static int pipeline_decode(pipeline_decoder_t *decoder, const uint8_t *buf,
+                           size_t size) {
+  huffman_entry_t littable[LITLEN_TABLE_SIZE];
+  huffman_entry_t disttable[DISTANCE_TABLE_SIZE];
+  size_t pos = 0;
+  for (;;) {
+    size_t header_size = member_header_size(buf + pos, size - pos);
+    if (header_size == 0) return INFLATE_INVALID_DATA;
+    bitreader_t br;
+    bitreader_init(&br, buf + pos + header_size, size - pos - header_size);
+    uint64_t member_offset = decoder->chunk->offset;
+    uint8_t bfinal = 0;
+    do {
+      if (__atomic_load_n(&decoder->pipeline->failed, __ATOMIC_RELAXED))
+        return INFLATE_OK;
+      bfinal = bitreader_read(&br, 1);
+      uint8_t btype = bitreader_read(&br, 2);
+      int res = INFLATE_OK;
+      switch (btype) {
+        case DEFLATE_LITERAL_BLOCK_TYPE: {
+          // https://tools.ietf.org/html/rfc1951#page-11
+          bitreader_align(&br);
+          if (br.end - br.ptr < 4) return INFLATE_TRUNCATED;
+          uint16_t len = br.ptr[0] | br.ptr[1] << 8;
+          uint16_t nlen = br.ptr[2] | br.ptr[3] << 8;
+          if (len != (uint16_t) ~nlen) return INFLATE_INVALID_DATA;
+          br.ptr += 4;
+          if (br.end - br.ptr < len) return INFLATE_TRUNCATED;
+          // Fits in the PIPELINE_OVERFLOW bytes of room at least
+          memcpy(decoder->output, br.ptr, len);
+          br.ptr += len;
+          decoder->output += len;
+          pipeline_advance(decoder);
+          break;
+        }
+        case DEFLATE_FIX_HUF_BLOCK_TYPE:
+          res = pipeline_block(decoder, &br, fixed_litlen_table,
+            fixed_distance_table);
+          break;
+        case DEFLATE_DYN_HUF_BLOCK_TYPE:
+          res = parse_dynamic_tree(&br, littable, disttable);
+          if (res == INFLATE_OK)
+            res = pipeline_block(decoder, &br, littable, disttable);
+          break;
+        default:
+          res = INFLATE_INVALID_DATA;
+      }
+      // Reading past the end of the input yields zeros, which might be what
+      // made the data look invalid, or overflow the output.
+      if (bitreader_overrun(&br)) return INFLATE_TRUNCATED;
+      if (res == INFLATE_OUTPUT_FULL) return INFLATE_INVALID_DATA;
+      if (res != INFLATE_OK) return res;
+    } while (!bfinal);
+
+    // https://tools.ietf.org/html/rfc1952#page-5
+    size_t footer = pos + header_size + (bitreader_position(&br) + 7) / 8;
+    if (size - footer < 8) return INFLATE_TRUNCATED;
+    uint64_t produced = decoder->chunk->offset +
+      (decoder->output - decoder->chunk->data) - member_offset;
+    // ISIZE is the size of the original input modulo 2^32
+    if (read_le32(buf + footer + 4) != (uint32_t) produced)
+      return INFLATE_CHECK_FAILED;
+    pipeline_member_end(decoder, read_le32(buf + footer));
+    // The next member starts right after the trailer of the previous one
+    pos = footer + 8;
+    if (pos == size) return INFLATE_OK;
+    if (buf[pos] != 0x1F) {
+      if (!is_zero_padding(buf + pos, size - pos))
+        fprintf(stderr, "warning: trailing garbage ignored\n");
+      return INFLATE_OK;
+    }
+  }
+}
+
+/**
+ * Decompresses the gzip file in buf to fd, or only checks it if fd is -1,
+ * with the three stages of the pipeline. Returns INFLATE_OK on success,
+ * INFLATE_OUTPUT_FULL if the output could not be written (see errno), or
+ * another inflate error.
+ */
+int inflate_pipelined(const uint8_t *buf, size_t size, int fd,
+                      pipeline_result_t *result) {
+  pipeline_t *pipeline = (pipeline_t *) calloc(1, sizeof (pipeline_t));
+  uint8_t *data = (uint8_t *) malloc(PIPELINE_WINDOW +
+    PIPELINE_CHUNKS * PIPELINE_CHUNK_SIZE + PIPELINE_OVERFLOW);
+  if (pipeline == NULL || data == NULL) {
+    free(pipeline);
+    free(data);
+    return INFLATE_OUTPUT_FULL;
+  }
+  pipeline->fd = fd;
+  for (int i = 0; i < PIPELINE_CHUNKS; ++i) {
+    pipeline->chunks[i].data = data + PIPELINE_WINDOW + i * PIPELINE_CHUNK_SIZE;
+    spsc_push(&pipeline->free, &pipeline->chunks[i]);
+  }
+  pthread_t crc_thread;
+  pthread_t write_thread;
+  int started = 0;
+  if (pthread_create(&crc_thread, NULL, pipeline_crc_stage, pipeline) == 0) {
+    started = 1;
+    if (pthread_create(&write_thread, NULL, pipeline_write_stage,
+        pipeline) == 0) started = 2;
+  }
+
+  int res = INFLATE_OK;
+  uint64_t produced = 0;
+  if (started == 2) {
+    pipeline_decoder_t decoder = { pipeline, NULL, NULL, NULL, NULL, 0 };
+    double start = pipeline_now();
+    decoder.chunk = pipeline_take(&decoder);
+    decoder.chunk->offset = 0;
+    decoder.next = pipeline_take(&decoder);
+    decoder.output = decoder.chunk->data;
+    decoder.begin = decoder.chunk->data;
+    res = pipeline_decode(&decoder, buf, size);
+    produced = decoder.chunk->offset +
+      (decoder.output - decoder.chunk->data);
+    // The output left in the chunk, before an error, is not written
+    decoder.chunk->size = 0;
+    decoder.chunk->last = 1;
+    spsc_push(&pipeline->decoded, decoder.chunk);
+    pipeline->seconds[PIPELINE_DECODE] = pipeline_now() - start -
+      decoder.waiting;
+  }
+  if (started >= 1) {
+    if (started == 1) {
+      pipeline_chunk_t last = { NULL, 0, 0, 0, 0, 1 };
+      spsc_push(&pipeline->decoded, &last);
+      pthread_join(crc_thread, NULL);
+    } else {
+      pthread_join(crc_thread, NULL);
+      pthread_join(write_thread, NULL);
+    }
+  }
+
+  int error = INFLATE_OK;
+  if (started < 2) {
+    error = INFLATE_OUTPUT_FULL;
+    errno = EAGAIN;
+  } else if (pipeline->write_error != 0) {
+    error = INFLATE_OUTPUT_FULL;
+    errno = pipeline->write_error;
+  } else if (res != INFLATE_OK) {
+    error = res;
+  } else if (pipeline->crc_error != 0) {
+    error = pipeline->crc_error;
+  }
+  result->produced = produced;
+  memcpy(result->seconds, pipeline->seconds, sizeof (result->seconds));
+  free(data);
+  free(pipeline);
+  return error;
+}
+
+#endif // __PIPELINE_H__
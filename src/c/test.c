@@ -1,6 +1,24 @@
+// For vmsplice (see pipe_io.h)
+#define _GNU_SOURCE
+
 #include "gziped.h"
+#include "crc32.h"
+#include "inflate_stream.h"
+#include "members.h"
+#include "parallel_inflate.h"
+#include "index.h"
+#include "deflate.h"
+#include "gzi.h"
+#include "bgzf.h"
+#include "match_copy.h"
+#include "pipe_io.h"
+#include "input.h"
+#include "pipeline.h"
+#include "uring.h"
 #include "debug.h"
 
+#include <sys/resource.h>
+
 #define FAIL() { \
   ++totalres; \
   fprintf(stderr, "%s failed at %s(%i)\n", __func__, __FILE__, __LINE__); \
@@ -10,7 +28,7 @@ uint8_t test_count_by_code_length() {
   uint8_t totalres = 0;
 
   uint8_t code_lengths[8] = { 3, 3, 3, 3, 3, 2, 4, 4 };
-  uint8_t bit_counts[32];
+  uint16_t bit_counts[32];
   count_by_code_length(code_lengths, 8, bit_counts);
   if (bit_counts[1] != 0 || bit_counts[2] != 1 ||
     bit_counts[3] != 5 || bit_counts[4] != 2 || bit_counts[5] != 0) FAIL();
@@ -21,8 +39,8 @@ uint8_t test_count_by_code_length() {
 uint8_t test_generate_next_codes() {
   uint8_t totalres = 0;
 
-  uint8_t bit_counts[32];
-  memset(bit_counts, 0, 32);
+  uint16_t bit_counts[32];
+  memset(bit_counts, 0, 32 * sizeof (uint16_t));
   bit_counts[2] = 1; bit_counts[3] = 5; bit_counts[4] = 2;
   uint32_t next_codes[32];
   memset(next_codes, 0, 32 * sizeof (uint32_t));
@@ -47,27 +65,87 @@ uint8_t test_tobin() {
   return totalres;
 }
 
-uint8_t test_generate_dict() {
+// Decodes a huffman code given as a string (first bit first) with a decode
+// table and checks that exactly the bits of the code were consumed.
+uint16_t lookup(const huffman_entry_t *table, uint8_t table_bits,
+                const char *code) {
+  uint8_t buffer[4] = { 0, 0, 0, 0 };
+  uint8_t length = strlen(code);
+  for (uint8_t i = 0; i < length; ++i) {
+    if (code[i] == '1') buffer[i >> 3] |= 1 << (i & 7);
+  }
+  bitreader_t br;
+  bitreader_init(&br, buffer, 4);
+  uint16_t value = decode_symbol(&br, table, table_bits);
+  if (bitreader_position(&br) != length) return NO_VALUE - 1;
+  return value;
+}
+
+uint8_t test_build_decode_table() {
   uint8_t totalres = 0;
 
   uint8_t code_lengths[8] = { 3, 3, 3, 3, 3, 2, 4, 4 };
-  uint32_t next_codes[32];
-  bzero(next_codes, 32 * sizeof (uint32_t));
-  next_codes[3] = 2; next_codes[4] = 14;
+  huffman_entry_t table[16];
+
+  if (build_decode_table(code_lengths, 8, 4, table, 16) != 0) FAIL();
+
+  if (lookup(table, 4, "00") != 5) FAIL();   // F
+  if (lookup(table, 4, "010") != 0) FAIL();  // A
+  if (lookup(table, 4, "011") != 1) FAIL();  // B
+  if (lookup(table, 4, "100") != 2) FAIL();  // C
+  if (lookup(table, 4, "101") != 3) FAIL();  // D
+  if (lookup(table, 4, "110") != 4) FAIL();  // E
+  if (lookup(table, 4, "1110") != 6) FAIL(); // G
+  if (lookup(table, 4, "1111") != 7) FAIL(); // H
+
+  // Same code with a 2 bits primary table: 010, 011, 100, 101, 110 are in
+  // 1 bit sub-tables and 1110, 1111 in a 2 bits one.
+  huffman_entry_t small_table[16];
+  if (build_decode_table(code_lengths, 8, 2, small_table, 16) != 0) FAIL();
+  if (!(small_table[0b10] & HUFFMAN_ENTRY_SUBTABLE)) FAIL();
+  if (HUFFMAN_ENTRY_SUB_BITS(small_table[0b11]) != 2) FAIL();
+  if (lookup(small_table, 2, "00") != 5) FAIL();
+  if (lookup(small_table, 2, "011") != 1) FAIL();
+  if (lookup(small_table, 2, "110") != 4) FAIL();
+  if (lookup(small_table, 2, "1110") != 6) FAIL();
+  if (lookup(small_table, 2, "1111") != 7) FAIL();
+  // Not enough room for the sub-tables
+  if (build_decode_table(code_lengths, 8, 2, small_table, 8) != -1) FAIL();
+
+  // Over-subscribed and incomplete codes
+  uint8_t oversubscribed[3] = { 1, 1, 1 };
+  if (build_decode_table(oversubscribed, 3, 4, table, 16) != -1) FAIL();
+  uint8_t incomplete[3] = { 1, 2, 0 };
+  if (build_decode_table(incomplete, 3, 4, table, 16) != -1) FAIL();
+  // except when made of a single code
+  uint8_t single[3] = { 0, 1, 0 };
+  if (build_decode_table(single, 3, 4, table, 16) != 0) FAIL();
+  if (lookup(table, 4, "0") != 1) FAIL();
+  if (lookup(table, 4, "1") != NO_VALUE) FAIL();
 
-  uint16_t dict[32];
-  memset(dict, -1, 32 * sizeof (uint16_t));
+  return totalres;
+}
 
-  generate_dict(code_lengths, 8, next_codes, dict, 32);
+uint8_t test_long_codes() {
+  uint8_t totalres = 0;
 
-  if (dict[3]  != 5) FAIL(); // F: "00"
-  if (dict[9]  != 0) FAIL(); // A: "010"
-  if (dict[10] != 1) FAIL(); // B: "011"
-  if (dict[11] != 2) FAIL(); // C: "100"
-  if (dict[12] != 3) FAIL(); // D: "101"
-  if (dict[13] != 4) FAIL(); // E: "110"
-  if (dict[29] != 6) FAIL(); // G: "1110"
-  if (dict[30] != 7) FAIL(); // H: "1111"
+  // Symbol i is encoded with i ones followed by a zero, the two last ones on
+  // the maximum length of 15 bits.
+  uint8_t code_lengths[16] = {
+    1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 15
+  };
+  huffman_entry_t table[LITLEN_TABLE_SIZE];
+  if (build_decode_table(code_lengths, 16, LITLEN_TABLE_BITS, table,
+      LITLEN_TABLE_SIZE) != 0) FAIL();
+
+  char code[16];
+  for (uint8_t i = 0; i < 15; ++i) {
+    memset(code, '1', i);
+    code[i] = '0';
+    code[i + 1] = 0;
+    if (lookup(table, LITLEN_TABLE_BITS, code) != i) FAIL();
+  }
+  if (lookup(table, LITLEN_TABLE_BITS, "111111111111111") != 15) FAIL();
 
   return totalres;
 }
@@ -75,7 +153,7 @@ uint8_t test_generate_dict() {
 uint8_t test_static_dict() {
   uint8_t totalres = 0;
 
-  uint8_t bit_counts[32];
+  uint16_t bit_counts[32];
   count_by_code_length(static_huffman_params.code_lengths,
     DEFLATE_ALPHABET_SIZE, bit_counts);
 
@@ -87,26 +165,19 @@ uint8_t test_static_dict() {
     if (next_codes[i] != static_huffman_params.next_codes[i]) FAIL()
   }
 
-  uint16_t static_dict[1024];
-  memset(static_dict, -1, 1024 * sizeof (uint16_t));
-  generate_dict(static_huffman_params.code_lengths, DEFLATE_ALPHABET_SIZE,
-    static_huffman_params.next_codes, static_dict, 1024);
+  huffman_entry_t static_table[LITLEN_TABLE_SIZE];
+  if (build_decode_table(static_huffman_params.code_lengths,
+      DEFLATE_ALPHABET_SIZE, LITLEN_TABLE_BITS, static_table,
+      LITLEN_TABLE_SIZE) != 0) FAIL();
 
-  // Python to generate index in binary heap based on huffman code
-  // def c(a):
-  //   res = 0
-  //   for y in a:
-  //     res <<= 1
-  //     res += 1 if int(y) == 0 else 2
-  //   return str(res)
-  if (static_dict[303] != 0) FAIL();   // 0:   "00110000"
-  if (static_dict[446] != 143) FAIL(); // 143: "10111111"
-  if (static_dict[911] != 144) FAIL(); // 144: "110010000"
-  if (static_dict[1022] != 255) FAIL(); // 255: "111111111"
-  if (static_dict[127] != 256) FAIL(); // 256: "0000000"
-  if (static_dict[150] != 279) FAIL(); // 279: "0010111"
-  if (static_dict[447] != 280) FAIL(); // 280: "11000000"
-  if (static_dict[454] != 287) FAIL(); // 287: "11000111"
+  if (lookup(static_table, LITLEN_TABLE_BITS, "00110000") != 0) FAIL();
+  if (lookup(static_table, LITLEN_TABLE_BITS, "10111111") != 143) FAIL();
+  if (lookup(static_table, LITLEN_TABLE_BITS, "110010000") != 144) FAIL();
+  if (lookup(static_table, LITLEN_TABLE_BITS, "111111111") != 255) FAIL();
+  if (lookup(static_table, LITLEN_TABLE_BITS, "0000000") != 256) FAIL();
+  if (lookup(static_table, LITLEN_TABLE_BITS, "0010111") != 279) FAIL();
+  if (lookup(static_table, LITLEN_TABLE_BITS, "11000000") != 280) FAIL();
+  if (lookup(static_table, LITLEN_TABLE_BITS, "11000111") != 287) FAIL();
 
   return totalres;
 }
@@ -119,177 +190,1390 @@ uint8_t test_code_length_dict() {
   uint8_t code_lengths[19] = {
     3, 0, 0, 0, 4, 4, 3, 2, 3, 3, 4, 5, 0, 0, 0, 0, 6, 7, 7
   };
-  uint8_t length_counts[32];
-  bzero(length_counts, 32);
-  count_by_code_length(code_lengths, 19, length_counts);
+  huffman_entry_t code_length_table[CODE_LENGTH_TABLE_SIZE];
+  if (build_decode_table(code_lengths, 19, CODE_LENGTH_TABLE_BITS,
+      code_length_table, CODE_LENGTH_TABLE_SIZE) != 0) FAIL();
+
+  if (lookup(code_length_table, CODE_LENGTH_TABLE_BITS, "010") != 0) FAIL();
+  if (lookup(code_length_table, CODE_LENGTH_TABLE_BITS, "1100") != 4) FAIL();
+  if (lookup(code_length_table, CODE_LENGTH_TABLE_BITS, "1101") != 5) FAIL();
+  if (lookup(code_length_table, CODE_LENGTH_TABLE_BITS, "011") != 6) FAIL();
+  if (lookup(code_length_table, CODE_LENGTH_TABLE_BITS, "00") != 7) FAIL();
+  if (lookup(code_length_table, CODE_LENGTH_TABLE_BITS, "100") != 8) FAIL();
+  if (lookup(code_length_table, CODE_LENGTH_TABLE_BITS, "101") != 9) FAIL();
+  if (lookup(code_length_table, CODE_LENGTH_TABLE_BITS, "1110") != 10) FAIL();
+  if (lookup(code_length_table, CODE_LENGTH_TABLE_BITS, "11110") != 11) FAIL();
+  if (lookup(code_length_table, CODE_LENGTH_TABLE_BITS, "111110") != 16) FAIL();
+  if (lookup(code_length_table, CODE_LENGTH_TABLE_BITS, "1111110") != 17) FAIL();
+  if (lookup(code_length_table, CODE_LENGTH_TABLE_BITS, "1111111") != 18) FAIL();
 
-  uint32_t next_codes[32];
-  bzero(next_codes, 32 * sizeof (uint32_t));
-  generate_next_codes(length_counts, next_codes);
+  return totalres;
+}
+
+uint8_t test_bitreader() {
+  uint8_t totalres = 0;
+
+  // buffer: 11101010 11000011 10100010
+  // order:  76543210    ...98
+  uint8_t buffer[3] = { 234, 195, 162 };
+  bitreader_t br;
+  bitreader_init(&br, buffer, 3);
+
+  if (bitreader_read(&br, 4) != 0b1010) FAIL();
+  if (bitreader_read(&br, 8) != 0b00111110) FAIL();
+  if (bitreader_read(&br, 2) != 0b00) FAIL();
+  if (bitreader_read(&br, 2) != 0b11) FAIL();
+  if (bitreader_peek(&br, 4) != 0b0010) FAIL();
+  if (bitreader_read(&br, 4) != 0b0010) FAIL();
+  if (bitreader_read(&br, 1) != 0b0) FAIL();
+  if (bitreader_read(&br, 3) != 0b101) FAIL();
+  if (bitreader_position(&br) != 24) FAIL();
+  if (bitreader_overrun(&br)) FAIL();
+  // Past the end of the input we read zeros
+  if (bitreader_read(&br, 1) != 0) FAIL();
+  if (!bitreader_overrun(&br)) FAIL();
+
+  // Wide reads go through the 8 bytes refill
+  uint8_t wide[16] = {
+    0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef,
+    0x10, 0x32, 0x54, 0x76, 0x98, 0xba, 0xdc, 0xfe
+  };
+  bitreader_init(&br, wide, 16);
+  if (bitreader_read(&br, 4) != 0x1) FAIL();
+  if (bitreader_read(&br, 13) != 0x1230) FAIL();
+  if (bitreader_read(&br, 31) != 0x55c4b3a2) FAIL();
+  if (bitreader_read(&br, 10) != 0x3cd) FAIL();
+  // Stored blocks restart on the next byte
+  bitreader_align(&br);
+  if (br.ptr != wide + 8 || br.bitcount != 0) FAIL();
+  if (bitreader_read(&br, 8) != 0x10) FAIL();
+  if (bitreader_read(&br, 32) != 0x98765432) FAIL();
 
-  uint16_t code_length_dict[256];
-  memset(code_length_dict, -1, 256 * sizeof (uint16_t));
-  generate_dict(code_lengths, 19, next_codes, code_length_dict, 256);
+  return totalres;
+}
 
-  // 010: 0
-  // 1100: 4
-  // 1101: 5
-  // 011: 6
-  // 00: 7
-  // 100: 8
-  // 101: 9
-  // 1110: 10
-  // 11110: 11
-  // 111110: 16
-  // 1111110: 17
-  // 1111111: 18
+uint8_t test_distance_static_dictionary() {
+  uint8_t totalres = 0;
 
-  if (code_length_dict[9] != 0) FAIL();
-  if (code_length_dict[27] != 4) FAIL();
-  if (code_length_dict[28] != 5) FAIL();
-  if (code_length_dict[10] != 6) FAIL();
-  if (code_length_dict[3] != 7) FAIL();
-  if (code_length_dict[11] != 8) FAIL();
-  if (code_length_dict[12] != 9) FAIL();
-  if (code_length_dict[29] != 10) FAIL();
-  if (code_length_dict[61] != 11) FAIL();
-  if (code_length_dict[125] != 16) FAIL();
-  if (code_length_dict[253] != 17) FAIL();
-  if (code_length_dict[254] != 18) FAIL();
+  huffman_entry_t distance_static_table[DISTANCE_TABLE_SIZE];
+  if (build_decode_table(static_huffman_params_distance_code_lengths,
+      DEFLATE_STATIC_DISTANCE_CODE_LENGTHS_SIZE, DISTANCE_TABLE_BITS,
+      distance_static_table, DISTANCE_TABLE_SIZE) != 0) FAIL();
+
+  if (lookup(distance_static_table, DISTANCE_TABLE_BITS, "00000") != 0) FAIL();
+  if (lookup(distance_static_table, DISTANCE_TABLE_BITS, "00001") != 1) FAIL();
+  if (lookup(distance_static_table, DISTANCE_TABLE_BITS, "00010") != 2) FAIL();
+  if (lookup(distance_static_table, DISTANCE_TABLE_BITS, "01010") != 10) FAIL();
+  if (lookup(distance_static_table, DISTANCE_TABLE_BITS, "01101") != 13) FAIL();
+  if (lookup(distance_static_table, DISTANCE_TABLE_BITS, "11111") != 31) FAIL();
 
   return totalres;
 }
 
-uint8_t test_READ_INV() {
+uint8_t test_decode() {
   uint8_t totalres = 0;
 
-  // buffer: 11101010 11000011 10100010
-  // order:  76543210    ...98
-  uint8_t buffer[3] = { 234, 195, 162 };
-  uint8_t *ptr = buffer;
-  uint8_t mask = 1;
+  // 5: 00, 42: 01, 7: 100, 66: 101, 88: 110, DEFLATE_END_BLOCK_VALUE: 111
+  uint8_t code_lengths[DEFLATE_END_BLOCK_VALUE + 1];
+  memset(code_lengths, 0, sizeof (code_lengths));
+  code_lengths[5] = 2; code_lengths[42] = 2; code_lengths[7] = 3;
+  code_lengths[66] = 3; code_lengths[88] = 3;
+  code_lengths[DEFLATE_END_BLOCK_VALUE] = 3;
+  huffman_entry_t table[LITLEN_TABLE_SIZE];
+  if (build_decode_table(code_lengths, DEFLATE_END_BLOCK_VALUE + 1,
+      LITLEN_TABLE_BITS, table, LITLEN_TABLE_SIZE) != 0) FAIL();
+
+  // 01 101 100 100 110 110 101 00 00 00 01 111
+  // order:  76543210 ...
+  // buffer: 00110110 11011001 00001010 01111000
+  uint8_t input[4] = { 54, 217, 10, 120 };
+  bitreader_t br;
+  bitreader_init(&br, input, 4);
+  uint16_t expected[12] = {
+    42, 66, 7, 7, 88, 88, 66, 5, 5, 5, 42, DEFLATE_END_BLOCK_VALUE
+  };
+  for (int i = 0; i < 12; ++i) {
+    if (decode_symbol(&br, table, LITLEN_TABLE_BITS) != expected[i]) FAIL();
+  }
+  if (bitreader_position(&br) != 31) FAIL();
+  if (bitreader_overrun(&br)) FAIL();
 
-  uint8_t dest = 255;
+  return totalres;
+}
 
-  READ_INV(dest, mask, ptr, 4);
-  if (dest != 0b0101) FAIL();
+uint8_t test_crc32() {
+  uint8_t totalres = 0;
 
-  READ_INV(dest, mask, ptr, 4);
-  if (dest != 0b0111) FAIL();
+  const uint8_t *check = (const uint8_t *) "123456789";
+  if (crc32_update(0, check, 9) != 0xcbf43926) FAIL();
+  if (crc32_update(0, check, 0) != 0) FAIL();
+  // Incremental updates give the same result
+  if (crc32_update(crc32_update(0, check, 4), check + 4, 5) != 0xcbf43926)
+    FAIL();
+
+  // The sliced versions match the byte-at-a-time one, whatever the length and
+  // the alignment.
+  uint8_t buffer[1024];
+  for (int i = 0; i < 1024; ++i) buffer[i] = (i * 2654435761u) >> 13;
+  for (size_t offset = 0; offset < 8; ++offset) {
+    for (size_t len = 0; len < 200; len += 7) {
+      uint32_t expected = crc32_bytewise(0xffffffff, buffer + offset, len);
+      if (crc32_slice8(0xffffffff, buffer + offset, len) != expected) FAIL();
+      if (crc32_slice16(0xffffffff, buffer + offset, len) != expected) FAIL();
+    }
+  }
+#ifdef CRC32_HAS_FOLDING
+  if (crc32_has_pclmul()) {
+    for (size_t offset = 0; offset < 16; offset += 3) {
+      for (size_t len = 64; len <= 1000; len += 16) {
+        uint32_t expected = crc32_slice16(0x12345678, buffer + offset, len);
+        if (crc32_fold_pclmul(0x12345678, buffer + offset, len) != expected)
+          FAIL();
+      }
+    }
+  }
+#endif
+  for (size_t len = 0; len < 1024; len += 97) {
+    uint32_t expected = ~crc32_bytewise(0xffffffff, buffer, len);
+    if (crc32_update(0, buffer, len) != expected) FAIL();
+  }
 
-  READ_INV(dest, mask, ptr, 2);
-  if (dest != 0b11) FAIL();
+  // Combining the CRCs of two chunks gives the CRC of the whole
+  uint32_t whole = crc32_update(0, buffer, 1024);
+  for (size_t split = 0; split <= 1024; split += 101) {
+    uint32_t a = crc32_update(0, buffer, split);
+    uint32_t b = crc32_update(0, buffer + split, 1024 - split);
+    if (crc32_combine(a, b, 1024 - split) != whole) FAIL();
+  }
 
-  READ_INV(dest, mask, ptr, 4);
-  if (dest != 0b0000) FAIL();
+  return totalres;
+}
 
-  READ_INV(dest, mask, ptr, 2);
-  if (dest != 0b11) FAIL();
+// A gzip member with a dynamic block, the compressed version of lorem_ipsum
+const char *lorem_ipsum =
+  "Lorem ipsum dolor sit amet, consectetur adipiscing elit. "
+  "Lorem ipsum dolor sit amet, consectetur adipiscing elit. "
+  "Lorem ipsum dolor sit amet, consectetur adipiscing elit. "
+  "Sed do eiusmod tempor incididunt ut labore et dolore magna aliqua. Ut enim "
+  "ad minim veniam, quis nostrud exercitation ullamco laboris nisi ut aliquip "
+  "ex ea commodo consequat.";
+uint8_t lorem_ipsum_gz[175] = {
+  0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0xbd, 0x8f,
+  0xd1, 0x6d, 0xc4, 0x30, 0x0c, 0x43, 0x57, 0xe1, 0x00, 0x87, 0x4c, 0x72,
+  0x7f, 0x45, 0x07, 0x50, 0x6d, 0xe1, 0x40, 0xc0, 0xb2, 0x72, 0xb6, 0x54,
+  0x74, 0xfc, 0x2a, 0xcd, 0x0e, 0xfd, 0x93, 0x00, 0xf2, 0x91, 0x7c, 0xfa,
+  0x52, 0x03, 0xcf, 0x9d, 0x86, 0xee, 0xc3, 0x17, 0x36, 0x03, 0x62, 0x1a,
+  0x0f, 0x34, 0x9f, 0x5b, 0x5b, 0x68, 0xe4, 0x82, 0x74, 0x9e, 0xdc, 0x8d,
+  0xf3, 0x05, 0x1d, 0x8c, 0x03, 0xcf, 0x7f, 0x37, 0x7e, 0x68, 0x2f, 0x03,
+  0x94, 0xb9, 0xcd, 0x3b, 0x42, 0xed, 0x2c, 0x33, 0x67, 0x63, 0x67, 0xcf,
+  0x19, 0xc8, 0xc0, 0x90, 0xaf, 0xc2, 0x43, 0xe3, 0x46, 0x2b, 0x4c, 0x5e,
+  0x53, 0x20, 0x83, 0xef, 0x94, 0x03, 0x9f, 0x01, 0x9d, 0xb4, 0x62, 0xc3,
+  0x78, 0x1d, 0xdf, 0xf5, 0x8a, 0x3d, 0xf0, 0x4e, 0x6e, 0x4c, 0xdf, 0xb1,
+  0xb2, 0x43, 0x7f, 0x74, 0x35, 0x86, 0x04, 0x7d, 0x22, 0xc7, 0x10, 0x6b,
+  0x7e, 0x93, 0x2f, 0x11, 0x37, 0xaf, 0xa4, 0x3f, 0x24, 0xcf, 0x12, 0x43,
+  0xa5, 0x8a, 0x5b, 0x75, 0xf2, 0x7b, 0x40, 0x45, 0xc5, 0xf1, 0x0b, 0x6a,
+  0x2d, 0xd9, 0xbf, 0x59, 0x01, 0x00, 0x00
+};
+
+uint8_t test_fused_crc() {
+  uint8_t totalres = 0;
+  // A member of many dynamic blocks, whose CRC is folded in block by block
+  FILE *file = fopen("../../test/resources/lesmiserables.gz", "rb");
+  if (file == NULL) {
+    FAIL();
+    return totalres;
+  }
+  fseek(file, 0, SEEK_END);
+  size_t size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  uint8_t *buf = (uint8_t *) malloc(size);
+  if (fread(buf, 1, size, file) != size) FAIL();
+  fclose(file);
+  size_t isize = read_le32(buf + size - 4);
+  uint8_t *output = (uint8_t *) malloc(isize);
+  inflate_result_t result;
+  if (inflate_member(buf, size, output, isize, &result) != INFLATE_OK) FAIL();
+  if (result.produced != isize) FAIL();
+  if (result.crc != crc32_update(0, output, isize)) FAIL();
+  // The footer is checked against the folded CRC only
+  buf[size - 8] ^= 1;
+  if (inflate_member(buf, size, output, isize, &result) !=
+      INFLATE_CHECK_FAILED) FAIL();
+
+  // Three stored blocks, one byte of the second one being corrupted
+  size_t stored = 150000;
+  uint8_t *gz = (uint8_t *) malloc(10 + DEFLATE_BOUND(stored) + 8);
+  const uint8_t header[] = { 0x1F, 0x8B, 0x08, 0, 0, 0, 0, 0, 0, 0xFF };
+  memcpy(gz, header, sizeof (header));
+  size_t gz_size = 10 + deflate_stored(output, stored, gz + 10);
+  uint32_t crc = crc32_update(0, output, stored);
+  for (int i = 0; i < 4; ++i) {
+    gz[gz_size + i] = crc >> (8 * i);
+    gz[gz_size + 4 + i] = stored >> (8 * i);
+  }
+  gz_size += 8;
+  uint8_t *stored_output = (uint8_t *) malloc(stored);
+  if (inflate_member(gz, gz_size, stored_output, stored, &result) !=
+      INFLATE_OK) FAIL();
+  if (result.crc != crc || memcmp(stored_output, output, stored) != 0) FAIL();
+  gz[10 + 5 + DEFLATE_STORED_MAX + 5 + 100] ^= 1;
+  if (inflate_member(gz, gz_size, stored_output, stored, &result) !=
+      INFLATE_CHECK_FAILED) FAIL();
+
+  free(stored_output);
+  free(gz);
+  free(output);
+  free(buf);
+  return totalres;
+}
 
-  READ_INV(dest, mask, ptr, 3);
-  if (dest != 0b010) FAIL();
+uint8_t test_inflate_stream() {
+  uint8_t totalres = 0;
+  size_t size = strlen(lorem_ipsum);
+  uint8_t output[512];
+
+  // All at once
+  inflate_stream_t *stream = inflate_init();
+  stream->next_in = lorem_ipsum_gz;
+  stream->avail_in = sizeof (lorem_ipsum_gz);
+  stream->next_out = output;
+  stream->avail_out = sizeof (output);
+  if (inflate_step(stream) != INFLATE_STREAM_END) FAIL();
+  if (stream->total_out != size) FAIL();
+  if (stream->avail_in != 0) FAIL();
+  if (memcmp(output, lorem_ipsum, size) != 0) FAIL();
+  inflate_end(stream);
+
+  // One byte of input and of output at a time
+  stream = inflate_init();
+  memset(output, 0, sizeof (output));
+  int res = INFLATE_STREAM_OK;
+  size_t in = 0;
+  while (res == INFLATE_STREAM_OK && in < sizeof (lorem_ipsum_gz)) {
+    stream->next_in = lorem_ipsum_gz + in;
+    stream->avail_in = 1;
+    do {
+      stream->next_out = output + stream->total_out;
+      stream->avail_out = 1;
+      res = inflate_step(stream);
+    } while (res == INFLATE_STREAM_OK && stream->avail_out == 0);
+    in += 1 - stream->avail_in;
+  }
+  if (res != INFLATE_STREAM_END) FAIL();
+  if (in != sizeof (lorem_ipsum_gz)) FAIL();
+  if (memcmp(output, lorem_ipsum, size) != 0) FAIL();
+  inflate_end(stream);
+
+  // Corrupted CRC
+  uint8_t corrupted[sizeof (lorem_ipsum_gz)];
+  memcpy(corrupted, lorem_ipsum_gz, sizeof (lorem_ipsum_gz));
+  corrupted[sizeof (corrupted) - 8] ^= 1;
+  stream = inflate_init();
+  stream->next_in = corrupted;
+  stream->avail_in = sizeof (corrupted);
+  stream->next_out = output;
+  stream->avail_out = sizeof (output);
+  if (inflate_step(stream) != INFLATE_STREAM_ERROR) FAIL();
+  inflate_end(stream);
+
+  // A large member, in chunks of sizes which alternate between the fast
+  // loops and the state machine, and move the window back many times
+  FILE *file = fopen("../../test/resources/lesmiserables.gz", "rb");
+  if (file == NULL) {
+    FAIL();
+    return totalres;
+  }
+  fseek(file, 0, SEEK_END);
+  size_t gz_size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  uint8_t *gz = (uint8_t *) malloc(gz_size);
+  if (fread(gz, 1, gz_size, file) != gz_size) FAIL();
+  fclose(file);
+  size_t isize = read_le32(gz + gz_size - 4);
+  uint8_t *expected = (uint8_t *) malloc(isize);
+  // One more byte, so that the end-of-block code can be read once the output
+  // is complete
+  uint8_t *big_output = (uint8_t *) malloc(isize + 1);
+  inflate_result_t result;
+  if (inflate_member(gz, gz_size, expected, isize, &result) != INFLATE_OK)
+    FAIL();
+  const size_t in_sizes[] = { 1, 40, 7, 100000, 33, 4096 };
+  const size_t out_sizes[] = { 290, 1, 65536, 289, 3, 300000 };
+  stream = inflate_init();
+  res = INFLATE_STREAM_OK;
+  in = 0;
+  for (int i = 0; res == INFLATE_STREAM_OK && in < gz_size; ++i) {
+    size_t len = in_sizes[i % 6];
+    stream->next_in = gz + in;
+    stream->avail_in = len < gz_size - in ? len : gz_size - in;
+    size_t avail_in = stream->avail_in;
+    for (int j = i; res == INFLATE_STREAM_OK; ++j) {
+      size_t avail = isize + 1 - stream->total_out;
+      if (avail > out_sizes[j % 6]) avail = out_sizes[j % 6];
+      stream->next_out = big_output + stream->total_out;
+      stream->avail_out = avail;
+      res = inflate_step(stream);
+      if (stream->avail_out != 0) break;
+    }
+    in += avail_in - stream->avail_in;
+  }
+  if (res != INFLATE_STREAM_END) FAIL();
+  if (in != gz_size || stream->total_out != isize) FAIL();
+  if (memcmp(big_output, expected, isize) != 0) FAIL();
+  inflate_end(stream);
+  free(big_output);
+  free(expected);
+  free(gz);
 
-  READ_INV(dest, mask, ptr, 1);
-  if (dest != 0b0) FAIL();
+  return totalres;
+}
 
-  READ_INV(dest, mask, ptr, 1);
-  if (dest != 0b0) FAIL();
+uint8_t test_inflate_members() {
+  uint8_t totalres = 0;
+  size_t size = strlen(lorem_ipsum);
+  // Three members appended to each other and some zero padding
+  uint8_t concatenated[3 * sizeof (lorem_ipsum_gz) + 4];
+  memset(concatenated, 0, sizeof (concatenated));
+  for (int i = 0; i < 3; ++i) {
+    memcpy(concatenated + i * sizeof (lorem_ipsum_gz), lorem_ipsum_gz,
+      sizeof (lorem_ipsum_gz));
+  }
+
+  inflate_result_t result;
+  uint8_t output[512];
+  if (inflate_member(concatenated, sizeof (concatenated), output,
+      sizeof (output), &result) != INFLATE_OK) FAIL();
+  if (result.consumed != sizeof (lorem_ipsum_gz)) FAIL();
+  if (result.produced != size) FAIL();
+  if (inflate_member(concatenated, sizeof (concatenated), output, size - 1,
+      &result) != INFLATE_OUTPUT_FULL) FAIL();
+
+  for (unsigned threads = 1; threads <= 4; threads += 3) {
+    uint8_t *inflated = NULL;
+    size_t inflated_size = 0;
+    if (inflate_members(concatenated, sizeof (concatenated), threads, NULL,
+        &inflated, &inflated_size) != INFLATE_OK) FAIL();
+    if (inflated_size != 3 * size) FAIL();
+    for (int i = 0; i < 3; ++i) {
+      if (memcmp(inflated + i * size, lorem_ipsum, size) != 0) FAIL();
+    }
+    free(inflated);
+  }
 
-  READ_INV(dest, mask, ptr, 3);
-  if (dest != 0b101) FAIL();
+  // The members have the same dynamic tables, built for the first one only
+  gziped_decoder_t *decoder = gziped_decoder_init();
+  uint8_t *cached = NULL;
+  size_t cached_size = 0;
+  if (inflate_members(concatenated, sizeof (concatenated), 1, decoder, &cached,
+      &cached_size) != INFLATE_OK) FAIL();
+  if (cached_size != 3 * size) FAIL();
+  for (int i = 0; i < 3; ++i) {
+    if (memcmp(cached + i * size, lorem_ipsum, size) != 0) FAIL();
+  }
+  // Buffers too small for a member have it decoded again, from the cache
+  if (decoder->cache.misses != 1 || decoder->cache.hits < 2) FAIL();
+  free(cached);
+
+  // A decoder reused for other streams keeps its tables
+  gziped_decoder_reset(decoder);
+  for (int i = 0; i < 3; ++i) {
+    if (gziped_inflate_member(decoder, lorem_ipsum_gz, sizeof (lorem_ipsum_gz),
+        output, sizeof (output), &result) != INFLATE_OK) FAIL();
+    if (result.produced != size || memcmp(output, lorem_ipsum, size) != 0)
+      FAIL();
+  }
+  if (decoder->cache.misses != 0 || decoder->cache.hits != 3) FAIL();
+  gziped_decoder_free(decoder);
+
+  // A stored member whose data looks like a header preceded by an ISIZE,
+  // larger or smaller than the member: the candidate found there is not
+  // a member and the room of the member around it is wrong
+  for (uint32_t guess = 5; guess <= 200; guess += 195) {
+    uint8_t data[100];
+    memset(data, 'y', sizeof (data));
+    const uint8_t header[] = { 0x1F, 0x8B, 0x08, 0, 0, 0, 0, 0, 0, 3 };
+    for (int i = 0; i < 4; ++i) data[56 + i] = guess >> (8 * i);
+    memcpy(data + 60, header, sizeof (header));
+    uint8_t file[sizeof (header) + DEFLATE_BOUND(sizeof (data)) + 8 +
+                 sizeof (lorem_ipsum_gz)];
+    memcpy(file, header, sizeof (header));
+    size_t file_size = sizeof (header) +
+      deflate_stored(data, sizeof (data), file + sizeof (header));
+    uint32_t crc = crc32_update(0, data, sizeof (data));
+    for (int i = 0; i < 4; ++i) {
+      file[file_size + i] = crc >> (8 * i);
+      file[file_size + 4 + i] = sizeof (data) >> (8 * i);
+    }
+    file_size += 8;
+    memcpy(file + file_size, lorem_ipsum_gz, sizeof (lorem_ipsum_gz));
+    file_size += sizeof (lorem_ipsum_gz);
+    for (unsigned threads = 1; threads <= 4; threads += 3) {
+      uint8_t *inflated = NULL;
+      size_t inflated_size = 0;
+      if (inflate_members(file, file_size, threads, NULL, &inflated,
+          &inflated_size) != INFLATE_OK) {
+        FAIL();
+        continue;
+      }
+      if (inflated_size != sizeof (data) + size) FAIL();
+      if (memcmp(inflated, data, sizeof (data)) != 0 ||
+          memcmp(inflated + sizeof (data), lorem_ipsum, size) != 0) FAIL();
+      free(inflated);
+    }
+  }
 
+  // A second member cut after 64 KB, whose last bytes read as a plausible
+  // ISIZE of 64 MB: the truncation is reported at once, without filling the
+  // room guessed from it with the zeros read past the end of the input,
+  // which would raise the peak memory of the process as much
+  FILE *file = fopen("../../test/resources/lesmiserables.gz", "rb");
+  if (file == NULL) FAIL();
+  size_t cut = 64 * 1024;
+  size_t truncated_size = sizeof (lorem_ipsum_gz) + cut + 8;
+  uint8_t *truncated = (uint8_t *) malloc(truncated_size);
+  memcpy(truncated, lorem_ipsum_gz, sizeof (lorem_ipsum_gz));
+  if (fread(truncated + sizeof (lorem_ipsum_gz), 1, cut, file) != cut) FAIL();
+  fclose(file);
+  uint8_t *trailer = truncated + truncated_size - 8;
+  memset(trailer, 0, 8);
+  for (int i = 0; i < 4; ++i) trailer[4 + i] = (64 << 20) >> (8 * i);
+  struct rusage before, after;
+  getrusage(RUSAGE_SELF, &before);
+  for (unsigned threads = 1; threads <= 4; threads += 3) {
+    uint8_t *inflated = NULL;
+    size_t inflated_size = 0;
+    if (inflate_members(truncated, truncated_size, threads, NULL, &inflated,
+        &inflated_size) != INFLATE_TRUNCATED) FAIL();
+  }
+  getrusage(RUSAGE_SELF, &after);
+  // ru_maxrss is in KB. Half the room guessed leaves some margin for the
+  // shadow memory of the sanitizers.
+  if (after.ru_maxrss - before.ru_maxrss > 32 * 1024) FAIL();
+  free(truncated);
+
+  // Each member is checked against its own footer
+  concatenated[2 * sizeof (lorem_ipsum_gz) - 8] ^= 1;
+  uint8_t *inflated = NULL;
+  size_t inflated_size = 0;
+  if (inflate_members(concatenated, sizeof (concatenated), 4, NULL, &inflated,
+      &inflated_size) != INFLATE_CHECK_FAILED) FAIL();
 
   return totalres;
 }
 
-uint8_t test_READ() {
+typedef struct stealing_test_s {
+  uint8_t runs[1000];
+  uint8_t bad_worker;
+} stealing_test_t;
+
+void stealing_test_task(size_t index, unsigned worker, void *context) {
+  stealing_test_t *test = (stealing_test_t *) context;
+  __atomic_fetch_add(&test->runs[index], 1, __ATOMIC_RELAXED);
+  if (worker >= 4) test->bad_worker = 1;
+  // The first tasks of each range are much longer than the others
+  if (index % 250 < 5) {
+    for (volatile int i = 0; i < 1000000; ++i) ;
+  }
+}
+
+uint8_t test_thread_pool_stealing() {
   uint8_t totalres = 0;
+  if (thread_pool_range_begin(10, 4, 0) != 0) FAIL();
+  if (thread_pool_range_begin(10, 4, 2) != 6) FAIL();
+  if (thread_pool_range_begin(10, 4, 4) != 10) FAIL();
+
+  // Every task runs once, on one of the workers
+  for (unsigned threads = 1; threads <= 4; threads += 3) {
+    stealing_test_t test;
+    memset(&test, 0, sizeof (test));
+    if (thread_pool_run_stealing(1000, threads, stealing_test_task, &test) !=
+        threads) FAIL();
+    for (int i = 0; i < 1000; ++i) {
+      if (test.runs[i] != 1) FAIL();
+    }
+    if (test.bad_worker) FAIL();
+  }
+  // No more workers than tasks
+  stealing_test_t test;
+  memset(&test, 0, sizeof (test));
+  if (thread_pool_run_stealing(2, 4, stealing_test_task, &test) != 2) FAIL();
+  if (test.runs[0] != 1 || test.runs[1] != 1) FAIL();
+  return totalres;
+}
 
-  // buffer: 11101010 11000011 10100010
-  // order:  76543210    ...98
-  uint8_t buffer[3] = { 234, 195, 162 };
-  uint8_t *ptr = buffer;
-  uint8_t mask = 1;
+typedef struct pipe_test_s {
+  int fd;
+  uint8_t *data;
+  size_t size;
+} pipe_test_t;
+
+void *pipe_test_reader(void *arg) {
+  pipe_test_t *test = (pipe_test_t *) arg;
+  ssize_t len;
+  while ((len = read(test->fd, test->data + test->size, 4096)) > 0) {
+    test->size += len;
+  }
+  return NULL;
+}
 
-  uint8_t dest = 255;
+uint8_t test_input() {
+  uint8_t totalres = 0;
+  input_method_t method;
+  if (input_method_parse("direct", &method) != 0 || method != INPUT_DIRECT)
+    FAIL();
+  if (input_method_parse("mmap2", &method) == 0) FAIL();
+
+  // Several chunks and a partial one, which O_DIRECT reads past the end
+  const char *path = "test.input";
+  const size_t size = 2 * INPUT_CHUNK_SIZE + 12345;
+  uint8_t *data = (uint8_t *) malloc(size);
+  for (size_t i = 0; i < size; ++i) {
+    data[i] = (uint8_t) (i * 13 + i / 4099);
+  }
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd < 0 || gzi_write_all(fd, data, size) != 0) FAIL();
+  close(fd);
+  for (int i = 0; i < INPUT_METHOD_COUNT; ++i) {
+    input_t input;
+    if (input_open(path, (input_method_t) i, &input) != 0) {
+      FAIL();
+      continue;
+    }
+    if (input.size != size || memcmp(input.data, data, size) != 0) FAIL();
+    input_close(&input);
+  }
+  // An empty file has no data
+  fd = open(path, O_WRONLY | O_TRUNC);
+  close(fd);
+  input_t input;
+  if (input_open(path, INPUT_PREAD, &input) != 0) FAIL();
+  if (input.size != 0 || input.data != NULL) FAIL();
+  unlink(path);
+  if (input_open(path, INPUT_MMAP, &input) != ENOENT) FAIL();
+  free(data);
+  return totalres;
+}
 
-  READ(dest, mask, ptr, 4);
-  if (dest != 0b1010) FAIL();
+uint8_t test_pipeline() {
+  uint8_t totalres = 0;
+  // A file of two members, larger than all the chunks together
+  FILE *file = fopen("../../test/resources/lesmiserables.gz", "rb");
+  if (file == NULL) FAIL();
+  fseek(file, 0, SEEK_END);
+  size_t member_size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  uint8_t *buf = (uint8_t *) malloc(2 * member_size);
+  if (fread(buf, 1, member_size, file) != member_size) FAIL();
+  fclose(file);
+  memcpy(buf + member_size, buf, member_size);
+  size_t isize = read_le32(buf + member_size - 4);
+  uint8_t *expected = (uint8_t *) malloc(isize);
+  inflate_result_t result;
+  if (inflate_member(buf, member_size, expected, isize, &result) != INFLATE_OK)
+    FAIL();
+
+  const char *path = "test.pipeline";
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  pipeline_result_t pipelined;
+  if (inflate_pipelined(buf, 2 * member_size, fd, &pipelined) != INFLATE_OK)
+    FAIL();
+  if (pipelined.produced != 2 * isize) FAIL();
+  uint8_t *output = (uint8_t *) malloc(2 * isize);
+  if (pread(fd, output, 2 * isize, 0) != (ssize_t) (2 * isize)) FAIL();
+  if (memcmp(output, expected, isize) != 0 ||
+      memcmp(output + isize, expected, isize) != 0) FAIL();
+  close(fd);
+  unlink(path);
+
+  // The CRC of the second member is checked, without output
+  buf[2 * member_size - 8] ^= 1;
+  if (inflate_pipelined(buf, 2 * member_size, -1, &pipelined) !=
+      INFLATE_CHECK_FAILED) FAIL();
+  // And its ISIZE, by the decoder
+  buf[2 * member_size - 8] ^= 1;
+  buf[2 * member_size - 4] ^= 1;
+  if (inflate_pipelined(buf, 2 * member_size, -1, &pipelined) !=
+      INFLATE_CHECK_FAILED) FAIL();
+  if (inflate_pipelined(buf, member_size / 2, -1, &pipelined) !=
+      INFLATE_TRUNCATED) FAIL();
+  free(output);
+  free(expected);
+  free(buf);
+  return totalres;
+}
 
-  READ(dest, mask, ptr, 8);
-  if (dest != 0b00111110) FAIL();
+uint8_t test_uring() {
+  uint8_t totalres = 0;
+  uring_t ring;
+  if (uring_init(&ring) != 0) {
+    // Without io_uring, the batch mode uses the POSIX calls
+    fprintf(stderr, "%s skipped: io_uring unavailable\n", __func__);
+    return totalres;
+  }
+  const char *paths[3] = { "test.uring0", "test.uring1", "test.uring2" };
+  uint8_t *data[3];
+  size_t sizes[3] = { 1000, 0, URING_BUFFER_SIZE + 10 };
+  for (int i = 0; i < 3; ++i) {
+    data[i] = (uint8_t *) malloc(sizes[i] + 1);
+    for (size_t j = 0; j < sizes[i]; ++j) data[i][j] = (uint8_t) (i + j * 31);
+  }
+  int errors[3];
+  if (uring_write_files(&ring, paths, data, sizes, 3, errors) != 0) FAIL();
+  if (errors[0] != 0 || errors[1] != 0 || errors[2] != 0) FAIL();
+
+  // Twice, for the slots to be reused once closed
+  const char *read_paths[4] = { paths[0], paths[1], paths[2], "test.uring3" };
+  for (int k = 0; k < 2; ++k) {
+    ssize_t read[4];
+    if (uring_read_files(&ring, read_paths, 4, read) != 0) FAIL();
+    if (read[0] != 1000 || memcmp(uring_buffer(&ring, 0), data[0], 1000))
+      FAIL();
+    if (read[1] != 0) FAIL();
+    // Larger than the buffer
+    if (read[2] != URING_BUFFER_SIZE) FAIL();
+    if (read[3] != -ENOENT) FAIL();
+  }
+  // Errors are reported for the file they concern only
+  const char *bad_paths[2] = { "no/such/dir", paths[0] };
+  if (uring_write_files(&ring, bad_paths, data, sizes, 2, errors) != 0) FAIL();
+  if (errors[0] != ENOENT || errors[1] != 0) FAIL();
+  uring_free(&ring);
+  for (int i = 0; i < 3; ++i) {
+    unlink(paths[i]);
+    free(data[i]);
+  }
+  return totalres;
+}
 
-  READ(dest, mask, ptr, 2);
-  if (dest != 0b00) FAIL();
+uint8_t test_pipe_writer() {
+  uint8_t totalres = 0;
+  const size_t size = 300000;
+  const size_t chunk_size = 64 * 1024;
+  int fds[2];
+  if (pipe(fds) != 0) FAIL();
+  pipe_test_t test = { fds[0], (uint8_t *) malloc(size), 0 };
+  pthread_t reader;
+  pthread_create(&reader, NULL, pipe_test_reader, &test);
+
+  // Written in pieces of varying sizes, as the decoder does, while the
+  // reader consumes the pipe: a buffer reused too early would show. A flush
+  // in the middle, as at the end of a file, leaves the writer usable.
+  pipe_writer_t *writer = pipe_writer_init(fds[1], chunk_size);
+  if (writer == NULL) FAIL();
+  size_t offset = 0;
+  int flushed = 0;
+  for (size_t piece = 1; offset < size; piece = piece * 3 % 7919 + 1) {
+    if (!flushed && offset > size / 2) {
+      if (pipe_writer_flush(writer) != 0) FAIL();
+      flushed = 1;
+    }
+    size_t avail = 0;
+    uint8_t *buffer = pipe_writer_buffer(writer, &avail);
+    if (avail == 0 || avail > chunk_size) FAIL();
+    if (piece > avail) piece = avail;
+    if (piece > size - offset) piece = size - offset;
+    for (size_t i = 0; i < piece; ++i) {
+      buffer[i] = (uint8_t) ((offset + i) * 7 + (offset + i) / 251);
+    }
+    offset += piece;
+    if (pipe_writer_commit(writer, piece) != 0) FAIL();
+  }
+  if (pipe_writer_flush(writer) != 0) FAIL();
+  if (writer->total != size) FAIL();
+  pipe_writer_free(writer);
+  close(fds[1]);
+  pthread_join(reader, NULL);
+  close(fds[0]);
+
+  if (test.size != size) FAIL();
+  for (size_t i = 0; i < test.size; ++i) {
+    if (test.data[i] != (uint8_t) (i * 7 + i / 251)) {
+      FAIL();
+      break;
+    }
+  }
+  free(test.data);
+  return totalres;
+}
 
-  READ(dest, mask, ptr, 2);
-  if (dest != 0b11) FAIL();
+uint8_t test_get_metadata() {
+  uint8_t totalres = 0;
+  metadata_t metadata;
+  uint8_t buf[sizeof (lorem_ipsum_gz)];
+  memcpy(buf, lorem_ipsum_gz, sizeof (buf));
+
+  if (get_metadata(buf, sizeof (buf), &metadata) != INFLATE_OK) FAIL();
+  if (metadata.block_offset != GZIP_HEADER_SIZE) FAIL();
+  if (metadata.footer.isize != strlen(lorem_ipsum)) FAIL();
+  free_metadata(&metadata);
+
+  // Errors are returned, with nothing to free
+  if (get_metadata(buf, GZIP_HEADER_SIZE, &metadata) != INFLATE_TRUNCATED)
+    FAIL();
+  buf[0] = 0;
+  if (get_metadata(buf, sizeof (buf), &metadata) != INFLATE_BAD_MAGIC) FAIL();
+  buf[0] = 0x1F;
+  buf[2] = 7;
+  if (get_metadata(buf, sizeof (buf), &metadata) != INFLATE_BAD_METHOD) FAIL();
+  buf[2] = GZIP_DEFLATE_CM;
+  // A file name running up to the end of the file
+  memset(buf + GZIP_HEADER_SIZE, 'a', sizeof (buf) - GZIP_HEADER_SIZE);
+  buf[3] = FNAME;
+  if (get_metadata(buf, sizeof (buf), &metadata) != INFLATE_INVALID_DATA)
+    FAIL();
+  if (metadata.extra_header.fname != NULL) FAIL();
 
-  READ(dest, mask, ptr, 4);
-  if (dest != 0b0010) FAIL();
+  return totalres;
+}
 
-  READ(dest, mask, ptr, 1);
-  if (dest != 0b0) FAIL();
+typedef struct concurrent_decode_s {
+  uint8_t failed[4];
+} concurrent_decode_t;
+
+void concurrent_decode_task(size_t index, void *context) {
+  concurrent_decode_t *decode = (concurrent_decode_t *) context;
+  gziped_decoder_t *decoder = gziped_decoder_init();
+  uint8_t output[512];
+  inflate_result_t result;
+  for (int i = 0; i < 100; ++i) {
+    if (gziped_inflate_member(decoder, lorem_ipsum_gz, sizeof (lorem_ipsum_gz),
+        output, sizeof (output), &result) != INFLATE_OK ||
+        memcmp(output, lorem_ipsum, result.produced) != 0)
+      decode->failed[index] = 1;
+  }
+  gziped_decoder_free(decoder);
+}
 
-  READ(dest, mask, ptr, 3);
-  if (dest != 0b101) FAIL();
+uint8_t test_concurrent_decoders() {
+  uint8_t totalres = 0;
+  // Each thread with its own decoder, and nothing else shared
+  concurrent_decode_t decode;
+  memset(&decode, 0, sizeof (decode));
+  thread_pool_run(4, 4, concurrent_decode_task, &decode);
+  for (int i = 0; i < 4; ++i) {
+    if (decode.failed[i]) FAIL();
+  }
+  return totalres;
+}
 
+uint8_t test_inflate_parallel() {
+  uint8_t totalres = 0;
+  // A stream large enough for many dynamic blocks
+  FILE *file = fopen("../../test/resources/lesmiserables.gz", "rb");
+  if (file == NULL) {
+    FAIL();
+    return totalres;
+  }
+  fseek(file, 0, SEEK_END);
+  size_t size = ftell(file);
+  rewind(file);
+  uint8_t *buf = (uint8_t *) malloc(size);
+  if (fread(buf, 1, size, file) != size) FAIL();
+  fclose(file);
+  size_t header_size = member_header_size(buf, size);
+  size_t isize = read_le32(buf + size - 4);
+  uint8_t *expected = (uint8_t *) malloc(isize);
+  uint8_t *output = (uint8_t *) malloc(isize);
+  inflate_result_t expected_result;
+  if (inflate(buf + header_size, size - header_size, expected, isize,
+      &expected_result) != INFLATE_OK) FAIL();
+
+  // Small chunks to go through block search, markers and gaps
+  size_t chunk_sizes[] = { 20000, 65536, 300000 };
+  for (int i = 0; i < 3; ++i) {
+    inflate_result_t result;
+    memset(output, 0, isize);
+    if (inflate_parallel(buf + header_size, size - header_size, output, isize,
+        &result, 4, chunk_sizes[i]) != INFLATE_OK) FAIL();
+    if (result.consumed != expected_result.consumed) FAIL();
+    if (result.produced != isize) FAIL();
+    if (result.crc != expected_result.crc) FAIL();
+    if (memcmp(output, expected, isize) != 0) FAIL();
+  }
+  inflate_result_t result;
+  if (inflate_parallel(buf + header_size, size - header_size, output,
+      isize - 1, &result, 4, 65536) != INFLATE_OUTPUT_FULL) FAIL();
+  // A truncated stream, with a much larger output, is reported as such
+  uint8_t *large = (uint8_t *) malloc(4 * isize);
+  if (inflate_parallel(buf + header_size, (size - header_size) * 2 / 3, large,
+      4 * isize, &result, 4, 65536) != INFLATE_TRUNCATED) FAIL();
+  free(large);
+  // Chunks do not grow past their maximum
+  chunk_t chunk;
+  memset(&chunk, 0, sizeof (chunk));
+  if (chunk_reserve(&chunk, 100, 1000) != 0 || chunk.capacity < 100) FAIL();
+  if (chunk_reserve(&chunk, 1000, 1000) != 0 || chunk.capacity != 1000) FAIL();
+  chunk.length = 1000;
+  if (chunk_reserve(&chunk, 1, 1000) == 0) FAIL();
+  free(chunk.data);
+
+  free(output);
+  free(expected);
+  free(buf);
   return totalres;
 }
 
-uint8_t test_distance_static_dictionary() {
+uint8_t test_index() {
   uint8_t totalres = 0;
+  size_t size = strlen(lorem_ipsum);
+  uint8_t concatenated[3 * sizeof (lorem_ipsum_gz)];
+  for (int i = 0; i < 3; ++i) {
+    memcpy(concatenated + i * sizeof (lorem_ipsum_gz), lorem_ipsum_gz,
+      sizeof (lorem_ipsum_gz));
+  }
+
+  // A checkpoint before each block, i.e. one per member here
+  gziped_index_t *index = gziped_build_index(concatenated,
+    sizeof (concatenated), 1);
+  if (index == NULL) {
+    FAIL();
+    return totalres;
+  }
+  if (index->count != 3) FAIL();
+  if (index->length != 3 * size) FAIL();
+  if (index->checkpoints[1].out != size) FAIL();
+  if (index->checkpoints[1].window_size != 0) FAIL();
+
+  uint8_t output[512];
+  // Within a member, from its checkpoint
+  if (gziped_seek_read(index, size + 100, 50, output) != 50) FAIL();
+  if (memcmp(output, lorem_ipsum + 100, 50) != 0) FAIL();
+  // Across two members
+  if (gziped_seek_read(index, size - 10, 20, output) != 20) FAIL();
+  if (memcmp(output, lorem_ipsum + size - 10, 10) != 0) FAIL();
+  if (memcmp(output + 10, lorem_ipsum, 10) != 0) FAIL();
+  // Past the end
+  if (gziped_seek_read(index, 3 * size - 5, 20, output) != 5) FAIL();
+  if (gziped_seek_read(index, 3 * size, 20, output) != 0) FAIL();
+  gziped_free_index(index);
+
+  // Corrupted CRC
+  concatenated[sizeof (lorem_ipsum_gz) - 8] ^= 1;
+  if (gziped_build_index(concatenated, sizeof (concatenated), 1) != NULL)
+    FAIL();
 
-  uint16_t distance_static_dict[64];
-  memset(distance_static_dict, -1, 64 * sizeof (uint16_t));
-  generate_dict_from_code_length(static_huffman_params_distance_code_lengths,
-    DEFLATE_STATIC_DISTANCE_CODE_LENGTHS_SIZE, distance_static_dict, 32);
+  return totalres;
+}
 
-  if (distance_static_dict[31 + 0] != 0) FAIL();
-  if (distance_static_dict[31 + 1] != 1) FAIL();
-  if (distance_static_dict[31 + 2] != 2) FAIL();
-  if (distance_static_dict[31 + 10] != 10) FAIL();
-  if (distance_static_dict[31 + 13] != 13) FAIL();
-  if (distance_static_dict[31 + 31] != 31) FAIL();
+uint8_t test_fixed_tables() {
+  uint8_t totalres = 0;
 
+  // The tables generated by mktables are the ones build_decode_table builds
+  huffman_entry_t littable[LITLEN_TABLE_SIZE];
+  if (build_decode_table(static_huffman_params.code_lengths,
+      DEFLATE_ALPHABET_SIZE, LITLEN_TABLE_BITS, littable,
+      LITLEN_TABLE_SIZE) != 0) FAIL();
+  if (memcmp(littable, fixed_litlen_table, sizeof (fixed_litlen_table)) != 0)
+    FAIL();
+  huffman_entry_t disttable[DISTANCE_TABLE_SIZE];
+  if (build_decode_table(static_huffman_params_distance_code_lengths,
+      DEFLATE_SDCLS, DISTANCE_TABLE_BITS, disttable,
+      DISTANCE_TABLE_SIZE) != 0) FAIL();
+  if (memcmp(disttable, fixed_distance_table,
+      sizeof (fixed_distance_table)) != 0) FAIL();
+
+  // A fixed block decoded into an output one byte too small
+  size_t size = 4000;
+  uint8_t *buf = (uint8_t *) malloc(size);
+  uint8_t *compressed = (uint8_t *) malloc(DEFLATE_BOUND(size));
+  uint8_t *output = (uint8_t *) malloc(size);
+  size_t lorem_size = strlen(lorem_ipsum);
+  for (size_t i = 0; i < size; ++i) buf[i] = lorem_ipsum[i % lorem_size];
+  size_t compressed_size = deflate_fixed(buf, size, compressed);
+  if (inflate(compressed, compressed_size, output, size - 1, NULL) !=
+      INFLATE_OUTPUT_FULL) FAIL();
+
+  free(output);
+  free(compressed);
+  free(buf);
   return totalres;
 }
 
-uint8_t test_decode() {
+uint8_t test_deflate_fixed() {
+  uint8_t totalres = 0;
+  size_t size = 40000;
+  uint8_t *buf = (uint8_t *) malloc(size);
+  uint8_t *compressed = (uint8_t *) malloc(DEFLATE_BOUND(size));
+  uint8_t *output = (uint8_t *) malloc(size);
+  inflate_result_t result;
+
+  // Text compresses, and round trips through inflate
+  size_t lorem_size = strlen(lorem_ipsum);
+  for (size_t i = 0; i < size; ++i) buf[i] = lorem_ipsum[i % lorem_size];
+  size_t compressed_size = deflate_fixed(buf, size, compressed);
+  if (compressed_size >= size / 10) FAIL();
+  if (inflate(compressed, compressed_size, output, size, &result) != INFLATE_OK)
+    FAIL();
+  if (result.produced != size || memcmp(output, buf, size) != 0) FAIL();
+
+  // Random data falls back to stored blocks
+  uint32_t seed = 1;
+  for (size_t i = 0; i < size; ++i) {
+    seed = seed * 1103515245 + 12345;
+    buf[i] = seed >> 16;
+  }
+  compressed_size = deflate_fixed(buf, size, compressed);
+  if (compressed_size != size + 5) FAIL();
+  if (inflate(compressed, compressed_size, output, size, &result) != INFLATE_OK)
+    FAIL();
+  if (result.produced != size || memcmp(output, buf, size) != 0) FAIL();
+
+  // Empty input
+  compressed_size = deflate_fixed(buf, 0, compressed);
+  if (inflate(compressed, compressed_size, output, size, &result) != INFLATE_OK)
+    FAIL();
+  if (result.produced != 0) FAIL();
+
+  free(output);
+  free(compressed);
+  free(buf);
+  return totalres;
+}
+
+uint8_t test_index_file() {
   uint8_t totalres = 0;
+  FILE *file = fopen("../../test/resources/lesmiserables.gz", "rb");
+  if (file == NULL) {
+    FAIL();
+    return totalres;
+  }
+  fseek(file, 0, SEEK_END);
+  size_t size = ftell(file);
+  rewind(file);
+  uint8_t *buf = (uint8_t *) malloc(size);
+  if (fread(buf, 1, size, file) != size) FAIL();
+  fclose(file);
+  const char *path = "test.gzi";
+
+  gziped_index_t *built = gziped_build_index(buf, size, 1 << 18);
+  if (built == NULL) {
+    FAIL();
+    free(buf);
+    return totalres;
+  }
+  struct timespec mtime = { 1234, 567890123 };
+  if (gziped_save_index(built, path, mtime) != GZI_OK) FAIL();
+  gziped_index_t *loaded = NULL;
+  if (gziped_load_index(path, buf, size, mtime, GZI_CHECK_CRC, &loaded) !=
+      GZI_OK) {
+    FAIL();
+    gziped_free_index(built);
+    free(buf);
+    return totalres;
+  }
+  if (loaded->count != built->count || loaded->length != built->length)
+    FAIL();
+  // Reads from every checkpoint, whose windows are compressed in the file
+  uint8_t expected[1000];
+  uint8_t output[1000];
+  for (size_t i = 0; i < built->count; ++i) {
+    uint64_t offset = built->checkpoints[i].out + 500;
+    if (gziped_seek_read(built, offset, sizeof (expected), expected) !=
+        sizeof (expected)) FAIL();
+    if (gziped_seek_read(loaded, offset, sizeof (output), output) !=
+        sizeof (output)) FAIL();
+    if (memcmp(output, expected, sizeof (output)) != 0) FAIL();
+  }
+  gziped_free_index(loaded);
+
+  // Stale, including when modified within the same second
+  struct timespec later = { 1235, 567890123 };
+  if (gziped_load_index(path, buf, size, later, 0, &loaded) != GZI_STALE)
+    FAIL();
+  later.tv_sec = 1234;
+  later.tv_nsec += 1;
+  if (gziped_load_index(path, buf, size, later, 0, &loaded) != GZI_STALE)
+    FAIL();
+  buf[size / 2] ^= 1;
+  if (gziped_load_index(path, buf, size, mtime, GZI_CHECK_CRC, &loaded) !=
+      GZI_STALE) FAIL();
+  buf[size / 2] ^= 1;
+  if (loaded != NULL) FAIL();
+
+  // Not an index file
+  file = fopen(path, "r+b");
+  fputc('x', file);
+  fclose(file);
+  if (gziped_load_index(path, buf, size, mtime, 0, &loaded) != GZI_INVALID)
+    FAIL();
+  unlink(path);
+  if (gziped_load_index(path, buf, size, mtime, 0, &loaded) != GZI_IO_ERROR)
+    FAIL();
+
+  gziped_free_index(built);
+  free(buf);
+  return totalres;
+}
 
-  // 00101100 01101001 10100111 01110010
-  // 00 (3) -> 42
-  // 110 (13) -> 66
-  // 100 (11) -> 7
-  // 101 (12) -> 88
-  // 01 (4) -> 5
-  // 111 (14) -> DEFLATE_END_BLOCK_VALUE
-  uint8_t *input = malloc(4 * sizeof (uint8_t));
-  uint8_t *pos = input;
-  input[0] = 44; input[1] =  105; input[2] = 167; input[3] = 242;
-  uint8_t mask = 1;
-  uint16_t dict[16] = {
-  // 0   1   2   3   4   5   6   7   8   9  10  11  12  13  14  15
-    -1, -1, -1, 42,  5, -1, -1, -1, -1, -1, -1,  7, 88, 66, DEFLATE_END_BLOCK_VALUE, -1
+/**
+ * Writes a BGZF block holding data at output and returns its size.
+ */
+size_t make_bgzf_block(const uint8_t *data, size_t size, uint8_t *output) {
+  const uint8_t header[] = {
+    0x1F, 0x8B, 0x08, FEXTRA, 0, 0, 0, 0, 0, 0xFF, 6, 0, 'B', 'C', 2, 0
   };
-  uint8_t output[11];
+  memcpy(output, header, sizeof (header));
+  size_t block_size = BGZF_HEADER_SIZE +
+    deflate_fixed(data, size, output + BGZF_HEADER_SIZE) + 8;
+  output[16] = (block_size - 1) & 0xFF;
+  output[17] = (block_size - 1) >> 8;
+  uint32_t crc = crc32_update(0, data, size);
+  uint8_t *footer = output + block_size - 8;
+  for (int i = 0; i < 4; ++i) {
+    footer[i] = crc >> (8 * i);
+    footer[4 + i] = size >> (8 * i);
+  }
+  return block_size;
+}
 
-  decode(&pos, &mask, dict, output);
+uint8_t test_bgzf() {
+  uint8_t totalres = 0;
+  // Subfields are looked for past the ones before them
+  const uint8_t extra[] = { 'A', 'B', 1, 0, 'x', 'B', 'C', 2, 0, 0x34, 0x12 };
+  uint16_t len = 0;
+  const uint8_t *subfield = find_extra_subfield(extra, sizeof (extra), 'B',
+    'C', &len);
+  if (subfield != extra + 9 || len != 2) FAIL();
+  if (find_extra_subfield(extra, sizeof (extra) - 1, 'B', 'C', &len) != NULL)
+    FAIL();
+
+  // Three blocks of data and the empty block ending BGZF files
+  size_t size = strlen(lorem_ipsum);
+  const uint8_t *data = (const uint8_t *) lorem_ipsum;
+  uint8_t buf[4096];
+  size_t buf_size = 0;
+  buf_size += make_bgzf_block(data, 100, buf + buf_size);
+  size_t second = buf_size;
+  buf_size += make_bgzf_block(data + 100, 150, buf + buf_size);
+  buf_size += make_bgzf_block(data + 250, size - 250, buf + buf_size);
+  buf_size += make_bgzf_block(data, 0, buf + buf_size);
+
+  bgzf_t *bgzf = bgzf_open(buf, buf_size);
+  if (bgzf == NULL) {
+    FAIL();
+    return totalres;
+  }
+  if (bgzf->count != 4 || bgzf->length != size) FAIL();
+  uint8_t output[2048];
+  for (unsigned threads = 1; threads <= 4; threads += 3) {
+    memset(output, 0, sizeof (output));
+    if (bgzf_inflate(bgzf, output, threads) != INFLATE_OK) FAIL();
+    if (memcmp(output, lorem_ipsum, size) != 0) FAIL();
+  }
 
-  if (output[0 ] != 42) FAIL();
-  if (output[1 ] != 66) FAIL();
-  if (output[2 ] != 7) FAIL();
-  if (output[3 ] != 7) FAIL();
-  if (output[4 ] != 88) FAIL();
-  if (output[5 ] != 88) FAIL();
-  if (output[6 ] != 66) FAIL();
-  if (output[7 ] != 5) FAIL();
-  if (output[8 ] != 5) FAIL();
-  if (output[9 ] != 5) FAIL();
-  if (output[10] != 42) FAIL();
+  // Virtual offsets
+  if (bgzf_tell(bgzf, 150) != bgzf_virtual_offset(second, 50)) FAIL();
+  if (bgzf_tell(bgzf, 100) != bgzf_virtual_offset(second, 0)) FAIL();
+  // Across the second and the third blocks
+  if (bgzf_read(bgzf, bgzf_tell(bgzf, 200), 100, output) != 100) FAIL();
+  if (memcmp(output, lorem_ipsum + 200, 100) != 0) FAIL();
+  if (bgzf_read(bgzf, bgzf_tell(bgzf, size - 10), 100, output) != 10) FAIL();
+  if (bgzf_read(bgzf, bgzf_virtual_offset(second + 1, 0), 10, output) != -1)
+    FAIL();
+  if (bgzf_read(bgzf, bgzf_virtual_offset(second, 151), 10, output) != -1)
+    FAIL();
+
+  // Corrupted CRC of the second block
+  buf[second + bgzf->blocks[1].size - 8] ^= 1;
+  if (bgzf_inflate(bgzf, output, 4) != INFLATE_CHECK_FAILED) FAIL();
+  bgzf_close(bgzf);
+
+  // Regular gzip files are not BGZF files
+  if (bgzf_open(lorem_ipsum_gz, sizeof (lorem_ipsum_gz)) != NULL) FAIL();
 
-  free(input);
+  return totalres;
+}
+
+uint8_t test_match_copy() {
+  uint8_t totalres = 0;
+  uint8_t output[64 + DEFLATE_MAX_MATCH_LENGTH + MATCH_COPY_SLACK];
+  uint8_t expected[sizeof (output)];
+  for (uint16_t distance = 1; distance <= 64; ++distance) {
+    for (uint16_t length = 3; length <= DEFLATE_MAX_MATCH_LENGTH; ++length) {
+      for (size_t i = 0; i < sizeof (output); ++i) {
+        output[i] = expected[i] = i * 7 + 1;
+      }
+      for (uint16_t i = 0; i < length; ++i) {
+        expected[64 + i] = expected[64 + i - distance];
+      }
+      if (match_copy(output + 64, distance, length) != output + 64 + length)
+        FAIL();
+      if (memcmp(output, expected, 64 + length) != 0) {
+        FAIL();
+        return totalres;
+      }
+    }
+  }
+#ifdef MATCH_COPY_HAS_SHUFFLE
+  // match_copy uses the shuffles above on a CPU with SSSE3: they are checked
+  // on their own as well, against the byte by byte copy
+  if (!match_copy_has_ssse3()) return totalres;
+  for (uint16_t distance = 2; distance < MATCH_COPY_WORD; ++distance) {
+    for (size_t i = 0; i < sizeof (output); ++i) {
+      output[i] = expected[i] = i * 7 + 1;
+    }
+    for (int i = 0; i < MATCH_COPY_WORD; ++i) {
+      expected[64 + i] = expected[64 + i - distance];
+    }
+    match_copy_shuffle_ssse3(output + 64, distance);
+    if (memcmp(output, expected, sizeof (output)) != 0) FAIL();
+  }
+#endif
+  return totalres;
+}
+
+uint8_t test_inflate_tail() {
+  uint8_t totalres = 0;
+  // Long enough for both the fast loop and the careful one
+  size_t size = 5000;
+  uint8_t *buf = (uint8_t *) malloc(size);
+  size_t lorem_size = strlen(lorem_ipsum);
+  for (size_t i = 0; i < size; ++i) {
+    buf[i] = i % 3 == 0 ? i / 3 : lorem_ipsum[i % lorem_size];
+  }
+  uint8_t *compressed = (uint8_t *) malloc(DEFLATE_BOUND(size));
+  size_t compressed_size = deflate_fixed(buf, size, compressed);
+  uint8_t *output = (uint8_t *) malloc(size);
+  inflate_result_t result;
+
+  // The output ending exactly with the data
+  if (inflate(compressed, compressed_size, output, size, &result) !=
+      INFLATE_OK) FAIL();
+  if (result.produced != size || memcmp(output, buf, size) != 0) FAIL();
+  if (inflate(compressed, compressed_size, output, size - 1, NULL) !=
+      INFLATE_OUTPUT_FULL) FAIL();
+  // Any truncation is detected
+  for (size_t n = 0; n < compressed_size; ++n) {
+    if (inflate(compressed, n, output, size, NULL) == INFLATE_OK) {
+      FAIL();
+      break;
+    }
+  }
+  // Even with an output much larger than the data, the zeros read past the
+  // end of the input are not decoded into it
+  uint8_t *large = (uint8_t *) malloc(16 * size);
+  for (size_t n = compressed_size / 2; n < compressed_size; n += 97) {
+    if (inflate(compressed, n, large, 16 * size, &result) !=
+        INFLATE_TRUNCATED || result.produced > size) {
+      FAIL();
+      break;
+    }
+  }
+  free(large);
+  // Nor in a dynamic block, where zeros are usually a literal
+  FILE *file = fopen("../../test/resources/lesmiserables.gz", "rb");
+  if (file == NULL) FAIL();
+  uint8_t gz[2000];
+  if (fread(gz, 1, sizeof (gz), file) != sizeof (gz)) FAIL();
+  fclose(file);
+  large = (uint8_t *) malloc(50 * 1000 * 1000);
+  // 2000 bytes of text compress to no less than a sixth of their size
+  uint8_t *past = large + 6 * sizeof (gz);
+  memset(past, 0xA5, 4096);
+  if (inflate_member(gz, sizeof (gz), large, 50 * 1000 * 1000, &result) !=
+      INFLATE_TRUNCATED) FAIL();
+  if (result.produced > 6 * sizeof (gz)) FAIL();
+  for (int i = 0; i < 4096; ++i) {
+    if (past[i] != 0xA5) {
+      FAIL();
+      break;
+    }
+  }
+  free(large);
+
+  // A match reaching before the output, with enough input left for the
+  // fast loop
+  uint8_t invalid[64];
+  memset(invalid, 0, sizeof (invalid));
+  bitwriter_t bw = { invalid, invalid + sizeof (invalid), 0, 0, 0 };
+  put_bits(&bw, 1, 1);
+  put_bits(&bw, 1, 2);
+  put_fixed_litlen(&bw, 'a');
+  put_fixed_match(&bw, 3, 2);
+  put_fixed_litlen(&bw, DEFLATE_END_BLOCK_VALUE);
+  flush_bits(&bw);
+  if (inflate(invalid, sizeof (invalid), output, size, NULL) !=
+      INFLATE_INVALID_DATA) FAIL();
+
+  free(output);
+  free(compressed);
+  free(buf);
+  return totalres;
+}
+
+/**
+ * Writes a final dynamic block made of the given literal/length symbols,
+ * whose code is 'a': 10, 257: 11, end of block: 0, and whose distance code
+ * has a single unused symbol (HDIST = 1, length 0).
+ */
+size_t make_literal_block(const uint16_t *symbols, size_t count,
+                          uint8_t *output, size_t size) {
+  bitwriter_t bw = { output, output + size, 0, 0, 0 };
+  put_bits(&bw, 1, 1);
+  put_bits(&bw, 2, 2);
+  put_bits(&bw, 258 - 257, 5);  // HLIT
+  put_bits(&bw, 1 - 1, 5);      // HDIST
+  put_bits(&bw, 18 - 4, 4);     // HCLEN
+  // 0: 00, 1: 01, 2: 10, 18: 11 in the code length code order
+  const uint8_t clens[18] = { 0, 0, 2, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2,
+                              0, 2 };
+  for (int i = 0; i < 18; ++i) put_bits(&bw, clens[i], 3);
+  put_bits(&bw, reverse_bits(3, 2), 2);   // 97 zeros
+  put_bits(&bw, 97 - 11, 7);
+  put_bits(&bw, reverse_bits(2, 2), 2);   // 'a'
+  put_bits(&bw, reverse_bits(3, 2), 2);   // 138 + 20 zeros
+  put_bits(&bw, 138 - 11, 7);
+  put_bits(&bw, reverse_bits(3, 2), 2);
+  put_bits(&bw, 20 - 11, 7);
+  put_bits(&bw, reverse_bits(1, 2), 2);   // end of block
+  put_bits(&bw, reverse_bits(2, 2), 2);   // 257
+  put_bits(&bw, reverse_bits(0, 2), 2);   // the distance
+  for (size_t i = 0; i < count; ++i) {
+    if (symbols[i] == DEFLATE_END_BLOCK_VALUE) put_bits(&bw, 0, 1);
+    else put_bits(&bw, reverse_bits(symbols[i] == 'a' ? 2 : 3, 2), 2);
+  }
+  put_bits(&bw, 0, 1);
+  flush_bits(&bw);
+  return bw.ptr - output;
+}
+
+uint8_t test_empty_distance_code() {
+  uint8_t totalres = 0;
+  // No code at all
+  uint8_t lengths[DEFLATE_MAX_DISTANCE_VALUE + 1];
+  memset(lengths, 0, sizeof (lengths));
+  huffman_entry_t table[DISTANCE_TABLE_SIZE];
+  if (build_decode_table(lengths, 1, DISTANCE_TABLE_BITS, table,
+      DISTANCE_TABLE_SIZE) != 0) FAIL();
+  if (build_decode_table(lengths, sizeof (lengths), DISTANCE_TABLE_BITS,
+      table, DISTANCE_TABLE_SIZE) != 0) FAIL();
+  if (!(table[0] & HUFFMAN_ENTRY_INVALID)) FAIL();
+
+  // A block of literals only
+  uint16_t symbols[40];
+  for (size_t i = 0; i < 40; ++i) symbols[i] = 'a';
+  uint8_t gz[128] = { 0x1F, 0x8B, 0x08, 0, 0, 0, 0, 0, 0, 0xFF };
+  size_t size = 10 + make_literal_block(symbols, 40, gz + 10,
+    sizeof (gz) - 18);
+  uint8_t output[64];
+  inflate_result_t result;
+  if (inflate(gz + 10, size - 10, output, sizeof (output), &result) !=
+      INFLATE_OK) FAIL();
+  if (result.produced != 40 || output[0] != 'a' || output[39] != 'a') FAIL();
+  uint32_t crc = crc32_update(0, output, 40);
+  for (int i = 0; i < 4; ++i) {
+    gz[size + i] = crc >> (8 * i);
+    gz[size + 4 + i] = 40 >> (8 * i);
+  }
+  inflate_stream_t *stream = inflate_init();
+  stream->next_in = gz;
+  stream->avail_in = size + 8;
+  stream->next_out = output;
+  stream->avail_out = sizeof (output);
+  if (inflate_step(stream) != INFLATE_STREAM_END) FAIL();
+  if (stream->total_out != 40) FAIL();
+  inflate_end(stream);
+
+  // Only using the distance code fails
+  symbols[1] = 257;
+  size = 10 + make_literal_block(symbols, 40, gz + 10, sizeof (gz) - 18);
+  if (inflate(gz + 10, size - 10, output, sizeof (output), NULL) !=
+      INFLATE_INVALID_DATA) FAIL();
+  stream = inflate_init();
+  stream->next_in = gz;
+  stream->avail_in = size + 8;
+  stream->next_out = output;
+  stream->avail_out = sizeof (output);
+  if (inflate_step(stream) != INFLATE_STREAM_ERROR) FAIL();
+  inflate_end(stream);
+
+  return totalres;
+}
+
+/**
+ * Writes a gzip member of a final dynamic block decoding to "aaa", with HLIT
+ * and HDIST giving nlit and ndist code lengths. All are 0 but those of 'a',
+ * 257 and, if eob is set, end of block.
+ */
+size_t make_header_member(uint16_t nlit, uint8_t ndist, int eob,
+                          uint8_t *output, size_t size) {
+  const uint8_t header[] = { 0x1F, 0x8B, 0x08, 0, 0, 0, 0, 0, 0, 0xFF };
+  memcpy(output, header, sizeof (header));
+  bitwriter_t bw = { output + 10, output + size - 8, 0, 0, 0 };
+  put_bits(&bw, 1, 1);
+  put_bits(&bw, 2, 2);
+  put_bits(&bw, nlit - 257, 5);  // HLIT
+  put_bits(&bw, ndist - 1, 5);   // HDIST
+  put_bits(&bw, 18 - 4, 4);      // HCLEN
+  // 0: 00, 1: 01, 2: 10, 18: 11 in the code length code order
+  const uint8_t clens[18] = { 0, 0, 2, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2,
+                              0, 2 };
+  for (int i = 0; i < 18; ++i) put_bits(&bw, clens[i], 3);
+  // 'a': 0, then end of block: 10 and 257: 11, or 257: 1
+  for (uint16_t i = 0; i < nlit + ndist; ++i) {
+    uint8_t length = 0;
+    if (i == 'a') length = 1;
+    if (i == DEFLATE_END_BLOCK_VALUE && eob) length = 2;
+    if (i == DEFLATE_END_BLOCK_VALUE + 1) length = eob ? 2 : 1;
+    put_bits(&bw, reverse_bits(length, 2), 2);
+  }
+  for (int i = 0; i < 3; ++i) put_bits(&bw, 0, 1);
+  if (eob) put_bits(&bw, reverse_bits(2, 2), 2);
+  flush_bits(&bw);
+  size_t length = bw.ptr - output;
+  uint32_t crc = crc32_update(0, (const uint8_t *) "aaa", 3);
+  for (int i = 0; i < 4; ++i) {
+    output[length + i] = crc >> (8 * i);
+    output[length + 4 + i] = 3 >> (8 * i);
+  }
+  return length + 8;
+}
+
+/**
+ * Decodes the member in buf with a stream fed chunk bytes at a time.
+ */
+int inflate_stream_chunks(uint8_t *buf, size_t size, size_t chunk) {
+  uint8_t output[64];
+  inflate_stream_t *stream = inflate_init();
+  stream->next_out = output;
+  stream->avail_out = sizeof (output);
+  int res = INFLATE_STREAM_OK;
+  for (size_t in = 0; res == INFLATE_STREAM_OK && in < size; in += chunk) {
+    stream->next_in = buf + in;
+    stream->avail_in = in + chunk < size ? chunk : size - in;
+    res = inflate_step(stream);
+  }
+  inflate_end(stream);
+  return res;
+}
+
+uint8_t test_dynamic_header_limits() {
+  uint8_t totalres = 0;
+  uint8_t gz[128];
+  uint8_t output[64];
+  inflate_result_t result;
+  // The largest valid header
+  size_t size = make_header_member(286, 30, 1, gz, sizeof (gz));
+  if (inflate(gz + 10, size - 18, output, sizeof (output), &result) !=
+      INFLATE_OK) FAIL();
+  if (result.produced != 3 || memcmp(output, "aaa", 3) != 0) FAIL();
+  if (inflate_stream_chunks(gz, size, size) != INFLATE_STREAM_END) FAIL();
+  if (inflate_stream_chunks(gz, size, 1) != INFLATE_STREAM_END) FAIL();
+
+  // Too many literal/length or distance codes, or no end-of-block code, are
+  // rejected by the fast paths as by the state machine
+  const struct { uint16_t nlit; uint8_t ndist; int eob; } invalid[] = {
+    { 287, 30, 1 }, { 288, 30, 1 }, { 286, 31, 1 }, { 286, 32, 1 },
+    { 257, 1, 0 }, { 286, 30, 0 }
+  };
+  for (size_t i = 0; i < sizeof (invalid) / sizeof (invalid[0]); ++i) {
+    size = make_header_member(invalid[i].nlit, invalid[i].ndist,
+      invalid[i].eob, gz, sizeof (gz));
+    if (inflate(gz + 10, size - 18, output, sizeof (output), NULL) !=
+        INFLATE_INVALID_DATA) FAIL();
+    if (inflate_stream_chunks(gz, size, size) != INFLATE_STREAM_ERROR) FAIL();
+    if (inflate_stream_chunks(gz, size, 1) != INFLATE_STREAM_ERROR) FAIL();
+  }
   return totalres;
 }
 
@@ -299,13 +1583,34 @@ int main(int argc, char **argv) {
   totalres += test_count_by_code_length();
   totalres += test_generate_next_codes();
   totalres += test_tobin();
-  totalres += test_generate_dict();
+  totalres += test_build_decode_table();
+  totalres += test_long_codes();
   totalres += test_static_dict();
   totalres += test_code_length_dict();
-  totalres += test_READ_INV();
-  totalres += test_READ();
+  totalres += test_bitreader();
   totalres += test_distance_static_dictionary();
   totalres += test_decode();
+  totalres += test_crc32();
+  totalres += test_fused_crc();
+  totalres += test_inflate_stream();
+  totalres += test_inflate_members();
+  totalres += test_thread_pool_stealing();
+  totalres += test_pipe_writer();
+  totalres += test_input();
+  totalres += test_pipeline();
+  totalres += test_uring();
+  totalres += test_get_metadata();
+  totalres += test_concurrent_decoders();
+  totalres += test_inflate_parallel();
+  totalres += test_index();
+  totalres += test_fixed_tables();
+  totalres += test_deflate_fixed();
+  totalres += test_index_file();
+  totalres += test_bgzf();
+  totalres += test_match_copy();
+  totalres += test_inflate_tail();
+  totalres += test_empty_distance_code();
+  totalres += test_dynamic_header_limits();
 
   return totalres;
 }
@@ -0,0 +1,195 @@
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/**
+ * Minimal thread pool running `count` independent tasks on `threads` threads.
+ * Tasks are handed out one at a time from a shared counter, so that a long
+ * task does not hold back the ones after it.
+ */
+typedef void (*thread_pool_task_t)(size_t index, void *context);
+
+typedef struct thread_pool_s {
+  thread_pool_task_t task;
+  void *context;
+  size_t count;
+  size_t next;  // the index of the next task to run, shared by the workers
+} thread_pool_t;
+
+/**
+ * Returns the number of online CPUs, at least 1.
+ */
+unsigned thread_pool_cpu_count() {
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (unsigned) count : 1;
+}
+
+void *thread_pool_worker(void *arg) {
+  thread_pool_t *pool = (thread_pool_t *) arg;
+  for (;;) {
+    size_t index = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+    if (index >= pool->count) break;
+    pool->task(index, pool->context);
+  }
+  return NULL;
+}
+
+/**
+ * Calls task(i, context) for i in [0, count) and returns once they are all
+ * done. The calling thread takes part in the work, so threads == 1 runs all
+ * the tasks in order without creating any thread.
+ */
+void thread_pool_run(size_t count, unsigned threads, thread_pool_task_t task,
+                     void *context) {
+  thread_pool_t pool = { task, context, count, 0 };
+  if (threads > count) threads = count;
+  if (threads == 0) threads = 1;
+  pthread_t workers[threads];
+  unsigned started = 0;
+  for (; started < threads - 1; ++started) {
+    if (pthread_create(&workers[started], NULL, thread_pool_worker, &pool) != 0)
+      break; // the remaining workers will take over
+  }
+  thread_pool_worker(&pool);
+  for (unsigned i = 0; i < started; ++i) {
+    pthread_join(workers[i], NULL);
+  }
+}
+
+/**
+ * Work-stealing variant of thread_pool_run, for tasks of very different
+ * lengths with some state to keep per worker.
+ * Each worker starts with its own contiguous range of the tasks, see
+ * thread_pool_range_begin, which it runs from the front. A worker done with
+ * its range steals the back half of the range of the worker with the most
+ * tasks left. task receives the index of the worker running it, in
+ * [0, threads), the calling thread being worker 0.
+ */
+typedef void (*thread_pool_worker_task_t)(size_t index, unsigned worker,
+                                          void *context);
+
+typedef struct thread_pool_range_s {
+  pthread_mutex_t lock;
+  size_t next;  // the next task to run
+  size_t end;   // the end of the range
+} thread_pool_range_t;
+
+typedef struct thread_pool_stealing_s {
+  thread_pool_worker_task_t task;
+  void *context;
+  thread_pool_range_t *ranges;
+  unsigned threads;
+} thread_pool_stealing_t;
+
+typedef struct thread_pool_worker_s {
+  thread_pool_stealing_t *pool;
+  unsigned worker;
+} thread_pool_worker_t;
+
+/**
+ * Returns the first task of the initial range of a worker. The ranges differ
+ * in size by one at most, the first count % threads ones being the longer.
+ */
+static inline size_t thread_pool_range_begin(size_t count, unsigned threads,
+                                             unsigned worker) {
+  size_t begin = worker * (count / threads);
+  return begin + (worker < count % threads ? worker : count % threads);
+}
+
+/**
+ * Moves the back half of the largest range left to the (empty) range of the
+ * worker. Returns 0 if there is nothing left to steal.
+ */
+int thread_pool_steal(thread_pool_stealing_t *pool, unsigned worker) {
+  for (;;) {
+    unsigned victim = worker;
+    size_t largest = 0;
+    for (unsigned i = 0; i < pool->threads; ++i) {
+      thread_pool_range_t *range = &pool->ranges[i];
+      pthread_mutex_lock(&range->lock);
+      size_t left = range->end - range->next;
+      pthread_mutex_unlock(&range->lock);
+      if (left > largest) {
+        largest = left;
+        victim = i;
+      }
+    }
+    if (largest == 0) return 0;
+    // The victim may have run some of its tasks since, or been stolen from
+    thread_pool_range_t *range = &pool->ranges[victim];
+    pthread_mutex_lock(&range->lock);
+    size_t left = range->end - range->next;
+    size_t begin = range->next + left / 2;
+    size_t end = range->end;
+    range->end = begin;
+    pthread_mutex_unlock(&range->lock);
+    if (begin == end) continue;
+    range = &pool->ranges[worker];
+    pthread_mutex_lock(&range->lock);
+    range->next = begin;
+    range->end = end;
+    pthread_mutex_unlock(&range->lock);
+    return 1;
+  }
+}
+
+void *thread_pool_stealing_worker(void *arg) {
+  thread_pool_worker_t *self = (thread_pool_worker_t *) arg;
+  thread_pool_stealing_t *pool = self->pool;
+  thread_pool_range_t *range = &pool->ranges[self->worker];
+  for (;;) {
+    pthread_mutex_lock(&range->lock);
+    size_t index = range->next < range->end ? range->next++ : SIZE_MAX;
+    pthread_mutex_unlock(&range->lock);
+    if (index != SIZE_MAX) {
+      pool->task(index, self->worker, pool->context);
+    } else if (!thread_pool_steal(pool, self->worker)) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Calls task(i, worker, context) for i in [0, count) on up to `threads`
+ * threads and returns once they are all done. Returns the number of workers
+ * used, at most `threads`: the state per worker of the context must be
+ * allocated for `threads` workers.
+ */
+unsigned thread_pool_run_stealing(size_t count, unsigned threads,
+                                  thread_pool_worker_task_t task,
+                                  void *context) {
+  if (threads > count) threads = count;
+  if (threads == 0) threads = 1;
+  thread_pool_range_t ranges[threads];
+  thread_pool_worker_t args[threads];
+  thread_pool_stealing_t pool = { task, context, ranges, threads };
+  for (unsigned i = 0; i < threads; ++i) {
+    pthread_mutex_init(&ranges[i].lock, NULL);
+    ranges[i].next = thread_pool_range_begin(count, threads, i);
+    ranges[i].end = thread_pool_range_begin(count, threads, i + 1);
+    args[i].pool = &pool;
+    args[i].worker = i;
+  }
+  pthread_t workers[threads];
+  unsigned started = 1;
+  for (; started < threads; ++started) {
+    if (pthread_create(&workers[started], NULL, thread_pool_stealing_worker,
+        &args[started]) != 0)
+      break; // the ranges of the missing workers will be stolen
+  }
+  thread_pool_stealing_worker(&args[0]);
+  for (unsigned i = 1; i < started; ++i) {
+    pthread_join(workers[i], NULL);
+  }
+  for (unsigned i = 0; i < threads; ++i) {
+    pthread_mutex_destroy(&ranges[i].lock);
+  }
+  return threads;
+}
+
+#endif // __THREAD_POOL_H__
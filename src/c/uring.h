@@ -0,0 +1,349 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+/**
+ * Batched file I/O with io_uring, for the batch mode of gziped (--uring).
+ *
+ * Decompressing many small files costs more in system calls than in decoding:
+ * open, fstat, mmap, munmap and close for each input, open, write and close
+ * for each output. Here, the files of a batch are read, and then written,
+ * up to URING_DEPTH at a time, with a single io_uring_enter each time. Each
+ * file takes a chain of three requests: open, read or write, and close. The
+ * descriptors are direct ones, slots of a table registered with the ring,
+ * so that the read or the write can follow the open in the same chain, and
+ * no regular descriptor is created. The inputs are read into registered
+ * buffers, of URING_BUFFER_SIZE bytes each, which the kernel does not have
+ * to map for each read.
+ *
+ * The chains are hard links: a request runs even if the previous one failed,
+ * so that the close is never cancelled, and the first error of the chain is
+ * the one reported.
+ *
+ * The ring is set up with the raw system calls, liburing not being needed.
+ * Where io_uring is missing, or too old for direct descriptors (Linux 5.15),
+ * uring_init or the first uring_read_files return an error, and the caller
+ * falls back to the POSIX calls.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define URING_SUPPORTED 1
+#endif
+#endif
+
+#define URING_DEPTH 16  // files in flight per ring
+#define URING_BUFFER_SIZE (256 * 1024)
+#define URING_CHAIN 3   // requests per file
+
+#if defined(URING_SUPPORTED)
+
+typedef struct uring_s {
+  int fd;
+  unsigned sq_tail;       // the tail of the submission queue, not published yet
+  unsigned *sq_head_ptr;
+  unsigned *sq_tail_ptr;
+  unsigned sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head_ptr;
+  unsigned *cq_tail_ptr;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_map;
+  size_t sq_map_size;
+  void *cq_map;           // sq_map with IORING_FEAT_SINGLE_MMAP
+  size_t cq_map_size;
+  size_t sqes_size;
+  uint8_t *buffers;       // URING_DEPTH registered buffers
+  int direct;             // 1 once a direct open has succeeded
+} uring_t;
+
+void uring_free(uring_t *ring) {
+  if (ring->buffers != NULL) {
+    munmap(ring->buffers, (size_t) URING_DEPTH * URING_BUFFER_SIZE);
+  }
+  if (ring->sqes != NULL) munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_map != NULL && ring->cq_map != ring->sq_map)
+    munmap(ring->cq_map, ring->cq_map_size);
+  if (ring->sq_map != NULL) munmap(ring->sq_map, ring->sq_map_size);
+  if (ring->fd >= 0) close(ring->fd);
+  memset(ring, 0, sizeof (uring_t));
+  ring->fd = -1;
+}
+
+static inline void *uring_map(int fd, size_t size, off_t offset) {
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, fd, offset);
+  return map == MAP_FAILED ? NULL : map;
+}
+
+/**
+ * Checks that the kernel supports the requests used here.
+ */
+static int uring_probe(uring_t *ring) {
+  static const uint8_t opcodes[] = {
+    IORING_OP_OPENAT, IORING_OP_READ_FIXED, IORING_OP_WRITE, IORING_OP_CLOSE
+  };
+  size_t size = sizeof (struct io_uring_probe) +
+    256 * sizeof (struct io_uring_probe_op);
+  struct io_uring_probe *probe = (struct io_uring_probe *) calloc(1, size);
+  if (probe == NULL) return -ENOMEM;
+  int res = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE,
+    probe, 256);
+  if (res < 0) res = -errno;
+  for (size_t i = 0; res >= 0 && i < sizeof (opcodes); ++i) {
+    if (opcodes[i] > probe->last_op ||
+        !(probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED)) res = -ENOSYS;
+  }
+  free(probe);
+  return res < 0 ? res : 0;
+}
+
+/**
+ * Sets up ring, with its buffers and its table of descriptors. Returns 0 on
+ * success, or -errno, in which case nothing is left to free.
+ */
+int uring_init(uring_t *ring) {
+  memset(ring, 0, sizeof (uring_t));
+  struct io_uring_params params;
+  memset(&params, 0, sizeof (params));
+  ring->fd = syscall(__NR_io_uring_setup, URING_DEPTH * URING_CHAIN, &params);
+  if (ring->fd < 0) {
+    int error = errno;
+    ring->fd = -1;
+    return -error;
+  }
+  ring->sq_map_size = params.sq_off.array +
+    params.sq_entries * sizeof (unsigned);
+  ring->cq_map_size = params.cq_off.cqes +
+    params.cq_entries * sizeof (struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_map_size > ring->sq_map_size)
+      ring->sq_map_size = ring->cq_map_size;
+    ring->sq_map = uring_map(ring->fd, ring->sq_map_size, IORING_OFF_SQ_RING);
+    ring->cq_map = ring->sq_map;
+  } else {
+    ring->sq_map = uring_map(ring->fd, ring->sq_map_size, IORING_OFF_SQ_RING);
+    ring->cq_map = uring_map(ring->fd, ring->cq_map_size, IORING_OFF_CQ_RING);
+  }
+  ring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe *) uring_map(ring->fd, ring->sqes_size,
+    IORING_OFF_SQES);
+  if (ring->sq_map == NULL || ring->cq_map == NULL || ring->sqes == NULL) {
+    int error = errno;
+    uring_free(ring);
+    return -error;
+  }
+  uint8_t *sq = (uint8_t *) ring->sq_map;
+  uint8_t *cq = (uint8_t *) ring->cq_map;
+  ring->sq_head_ptr = (unsigned *) (sq + params.sq_off.head);
+  ring->sq_tail_ptr = (unsigned *) (sq + params.sq_off.tail);
+  ring->sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+  ring->sq_tail = *ring->sq_tail_ptr;
+  ring->cq_head_ptr = (unsigned *) (cq + params.cq_off.head);
+  ring->cq_tail_ptr = (unsigned *) (cq + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+  int res = uring_probe(ring);
+  if (res == 0) {
+    void *buffers = mmap(NULL, (size_t) URING_DEPTH * URING_BUFFER_SIZE,
+      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers == MAP_FAILED) res = -errno;
+    else ring->buffers = (uint8_t *) buffers;
+  }
+  if (res == 0) {
+    struct iovec iovecs[URING_DEPTH];
+    for (unsigned i = 0; i < URING_DEPTH; ++i) {
+      iovecs[i].iov_base = ring->buffers + (size_t) i * URING_BUFFER_SIZE;
+      iovecs[i].iov_len = URING_BUFFER_SIZE;
+    }
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS,
+        iovecs, URING_DEPTH) < 0) res = -errno;
+  }
+  if (res == 0) {
+    // Empty slots, for the direct opens to fill
+    int fds[URING_DEPTH];
+    for (unsigned i = 0; i < URING_DEPTH; ++i) fds[i] = -1;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES,
+        fds, URING_DEPTH) < 0) res = -errno;
+  }
+  if (res != 0) uring_free(ring);
+  return res;
+}
+
+/**
+ * Returns the registered buffer of slot, which uring_read_files reads into.
+ */
+static inline uint8_t *uring_buffer(uring_t *ring, unsigned slot) {
+  return ring->buffers + (size_t) slot * URING_BUFFER_SIZE;
+}
+
+static inline struct io_uring_sqe *uring_sqe(uring_t *ring, uint8_t opcode,
+                                             unsigned slot, unsigned step) {
+  unsigned index = ring->sq_tail++ & ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof (struct io_uring_sqe));
+  ring->sq_array[index] = index;
+  sqe->opcode = opcode;
+  sqe->user_data = (uint64_t) slot * URING_CHAIN + step;
+  return sqe;
+}
+
+static inline void uring_prep_open(uring_t *ring, unsigned slot,
+                                   const char *path, int flags, mode_t mode) {
+  struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_OPENAT, slot, 0);
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uint64_t) (uintptr_t) path;
+  sqe->open_flags = flags; // O_CLOEXEC is refused for direct descriptors
+  sqe->len = mode;
+  sqe->file_index = slot + 1; // 0 is for a regular descriptor
+  sqe->flags = IOSQE_IO_HARDLINK;
+}
+
+static inline void uring_prep_close(uring_t *ring, unsigned slot) {
+  struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_CLOSE, slot, 2);
+  sqe->file_index = slot + 1;
+}
+
+/**
+ * Submits the chains prepared for count files, and waits for all of them.
+ * results[slot] receives the result of the read or write of the chain, or
+ * the first error of the chain, as -errno. Returns 0, or -errno if the ring
+ * failed.
+ */
+static int uring_run(uring_t *ring, unsigned count, ssize_t *results) {
+  __atomic_store_n(ring->sq_tail_ptr, ring->sq_tail, __ATOMIC_RELEASE);
+  int failed[URING_DEPTH] = { 0 };
+  unsigned left = count * URING_CHAIN;
+  while (left > 0) {
+    unsigned head = *ring->cq_head_ptr;
+    unsigned tail = __atomic_load_n(ring->cq_tail_ptr, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head, --left) {
+      struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+      unsigned slot = cqe->user_data / URING_CHAIN;
+      unsigned step = cqe->user_data % URING_CHAIN;
+      if (step == 0 && cqe->res >= 0) ring->direct = 1;
+      if (failed[slot]) continue;
+      if (cqe->res < 0 && step != 2) {
+        failed[slot] = 1;
+        results[slot] = cqe->res;
+      } else if (step == 1) {
+        results[slot] = cqe->res;
+      }
+    }
+    __atomic_store_n(ring->cq_head_ptr, head, __ATOMIC_RELEASE);
+    if (left == 0) break;
+    unsigned submit = ring->sq_tail -
+      __atomic_load_n(ring->sq_head_ptr, __ATOMIC_ACQUIRE);
+    if (syscall(__NR_io_uring_enter, ring->fd, submit, left,
+        IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+      return -errno;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Reads the files of paths, count at most URING_DEPTH, into the buffers of
+ * the slots 0 to count - 1. sizes[slot] receives the number of bytes read,
+ * URING_BUFFER_SIZE for a file which may be larger, or -errno. Returns 0,
+ * or -errno if the ring cannot be used.
+ */
+int uring_read_files(uring_t *ring, const char *const *paths, unsigned count,
+                     ssize_t *sizes) {
+  for (unsigned slot = 0; slot < count; ++slot) {
+    uring_prep_open(ring, slot, paths[slot], O_RDONLY, 0);
+    struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_READ_FIXED, slot, 1);
+    sqe->fd = slot;
+    sqe->addr = (uint64_t) (uintptr_t) uring_buffer(ring, slot);
+    sqe->len = URING_BUFFER_SIZE;
+    sqe->buf_index = slot;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    uring_prep_close(ring, slot);
+  }
+  int res = uring_run(ring, count, sizes);
+  if (res != 0) return res;
+  // Without direct descriptors, every open fails with EINVAL
+  for (unsigned slot = 0; !ring->direct && slot < count; ++slot) {
+    if (sizes[slot] == -EINVAL) return -EINVAL;
+  }
+  return 0;
+}
+
+/**
+ * Writes sizes[slot] bytes of data[slot] to the file at paths[slot], created
+ * or truncated, for the count files. errors[slot] receives 0 or the errno
+ * of the failure. Returns 0, or -errno if the ring failed.
+ */
+int uring_write_files(uring_t *ring, const char *const *paths,
+                      uint8_t *const *data, const size_t *sizes,
+                      unsigned count, int *errors) {
+  ssize_t results[URING_DEPTH];
+  for (unsigned slot = 0; slot < count; ++slot) {
+    uring_prep_open(ring, slot, paths[slot], O_WRONLY | O_CREAT | O_TRUNC,
+      S_IRUSR | S_IWUSR | S_IRGRP);
+    struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_WRITE, slot, 1);
+    sqe->fd = slot;
+    sqe->addr = (uint64_t) (uintptr_t) data[slot];
+    sqe->len = sizes[slot];
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    uring_prep_close(ring, slot);
+  }
+  int res = uring_run(ring, count, results);
+  if (res != 0) return res;
+  for (unsigned slot = 0; slot < count; ++slot) {
+    errors[slot] = results[slot] < 0 ? (int) -results[slot] :
+      (size_t) results[slot] != sizes[slot] ? EIO : 0;
+  }
+  return 0;
+}
+
+#else
+
+// Without io_uring, the ring cannot be set up, and the caller falls back
+typedef struct uring_s {
+  int fd;
+} uring_t;
+
+void uring_free(uring_t *ring) {
+  ring->fd = -1;
+}
+
+int uring_init(uring_t *ring) {
+  ring->fd = -1;
+  return -ENOSYS;
+}
+
+static inline uint8_t *uring_buffer(uring_t *ring, unsigned slot) {
+  return NULL;
+}
+
+int uring_read_files(uring_t *ring, const char *const *paths, unsigned count,
+                     ssize_t *sizes) {
+  return -ENOSYS;
+}
+
+int uring_write_files(uring_t *ring, const char *const *paths,
+                      uint8_t *const *data, const size_t *sizes,
+                      unsigned count, int *errors) {
+  return -ENOSYS;
+}
+
+#endif // URING_SUPPORTED
+
+#endif // __URING_H__
@@ -3,10 +3,11 @@ function inflateWA(buffer, mark) {
   const metadata = Gziped.getMetadata(content);
   const output = Module._malloc(metadata.filesize);
   // We could allocate once and always copy the data into the same place
-  const input = Module._malloc((content.length + metadata.offset) * content.BYTES_PER_ELEMENT);
+  const size = content.length - metadata.offset;
+  const input = Module._malloc(size * content.BYTES_PER_ELEMENT);
   Module.HEAP8.set(content.slice(metadata.offset), input);
   performance.mark(`${mark}-start`);
-  Module._em_inflate(input, output);
+  Module._em_inflate(input, size, output, metadata.filesize);
   performance.mark(`${mark}-end`);
   performance.measure(mark, `${mark}-start`, `${mark}-end`);
   Module._free(input);
@@ -110,10 +111,11 @@ window.test = () => {
       const metadata = Gziped.getMetadata(content);
       const output = Module._malloc(metadata.filesize);
       // We could allocate once and always copy the data into the same place
-      const input = Module._malloc((content.length - metadata.offset) * content.BYTES_PER_ELEMENT);
+      const size = content.length - metadata.offset;
+      const input = Module._malloc(size * content.BYTES_PER_ELEMENT);
       Module.HEAPU8.set(content.slice(metadata.offset), input);
       const then = performance.now();
-      window._inflateWA(input, output);
+      window._inflateWA(input, size, output, metadata.filesize);
       console.log(performance.now() - then);
       window.output = output;
       window.metadata = metadata;
@@ -2,6 +2,7 @@
 #include <emscripten.h>
 
 EMSCRIPTEN_KEEPALIVE
-void em_inflate(uint8_t *buf, uint8_t *output) {
-  inflate(buf, output);
+int em_inflate(uint8_t *buf, size_t size, uint8_t *output,
+               size_t output_size) {
+  return inflate(buf, size, output, output_size, NULL);
 }
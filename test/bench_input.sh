@@ -0,0 +1,79 @@
+#!/bin/bash
+
+# Compares the input methods of gziped (--input) on the given gzip files,
+# with the files in the page cache (warm) and evicted from it (cold).
+# The files are evicted with dd iflag=nocache, which needs GNU dd, and only
+# works on files which are not being written back.
+
+if [[ $# -lt 2 ]];
+then
+  echo "usage: ./bench_input.sh ../src/c/gziped <file.gz>... [-- <options>]"
+  echo "  options are passed to gziped, e.g. -- -j 4 --mmap"
+  exit 1
+fi
+
+BIN=$(realpath $1)
+shift
+if [[ ! -x $BIN ]];
+then
+  echo "$BIN: file is not executable"
+  exit 2
+fi
+
+FILES=()
+while [[ $# -gt 0 && $1 != "--" ]];
+do
+  FILES+=($(realpath $1))
+  shift
+done
+[[ $1 == "--" ]] && shift
+OPTIONS=("$@")
+RUNS=${RUNS:-3}
+
+TMPDIR=$(mktemp -d)
+cd $TMPDIR
+
+evict() {
+  for file in "${FILES[@]}";
+  do
+    dd if=$file iflag=nocache count=0 status=none
+  done
+}
+
+warm() {
+  cat "${FILES[@]}" > /dev/null
+}
+
+size=$(cat "${FILES[@]}" | wc -c)
+printf "%-10s %-6s %10s %10s\n" method cache seconds "MB/s in"
+for method in mmap populate pread direct;
+do
+  for cache in cold warm;
+  do
+    best=""
+    for run in $(seq $RUNS);
+    do
+      if [[ $cache == cold ]]; then evict; else warm; fi
+      start=$(date +%s%N)
+      $BIN --input $method "${OPTIONS[@]}" "${FILES[@]}" 2> /dev/null
+      status=$?
+      end=$(date +%s%N)
+      if [[ $status -ne 0 ]];
+      then
+        echo "$method: gziped failed with status $status"
+        exit 3
+      fi
+      ns=$((end - start))
+      if [[ -z $best || $ns -lt $best ]];
+      then
+        best=$ns
+      fi
+    done
+    # In MB/s: bytes per nanosecond are GB/s
+    printf "%-10s %-6s %6d.%03d %10d\n" $method $cache $((best / 1000000000)) \
+      $((best / 1000000 % 1000)) $((size * 1000 / best))
+  done
+done
+
+cd - > /dev/null
+rm -fr $TMPDIR
@@ -4,9 +4,10 @@ RED='\033[0;31m'
 GREEN='\033[0;32m'
 NC='\033[0m'
 
-if [[ $# -ne 1 ]];
+if [[ $# -lt 1 || $# -gt 2 ]];
 then
-  echo "usage: ./test.sh ../src/c/gziped"
+  echo "usage: ./test.sh ../src/c/gziped [<corpus>]"
+  echo "  <corpus> is a folder written by tools/generate_corpus.py"
   exit 1
 fi
 
@@ -16,6 +17,14 @@ then
   exit 2
 fi
 
+if [[ -n $2 && ! -f $2/manifest.txt ]];
+then
+  echo "$2: no manifest.txt"
+  exit 2
+fi
+
+CORPUS=""
+[[ -n $2 ]] && CORPUS=$(realpath $2)
 TMPDIR=$(mktemp -d)
 CURDIR=$(pwd)
 cd $TMPDIR
@@ -44,6 +53,110 @@ for filename in $(ls $CURDIR/resources/ --ignore='*.gz'); do
   echo -e "${GREEN}\t\t\tOK${NC}"
 done
 
+for filename in $CURDIR/resources/*.gz; do
+  expected=${filename%.gz}
+  [[ -f $expected ]] || expected=$expected.txt
+  [[ -f $expected ]] || continue
+  echo -n "testing stdin for $(basename $expected)"
+  res=$($CURDIR/$1 - < $filename | cmp - $expected 2>&1)
+  if [[ $? -ne 0 ]];
+  then
+    echo -e "${RED}\t\tKO - different${NC}"
+    echo $res
+    failures=$((failures+1))
+    continue
+  fi
+  echo -e "${GREEN}\t\tOK${NC}"
+done
+
+# Several files through the same output while the reader lags behind, so
+# that the pipe still holds the pages of a file when the next one is decoded
+R=$CURDIR/resources
+echo -n "testing -c with a slow reader"
+res=$($CURDIR/$1 -c $R/gunzip.c.gz $R/a.gz $R/lesmiserables.gz $R/gunzip.c.gz \
+  | (sleep 0.3; cat) | cmp - <(cat $R/gunzip.c $R/a $R/lesmiserables.txt \
+  $R/gunzip.c) 2>&1)
+if [[ $? -ne 0 ]];
+then
+  echo -e "${RED}\t\tKO - different${NC}"
+  echo $res
+  failures=$((failures+1))
+else
+  echo -e "${GREEN}\t\tOK${NC}"
+fi
+echo -n "testing stdin with a slow reader"
+res=$($CURDIR/$1 - < $R/lesmiserables.gz | (sleep 0.2; cat) | \
+  cmp - $R/lesmiserables.txt 2>&1)
+if [[ $? -ne 0 ]];
+then
+  echo -e "${RED}\t\tKO - different${NC}"
+  echo $res
+  failures=$((failures+1))
+else
+  echo -e "${GREEN}\t\tOK${NC}"
+fi
+
+# Decompressed in place into the mapped output file, and, for a file of two
+# members whose size ISIZE does not give, written from a buffer instead
+for members in 1 2; do
+  echo -n "testing --mmap with $members member(s)"
+  rm -f lesmiserables.txt mmap.gz expected.txt
+  for i in $(seq $members); do
+    cat $R/lesmiserables.gz >> mmap.gz
+    cat $R/lesmiserables.txt >> expected.txt
+  done
+  res=$($CURDIR/$1 --mmap mmap.gz 2>&1 && cmp lesmiserables.txt expected.txt 2>&1)
+  if [[ $? -ne 0 ]];
+  then
+    echo -e "${RED}\t\tKO - different${NC}"
+    echo $res
+    failures=$((failures+1))
+    continue
+  fi
+  echo -e "${GREEN}\t\tOK${NC}"
+done
+
+# A truncated member whose ISIZE is forged to 4 GB: no output file that large
+# is created (the file size limit would kill the process), and the truncation
+# is reported at once
+echo -n "testing --mmap with a corrupt ISIZE"
+rm -f lesmiserables.txt mmap.gz
+head -c 2000 $R/lesmiserables.gz > mmap.gz
+printf '\x00\x00\x00\x00\x00\x28\x6b\xee' >> mmap.gz
+res=$( (ulimit -f 102400; timeout 10 $CURDIR/$1 --mmap mmap.gz) 2>&1)
+if [[ $? -ne 4 || -e lesmiserables.txt ]];
+then
+  echo -e "${RED}\t\tKO - not rejected${NC}"
+  echo $res
+  failures=$((failures+1))
+else
+  echo -e "${GREEN}\t\tOK${NC}"
+fi
+rm -f mmap.gz
+
+# The files of the corpus, checked against the size and CRC32 of its manifest
+if [[ -n $CORPUS ]];
+then
+  while read file size crc;
+  do
+    echo -n "testing corpus $file"
+    res=$($CURDIR/$1 -c $CORPUS/$file | python3 -c "
+import sys, zlib
+size = crc = 0
+for chunk in iter(lambda: sys.stdin.buffer.read(1 << 20), b''):
+  size += len(chunk)
+  crc = zlib.crc32(chunk, crc)
+print('%d %08x' % (size, crc))")
+    if [[ $res != "$size $crc" ]];
+    then
+      echo -e "${RED}\t\tKO - expected $size $crc, got $res${NC}"
+      failures=$((failures+1))
+      continue
+    fi
+    echo -e "${GREEN}\t\tOK${NC}"
+  done < $CORPUS/manifest.txt
+fi
+
 cd $CURDIR
 rm -fr $TMPDIR
 
@@ -0,0 +1,487 @@
+#!/usr/bin/env python3
+
+# Generates gzip files which stress specific paths of the decoder, and a
+# manifest of their expected output for test.sh and the benchmark:
+#
+#   <folder>/manifest.txt, one line per file: <file.gz> <size> <crc32>
+#
+# The files are written by the DEFLATE encoder below, which chooses the type
+# of every block and every match, and the output is checked with Python's
+# zlib. The multi-GB file is compressed by zlib itself, the encoder below
+# being far too slow for it. Its output is over 4 GiB, so that its ISIZE
+# wraps around.
+#
+# usage: generate_corpus.py [--large-size <size>] [--seed <n>] <folder>
+
+import argparse
+import os
+import random
+import struct
+import sys
+import zlib
+
+# https://tools.ietf.org/html/rfc1951#page-11
+LENGTH_BASE = [3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35,
+               43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258]
+LENGTH_EXTRA = [0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                4, 4, 4, 4, 5, 5, 5, 5, 0]
+DISTANCE_BASE = [1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+                 8193, 12289, 16385, 24577]
+DISTANCE_EXTRA = [0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8,
+                  9, 9, 10, 10, 11, 11, 12, 12, 13, 13]
+# Order of the code length code lengths in a dynamic block header
+CODE_LENGTH_ORDER = [16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2,
+                     14, 1, 15]
+END_OF_BLOCK = 256
+WINDOW_SIZE = 32768
+MAX_MATCH = 258
+
+def length_code(length):
+  # 258 has a code of its own, 285, not 284 with all its extra bits set
+  code = 28 if length == MAX_MATCH else \
+    max(i for i in range(28) if LENGTH_BASE[i] <= length)
+  return code, length - LENGTH_BASE[code]
+
+def distance_code(distance):
+  code = max(i for i in range(30) if DISTANCE_BASE[i] <= distance)
+  return code, distance - DISTANCE_BASE[code]
+
+class BitWriter:
+  def __init__(self):
+    self.out = bytearray()
+    self.acc = 0
+    self.count = 0
+
+  # Values are written starting from their least significant bit
+  def bits(self, value, count):
+    self.acc |= value << self.count
+    self.count += count
+    while self.count >= 8:
+      self.out.append(self.acc & 0xFF)
+      self.acc >>= 8
+      self.count -= 8
+
+  # Huffman codes are written starting from their most significant bit
+  def code(self, code, length):
+    self.bits(int(format(code, '0%db' % length)[::-1], 2), length)
+
+  def align(self):
+    if self.count > 0:
+      self.out.append(self.acc & 0xFF)
+    self.acc = 0
+    self.count = 0
+
+def canonical_codes(lengths):
+  # https://tools.ietf.org/html/rfc1951#page-8
+  max_length = max(lengths + [0])
+  counts = [0] * (max_length + 1)
+  for length in lengths:
+    if length:
+      counts[length] += 1
+  next_code = [0] * (max_length + 2)
+  code = 0
+  for bits in range(1, max_length + 1):
+    code = (code + counts[bits - 1]) << 1
+    next_code[bits] = code
+  codes = [0] * len(lengths)
+  for symbol, length in enumerate(lengths):
+    if length:
+      codes[symbol] = next_code[length]
+      next_code[length] += 1
+  return codes
+
+# Lengths of the Huffman code of freqs of at most limit bits (package-merge)
+def code_lengths(freqs, limit):
+  lengths = [0] * len(freqs)
+  leaves = sorted((freq, [symbol]) for symbol, freq in enumerate(freqs)
+                  if freq > 0)
+  if len(leaves) == 1:
+    lengths[leaves[0][1][0]] = 1
+    return lengths
+  packages = list(leaves)
+  for _ in range(limit - 1):
+    merged = [(packages[i][0] + packages[i + 1][0],
+               packages[i][1] + packages[i + 1][1])
+              for i in range(0, len(packages) - 1, 2)]
+    packages = sorted(leaves + merged, key=lambda package: package[0])
+  for _, symbols in packages[:2 * len(leaves) - 2]:
+    for symbol in symbols:
+      lengths[symbol] += 1
+  return lengths
+
+FIXED_LITERAL_LENGTHS = [8] * 144 + [9] * 112 + [7] * 24 + [8] * 8
+FIXED_DISTANCE_LENGTHS = [5] * 30
+
+# Tokens are a byte for a literal, or a (length, distance) tuple for a match
+def write_tokens(bw, tokens, literal_lengths, distance_lengths):
+  literal_codes = canonical_codes(literal_lengths)
+  distance_codes = canonical_codes(distance_lengths)
+  for token in tokens:
+    if isinstance(token, int):
+      bw.code(literal_codes[token], literal_lengths[token])
+      continue
+    length, distance = token
+    code, extra = length_code(length)
+    bw.code(literal_codes[257 + code], literal_lengths[257 + code])
+    bw.bits(extra, LENGTH_EXTRA[code])
+    code, extra = distance_code(distance)
+    bw.code(distance_codes[code], distance_lengths[code])
+    bw.bits(extra, DISTANCE_EXTRA[code])
+  bw.code(literal_codes[END_OF_BLOCK], literal_lengths[END_OF_BLOCK])
+
+def stored_block(bw, data, last):
+  bw.bits(last, 1)
+  bw.bits(0, 2)
+  bw.align()
+  bw.out += struct.pack('<HH', len(data), len(data) ^ 0xFFFF)
+  bw.out += data
+
+def fixed_block(bw, tokens, last):
+  bw.bits(last, 1)
+  bw.bits(1, 2)
+  write_tokens(bw, tokens, FIXED_LITERAL_LENGTHS, FIXED_DISTANCE_LENGTHS)
+
+def symbol_frequencies(tokens):
+  literals = [0] * 286
+  distances = [0] * 30
+  literals[END_OF_BLOCK] = 1
+  for token in tokens:
+    if isinstance(token, int):
+      literals[token] += 1
+    else:
+      literals[257 + length_code(token[0])[0]] += 1
+      distances[distance_code(token[1])[0]] += 1
+  return literals, distances
+
+# Run length encoding of the code lengths with the codes 16, 17 and 18
+def encode_lengths(lengths):
+  symbols = []
+  i = 0
+  while i < len(lengths):
+    run = 1
+    while i + run < len(lengths) and lengths[i + run] == lengths[i]:
+      run += 1
+    length = lengths[i]
+    if length == 0 and run >= 11:
+      run = min(run, 138)
+      symbols.append((18, run - 11, 7))
+    elif length == 0 and run >= 3:
+      symbols.append((17, run - 3, 3))
+    elif length != 0 and run >= 4:
+      run = min(run, 7)
+      symbols.append((length, 0, 0))
+      symbols.append((16, run - 4, 2))
+    else:
+      run = 1
+      symbols.append((length, 0, 0))
+    i += run
+  return symbols
+
+def dynamic_block(bw, tokens, last, freqs=None):
+  literals, distances = freqs or symbol_frequencies(tokens)
+  literal_lengths = code_lengths(literals, 15)
+  distance_lengths = code_lengths(distances, 15)
+  if not any(distance_lengths):
+    # A block without matches still has a distance code
+    distance_lengths[0] = 1
+  nlit = max(257, max(i for i in range(286) if literal_lengths[i]) + 1)
+  ndist = max(i for i in range(30) if distance_lengths[i]) + 1
+  symbols = encode_lengths(literal_lengths[:nlit] + distance_lengths[:ndist])
+  length_freqs = [0] * 19
+  for symbol, _, _ in symbols:
+    length_freqs[symbol] += 1
+  if sum(1 for freq in length_freqs if freq) == 1:
+    # zlib refuses an incomplete code length code, which one symbol would be
+    length_freqs[length_freqs.index(0)] = 1
+  length_lengths = code_lengths(length_freqs, 7)
+  length_codes = canonical_codes(length_lengths)
+  nclen = max(4, max(i for i in range(19)
+                     if length_lengths[CODE_LENGTH_ORDER[i]]) + 1)
+  bw.bits(last, 1)
+  bw.bits(2, 2)
+  bw.bits(nlit - 257, 5)
+  bw.bits(ndist - 1, 5)
+  bw.bits(nclen - 4, 4)
+  for i in range(nclen):
+    bw.bits(length_lengths[CODE_LENGTH_ORDER[i]], 3)
+  for symbol, extra, extra_bits in symbols:
+    bw.code(length_codes[symbol], length_lengths[symbol])
+    bw.bits(extra, extra_bits)
+  write_tokens(bw, tokens, literal_lengths, distance_lengths)
+
+# The output of tokens, appended to out
+def apply_tokens(tokens, out):
+  for token in tokens:
+    if isinstance(token, int):
+      out.append(token)
+      continue
+    length, distance = token
+    assert 0 < distance <= min(len(out), WINDOW_SIZE)
+    if distance >= length:
+      out += out[-distance:len(out) - distance + length]
+    else:
+      pattern = out[-distance:]
+      out += (pattern * (length // distance + 1))[:length]
+
+# Greedy LZ77 matching over data, with a single candidate per 3 bytes
+def lz77(data):
+  tokens = []
+  last = {}
+  i = 0
+  while i < len(data):
+    key = bytes(data[i:i + 3])
+    candidate = last.get(key)
+    last[key] = i
+    length = 0
+    if candidate is not None and i - candidate <= WINDOW_SIZE:
+      while length < MAX_MATCH and i + length < len(data) and \
+          data[candidate + length] == data[i + length]:
+        length += 1
+    if length >= 3:
+      tokens.append((length, i - candidate))
+      i += length
+    else:
+      tokens.append(data[i])
+      i += 1
+  return tokens
+
+def gzip_member(deflate, data):
+  # No name, no time: the file only depends on its content
+  header = bytes([0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 255])
+  trailer = struct.pack('<II', zlib.crc32(data), len(data) & 0xFFFFFFFF)
+  return header + bytes(deflate) + trailer
+
+WORDS = ('the of and to a in is that it was for on with he as his by at '
+         'from her had not but they which one all were she there would '
+         'barricade convent candlestick galley bishop').split()
+
+def text(rng, size):
+  out = bytearray()
+  while len(out) < size:
+    out += rng.choice(WORDS).encode()
+    out += b'\n' if rng.random() < 0.05 else b' '
+  return out[:size]
+
+def random_bytes(rng, size):
+  return bytearray(rng.randbytes(size))
+
+# Each generator returns the bit writer of the DEFLATE stream and the output
+def all_stored(rng):
+  bw = BitWriter()
+  out = bytearray()
+  # Empty, single byte and largest blocks, then sizes in between
+  sizes = [0, 1, 65535, 65535] + [rng.randrange(65536) for _ in range(16)]
+  for i, size in enumerate(sizes):
+    data = random_bytes(rng, size)
+    stored_block(bw, data, i == len(sizes) - 1)
+    out += data
+  return bw, out
+
+def all_fixed(rng):
+  bw = BitWriter()
+  out = bytearray()
+  data = text(rng, 1 << 20)
+  tokens = lz77(data)
+  blocks = [tokens[i:i + 4096] for i in range(0, len(tokens), 4096)]
+  for i, block in enumerate(blocks):
+    fixed_block(bw, block, i == len(blocks) - 1)
+    apply_tokens(block, out)
+  return bw, out
+
+def tiny_dynamic(rng):
+  bw = BitWriter()
+  out = bytearray()
+  blocks = 5000
+  for i in range(blocks):
+    size = rng.randrange(1, 48)
+    tokens = [rng.choice(b'abcdefgh') for _ in range(size)]
+    if out and rng.random() < 0.5:
+      tokens.append((rng.randrange(3, 20), rng.randrange(1, min(len(out),
+        WINDOW_SIZE) + 1)))
+    dynamic_block(bw, tokens, i == blocks - 1)
+    apply_tokens(tokens, out)
+  return bw, out
+
+def long_codes(rng):
+  # Fibonacci frequencies give the deepest Huffman trees: limited to 15 bits,
+  # the rarest literals, lengths and distances get 15 bit codes
+  fibonacci = [1, 1]
+  while len(fibonacci) < 30:
+    fibonacci.append(fibonacci[-1] + fibonacci[-2])
+  bw = BitWriter()
+  out = bytearray()
+  blocks = 4
+  for i in range(blocks):
+    literals = rng.sample(range(256), 24)
+    lengths = rng.sample(range(3, MAX_MATCH + 1), 20)
+    distances = rng.sample([DISTANCE_BASE[code] for code in range(30)], 20)
+    tokens = []
+    for rank, literal in enumerate(literals):
+      tokens += [literal] * fibonacci[rank]
+    for rank in range(20):
+      tokens += [(lengths[rank], distances[19 - rank])] * fibonacci[rank]
+    rng.shuffle(tokens)
+    # Matches only where the window is large enough for them
+    position = len(out)
+    valid = []
+    for token in tokens:
+      if isinstance(token, tuple) and token[1] > min(position, WINDOW_SIZE):
+        token = token[1] % 256
+      valid.append(token)
+      position += 1 if isinstance(token, int) else token[0]
+    freqs = symbol_frequencies(valid)
+    assert max(code_lengths(freqs[0], 15)) == 15
+    assert max(code_lengths(freqs[1], 15)) == 15
+    dynamic_block(bw, valid, i == blocks - 1, freqs)
+    apply_tokens(valid, out)
+  return bw, out
+
+def far_distances(rng):
+  bw = BitWriter()
+  out = random_bytes(rng, WINDOW_SIZE)
+  stored_block(bw, out, 0)
+  blocks = 16
+  for i in range(blocks):
+    tokens = []
+    for _ in range(512):
+      distance = rng.choice([WINDOW_SIZE, WINDOW_SIZE - 1, 24577, 16385])
+      tokens.append((rng.choice([3, 130, MAX_MATCH]), distance))
+      tokens.append(rng.getrandbits(8))
+    dynamic_block(bw, tokens, i == blocks - 1)
+    apply_tokens(tokens, out)
+  return bw, out
+
+def distance_one(rng):
+  bw = BitWriter()
+  out = bytearray()
+  blocks = 16
+  for i in range(blocks):
+    tokens = []
+    for _ in range(256):
+      # A byte repeated, as in images and sparse files
+      tokens.append(rng.getrandbits(8))
+      for _ in range(rng.randrange(1, 64)):
+        tokens.append((rng.choice([3, rng.randrange(3, MAX_MATCH), MAX_MATCH]),
+                       1))
+    dynamic_block(bw, tokens, i == blocks - 1)
+    apply_tokens(tokens, out)
+  return bw, out
+
+def max_matches(rng):
+  bw = BitWriter()
+  out = text(rng, 4096)
+  stored_block(bw, out, 0)
+  blocks = 16
+  for i in range(blocks):
+    tokens = [(MAX_MATCH, rng.randrange(1, min(len(out), WINDOW_SIZE) + 1))
+              for _ in range(2048)]
+    if i % 2:
+      fixed_block(bw, tokens, i == blocks - 1)
+    else:
+      dynamic_block(bw, tokens, i == blocks - 1)
+    apply_tokens(tokens, out)
+  return bw, out
+
+def mixed_blocks(rng):
+  # The three types of blocks one after the other, with matches across them
+  bw = BitWriter()
+  out = bytearray()
+  blocks = 300
+  for i in range(blocks):
+    data = text(rng, rng.randrange(1, 8192))
+    kind = rng.randrange(3)
+    if kind == 0:
+      stored_block(bw, data, i == blocks - 1)
+      out += data
+      continue
+    tokens = lz77(out[-WINDOW_SIZE:] + data)
+    # Only the tokens of data, the window being already decoded
+    skip = min(len(out), WINDOW_SIZE)
+    position = 0
+    first = 0
+    while position < skip:
+      token = tokens[first]
+      position += 1 if isinstance(token, int) else token[0]
+      first += 1
+    # A match across the end of the window: its end as literals
+    tokens = list(data[:position - skip]) + tokens[first:]
+    if kind == 1:
+      fixed_block(bw, tokens, i == blocks - 1)
+    else:
+      dynamic_block(bw, tokens, i == blocks - 1)
+    apply_tokens(tokens, out)
+  return bw, out
+
+GENERATORS = [
+  ('stored.gz', all_stored),
+  ('fixed.gz', all_fixed),
+  ('tiny_dynamic.gz', tiny_dynamic),
+  ('long_codes.gz', long_codes),
+  ('far_distances.gz', far_distances),
+  ('distance_one.gz', distance_one),
+  ('max_matches.gz', max_matches),
+  ('mixed_blocks.gz', mixed_blocks),
+]
+
+def parse_size(size):
+  units = {'K': 1 << 10, 'M': 1 << 20, 'G': 1 << 30}
+  if size[-1:] in units:
+    return int(size[:-1]) * units[size[-1]]
+  return int(size)
+
+def large(path, size, rng):
+  # Text with some noise, compressed by zlib in chunks, as streams are
+  chunk = text(rng, 1 << 24)
+  compressor = zlib.compressobj(1, zlib.DEFLATED, 16 + zlib.MAX_WBITS)
+  crc = 0
+  written = 0
+  with open(path, 'wb') as f:
+    while written < size:
+      offset = rng.randrange(len(chunk))
+      data = chunk[offset:] + chunk[:offset]
+      for _ in range(64):
+        data[rng.randrange(len(data))] = rng.getrandbits(8)
+      data = data[:size - written]
+      crc = zlib.crc32(data, crc)
+      f.write(compressor.compress(data))
+      written += len(data)
+    f.write(compressor.flush())
+  return written, crc
+
+def main():
+  parser = argparse.ArgumentParser(
+    description='Generates gzip files which stress the decoder.')
+  parser.add_argument('folder')
+  parser.add_argument('--large-size', default='5G',
+                      help='size of the output of large-<size>.gz, 0 for '
+                           'none (default: 5G)')
+  parser.add_argument('--seed', type=int, default=1)
+  args = parser.parse_args()
+  os.makedirs(args.folder, exist_ok=True)
+  manifest = []
+  for name, generator in GENERATORS:
+    rng = random.Random('%d %s' % (args.seed, name))
+    bw, out = generator(rng)
+    bw.align()
+    deflate = bw.out
+    # The encoder is checked against zlib
+    if zlib.decompress(bytes(deflate), -zlib.MAX_WBITS) != out:
+      sys.exit('%s: zlib disagrees with the encoder' % name)
+    with open(os.path.join(args.folder, name), 'wb') as f:
+      f.write(gzip_member(deflate, out))
+    manifest.append((name, len(out), zlib.crc32(out)))
+    print(name, len(out))
+  size = parse_size(args.large_size)
+  if size > 0:
+    name = 'large-%s.gz' % args.large_size
+    rng = random.Random('%d %s' % (args.seed, name))
+    written, crc = large(os.path.join(args.folder, name), size, rng)
+    manifest.append((name, written, crc))
+    print(name, written)
+  with open(os.path.join(args.folder, 'manifest.txt'), 'w') as f:
+    for name, size, crc in manifest:
+      f.write('%s %d %08x\n' % (name, size, crc))
+
+if __name__ == '__main__':
+  main()